@@ -0,0 +1,746 @@
+/*
+ * agent.c - Remote backend for multi-host setups
+ *
+ * A teleterm started with --agent does not talk to Telegram: it serves
+ * the operations of its local backend (list, connected, capture, send
+ * keys) to a hub, that is the teleterm process running the bot, so a
+ * single bot can control the terminals of many machines (see hub.c).
+ *
+ * The protocol is made of binary frames:
+ *
+ *   +------------------+------------------+---------+-------------+
+ *   | payload len (u32)| request id (u32) | type(u8)| payload ... |
+ *   +------------------+------------------+---------+-------------+
+ *
+ * Integers are big endian. Once connected, the agent sends HELLO with a
+ * random nonce. The hub replies with AUTH, containing HMAC-SHA1(secret,
+ * "hub" + agent nonce) and a nonce of its own, and the agent proves that
+ * it knows the secret too with WELCOME, containing HMAC-SHA1(secret,
+ * "agent" + hub nonce). The secret itself never goes on the wire.
+ *
+ * After that the hub sends requests, each with a new id, without waiting
+ * for the replies of the previous ones: the agent serves every request in
+ * its own thread, so a slow capture does not delay the other requests,
+ * and tags the reply frames with the request id. A reply is zero or more
+ * DATA frames followed by END, or a single ERR frame. Captures are sent
+ * in chunks of AGENT_CHUNK bytes, so that the frames of different
+ * replies interleave instead of waiting for a large screen to be sent.
+ *
+ * Payloads are text. Terminals are addressed as "<id>\t<pid>", followed
+ * by "\t<keys>" for AGENT_KEYS. The list is one "id\tname\tpid\ttitle"
+ * line per terminal.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+
+#include "agent.h"
+#include "httpd.h"
+#include "sha1.h"
+#include "xmalloc.h"
+#include "flight.h"
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0          /* macOS: SIGPIPE is ignored instead. */
+#endif
+
+#define AGENT_HEADER_LEN 9
+#define AGENT_MAX_PAYLOAD (1024*1024*4)
+#define AGENT_CHUNK 16384       /* Max payload of a DATA frame. */
+#define AGENT_NONCE_LEN 20
+#define AGENT_MAGIC "TTA1"      /* Protocol version, in HELLO. */
+#define AGENT_IO_TIMEOUT 10     /* Seconds, for handshakes and writes. */
+#define AGENT_CALL_TIMEOUT 15000
+#define AGENT_KEYS_TIMEOUT 30000
+
+/* ============================================================================
+ * Frames
+ * ========================================================================= */
+
+static void agentPutU32(unsigned char *p, uint32_t v) {
+    p[0] = v >> 24; p[1] = v >> 16; p[2] = v >> 8; p[3] = v;
+}
+
+static uint32_t agentGetU32(const unsigned char *p) {
+    return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+           ((uint32_t)p[2] << 8) | p[3];
+}
+
+static int agentWriteAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len) {
+        ssize_t n = send(fd, p, len, MSG_NOSIGNAL);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+static int agentReadAll(int fd, void *buf, size_t len) {
+    char *p = buf;
+    while (len) {
+        ssize_t n = read(fd, p, len);
+        if (n == -1 && errno == EINTR) continue;
+        if (n <= 0) return 0;
+        p += n;
+        len -= n;
+    }
+    return 1;
+}
+
+/* Write a frame. The caller serializes the writes of the connection.
+ * Returns 1 on success, 0 on error. */
+static int agentWriteFrame(int fd, uint32_t id, int type, const void *payload,
+                           size_t len)
+{
+    unsigned char hdr[AGENT_HEADER_LEN];
+    agentPutU32(hdr, len);
+    agentPutU32(hdr + 4, id);
+    hdr[8] = type;
+    if (!agentWriteAll(fd, hdr, sizeof(hdr))) return 0;
+    return len == 0 || agentWriteAll(fd, payload, len);
+}
+
+/* Read a frame. On success returns 1 and sets *payload to a new sds
+ * string. Returns 0 on error or EOF. */
+static int agentReadFrame(int fd, uint32_t *id, int *type, sds *payload) {
+    unsigned char hdr[AGENT_HEADER_LEN];
+    if (!agentReadAll(fd, hdr, sizeof(hdr))) return 0;
+    uint32_t len = agentGetU32(hdr);
+    if (len > AGENT_MAX_PAYLOAD) return 0;
+    *id = agentGetU32(hdr + 4);
+    *type = hdr[8];
+    *payload = sdsnewlen(NULL, len);
+    if (!agentReadAll(fd, *payload, len)) {
+        sdsfree(*payload);
+        return 0;
+    }
+    return 1;
+}
+
+/* ============================================================================
+ * Authentication
+ * ========================================================================= */
+
+static int agentRandom(unsigned char *buf, size_t len) {
+    FILE *fp = fopen("/dev/urandom", "r");
+    if (!fp) return 0;
+    size_t n = fread(buf, 1, len, fp);
+    fclose(fp);
+    return n == len;
+}
+
+/* HMAC-SHA1(secret, label + nonce). */
+static void agentProof(const char *secret, const char *label,
+                       const unsigned char *nonce, unsigned char *out)
+{
+    unsigned char msg[16 + AGENT_NONCE_LEN];
+    size_t llen = strlen(label);
+    memcpy(msg, label, llen);
+    memcpy(msg + llen, nonce, AGENT_NONCE_LEN);
+    hmac_sha1((const unsigned char *)secret, strlen(secret), msg,
+              llen + AGENT_NONCE_LEN, out);
+}
+
+/* Compare in constant time, so that the timing doesn't tell how many
+ * bytes of a forged proof are right. */
+static int agentProofMatch(const unsigned char *a, const unsigned char *b) {
+    unsigned char diff = 0;
+    for (int j = 0; j < SHA1_DIGEST_SIZE; j++) diff |= a[j] ^ b[j];
+    return diff == 0;
+}
+
+/* Bound blocking reads and writes, so that a dead peer can't block a
+ * handshake or a writer forever. A zero timeout blocks forever. */
+static void agentSetTimeouts(int fd, int rsecs, int wsecs) {
+    struct timeval tv = {rsecs, 0};
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    tv.tv_sec = wsecs;
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/* ============================================================================
+ * Agent side
+ * ========================================================================= */
+
+typedef struct agentConn {
+    int fd;
+    pthread_mutex_t wlock;      /* Serializes the reply frames. */
+    _Atomic int refcount;       /* Reader thread plus running requests. */
+} agentConn;
+
+typedef struct agentJob {
+    agentConn *conn;
+    uint32_t id;
+    int type;
+    sds payload;
+} agentJob;
+
+/* backend_list() fills the global TermList: one list at a time. */
+static pthread_mutex_t ListLock = PTHREAD_MUTEX_INITIALIZER;
+static const char *Secret;
+
+static void agentConnRelease(agentConn *conn) {
+    if (atomic_fetch_sub(&conn->refcount, 1) != 1) return;
+    close(conn->fd);
+    pthread_mutex_destroy(&conn->wlock);
+    xfree(conn);
+}
+
+static void agentReply(agentConn *conn, uint32_t id, int type,
+                       const char *payload, size_t len)
+{
+    pthread_mutex_lock(&conn->wlock);
+    if (!agentWriteFrame(conn->fd, id, type, payload, len))
+        shutdown(conn->fd, SHUT_RDWR);
+    pthread_mutex_unlock(&conn->wlock);
+}
+
+/* Parse "<id>\t<pid>[\t<rest>]" into 't'. Returns a pointer to the rest,
+ * or to the end of the string, or NULL if malformed. */
+static const char *agentParseTarget(const char *p, TermInfo *t) {
+    memset(t, 0, sizeof(*t));
+    const char *tab = strchr(p, '\t');
+    if (tab == NULL || (size_t)(tab - p) >= sizeof(t->id)) return NULL;
+    memcpy(t->id, p, tab - p);
+    char *end;
+    t->pid = (pid_t)strtol(tab + 1, &end, 10);
+    if (*end == '\t') return end + 1;
+    return *end == '\0' ? end : NULL;
+}
+
+/* Replace tabs and newlines, that would break the list format. */
+static sds agentCatField(sds s, const char *field) {
+    size_t start = sdslen(s);
+    s = sdscat(s, field);
+    for (size_t j = start; j < sdslen(s); j++)
+        if (s[j] == '\t' || s[j] == '\n') s[j] = ' ';
+    return s;
+}
+
+static void agentServeList(agentConn *conn, uint32_t id) {
+    sds out = sdsempty();
+    pthread_mutex_lock(&ListLock);
+    backend_list();
+    for (int i = 0; i < TermCount; i++) {
+        TermInfo *t = &TermList[i];
+        out = agentCatField(out, t->id);
+        out = sdscatlen(out, "\t", 1);
+        out = agentCatField(out, t->name);
+        out = sdscatprintf(out, "\t%d\t", (int)t->pid);
+        out = agentCatField(out, t->title);
+        out = sdscatlen(out, "\n", 1);
+    }
+    pthread_mutex_unlock(&ListLock);
+    agentReply(conn, id, AGENT_END, out, sdslen(out));
+    sdsfree(out);
+}
+
+/* Thread serving one request. */
+static void *agentJobThread(void *arg) {
+    agentJob *job = arg;
+    agentConn *conn = job->conn;
+    TermInfo t;
+    const char *rest = NULL;
+    if (job->type != AGENT_LIST) {
+        rest = agentParseTarget(job->payload, &t);
+        if (rest == NULL) {
+            agentReply(conn, job->id, AGENT_ERR, "bad request", 11);
+            goto done;
+        }
+    }
+
+    switch (job->type) {
+    case AGENT_LIST:
+        agentServeList(conn, job->id);
+        break;
+    case AGENT_CONNECTED: {
+        /* The backend may update the id (macOS tab switch). */
+        sds out = backend_connected(&t) ?
+                  sdscatprintf(sdsempty(), "1\t%s", t.id) : sdsnew("0");
+        agentReply(conn, job->id, AGENT_END, out, sdslen(out));
+        sdsfree(out);
+        break;
+    }
+    case AGENT_CAPTURE: {
+        sds text = backend_capture_text(&t);
+        if (text == NULL) {
+            agentReply(conn, job->id, AGENT_ERR, "capture failed", 14);
+            break;
+        }
+        size_t len = sdslen(text), off = 0;
+        while (len - off > AGENT_CHUNK) {
+            agentReply(conn, job->id, AGENT_DATA, text + off, AGENT_CHUNK);
+            off += AGENT_CHUNK;
+        }
+        agentReply(conn, job->id, AGENT_END, text + off, len - off);
+        sdsfree(text);
+        break;
+    }
+    case AGENT_KEYS:
+        if (backend_send_keys(&t, rest) == 0)
+            agentReply(conn, job->id, AGENT_END, NULL, 0);
+        else
+            agentReply(conn, job->id, AGENT_ERR, "send failed", 11);
+        break;
+    default:
+        agentReply(conn, job->id, AGENT_ERR, "unknown request", 15);
+        break;
+    }
+
+done:
+    sdsfree(job->payload);
+    xfree(job);
+    agentConnRelease(conn);
+    return NULL;
+}
+
+/* Authenticate the hub. Returns 1 on success. */
+static int agentHandshake(agentConn *conn) {
+    unsigned char hello[4 + AGENT_NONCE_LEN];
+    memcpy(hello, AGENT_MAGIC, 4);
+    if (!agentRandom(hello + 4, AGENT_NONCE_LEN)) return 0;
+    if (!agentWriteFrame(conn->fd, 0, AGENT_HELLO, hello, sizeof(hello)))
+        return 0;
+
+    uint32_t id;
+    int type;
+    sds auth;
+    if (!agentReadFrame(conn->fd, &id, &type, &auth)) return 0;
+
+    int ok = 0;
+    unsigned char expected[SHA1_DIGEST_SIZE];
+    agentProof(Secret, "hub", hello + 4, expected);
+    if (type == AGENT_AUTH &&
+        sdslen(auth) == SHA1_DIGEST_SIZE + AGENT_NONCE_LEN &&
+        agentProofMatch((unsigned char *)auth, expected))
+    {
+        unsigned char proof[SHA1_DIGEST_SIZE];
+        agentProof(Secret, "agent",
+                   (unsigned char *)auth + SHA1_DIGEST_SIZE, proof);
+        ok = agentWriteFrame(conn->fd, 0, AGENT_WELCOME, proof, sizeof(proof));
+    } else {
+        agentWriteFrame(conn->fd, 0, AGENT_ERR, "authentication failed", 21);
+    }
+    sdsfree(auth);
+    return ok;
+}
+
+/* Thread reading the requests of a hub connection. */
+static void *agentConnThread(void *arg) {
+    agentConn *conn = arg;
+    agentSetTimeouts(conn->fd, AGENT_IO_TIMEOUT, AGENT_IO_TIMEOUT);
+    if (!agentHandshake(conn)) {
+        fprintf(stderr, "Agent: hub authentication failed.\n");
+        flightRecord(FLIGHT_ERROR, "agent auth failed", 0, 0);
+        agentConnRelease(conn);
+        return NULL;
+    }
+    /* Hubs keep idle connections open. */
+    agentSetTimeouts(conn->fd, 0, AGENT_IO_TIMEOUT);
+
+    while (1) {
+        agentJob *job = xmalloc(sizeof(*job));
+        if (!agentReadFrame(conn->fd, &job->id, &job->type, &job->payload)) {
+            xfree(job);
+            break;
+        }
+        job->conn = conn;
+        atomic_fetch_add(&conn->refcount, 1);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, agentJobThread, job) == 0)
+            pthread_detach(tid);
+        else
+            agentJobThread(job);
+    }
+    agentConnRelease(conn);
+    return NULL;
+}
+
+void agentServe(const char *addr, const char *secret) {
+    int unixsock;
+    int fd = httpListen(addr, &unixsock);
+    if (fd == -1) {
+        fprintf(stderr, "Agent: can't listen on %s: %s\n",
+                addr, strerror(errno));
+        return;
+    }
+    Secret = secret;
+    signal(SIGPIPE, SIG_IGN);
+    printf("Agent listening on %s\n", addr);
+    fflush(stdout);
+
+    while (1) {
+        int cfd = accept(fd, NULL, NULL);
+        if (cfd == -1) {
+            if (errno == EINTR || errno == ECONNABORTED) continue;
+            fprintf(stderr, "Agent: accept: %s\n", strerror(errno));
+            sleep(1);
+            continue;
+        }
+        if (!unixsock) {
+            int yes = 1;
+            setsockopt(cfd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        agentConn *conn = xmalloc(sizeof(*conn));
+        conn->fd = cfd;
+        pthread_mutex_init(&conn->wlock, NULL);
+        atomic_init(&conn->refcount, 1);
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, agentConnThread, conn) == 0) {
+            pthread_detach(tid);
+        } else {
+            agentConnRelease(conn);
+        }
+    }
+}
+
+/* ============================================================================
+ * Hub side
+ * ========================================================================= */
+
+struct agentClient {
+    sds name;
+    sds addr;
+    sds secret;
+    pthread_mutex_t wlock;      /* Serializes connecting and writing. */
+    pthread_mutex_t lock;       /* Protects the fields below. */
+    pthread_cond_t cond;        /* Broadcast when a call completes. */
+    int fd;                     /* -1 if not connected. */
+    uint32_t nextid;
+    agentCall *calls;           /* Calls waiting for their reply. */
+};
+
+typedef struct agentReader {
+    agentClient *c;
+    int fd;
+} agentReader;
+
+agentClient *agentClientNew(const char *name, const char *addr,
+                            const char *secret)
+{
+    agentClient *c = xmalloc(sizeof(*c));
+    memset(c, 0, sizeof(*c));
+    c->name = sdsnew(name);
+    c->addr = sdsnew(addr);
+    c->secret = sdsnew(secret);
+    c->fd = -1;
+    pthread_mutex_init(&c->wlock, NULL);
+    pthread_mutex_init(&c->lock, NULL);
+    pthread_cond_init(&c->cond, NULL);
+    return c;
+}
+
+const char *agentClientName(agentClient *c) {
+    return c->name;
+}
+
+/* Connect to "host:port" or "unix:/path". Returns the socket or -1. */
+static int agentDial(const char *addr) {
+    int fd;
+    if (!strncmp(addr, "unix:", 5)) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(sa.sun_path)) return -1;
+        strcpy(sa.sun_path, addr + 5);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+        if (connect(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1) {
+            close(fd);
+            return -1;
+        }
+        return fd;
+    }
+
+    const char *colon = strrchr(addr, ':');
+    if (!colon) return -1;
+    sds host = sdsnewlen(addr, colon - addr);
+    if (host[0] == '[') {
+        sdsrange(host, 1, -1);
+        if (sdslen(host) && host[sdslen(host)-1] == ']')
+            sdsrange(host, 0, -2);
+    }
+    struct addrinfo hints, *ai, *p;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    int err = getaddrinfo(sdslen(host) ? host : "127.0.0.1", colon + 1,
+                          &hints, &ai);
+    sdsfree(host);
+    if (err) return -1;
+
+    fd = -1;
+    for (p = ai; p && fd == -1; p = p->ai_next) {
+        fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+        if (fd == -1) continue;
+        /* The send timeout bounds connect() too. */
+        agentSetTimeouts(fd, AGENT_IO_TIMEOUT, AGENT_IO_TIMEOUT);
+        if (connect(fd, p->ai_addr, p->ai_addrlen) == -1) {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    if (fd != -1) {
+        int yes = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+    }
+    return fd;
+}
+
+/* Run the handshake on a new connection. Returns 1 if both sides proved
+ * to know the secret. */
+static int agentClientHandshake(agentClient *c, int fd) {
+    uint32_t id;
+    int type;
+    sds hello;
+    if (!agentReadFrame(fd, &id, &type, &hello)) return 0;
+    if (type != AGENT_HELLO || sdslen(hello) != 4 + AGENT_NONCE_LEN ||
+        memcmp(hello, AGENT_MAGIC, 4))
+    {
+        sdsfree(hello);
+        return 0;
+    }
+
+    unsigned char auth[SHA1_DIGEST_SIZE + AGENT_NONCE_LEN];
+    agentProof(c->secret, "hub", (unsigned char *)hello + 4, auth);
+    sdsfree(hello);
+    unsigned char *nonce = auth + SHA1_DIGEST_SIZE;
+    if (!agentRandom(nonce, AGENT_NONCE_LEN)) return 0;
+    if (!agentWriteFrame(fd, 0, AGENT_AUTH, auth, sizeof(auth))) return 0;
+
+    sds welcome;
+    if (!agentReadFrame(fd, &id, &type, &welcome)) return 0;
+    unsigned char expected[SHA1_DIGEST_SIZE];
+    agentProof(c->secret, "agent", nonce, expected);
+    int ok = type == AGENT_WELCOME && sdslen(welcome) == SHA1_DIGEST_SIZE &&
+             agentProofMatch((unsigned char *)welcome, expected);
+    sdsfree(welcome);
+    return ok;
+}
+
+/* Unlink the call from the list of waiting calls. Called with the lock. */
+static void agentUnlinkCall(agentClient *c, agentCall *call) {
+    for (agentCall **p = &c->calls; *p; p = &(*p)->next) {
+        if (*p == call) {
+            *p = call->next;
+            return;
+        }
+    }
+}
+
+/* Thread reading the replies of a connection, and handing them to the
+ * calls waiting for them. When the connection fails, the calls still
+ * waiting fail, and the next agentStart() connects again. */
+static void *agentReaderThread(void *arg) {
+    agentReader *r = arg;
+    agentClient *c = r->c;
+    uint32_t id;
+    int type;
+    sds payload;
+
+    while (agentReadFrame(r->fd, &id, &type, &payload)) {
+        pthread_mutex_lock(&c->lock);
+        agentCall *call = c->calls;
+        while (call && call->id != id) call = call->next;
+        /* No call: it timed out, and the reply is discarded. */
+        if (call) {
+            if (type == AGENT_DATA || type == AGENT_END)
+                call->reply = sdscatsds(call->reply, payload);
+            if (type != AGENT_DATA) {
+                call->ok = type == AGENT_END;
+                call->done = 1;
+                agentUnlinkCall(c, call);
+                pthread_cond_broadcast(&c->cond);
+            }
+        }
+        pthread_mutex_unlock(&c->lock);
+        sdsfree(payload);
+    }
+
+    fprintf(stderr, "Agent %s: connection lost.\n", c->name);
+    flightRecord(FLIGHT_ERROR, "agent connection lost", 0, 0);
+    pthread_mutex_lock(&c->wlock);
+    pthread_mutex_lock(&c->lock);
+    c->fd = -1;
+    for (agentCall *call = c->calls; call; call = call->next) call->done = 1;
+    c->calls = NULL;
+    pthread_cond_broadcast(&c->cond);
+    pthread_mutex_unlock(&c->lock);
+    close(r->fd);
+    pthread_mutex_unlock(&c->wlock);
+    xfree(r);
+    return NULL;
+}
+
+/* Connect and authenticate, if not connected. Called with wlock held.
+ * Returns 1 if connected. */
+static int agentClientConnect(agentClient *c) {
+    if (c->fd != -1) return 1;
+    int fd = agentDial(c->addr);
+    if (fd == -1) {
+        fprintf(stderr, "Agent %s: can't connect to %s: %s\n",
+                c->name, c->addr, strerror(errno));
+        return 0;
+    }
+    if (!agentClientHandshake(c, fd)) {
+        fprintf(stderr, "Agent %s: authentication failed.\n", c->name);
+        close(fd);
+        return 0;
+    }
+    agentSetTimeouts(fd, 0, AGENT_IO_TIMEOUT);
+
+    agentReader *r = xmalloc(sizeof(*r));
+    r->c = c;
+    r->fd = fd;
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, agentReaderThread, r) != 0) {
+        xfree(r);
+        close(fd);
+        return 0;
+    }
+    pthread_detach(tid);
+    pthread_mutex_lock(&c->lock);
+    c->fd = fd;
+    pthread_mutex_unlock(&c->lock);
+    return 1;
+}
+
+int agentStart(agentClient *c, agentCall *call, int type, const char *payload,
+               size_t len)
+{
+    pthread_mutex_lock(&c->wlock);
+    if (!agentClientConnect(c)) {
+        pthread_mutex_unlock(&c->wlock);
+        return 0;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    if (++c->nextid == 0) c->nextid = 1;
+    call->id = c->nextid;
+    call->done = 0;
+    call->ok = 0;
+    call->reply = sdsempty();
+    call->next = c->calls;
+    c->calls = call;
+    int fd = c->fd;
+    pthread_mutex_unlock(&c->lock);
+
+    /* If the write fails, the reader thread sees the connection closed
+     * and fails the call. */
+    if (!agentWriteFrame(fd, call->id, type, payload, len))
+        shutdown(fd, SHUT_RDWR);
+    pthread_mutex_unlock(&c->wlock);
+    return 1;
+}
+
+int agentWait(agentClient *c, agentCall *call, int timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (long)(timeout % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    while (!call->done) {
+        if (pthread_cond_timedwait(&c->cond, &c->lock, &deadline) == ETIMEDOUT)
+            break;
+    }
+    if (!call->done) {
+        agentUnlinkCall(c, call);
+        fprintf(stderr, "Agent %s: request timed out.\n", c->name);
+        flightRecord(FLIGHT_ERROR, "agent timeout", 0, 0);
+    }
+    int ok = call->done && call->ok;
+    pthread_mutex_unlock(&c->lock);
+
+    if (!ok) {
+        sdsfree(call->reply);
+        call->reply = NULL;
+    }
+    return ok;
+}
+
+/* Send a request and wait for its reply. Returns the reply, or NULL. */
+static sds agentCallSync(agentClient *c, int type, sds payload, int timeout) {
+    agentCall call;
+    int ok = agentStart(c, &call, type, payload, sdslen(payload)) &&
+             agentWait(c, &call, timeout);
+    sdsfree(payload);
+    return ok ? call.reply : NULL;
+}
+
+static sds agentTarget(const TermInfo *t) {
+    return sdscatprintf(sdsempty(), "%s\t%d", t->id, (int)t->pid);
+}
+
+int agentParseList(agentClient *c, const char *reply, TermInfo **list) {
+    int count;
+    sds *rows = sdssplitlen(reply, strlen(reply), "\n", 1, &count);
+    *list = xmalloc(sizeof(TermInfo) * (count ? count : 1));
+    int n = 0;
+    for (int i = 0; i < count; i++) {
+        int ncols;
+        sds *cols = sdssplitlen(rows[i], sdslen(rows[i]), "\t", 1, &ncols);
+        if (ncols == 4) {
+            TermInfo *t = &(*list)[n++];
+            memset(t, 0, sizeof(*t));
+            snprintf(t->id, sizeof(t->id), "%s", cols[0]);
+            snprintf(t->name, sizeof(t->name), "%s", cols[1]);
+            t->pid = (pid_t)atoi(cols[2]);
+            snprintf(t->title, sizeof(t->title), "%s", cols[3]);
+            snprintf(t->host, sizeof(t->host), "%s", c->name);
+        }
+        sdsfreesplitres(cols, ncols);
+    }
+    sdsfreesplitres(rows, count);
+    return n;
+}
+
+int agentConnected(agentClient *c, TermInfo *t) {
+    sds reply = agentCallSync(c, AGENT_CONNECTED, agentTarget(t),
+                              AGENT_CALL_TIMEOUT);
+    if (reply == NULL) return 0;
+    int alive = reply[0] == '1';
+    if (alive && reply[1] == '\t')
+        snprintf(t->id, sizeof(t->id), "%s", reply + 2);
+    sdsfree(reply);
+    return alive;
+}
+
+sds agentCaptureText(agentClient *c, const TermInfo *t) {
+    sds text = agentCallSync(c, AGENT_CAPTURE, agentTarget(t),
+                             AGENT_CALL_TIMEOUT);
+    if (text && sdslen(text) == 0) {
+        sdsfree(text);
+        return NULL;
+    }
+    return text;
+}
+
+int agentSendKeys(agentClient *c, const TermInfo *t, const char *text) {
+    sds payload = agentTarget(t);
+    payload = sdscatprintf(payload, "\t%s", text);
+    sds reply = agentCallSync(c, AGENT_KEYS, payload, AGENT_KEYS_TIMEOUT);
+    if (reply == NULL) return -1;
+    sdsfree(reply);
+    return 0;
+}
@@ -0,0 +1,63 @@
+#ifndef AGENT_H
+#define AGENT_H
+
+#include "sds.h"
+#include "backend.h"
+
+/* Frame types of the agent protocol, see agent.c. */
+#define AGENT_HELLO 1       /* Agent -> hub: nonce to authenticate. */
+#define AGENT_AUTH 2        /* Hub -> agent: proof and hub nonce. */
+#define AGENT_WELCOME 3     /* Agent -> hub: proof of the agent. */
+#define AGENT_LIST 4        /* List the terminals. */
+#define AGENT_CONNECTED 5   /* Check a terminal is alive. */
+#define AGENT_CAPTURE 6     /* Capture the text of a terminal. */
+#define AGENT_KEYS 7        /* Send keystrokes to a terminal. */
+#define AGENT_DATA 8        /* Part of a reply, more follows. */
+#define AGENT_END 9         /* Last part of a reply. */
+#define AGENT_ERR 10        /* The request failed: payload = reason. */
+
+/* Serve the local backend on 'addr' ("host:port", ":port" or
+ * "unix:/path") to hubs knowing the shared secret. Never returns, except
+ * on error, after logging the reason. */
+void agentServe(const char *addr, const char *secret);
+
+/* Connection of the hub to one agent. It connects on first use, and
+ * reconnects after errors. Any number of threads can use it at the same
+ * time: their requests are pipelined on the same connection. */
+typedef struct agentClient agentClient;
+
+agentClient *agentClientNew(const char *name, const char *addr,
+                            const char *secret);
+const char *agentClientName(agentClient *c);
+
+/* A request in flight, see agentStart() and agentWait(). */
+typedef struct agentCall {
+    uint32_t id;
+    int done;               /* Reply complete, or connection lost. */
+    int ok;                 /* The reply ended with AGENT_END. */
+    sds reply;              /* Concatenated payloads of the reply. */
+    struct agentCall *next;
+} agentCall;
+
+/* Send a request without waiting for the reply, so that several requests,
+ * to the same agent or to different ones, can be in flight at the same
+ * time. Returns 1 if sent, 0 on error. Every sent call must be waited. */
+int agentStart(agentClient *c, agentCall *call, int type, const char *payload,
+               size_t len);
+
+/* Wait up to 'timeout' milliseconds for the reply of the call. Returns 1
+ * if the agent replied with success, in which case call->reply must be
+ * freed by the caller, 0 otherwise. */
+int agentWait(agentClient *c, agentCall *call, int timeout);
+
+/* Parse the reply of an AGENT_LIST request into a newly allocated array
+ * of terminals, with 'host' set to the agent name. Returns the count. */
+int agentParseList(agentClient *c, const char *reply, TermInfo **list);
+
+/* The backend operations on one of the agent's terminals, with the same
+ * semantics of backend.h. */
+int agentConnected(agentClient *c, TermInfo *t);
+sds agentCaptureText(agentClient *c, const TermInfo *t);
+int agentSendKeys(agentClient *c, const TermInfo *t, const char *text);
+
+#endif
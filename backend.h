@@ -3,6 +3,7 @@
 
 #include <sys/types.h>
 #include "sds.h"
+#include "text.h"  /* Emoji parsing shared by the backends. */
 
 /* Terminal session info (generic across backends). */
 typedef struct {
@@ -10,6 +11,7 @@ typedef struct {
     pid_t pid;            /* process PID */
     char name[128];       /* macOS: app name, tmux: session:window.pane */
     char title[256];      /* window/pane title or current command */
+    char host[32];        /* agent the terminal belongs to, "" if local */
 } TermInfo;
 
 /* ============================================================================
@@ -22,16 +24,17 @@ int backend_list(void);
 /* Free the terminal list. */
 void backend_free_list(void);
 
-/* Check if current connection is still alive. Returns 1 if yes. */
-int backend_connected(void);
+/* Check if the terminal is still alive. Returns 1 if yes. The backend may
+ * update t->id if the terminal moved (macOS: tab switch). */
+int backend_connected(TermInfo *t);
 
-/* Capture visible text from connected terminal. Returns sds string or NULL. */
-sds backend_capture_text(void);
+/* Capture visible text from the terminal. Returns sds string or NULL. */
+sds backend_capture_text(const TermInfo *t);
 
-/* Send keystrokes to connected terminal.
+/* Send keystrokes to the terminal.
  * text: raw input with emoji modifiers.
  * Returns 0 on success, -1 on error. */
-int backend_send_keys(const char *text);
+int backend_send_keys(const TermInfo *t, const char *text);
 
 /* ============================================================================
  * Shared state — defined in bot_common.c, used by backends
@@ -40,22 +43,6 @@ int backend_send_keys(const char *text);
 extern TermInfo *TermList;
 extern int TermCount;
 
-extern int Connected;
-extern char ConnectedId[128];   /* backend-specific ID (window_id or pane_id) */
-extern pid_t ConnectedPid;
-extern char ConnectedName[128];
-extern char ConnectedTitle[256];
-
 extern int DangerMode;
 
-/* ============================================================================
- * Shared emoji parsing — defined in bot_common.c, used by backends
- * ========================================================================= */
-
-int match_red_heart(const unsigned char *p, size_t remaining);
-int match_colored_heart(const unsigned char *p, size_t remaining, char *heart);
-int match_orange_heart(const unsigned char *p, size_t remaining);
-int match_purple_heart(const unsigned char *p, size_t remaining);
-int ends_with_purple_heart(const char *text);
-
 #endif
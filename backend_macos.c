@@ -11,6 +11,7 @@
 #include <string.h>
 #include <strings.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include <CoreGraphics/CoreGraphics.h>
 #include <CoreFoundation/CoreFoundation.h>
@@ -29,6 +30,14 @@ extern AXError _AXUIElementGetWindow(AXUIElementRef element, CGWindowID *wid);
 #define kVK_Return    0x24
 #define kVK_Tab       0x30
 #define kVK_Escape    0x35
+#define kVK_Home      0x73
+#define kVK_PageUp    0x74
+#define kVK_End       0x77
+#define kVK_PageDown  0x79
+#define kVK_LeftArrow 0x7B
+#define kVK_RightArrow 0x7C
+#define kVK_DownArrow 0x7D
+#define kVK_UpArrow   0x7E
 
 #define MOD_CTRL    (1<<0)
 #define MOD_ALT     (1<<1)
@@ -179,10 +188,8 @@ int backend_list(void) {
  * backend_connected  (adapted from connected_window_exists)
  * ========================================================================= */
 
-int backend_connected(void) {
-    if (!Connected) return 0;
-
-    CGWindowID connected_wid = (CGWindowID)atoi(ConnectedId);
+int backend_connected(TermInfo *t) {
+    CGWindowID connected_wid = (CGWindowID)atoi(t->id);
 
     CFArrayRef list = CGWindowListCopyWindowInfo(
         kCGWindowListOptionOnScreenOnly | kCGWindowListExcludeDesktopElements,
@@ -210,7 +217,7 @@ int backend_connected(void) {
         }
 
         /* Track a fallback: another on-screen window from the same PID. */
-        if (pid == ConnectedPid && !fallback_wid) {
+        if (pid == t->pid && !fallback_wid) {
             CFNumberRef layer_ref = CFDictionaryGetValue(info, kCGWindowLayer);
             int layer = 0;
             if (layer_ref) CFNumberGetValue(layer_ref, kCFNumberIntType, &layer);
@@ -220,7 +227,7 @@ int backend_connected(void) {
 
     /* Window gone but same app has another window — likely a tab switch. */
     if (!found && fallback_wid) {
-        snprintf(ConnectedId, sizeof(ConnectedId), "%u", (unsigned)fallback_wid);
+        snprintf(t->id, sizeof(t->id), "%u", (unsigned)fallback_wid);
         found = 1;
     }
 
@@ -295,12 +302,10 @@ static sds ax_get_text_content(AXUIElementRef element) {
  * backend_capture_text  (adapted from capture_terminal_text)
  * ========================================================================= */
 
-sds backend_capture_text(void) {
-    if (!Connected) return NULL;
-
-    CGWindowID connected_wid = (CGWindowID)atoi(ConnectedId);
+sds backend_capture_text(const TermInfo *t) {
+    CGWindowID connected_wid = (CGWindowID)atoi(t->id);
 
-    AXUIElementRef app = AXUIElementCreateApplication(ConnectedPid);
+    AXUIElementRef app = AXUIElementCreateApplication(t->pid);
     if (!app) return NULL;
 
     sds text = NULL;
@@ -446,12 +451,16 @@ static void send_key(pid_t pid, CGKeyCode keycode, UniChar ch, int mods) {
  * backend_send_keys  (adapted from send_keys)
  * ========================================================================= */
 
-int backend_send_keys(const char *text) {
-    if (!Connected) return -1;
+/* Keystrokes go to the focused window, so sending to several windows at
+ * the same time (.bcast) must be serialized: each sender raises its window
+ * and types with the lock held. */
+static pthread_mutex_t KeysLock = PTHREAD_MUTEX_INITIALIZER;
 
-    CGWindowID connected_wid = (CGWindowID)atoi(ConnectedId);
+int backend_send_keys(const TermInfo *t, const char *text) {
+    CGWindowID connected_wid = (CGWindowID)atoi(t->id);
 
-    raise_window_by_id(ConnectedPid, connected_wid);
+    pthread_mutex_lock(&KeysLock);
+    raise_window_by_id(t->pid, connected_wid);
 
     /* Check if we should suppress trailing newline. */
     int add_newline = !ends_with_purple_heart(text);
@@ -479,7 +488,7 @@ int backend_send_keys(const char *text) {
         }
 
         if ((consumed = match_orange_heart(p, len)) > 0) {
-            send_key(ConnectedPid, kVK_Return, 0, mods);
+            send_key(t->pid, kVK_Return, 0, mods);
             if (mods) had_mods = 1;
             keycount++; last_was_nl = 1; mods = 0;
             p += consumed; len -= consumed;
@@ -488,7 +497,7 @@ int backend_send_keys(const char *text) {
 
         if ((consumed = match_colored_heart(p, len, &heart)) > 0) {
             if (heart == 'Y') {
-                send_key(ConnectedPid, kVK_Escape, 0, 0);
+                send_key(t->pid, kVK_Escape, 0, 0);
                 keycount++; had_mods = 1; last_was_nl = 0;
                 mods = 0;
             } else if (heart == 'B') {
@@ -501,27 +510,41 @@ int backend_send_keys(const char *text) {
         }
 
         last_was_nl = 0;
+        int special;
+        if ((consumed = match_special_key(p, len, &special)) > 0) {
+            /* Same order of the KEY_* codes. */
+            static const CGKeyCode codes[SPECIAL_KEYS] = {
+                kVK_UpArrow, kVK_DownArrow, kVK_LeftArrow, kVK_RightArrow,
+                kVK_PageUp, kVK_PageDown, kVK_Home, kVK_End
+            };
+            send_key(t->pid, codes[special], 0, mods);
+            if (mods) had_mods = 1;
+            keycount++; mods = 0;
+            p += consumed; len -= consumed;
+            continue;
+        }
+
         if (*p == '\\' && len > 1) {
             if (p[1] == 'n') {
-                send_key(ConnectedPid, kVK_Return, 0, mods);
+                send_key(t->pid, kVK_Return, 0, mods);
                 if (mods) had_mods = 1;
                 keycount++; last_was_nl = 1; mods = 0;
                 p += 2; len -= 2;
                 continue;
             } else if (p[1] == 't') {
-                send_key(ConnectedPid, kVK_Tab, 0, mods);
+                send_key(t->pid, kVK_Tab, 0, mods);
                 if (mods) had_mods = 1;
                 keycount++; mods = 0; p += 2; len -= 2;
                 continue;
             } else if (p[1] == '\\') {
-                send_key(ConnectedPid, 0, '\\', mods);
+                send_key(t->pid, 0, '\\', mods);
                 if (mods) had_mods = 1;
                 keycount++; mods = 0; p += 2; len -= 2;
                 continue;
             }
         }
 
-        send_key(ConnectedPid, 0, (UniChar)*p, mods);
+        send_key(t->pid, 0, (UniChar)*p, mods);
         if (mods) had_mods = 1;
         keycount++; mods = 0;
         p++; len--;
@@ -533,8 +556,9 @@ int backend_send_keys(const char *text) {
      * - Last explicit keystroke was already a newline */
     if (add_newline && !(keycount == 1 && had_mods) && !last_was_nl) {
         usleep(50000);
-        send_key(ConnectedPid, kVK_Return, 0, 0);
+        send_key(t->pid, kVK_Return, 0, 0);
     }
 
+    pthread_mutex_unlock(&KeysLock);
     return 0;
 }
@@ -0,0 +1,399 @@
+/*
+ * backend_mock.c - Simulated terminals for teleterm load tests
+ *
+ * Implements the backend interface (backend.h) without any real terminal:
+ * every pane is a fake shell that records the keystrokes it receives and
+ * answers commands with scripted output, so that the whole bot pipeline
+ * can be exercised (together with tools/mock_telegram) on machines
+ * without tmux, with deterministic results. Built with `make teleterm-mock`.
+ *
+ * Configured via environment variables:
+ *
+ *   TELETERM_MOCK_PANES      Number of panes (default 3).
+ *   TELETERM_MOCK_ROWS       Rows of the visible screen (default 40).
+ *   TELETERM_MOCK_COLS       Columns, longer lines are cut (default 80).
+ *   TELETERM_MOCK_LATENCY    Milliseconds every backend call takes, to
+ *                            simulate the cost of running tmux (default 0).
+ *   TELETERM_MOCK_CMD_DELAY  Milliseconds a command takes before its
+ *                            output shows up on the screen (default 0).
+ *   TELETERM_MOCK_SCRIPT     File of "glob<TAB>output" lines: a command
+ *                            matching the glob prints the output, where
+ *                            \n is a newline and @N prints N lines of
+ *                            filler text. The first match wins. Commands
+ *                            matching nothing print "<command>: ok".
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "backend.h"
+#include "botlib.h"
+
+#define MOCK_MAX_PANES 64
+#define MOCK_SCROLLBACK 1000        /* Lines kept per pane. */
+#define MOCK_PROMPT "$ "
+
+typedef struct {
+    sds lines[MOCK_SCROLLBACK];     /* Ring of the output lines. */
+    int first;                      /* Index of the oldest line. */
+    int count;                      /* Number of lines in the ring. */
+    sds input;                      /* Line being typed at the prompt. */
+    sds pending;                    /* Output of the running command. */
+    uint64_t ready;                 /* When 'pending' shows up, in ms. */
+} MockPane;
+
+typedef struct {
+    sds pattern;
+    sds output;
+} MockRule;
+
+static pthread_mutex_t MockLock = PTHREAD_MUTEX_INITIALIZER;
+static int MockInitialized = 0;
+static MockPane Panes[MOCK_MAX_PANES];
+static int PaneCount, Rows, Cols, Latency, CmdDelay;
+static MockRule *Rules;
+static int RuleCount;
+
+/* ============================================================================
+ * Setup
+ * ========================================================================= */
+
+static int env_int(const char *name, int def, int min, int max) {
+    const char *v = getenv(name);
+    if (v == NULL) return def;
+    int i = atoi(v);
+    if (i < min) i = min;
+    if (i > max) i = max;
+    return i;
+}
+
+static uint64_t mock_mstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Load the TELETERM_MOCK_SCRIPT rules, if any. */
+static void mock_load_script(void) {
+    const char *filename = getenv("TELETERM_MOCK_SCRIPT");
+    if (filename == NULL) return;
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+        fprintf(stderr, "Mock backend: can't open %s\n", filename);
+        exit(1);
+    }
+    char buf[4096];
+    while (fgets(buf, sizeof(buf), fp)) {
+        sds line = sdstrim(sdsnew(buf), "\r\n");
+        char *tab = strchr(line, '\t');
+        if (line[0] != '#' && tab) {
+            Rules = xrealloc(Rules, sizeof(MockRule) * (RuleCount + 1));
+            Rules[RuleCount].pattern = sdsnewlen(line, tab - line);
+            Rules[RuleCount].output = sdsnew(tab + 1);
+            RuleCount++;
+        }
+        sdsfree(line);
+    }
+    fclose(fp);
+}
+
+/* Must be called with the lock held. */
+static void mock_init(void) {
+    if (MockInitialized) return;
+    PaneCount = env_int("TELETERM_MOCK_PANES", 3, 1, MOCK_MAX_PANES);
+    Rows = env_int("TELETERM_MOCK_ROWS", 40, 1, MOCK_SCROLLBACK);
+    Cols = env_int("TELETERM_MOCK_COLS", 80, 1, 4096);
+    Latency = env_int("TELETERM_MOCK_LATENCY", 0, 0, 60000);
+    CmdDelay = env_int("TELETERM_MOCK_CMD_DELAY", 0, 0, 600000);
+    mock_load_script();
+    for (int i = 0; i < PaneCount; i++) Panes[i].input = sdsempty();
+    MockInitialized = 1;
+}
+
+/* Every backend call runs between mock_lock() and mock_unlock(). */
+static void mock_lock(void) {
+    pthread_mutex_lock(&MockLock);
+    mock_init();
+}
+
+/* Simulate the time a real backend call takes. The wait is done after
+ * releasing the lock, so that calls from different threads overlap like
+ * tmux commands would. */
+static void mock_unlock(void) {
+    pthread_mutex_unlock(&MockLock);
+    if (Latency) usleep(Latency * 1000);
+}
+
+/* Return the pane of the terminal, or NULL if it does not exist. */
+static MockPane *mock_pane(const TermInfo *t) {
+    if (t->id[0] != '%') return NULL;
+    int i = atoi(t->id + 1);
+    if (i < 0 || i >= PaneCount) return NULL;
+    return &Panes[i];
+}
+
+/* ============================================================================
+ * Fake shell
+ * ========================================================================= */
+
+static void pane_add_line(MockPane *p, const char *line, size_t len) {
+    if (len > (size_t)Cols) len = Cols;
+    if (p->count == MOCK_SCROLLBACK) {
+        sdsfree(p->lines[p->first]);
+        p->first = (p->first + 1) % MOCK_SCROLLBACK;
+        p->count--;
+    }
+    p->lines[(p->first + p->count) % MOCK_SCROLLBACK] = sdsnewlen(line, len);
+    p->count++;
+}
+
+/* Add the text to the pane, one line per newline. */
+static void pane_add_text(MockPane *p, const char *text) {
+    while (*text) {
+        const char *nl = strchr(text, '\n');
+        size_t len = nl ? (size_t)(nl - text) : strlen(text);
+        pane_add_line(p, text, len);
+        text += len + (nl != NULL);
+    }
+}
+
+/* Show the output of the last command if its time has come. */
+static void pane_flush_pending(MockPane *p) {
+    if (p->pending && mock_mstime() >= p->ready) {
+        pane_add_text(p, p->pending);
+        sdsfree(p->pending);
+        p->pending = NULL;
+    }
+}
+
+/* Return the scripted output of the command. */
+static sds mock_output(const char *cmd) {
+    const char *out = NULL;
+    for (int i = 0; i < RuleCount; i++) {
+        if (strmatch(Rules[i].pattern, sdslen(Rules[i].pattern),
+                     cmd, strlen(cmd), 0))
+        {
+            out = Rules[i].output;
+            break;
+        }
+    }
+    if (out == NULL) return sdscatprintf(sdsempty(), "%s: ok", cmd);
+
+    if (out[0] == '@') {
+        int n = atoi(out + 1);
+        sds s = sdsempty();
+        for (int i = 1; i <= n; i++) {
+            sds line = sdscatprintf(sdsempty(), "%06d ", i);
+            while (sdslen(line) < (size_t)Cols)
+                line = sdscatlen(line, "abcdefghij" + sdslen(line) % 10, 1);
+            s = sdscatsds(s, line);
+            s = sdscatlen(s, "\n", 1);
+            sdsfree(line);
+        }
+        return s;
+    }
+
+    sds s = sdsempty();
+    for (const char *c = out; *c; c++) {
+        if (c[0] == '\\' && c[1] == 'n') {
+            s = sdscatlen(s, "\n", 1);
+            c++;
+        } else {
+            s = sdscatlen(s, c, 1);
+        }
+    }
+    return s;
+}
+
+/* Enter: run the command at the prompt. */
+static void pane_enter(MockPane *p) {
+    pane_flush_pending(p);
+    sds line = sdscatsds(sdsnew(MOCK_PROMPT), p->input);
+    pane_add_line(p, line, sdslen(line));
+    sdsfree(line);
+    if (sdslen(p->input)) {
+        sdsfree(p->pending);
+        p->pending = mock_output(p->input);
+        p->ready = mock_mstime() + CmdDelay;
+    }
+    sdsclear(p->input);
+}
+
+/* A key with modifiers, in tmux notation (C-c, M-x, Escape, Tab, ...). */
+static void pane_key(MockPane *p, const char *key) {
+    if (!strcmp(key, "Enter")) {
+        pane_enter(p);
+    } else if (!strcmp(key, "C-c")) {
+        /* Interrupt: drop the output of the running command too. */
+        sdsfree(p->pending);
+        p->pending = NULL;
+        sds line = sdscatprintf(sdsnew(MOCK_PROMPT), "%s^C", p->input);
+        pane_add_line(p, line, sdslen(line));
+        sdsfree(line);
+        sdsclear(p->input);
+    } else if (!strcmp(key, "C-l")) {
+        pane_flush_pending(p);
+        while (p->count) {
+            sdsfree(p->lines[p->first]);
+            p->first = (p->first + 1) % MOCK_SCROLLBACK;
+            p->count--;
+        }
+    } else if (!strcmp(key, "C-u")) {
+        sdsclear(p->input);
+    } else if (!strcmp(key, "Tab")) {
+        p->input = sdscat(p->input, "    ");
+    }
+    /* Other keys have no visible effect on our fake shell. */
+}
+
+/* ============================================================================
+ * Backend interface
+ * ========================================================================= */
+
+int backend_list(void) {
+    backend_free_list();
+    mock_lock();
+    TermList = malloc(PaneCount * sizeof(TermInfo));
+    if (TermList) {
+        for (int i = 0; i < PaneCount; i++) {
+            TermInfo *t = &TermList[i];
+            memset(t, 0, sizeof(*t));
+            snprintf(t->id, sizeof(t->id), "%%%d", i);
+            snprintf(t->name, sizeof(t->name), "mock:%d.0", i);
+            snprintf(t->title, sizeof(t->title), "mock shell");
+            t->pid = 10000 + i;
+        }
+        TermCount = PaneCount;
+    }
+    mock_unlock();
+    return TermCount;
+}
+
+void backend_free_list(void) {
+    if (TermList) {
+        free(TermList);
+        TermList = NULL;
+    }
+    TermCount = 0;
+}
+
+int backend_connected(TermInfo *t) {
+    mock_lock();
+    int alive = mock_pane(t) != NULL;
+    mock_unlock();
+    return alive;
+}
+
+sds backend_capture_text(const TermInfo *t) {
+    mock_lock();
+    MockPane *p = mock_pane(t);
+    if (p == NULL) {
+        mock_unlock();
+        return NULL;
+    }
+    pane_flush_pending(p);
+
+    /* The last Rows-1 lines of output, and the prompt line, unless a
+     * command is still running. */
+    int prompt = p->pending == NULL;
+    int n = p->count < Rows - prompt ? p->count : Rows - prompt;
+    sds text = sdsempty();
+    for (int i = p->count - n; i < p->count; i++) {
+        text = sdscatsds(text, p->lines[(p->first + i) % MOCK_SCROLLBACK]);
+        text = sdscatlen(text, "\n", 1);
+    }
+    if (prompt) {
+        sds line = sdscatsds(sdsnew(MOCK_PROMPT), p->input);
+        text = sdscatlen(text, line, sdslen(line) < (size_t)Cols ?
+                                     sdslen(line) : (size_t)Cols);
+        sdsfree(line);
+    }
+    mock_unlock();
+    return text;
+}
+
+/* Special keys by the tmux name, see match_special_key(). */
+static const char *MockKeyNames[SPECIAL_KEYS] = {
+    "Up", "Down", "Left", "Right", "PPage", "NPage", "Home", "End"
+};
+
+/* Same syntax and newline rules of the tmux backend. */
+int backend_send_keys(const TermInfo *t, const char *text) {
+    mock_lock();
+    MockPane *p = mock_pane(t);
+    if (p == NULL) {
+        mock_unlock();
+        return -1;
+    }
+
+    int add_newline = !ends_with_purple_heart(text);
+    const unsigned char *s = (const unsigned char *)text;
+    size_t len = strlen(text);
+    if (!add_newline && len >= 4) len -= 4;
+
+    int mods = 0, consumed, keycount = 0, had_mods = 0, last_was_nl = 0;
+    int special;
+    char heart;
+    char key[32];
+
+    while (len > 0) {
+        const char *name = NULL;
+        if ((consumed = match_red_heart(s, len)) > 0) {
+            mods |= 1;
+            s += consumed; len -= consumed;
+            continue;
+        } else if ((consumed = match_colored_heart(s, len, &heart)) > 0) {
+            s += consumed; len -= consumed;
+            if (heart == 'B') {
+                mods |= 2;
+                continue;
+            }
+            if (heart != 'Y') continue;
+            pane_key(p, "Escape");
+            keycount++; had_mods = 1; last_was_nl = 0; mods = 0;
+            continue;
+        } else if ((consumed = match_orange_heart(s, len)) > 0) {
+            name = "Enter";
+        } else if ((consumed = match_special_key(s, len, &special)) > 0) {
+            name = MockKeyNames[special];
+        } else if (s[0] == '\\' && len > 1 && s[1] == 'n') {
+            name = "Enter";
+            consumed = 2;
+        } else if (s[0] == '\\' && len > 1 && s[1] == 't') {
+            name = "Tab";
+            consumed = 2;
+        } else if (s[0] == '\\' && len > 1 && s[1] == '\\') {
+            name = "\\";
+            consumed = 2;
+        } else {
+            consumed = 1;
+        }
+
+        if (mods) {
+            const char *ctrl = (mods & 1) ? "C-" : "";
+            const char *alt = (mods & 2) ? "M-" : "";
+            if (name)
+                snprintf(key, sizeof(key), "%s%s%s", ctrl, alt, name);
+            else
+                snprintf(key, sizeof(key), "%s%s%c", ctrl, alt, s[0]);
+            pane_key(p, key);
+            had_mods = 1;
+        } else if (name && strcmp(name, "\\") != 0) {
+            pane_key(p, name);
+        } else {
+            p->input = sdscatlen(p->input, s, 1);
+        }
+        last_was_nl = name && !strcmp(name, "Enter");
+        keycount++; mods = 0;
+        s += consumed; len -= consumed;
+    }
+
+    if (add_newline && !(keycount == 1 && had_mods) && !last_was_nl)
+        pane_key(p, "Enter");
+    mock_unlock();
+    return 0;
+}
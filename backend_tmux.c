@@ -9,31 +9,76 @@
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "backend.h"
+#include "metrics.h"
+#include "flight.h"
 
 /* ============================================================================
  * Helper: run a shell command and capture output as sds string
  * ========================================================================= */
 
-static sds run_cmd(const char *cmd) {
+static pthread_once_t MetricsOnce = PTHREAD_ONCE_INIT;
+static metricFamily *TmuxCalls;     /* tmux invocations, by subcommand. */
+static metricFamily *TmuxTime;      /* tmux invocation latency. */
+
+static void tmux_metrics_init(void) {
+    TmuxCalls = metricsNew(METRIC_COUNTER, "teleterm_tmux_commands_total",
+        "tmux commands executed, by subcommand and outcome.",
+        "command,status", 1);
+    TmuxTime = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_tmux_command_duration_seconds",
+        "Time taken by tmux commands, including process startup.",
+        "command", 1e-6);
+}
+
+/* Run a tmux command line, store its output in *out and return its exit
+ * status (as returned by pclose), or -1 if the command could not run. */
+static int run_tmux(const char *cmd, sds *out) {
+    pthread_once(&MetricsOnce, tmux_metrics_init);
+
+    /* The subcommand is the word after "tmux". */
+    char sub[32] = "unknown";
+    if (strncmp(cmd, "tmux ", 5) == 0) {
+        size_t len = strcspn(cmd + 5, " ");
+        if (len >= sizeof(sub)) len = sizeof(sub) - 1;
+        memcpy(sub, cmd + 5, len);
+        sub[len] = '\0';
+    }
+
+    uint64_t start = metricsUstime();
+    *out = NULL;
     FILE *fp = popen(cmd, "r");
-    if (!fp) return NULL;
+    if (!fp) {
+        metricAdd(metricGet(TmuxCalls, sub, "error"), 1);
+        flightRecord(FLIGHT_ERROR, "popen failed", 0, 0);
+        return -1;
+    }
 
-    sds out = sdsempty();
+    sds text = sdsempty();
     char buf[4096];
     size_t n;
 
     while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        out = sdscatlen(out, buf, n);
+        text = sdscatlen(text, buf, n);
     }
 
     int status = pclose(fp);
-    if (status != 0) {
+    uint64_t elapsed = metricsUstime() - start;
+    metricObserve(metricGet(TmuxTime, sub, NULL), elapsed);
+    flightRecord(FLIGHT_TMUX, sub, status, elapsed);
+    metricAdd(metricGet(TmuxCalls, sub, status == 0 ? "ok" : "error"), 1);
+    *out = text;
+    return status;
+}
+
+static sds run_cmd(const char *cmd) {
+    sds out;
+    if (run_tmux(cmd, &out) != 0) {
         sdsfree(out);
         return NULL;
     }
-
     return out;
 }
 
@@ -145,13 +190,11 @@ void backend_free_list(void) {
 }
 
 /* ============================================================================
- * backend_connected — check if connected pane is still alive
+ * backend_connected — check if a pane is still alive
  * ========================================================================= */
 
-int backend_connected(void) {
-    if (!Connected) return 0;
-
-    sds escaped_id = shell_escape(ConnectedId);
+int backend_connected(TermInfo *t) {
+    sds escaped_id = shell_escape(t->id);
     sds cmd = sdscatprintf(sdsempty(),
         "tmux display-message -t %s -p '#{pane_id}'", escaped_id);
     sdsfree(escaped_id);
@@ -175,27 +218,18 @@ int backend_connected(void) {
  * backend_capture_text — capture visible pane content
  * ========================================================================= */
 
-sds backend_capture_text(void) {
-    if (!Connected) return NULL;
-
-    sds escaped_id = shell_escape(ConnectedId);
+sds backend_capture_text(const TermInfo *t) {
+    sds escaped_id = shell_escape(t->id);
     sds cmd = sdscatprintf(sdsempty(),
         "tmux capture-pane -t %s -p", escaped_id);
     sdsfree(escaped_id);
 
-    /* Use popen directly so we can capture output even on "failure"
+    /* Ignore the exit status so we can capture output even on "failure"
      * (capture-pane returns the text on stdout). */
-    FILE *fp = popen(cmd, "r");
+    sds text;
+    run_tmux(cmd, &text);
     sdsfree(cmd);
-    if (!fp) return NULL;
-
-    sds text = sdsempty();
-    char buf[4096];
-    size_t n;
-    while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
-        text = sdscatlen(text, buf, n);
-    }
-    pclose(fp);
+    if (!text) return NULL;
 
     if (sdslen(text) == 0) {
         sdsfree(text);
@@ -217,9 +251,14 @@ sds backend_capture_text(void) {
 }
 
 /* ============================================================================
- * backend_send_keys — send keystrokes to connected tmux pane
+ * backend_send_keys — send keystrokes to a tmux pane
  * ========================================================================= */
 
+/* tmux names of the special keys, see match_special_key(). */
+static const char *TmuxKeyNames[SPECIAL_KEYS] = {
+    "Up", "Down", "Left", "Right", "PPage", "NPage", "Home", "End"
+};
+
 /* Send a single tmux send-keys command (non-literal mode) for special keys. */
 static int tmux_send_key(const char *pane_id, const char *key) {
     sds escaped_id = shell_escape(pane_id);
@@ -264,8 +303,7 @@ static int tmux_send_literal(const char *pane_id, const char *text, size_t len)
     return -1;
 }
 
-int backend_send_keys(const char *text) {
-    if (!Connected) return -1;
+int backend_send_keys(const TermInfo *t, const char *text) {
 
     /* Check if we should suppress trailing newline. */
     int add_newline = !ends_with_purple_heart(text);
@@ -292,7 +330,7 @@ int backend_send_keys(const char *text) {
     /* Flush any accumulated literal text. */
     #define FLUSH_LITERAL() do { \
         if (literal_len > 0) { \
-            tmux_send_literal(ConnectedId, (const char *)literal_start, literal_len); \
+            tmux_send_literal(t->id, (const char *)literal_start, literal_len); \
             literal_start = NULL; \
             literal_len = 0; \
         } \
@@ -316,11 +354,11 @@ int backend_send_keys(const char *text) {
                 if (mods & 1) key = sdscat(key, "C-");
                 if (mods & 2) key = sdscat(key, "M-");
                 key = sdscat(key, "Enter");
-                tmux_send_key(ConnectedId, key);
+                tmux_send_key(t->id, key);
                 sdsfree(key);
                 had_mods = 1;
             } else {
-                tmux_send_key(ConnectedId, "Enter");
+                tmux_send_key(t->id, "Enter");
             }
             keycount++; last_was_nl = 1; mods = 0;
             p += consumed; len -= consumed;
@@ -332,7 +370,7 @@ int backend_send_keys(const char *text) {
             FLUSH_LITERAL();
             if (heart == 'Y') {
                 /* Yellow heart: send Escape immediately. */
-                tmux_send_key(ConnectedId, "Escape");
+                tmux_send_key(t->id, "Escape");
                 keycount++; had_mods = 1; last_was_nl = 0;
                 mods = 0;
             } else if (heart == 'B') {
@@ -347,6 +385,20 @@ int backend_send_keys(const char *text) {
 
         /* Backslash escape sequences. */
         last_was_nl = 0;
+        int special;
+        if ((consumed = match_special_key(p, len, &special)) > 0) {
+            FLUSH_LITERAL();
+            sds key = sdsempty();
+            if (mods & 1) key = sdscat(key, "C-");
+            if (mods & 2) key = sdscat(key, "M-");
+            key = sdscat(key, TmuxKeyNames[special]);
+            tmux_send_key(t->id, key);
+            sdsfree(key);
+            if (mods) had_mods = 1;
+            keycount++; mods = 0;
+            p += consumed; len -= consumed;
+            continue;
+        }
         if (*p == '\\' && len > 1) {
             if (p[1] == 'n') {
                 FLUSH_LITERAL();
@@ -355,11 +407,11 @@ int backend_send_keys(const char *text) {
                     if (mods & 1) key = sdscat(key, "C-");
                     if (mods & 2) key = sdscat(key, "M-");
                     key = sdscat(key, "Enter");
-                    tmux_send_key(ConnectedId, key);
+                    tmux_send_key(t->id, key);
                     sdsfree(key);
                     had_mods = 1;
                 } else {
-                    tmux_send_key(ConnectedId, "Enter");
+                    tmux_send_key(t->id, "Enter");
                 }
                 keycount++; last_was_nl = 1; mods = 0;
                 p += 2; len -= 2;
@@ -371,11 +423,11 @@ int backend_send_keys(const char *text) {
                     if (mods & 1) key = sdscat(key, "C-");
                     if (mods & 2) key = sdscat(key, "M-");
                     key = sdscat(key, "Tab");
-                    tmux_send_key(ConnectedId, key);
+                    tmux_send_key(t->id, key);
                     sdsfree(key);
                     had_mods = 1;
                 } else {
-                    tmux_send_key(ConnectedId, "Tab");
+                    tmux_send_key(t->id, "Tab");
                 }
                 keycount++; mods = 0;
                 p += 2; len -= 2;
@@ -388,11 +440,11 @@ int backend_send_keys(const char *text) {
                     if (mods & 1) key = sdscat(key, "C-");
                     if (mods & 2) key = sdscat(key, "M-");
                     key = sdscat(key, "\\");
-                    tmux_send_key(ConnectedId, key);
+                    tmux_send_key(t->id, key);
                     sdsfree(key);
                     had_mods = 1;
                 } else {
-                    tmux_send_literal(ConnectedId, "\\", 1);
+                    tmux_send_literal(t->id, "\\", 1);
                 }
                 keycount++; mods = 0;
                 p += 2; len -= 2;
@@ -408,7 +460,7 @@ int backend_send_keys(const char *text) {
             if (mods & 1) key = sdscat(key, "C-");
             if (mods & 2) key = sdscat(key, "M-");
             key = sdscatlen(key, (const char *)p, 1);
-            tmux_send_key(ConnectedId, key);
+            tmux_send_key(t->id, key);
             sdsfree(key);
             had_mods = 1;
             keycount++; mods = 0;
@@ -434,7 +486,7 @@ int backend_send_keys(const char *text) {
      * - Single modified keystroke (like Ctrl+C) or bare ESC
      * - Last explicit keystroke was already a newline */
     if (add_newline && !(keycount == 1 && had_mods) && !last_was_nl) {
-        tmux_send_key(ConnectedId, "Enter");
+        tmux_send_key(t->id, "Enter");
     }
 
     return 0;
@@ -0,0 +1,512 @@
+/*
+ * bench.c - Microbenchmarks of teleterm hot paths
+ *
+ * Usage: bench/bench [--time <ms>] [--filter <glob>] [--json <file>]
+ *                    [--baseline <file>]
+ *
+ * Every benchmark is calibrated to run for about --time milliseconds, then
+ * run BENCH_RUNS times: the median run is reported, with its ns/op,
+ * allocations/op and, for benchmarks processing a buffer, MB/s. Results
+ * can be saved as JSON with --json, and compared with a previous result
+ * file with --baseline.
+ *
+ * Allocations are counted by wrapping malloc() & co. at link time, which
+ * is only possible with GNU ld (see the Makefile): elsewhere they are
+ * reported as -1. Allocations done inside the SQLite shared library are
+ * not seen by the wrapper and are not counted.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "botlib.h"
+#include "text.h"
+#include "totp.h"
+#include "timer.h"
+#include "globset.h"
+
+#define BENCH_RUNS 5
+#define BENCH_MAX 64
+
+/* ============================================================================
+ * Allocation counting
+ * ========================================================================= */
+
+static uint64_t AllocCount = 0;
+
+#ifdef BENCH_COUNT_ALLOCS
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size) {
+    AllocCount++;
+    return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size) {
+    AllocCount++;
+    return __real_calloc(nmemb,size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size) {
+    AllocCount++;
+    return __real_realloc(ptr,size);
+}
+#endif
+
+/* ============================================================================
+ * Fixtures
+ * ========================================================================= */
+
+/* Results are stored here so the compiler can't optimize the work away. */
+static volatile uintptr_t Sink;
+
+static sds Screen;          /* 1000 lines of terminal output. */
+static sds Screen40;        /* Its last 40 lines. */
+static sds Updates;         /* A getUpdates reply. */
+static cJSON *UpdatesJSON;
+static sds Keys;            /* Keystrokes with emoji modifiers. */
+static sqlite3 *Db;
+static timerEvent Timers[1024]; /* Armed at 1024 different delays. */
+static globSet *Glob;           /* The pattern of the strmatch benchmarks. */
+static globSet *GlobWorst;
+static sds WorstString;         /* 64 'a', matched against WORST_PATTERN. */
+
+/* Build deterministic terminal output: lines of random length with
+ * random printable characters, including the ones HTML escaping. */
+static sds makeScreen(int lines) {
+    uint32_t seed = 12345;
+    sds s = sdsempty();
+    for (int j = 0; j < lines; j++) {
+        seed = seed*1103515245 + 12345;
+        int len = (seed >> 16) % 100;
+        for (int k = 0; k < len; k++) {
+            seed = seed*1103515245 + 12345;
+            char c = ' ' + (seed >> 16) % 95;
+            s = sdscatlen(s,&c,1);
+        }
+        s = sdscatlen(s,"\n",1);
+    }
+    return s;
+}
+
+static sds readFile(const char *filename) {
+    FILE *fp = fopen(filename,"r");
+    if (fp == NULL) {
+        fprintf(stderr,"Can't open %s (run from the repository root)\n",
+            filename);
+        exit(1);
+    }
+    sds s = sdsempty();
+    char buf[4096];
+    size_t n;
+    while ((n = fread(buf,1,sizeof(buf),fp)) > 0) s = sdscatlen(s,buf,n);
+    fclose(fp);
+    return s;
+}
+
+static void nop(void *privdata) { (void)privdata; }
+
+#define GLOB_STRING "make -j8 && ./run_tests --verbose"
+#define GLOB_PATTERN "*run_*s -?verb*"
+/* Backtracking tries every way to split the string among the stars, and
+ * then fails because there is no 'b': O(n^3) steps for strmatch(). */
+#define WORST_PATTERN "*a*a*a*b"
+
+static void setupFixtures(void) {
+    Screen = makeScreen(1000);
+    Screen40 = sdsnew(last_n_lines(Screen,40));
+    Updates = readFile("bench/data/getupdates.json");
+    UpdatesJSON = cJSON_Parse(Updates);
+    if (UpdatesJSON == NULL) {
+        fprintf(stderr,"Can't parse bench/data/getupdates.json\n");
+        exit(1);
+    }
+    Keys = sdsnew("git commit -am \"fix: escape <pre> & friends\"");
+    Keys = sdscat(Keys,"\xe2\x9d\xa4\xef\xb8\x8f" "c\xf0\x9f\x92\x9b:wq");
+    Keys = sdscat(Keys,"\xf0\x9f\xa7\xa1\xf0\x9f\x92\x99" "b ls -la\xf0\x9f\x92\x9c");
+
+    if (sqlite3_open(":memory:",&Db) != SQLITE_OK) {
+        fprintf(stderr,"Can't open the SQLite database\n");
+        exit(1);
+    }
+    sqlite3_exec(Db,TB_CREATE_KV_STORE,0,0,NULL);
+    kvSet(Db,"totp_secret","3132333435363738393031323334353637383930",0);
+    kvSet(Db,"owner_id","123456789",0);
+    char key[32];
+    for (int j = 0; j < 1000; j++) {
+        snprintf(key,sizeof(key),"key:%d",j);
+        kvSet(Db,key,"some value",0);
+    }
+    for (int j = 0; j < 1024; j++) timerInit(&Timers[j],nop,NULL);
+
+    char *glob[] = {GLOB_PATTERN, NULL};
+    char *worst[] = {WORST_PATTERN, NULL};
+    Glob = globSetCompile(glob,1);
+    GlobWorst = globSetCompile(worst,1);
+    WorstString = sdsgrowzero(sdsempty(),64);
+    memset(WorstString,'a',64);
+}
+
+/* ============================================================================
+ * Benchmarks
+ * ========================================================================= */
+
+static void benchHtmlEscape(uint64_t n) {
+    while (n--) {
+        sds s = html_escape(Screen40);
+        Sink += sdslen(s);
+        sdsfree(s);
+    }
+}
+
+static void benchLastNLines(uint64_t n) {
+    while (n--) Sink += (uintptr_t)last_n_lines(Screen,40);
+}
+
+static void benchFormat(uint64_t n, int lines, int split) {
+    while (n--) {
+        int count;
+        sds *msgs = format_terminal_messages(Screen,lines,split,&count);
+        for (int j = 0; j < count; j++) sdsfree(msgs[j]);
+        xfree(msgs);
+        Sink += count;
+    }
+}
+
+static void benchFormatTruncate(uint64_t n) { benchFormat(n,40,0); }
+static void benchFormatSplit(uint64_t n) { benchFormat(n,1000,1); }
+
+static void benchJSONParse(uint64_t n) {
+    while (n--) {
+        cJSON *json = cJSON_Parse(Updates);
+        Sink += (uintptr_t)json;
+        cJSON_Delete(json);
+    }
+}
+
+/* The selections botDispatchUpdate() does on a message update. */
+static void benchJSONSelect(uint64_t n) {
+    cJSON *update = cJSON_Select(UpdatesJSON,".result[0]");
+    while (n--) {
+        cJSON *msg = cJSON_Select(update,".message");
+        Sink += (uintptr_t)cJSON_Select(update,".callback_query");
+        Sink += (uintptr_t)cJSON_Select(msg,".chat.id:n");
+        Sink += (uintptr_t)cJSON_Select(msg,".from.id:n");
+        Sink += (uintptr_t)cJSON_Select(msg,".from.username:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".message_id:n");
+        Sink += (uintptr_t)cJSON_Select(msg,".chat.type:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".date:n");
+        Sink += (uintptr_t)cJSON_Select(msg,".text:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".voice.file_id:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".audio.file_id:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".document.file_id:s");
+        Sink += (uintptr_t)cJSON_Select(msg,".entities[0]");
+    }
+}
+
+static void benchSplitArgs(uint64_t n) {
+    const char *line = "echo \"hello world\" 'single quoted' foo\\tbar .2";
+    while (n--) {
+        int argc;
+        sds *argv = sdssplitargs(line,&argc);
+        sdsfreesplitres(argv,argc);
+        Sink += argc;
+    }
+}
+
+static void benchStrmatchStar(uint64_t n) {
+    const char *s = "make -j8 && ./run_tests --verbose";
+    size_t len = strlen(s);
+    while (n--) Sink += strmatch("*",1,s,len,1);
+}
+
+static void benchStrmatchGlob(uint64_t n) {
+    const char *s = GLOB_STRING, *p = GLOB_PATTERN;
+    size_t len = strlen(s), plen = strlen(p);
+    while (n--) Sink += strmatch(p,plen,s,len,1);
+}
+
+static void benchStrmatchWorst(uint64_t n) {
+    size_t plen = strlen(WORST_PATTERN);
+    while (n--) Sink += strmatch(WORST_PATTERN,plen,WorstString,64,1);
+}
+
+static void benchGlobSetGlob(uint64_t n) {
+    size_t len = strlen(GLOB_STRING);
+    while (n--) Sink += globSetMatch(Glob,GLOB_STRING,len);
+}
+
+static void benchGlobSetWorst(uint64_t n) {
+    while (n--) Sink += globSetMatch(GlobWorst,WorstString,64);
+}
+
+/* Scan keystrokes the way the backends parse them. */
+static void benchEmojiScan(uint64_t n) {
+    const unsigned char *p = (const unsigned char *)Keys;
+    size_t len = sdslen(Keys);
+    while (n--) {
+        size_t j = 0;
+        char heart;
+        while (j < len) {
+            size_t m;
+            if ((m = match_red_heart(p+j,len-j)) ||
+                (m = match_colored_heart(p+j,len-j,&heart)) ||
+                (m = match_orange_heart(p+j,len-j)) ||
+                (m = match_purple_heart(p+j,len-j)))
+            {
+                j += m;
+                Sink++;
+            } else {
+                j++;
+            }
+        }
+        Sink += ends_with_purple_heart(Keys);
+    }
+}
+
+static void benchKvGetHit(uint64_t n) {
+    while (n--) {
+        sds v = kvGet(Db,"owner_id");
+        Sink += sdslen(v);
+        sdsfree(v);
+    }
+}
+
+static void benchKvGetMiss(uint64_t n) {
+    while (n--) Sink += (uintptr_t)kvGet(Db,"no such key");
+}
+
+static void benchSqlSelectInt(uint64_t n) {
+    while (n--) Sink += sqlSelectInt(Db,
+        "SELECT COUNT(*) FROM KeyValue WHERE key > ?s","key:5");
+}
+
+static void benchTotpCode(uint64_t n) {
+    const unsigned char *secret = (const unsigned char *)"12345678901234567890";
+    uint64_t step = 56666666;
+    while (n--) Sink += totp_code(secret,20,step++);
+}
+
+/* A wrong code is the worst case: all the three windows are computed. */
+static void benchTotpVerify(uint64_t n) {
+    while (n--) Sink += totp_verify(Db,"totp_secret","000000");
+}
+
+/* Re-arm timers spread over all the wheel levels, with the other ones
+ * pending: the cost must not depend on how many timers there are. */
+static void benchTimerAdd(uint64_t n) {
+    int j = 0;
+    while (n--) {
+        timerAdd(&Timers[j],(uint64_t)(j+1)*(j+1)*1000,0);
+        j = (j+1) & 1023;
+    }
+}
+
+static void benchTimerAddCancel(uint64_t n) {
+    timerEvent t;
+    timerInit(&t,nop,NULL);
+    uint64_t delay = 1;
+    while (n--) {
+        timerAdd(&t,delay,0);
+        Sink += timerCancel(&t);
+        delay = delay*7 % 100000007;
+    }
+}
+
+typedef struct bench {
+    const char *name;
+    void (*run)(uint64_t iterations);
+    size_t *bytes;          /* Bytes processed per op, for MB/s, or NULL. */
+} bench;
+
+static size_t ScreenBytes, Screen40Bytes, UpdatesBytes;
+
+static bench Benchmarks[] = {
+    {"html_escape/40_lines", benchHtmlEscape, &Screen40Bytes},
+    {"last_n_lines/1000_lines", benchLastNLines, &Screen40Bytes},
+    {"format_terminal_messages/truncate", benchFormatTruncate, &Screen40Bytes},
+    {"format_terminal_messages/split", benchFormatSplit, &ScreenBytes},
+    {"cJSON_Parse/getUpdates", benchJSONParse, &UpdatesBytes},
+    {"cJSON_Select/dispatch", benchJSONSelect, NULL},
+    {"sdssplitargs/command", benchSplitArgs, NULL},
+    {"strmatch/star", benchStrmatchStar, NULL},
+    {"strmatch/glob", benchStrmatchGlob, NULL},
+    {"strmatch/worst_case", benchStrmatchWorst, NULL},
+    {"globSetMatch/glob", benchGlobSetGlob, NULL},
+    {"globSetMatch/worst_case", benchGlobSetWorst, NULL},
+    {"emoji/scan_keys", benchEmojiScan, NULL},
+    {"kvGet/hit", benchKvGetHit, NULL},
+    {"kvGet/miss", benchKvGetMiss, NULL},
+    {"sqlSelectInt/count", benchSqlSelectInt, NULL},
+    {"totp_code", benchTotpCode, NULL},
+    {"totp_verify/wrong_code", benchTotpVerify, NULL},
+    {"timerAdd/1024_pending", benchTimerAdd, NULL},
+    {"timerAdd+timerCancel", benchTimerAddCancel, NULL},
+    {NULL, NULL, NULL}
+};
+
+/* ============================================================================
+ * Runner
+ * ========================================================================= */
+
+typedef struct benchResult {
+    const char *name;
+    uint64_t iterations;
+    double ns_per_op;
+    double allocs_per_op;
+    double mb_per_sec;      /* Zero if not meaningful. */
+} benchResult;
+
+static uint64_t nstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static int cmpResult(const void *a, const void *b) {
+    double x = ((const benchResult*)a)->ns_per_op;
+    double y = ((const benchResult*)b)->ns_per_op;
+    return x < y ? -1 : x > y;
+}
+
+static benchResult runBench(bench *b, uint64_t target_ns) {
+    /* Calibrate: find how many iterations take the target time. */
+    uint64_t n = 1, elapsed;
+    while(1) {
+        uint64_t start = nstime();
+        b->run(n);
+        elapsed = nstime() - start;
+        if (elapsed >= target_ns/10 || n >= (1ULL<<40)) break;
+        n *= 2;
+    }
+    if (elapsed) n = n * (double)target_ns / elapsed;
+    if (n == 0) n = 1;
+
+    benchResult runs[BENCH_RUNS];
+    for (int j = 0; j < BENCH_RUNS; j++) {
+        uint64_t allocs = AllocCount;
+        uint64_t start = nstime();
+        b->run(n);
+        elapsed = nstime() - start;
+        allocs = AllocCount - allocs;
+
+        runs[j].name = b->name;
+        runs[j].iterations = n;
+        runs[j].ns_per_op = (double)elapsed / n;
+#ifdef BENCH_COUNT_ALLOCS
+        runs[j].allocs_per_op = (double)allocs / n;
+#else
+        runs[j].allocs_per_op = -1;
+#endif
+        runs[j].mb_per_sec = b->bytes ?
+            (*b->bytes * (double)n) / (elapsed / 1e9) / (1024*1024) : 0;
+    }
+    qsort(runs,BENCH_RUNS,sizeof(benchResult),cmpResult);
+    return runs[BENCH_RUNS/2];
+}
+
+static void writeJSON(const char *filename, benchResult *res, int count) {
+    cJSON *root = cJSON_CreateObject();
+    cJSON_AddNumberToObject(root,"timestamp",(double)time(NULL));
+    cJSON *arr = cJSON_AddArrayToObject(root,"results");
+    for (int j = 0; j < count; j++) {
+        cJSON *item = cJSON_CreateObject();
+        cJSON_AddStringToObject(item,"name",res[j].name);
+        cJSON_AddNumberToObject(item,"iterations",res[j].iterations);
+        cJSON_AddNumberToObject(item,"ns_per_op",res[j].ns_per_op);
+        cJSON_AddNumberToObject(item,"allocs_per_op",res[j].allocs_per_op);
+        cJSON_AddNumberToObject(item,"mb_per_sec",res[j].mb_per_sec);
+        cJSON_AddItemToArray(arr,item);
+    }
+    char *text = cJSON_Print(root);
+    FILE *fp = fopen(filename,"w");
+    if (fp) {
+        fprintf(fp,"%s\n",text);
+        fclose(fp);
+    } else {
+        fprintf(stderr,"Can't write %s\n",filename);
+    }
+    xfree(text);
+    cJSON_Delete(root);
+}
+
+/* Return the baseline entry of the benchmark 'name', or NULL. */
+static cJSON *baselineGet(cJSON *baseline, const char *name) {
+    cJSON *item;
+    cJSON *results = cJSON_GetObjectItem(baseline,"results");
+    cJSON_ArrayForEach(item,results) {
+        cJSON *n = cJSON_GetObjectItem(item,"name");
+        if (cJSON_IsString(n) && !strcmp(n->valuestring,name)) return item;
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv) {
+    double time_ms = 200;
+    const char *filter = NULL, *jsonfile = NULL, *basefile = NULL;
+
+    for (int j = 1; j < argc; j++) {
+        int morearg = argc-j-1;
+        if (!strcmp(argv[j],"--time") && morearg) {
+            time_ms = atof(argv[++j]);
+        } else if (!strcmp(argv[j],"--filter") && morearg) {
+            filter = argv[++j];
+        } else if (!strcmp(argv[j],"--json") && morearg) {
+            jsonfile = argv[++j];
+        } else if (!strcmp(argv[j],"--baseline") && morearg) {
+            basefile = argv[++j];
+        } else {
+            printf("Usage: %s [--time <ms>] [--filter <glob>] "
+                   "[--json <file>] [--baseline <file>]\n", argv[0]);
+            exit(1);
+        }
+    }
+
+    cJSON *baseline = NULL;
+    if (basefile) {
+        FILE *fp = fopen(basefile,"r");
+        if (fp) {
+            fclose(fp);
+            sds text = readFile(basefile);
+            baseline = cJSON_Parse(text);
+            sdsfree(text);
+        }
+    }
+
+    setupFixtures();
+    ScreenBytes = sdslen(Screen);
+    Screen40Bytes = sdslen(Screen40);
+    UpdatesBytes = sdslen(Updates);
+
+    benchResult results[BENCH_MAX];
+    int count = 0;
+    printf("%-36s %12s %10s %10s %10s\n",
+        "benchmark","ns/op","allocs/op","MB/s",basefile ? "vs base" : "");
+    for (bench *b = Benchmarks; b->name && count < BENCH_MAX; b++) {
+        if (filter && !strmatch(filter,strlen(filter),b->name,strlen(b->name),0))
+            continue;
+        benchResult r = runBench(b,time_ms*1000000);
+        results[count++] = r;
+
+        char delta[32] = "";
+        cJSON *base = baselineGet(baseline,r.name);
+        cJSON *ns = cJSON_GetObjectItem(base,"ns_per_op");
+        if (cJSON_IsNumber(ns) && ns->valuedouble > 0)
+            snprintf(delta,sizeof(delta),"%+.1f%%",
+                (r.ns_per_op / ns->valuedouble - 1) * 100);
+        char mbs[32] = "-";
+        if (r.mb_per_sec) snprintf(mbs,sizeof(mbs),"%.1f",r.mb_per_sec);
+        printf("%-36s %12.1f %10.2f %10s %10s\n",
+            r.name, r.ns_per_op, r.allocs_per_op, mbs, delta);
+        fflush(stdout);
+    }
+
+    if (jsonfile) writeJSON(jsonfile,results,count);
+    cJSON_Delete(baseline);
+    sqlite3_close(Db);
+    return 0;
+}
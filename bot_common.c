@@ -1,14 +1,31 @@
 /*
  * bot_common.c - Shared logic for teleterm Telegram bot
  *
- * Platform-independent code: TOTP auth, emoji parsing, command handling,
- * text formatting, and main(). Delegates to backend_*.c via backend.h
- * for terminal listing, text capture, and keystroke delivery.
+ * Platform-independent code: TOTP setup, command handling and main().
+ * TOTP codes live in totp.c, emoji parsing and text formatting in text.c.
+ * Delegates to backend_*.c via backend.h for terminal listing, text
+ * capture, and keystroke delivery, through hub.c that routes the
+ * terminals of other machines to their agent (agent.c).
+ *
+ * The bot is used by its owner, or with --team by the listed users, also
+ * from groups: every user has its own OTP authentication and sessions.
  *
  * Commands:
- *   .list    - List available terminal sessions
- *   .1 .2 .. - Connect to session by number
- *   .help    - Show help
+ *   .list      - List available terminal sessions
+ *   .1 .2 ..   - Connect to session by number
+ *   .sessions  - List the attached sessions
+ *   .detach    - Detach the active session
+ *   @N         - Switch to attached session N
+ *   @N <keys>  - Send keys to attached session N
+ *   .bcast     - Send keys to all the sessions matching a glob
+ *   .at .every - Send keys to the active session at a time, or periodically
+ *   .jobs      - List the scheduled jobs, .unjob N removes one
+ *   .watch-screen - Refresh the active session's screen in place
+ *   .keypad    - Show arrows, Tab, PgUp/PgDn, Ctrl-C... under the screen
+ *   .reload    - Reload the settings file (see config.c)
+ *   .restart   - Restart gracefully, running the binary again
+ *   .stats     - Show request latency statistics
+ *   .help      - Show help
  *
  * Once connected, any text is sent as keystrokes (newline auto-added).
  * End with a purple heart to suppress the automatic newline.
@@ -22,12 +39,22 @@
 #include <strings.h>
 #include <unistd.h>
 #include <ctype.h>
+#include <errno.h>
 #include <pthread.h>
+#include <stdatomic.h>
 
 #include "backend.h"
+#include "hub.h"
+#include "agent.h"
 #include "botlib.h"
-#include "sha1.h"
+#include "globset.h"
+#include "text.h"
+#include "totp.h"
 #include "qrcodegen.h"
+#include "metrics.h"
+#include "flight.h"
+#include "timer.h"
+#include "config.h"
 
 /* ============================================================================
  * Shared state (declared extern in backend.h)
@@ -35,75 +62,185 @@
 
 TermInfo *TermList = NULL;
 int TermCount = 0;
-int Connected = 0;
-char ConnectedId[128] = {0};
-pid_t ConnectedPid = 0;
-char ConnectedName[128] = {0};
-char ConnectedTitle[256] = {0};
 int DangerMode = 0;
 
 /* ============================================================================
  * Internal state
  * ========================================================================= */
 
-static pthread_mutex_t RequestLock = PTHREAD_MUTEX_INITIALIZER;
+/* hub_list() rebuilds the global TermList: one list at a time. */
+static pthread_mutex_t TermListLock = PTHREAD_MUTEX_INITIALIZER;
 static int WeakSecurity = 0;          /* If 1, skip all OTP logic. */
-static int Authenticated = 0;         /* Whether OTP has been verified. */
-static time_t LastActivity = 0;       /* Last time owner sent a valid command. */
-static int OtpTimeout = 300;          /* Timeout in seconds (default 5 min). */
+
+/* Team mode (--team): the users allowed to use the bots, instead of the
+ * single owner. */
+static int64_t *TeamUsers = NULL;
+static int TeamSize = 0;
 
 #define MAX_TRACKED_MSGS 16
-static int64_t TrackedMsgIds[MAX_TRACKED_MSGS];
-static int TrackedMsgCount = 0;
+#define MAX_SESSIONS 8
+
+/* Auto refresh of a session's screen, see .watch-screen. */
+typedef struct Watch {
+    int active;
+    uint64_t gen;               /* Changes at every start, see watch_fire(). */
+    timerEvent timer;
+    BotInstance *bot;
+    struct UserState *user;
+    int64_t chat_id;
+    int base;                   /* Requested interval, ms. */
+    int interval;               /* Current interval, ms. */
+    time_t changed_at;          /* Last time the screen changed. */
+} Watch;
+
+/* Screen update pending after keys were sent, see session_show_keys(). */
+typedef struct Settle {
+    _Atomic uint64_t gen;       /* Changes every time it is armed. */
+    timerEvent timer;
+    BotInstance *bot;           /* These two are set with the timer, and */
+    struct UserState *user;     /* don't change while it may fire. */
+    int64_t chat_id;
+    int traced;                 /* 'trace' is waiting to be published. */
+    Trace trace;                /* Of the last request that armed it. */
+    sds keys;                   /* Keypad keys not sent yet, or NULL. */
+    int edit;                   /* Edit the screen in place. */
+} Settle;
+
+/* Every terminal we are attached to is a session, numbered from 1 by its
+ * slot in Sessions[]. Several sessions can be attached at the same time:
+ * plain messages go to the active one, the others are reached with the
+ * "@N keys" prefix. Each session tracks the messages showing its screen
+ * and caches its last capture, so switching to it needs no backend call. */
+typedef struct Session {
+    int attached;
+    TermInfo term;
+    int64_t tracked[MAX_TRACKED_MSGS];  /* Messages showing its screen. */
+    int tracked_count;
+    sds screen;                 /* Last captured text, or NULL. */
+    uint64_t captured_at;       /* When 'screen' was captured. */
+    uint64_t keys_at;           /* When keys were last sent. */
+    Watch watch;
+    Settle settle;
+    int keypad;                 /* Show the inline keypad, see .keypad. */
+} Session;
+
+/* A user of a bot: the owner, or in team mode every member of the team.
+ * Each user has its own OTP authentication and sessions. The requests of
+ * a user are served one at a time, in order, holding its lock, while the
+ * requests of different users are served in parallel. */
+typedef struct UserState {
+    int64_t id;                 /* Telegram user ID. */
+    pthread_mutex_t lock;       /* Held while serving its requests. */
+    int authenticated;          /* Whether OTP has been verified. */
+    time_t last_activity;       /* Last time the user sent a valid command. */
+    int otp_timeout;            /* Timeout in seconds (default 5 min). */
+    Session sessions[MAX_SESSIONS];
+    Session *active;            /* Target of plain messages. */
+    /* Messages of previous screens whose deletion failed because Telegram
+     * could not be reached, or failed temporarily: they are retried with
+     * the next batch. Messages Telegram refused to delete are not. */
+    int64_t pending_delete_chat;
+    int64_t pending_delete_ids[MAX_TRACKED_MSGS];
+    int pending_delete_count;
+    /* What the interrupt fast lane needs to know without taking 'lock',
+     * protected by InterruptLock: see user_publish(). */
+    int fast_slot;              /* Slot of the active session, or -1. */
+    TermInfo fast_terms[MAX_SESSIONS]; /* Terminals of the sessions. */
+    unsigned fast_attached;     /* Bitmap of the attached slots. */
+    unsigned fast_batched;      /* Slots with keypad keys not typed yet. */
+    time_t fast_until;          /* Authenticated till then. */
+    uint64_t interrupts[MAX_SESSIONS]; /* See session_settle(). */
+    struct UserState *next;
+} UserState;
+
+/* State of one of the bots served by the process (one per --apikey): each
+ * bot has its own owner and users. Its keys in the KV store are prefixed
+ * by bot->kvprefix, see bot_key(). */
+typedef struct BotState {
+    pthread_mutex_t lock;       /* Protects the owner and 'users'. */
+    UserState *users;           /* Users seen so far, never freed. */
+} BotState;
+
+/* The user whose request the thread is serving. */
+static _Thread_local UserState *CurrentUser = NULL;
+
+/* Protects the fast lane fields of all the users, see session_interrupt(). */
+static pthread_mutex_t InterruptLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t SettleCond = PTHREAD_COND_INITIALIZER;
+
+static metricFamily *CaptureBytes;    /* Size of the captured screens. */
+static metricFamily *CaptureTime;     /* Time taken by backend_capture_text(). */
+static metricFamily *LockWaitTime;    /* Time waited for the user lock. */
+
+/* Return the state of the bot the calling thread works for. */
+static BotState *bot_state(void) {
+    return botCurrent()->privdata;
+}
 
-/* ============================================================================
- * TOTP Authentication
- * ========================================================================= */
+/* Return the state of the user whose request is being served. */
+static UserState *user_state(void) {
+    return CurrentUser;
+}
 
-/* Encode raw bytes to Base32 string (RFC 4648). Returns static buffer. */
-static const char *base32_encode(const unsigned char *data, size_t len) {
-    static char out[128];
-    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
-    int i = 0, j = 0;
-    uint64_t buf = 0;
-    int bits = 0;
-
-    for (i = 0; i < (int)len; i++) {
-        buf = (buf << 8) | data[i];
-        bits += 8;
-        while (bits >= 5) {
-            bits -= 5;
-            out[j++] = alphabet[(buf >> bits) & 0x1f];
-        }
-    }
-    if (bits > 0) {
-        out[j++] = alphabet[(buf << (5 - bits)) & 0x1f];
-    }
-    out[j] = '\0';
-    return out;
+/* Return the KV store key 'name' of the current bot. */
+static sds bot_key(const char *name) {
+    return sdscat(sdsdup(botCurrent()->kvprefix), name);
 }
 
-/* Compute 6-digit TOTP code from raw secret and time step. */
-static uint32_t totp_code(const unsigned char *secret, size_t secret_len,
-                          uint64_t time_step)
-{
-    unsigned char msg[8];
-    for (int i = 7; i >= 0; i--) {
-        msg[i] = (unsigned char)(time_step & 0xff);
-        time_step >>= 8;
-    }
+/* Return the KV store key 'name' of the user of the current bot. In team
+ * mode every user has its own keys, otherwise the owner uses the keys of
+ * the bot. */
+static sds user_key(int64_t uid, const char *name) {
+    sds key = bot_key(name);
+    if (TeamSize) key = sdscatprintf(key, ":%lld", (long long)uid);
+    return key;
+}
 
-    unsigned char hash[SHA1_DIGEST_SIZE];
-    hmac_sha1(secret, secret_len, msg, 8, hash);
+/* Return true if the user is a member of the team. */
+static int team_member(int64_t uid) {
+    for (int i = 0; i < TeamSize; i++)
+        if (TeamUsers[i] == uid) return 1;
+    return 0;
+}
 
-    int offset = hash[19] & 0x0f;
-    uint32_t code = ((uint32_t)(hash[offset] & 0x7f) << 24)
-                  | ((uint32_t)hash[offset+1] << 16)
-                  | ((uint32_t)hash[offset+2] << 8)
-                  | (uint32_t)hash[offset+3];
-    return code % 1000000;
+static void user_restore(sqlite3 *db, UserState *u);
+static void user_publish(UserState *u);
+
+/* Return the state of the user of the current bot, creating it the first
+ * time the user is seen. */
+static UserState *user_get(sqlite3 *db, int64_t uid) {
+    BotState *bs = bot_state();
+    pthread_mutex_lock(&bs->lock);
+    UserState *u = bs->users;
+    while (u && u->id != uid) u = u->next;
+    if (u == NULL) {
+        u = xmalloc(sizeof(*u));
+        memset(u, 0, sizeof(*u));
+        u->id = uid;
+        pthread_mutex_init(&u->lock, NULL);
+        u->otp_timeout = 300;
+        sds key = user_key(uid, "otp_timeout");
+        sds timeout_str = kvGet(db, key);
+        if (timeout_str) {
+            int t = atoi(timeout_str);
+            if (t >= 30 && t <= 28800) u->otp_timeout = t;
+            sdsfree(timeout_str);
+        }
+        sdsfree(key);
+        u->fast_slot = -1;
+        user_restore(db, u);
+        user_publish(u);
+        u->next = bs->users;
+        bs->users = u;
+    }
+    pthread_mutex_unlock(&bs->lock);
+    return u;
 }
 
+/* ============================================================================
+ * TOTP Authentication
+ * ========================================================================= */
+
 /* Print QR code as compact ASCII art using half-block characters.
  * Each output line encodes two QR rows using upper/lower half blocks. */
 static void print_qr_ascii(const char *text) {
@@ -135,54 +272,18 @@ static void print_qr_ascii(const char *text) {
     }
 }
 
-/* Convert hex string to raw bytes. Returns number of bytes written. */
-static int hex_to_bytes(const char *hex, unsigned char *out, int max) {
-    int len = 0;
-    while (*hex && *(hex+1) && len < max) {
-        unsigned int byte;
-        if (sscanf(hex, "%2x", &byte) != 1) break;
-        out[len++] = (unsigned char)byte;
-        hex += 2;
-    }
-    return len;
-}
-
-/* Convert raw bytes to hex string. Returns static buffer. */
-static const char *bytes_to_hex(const unsigned char *data, int len) {
-    static char hex[128];
-    for (int i = 0; i < len && i < 63; i++) {
-        sprintf(hex + i*2, "%02x", data[i]);
-    }
-    hex[len*2] = '\0';
-    return hex;
-}
-
-/* Setup TOTP: check for existing secret, generate if needed, display QR.
- * The db_path is the SQLite database file path.
- * Returns the secret length in bytes, or 0 on error/weak-security. */
-static int totp_setup(const char *db_path) {
+/* Setup TOTP for the user of the current bot (the owner if not in team
+ * mode): check for existing secret, generate if needed, display QR.
+ * Returns 1 on success, 0 on error/weak-security. */
+static int totp_setup(sqlite3 *db, int64_t uid) {
     if (WeakSecurity) return 0;
 
-    sqlite3 *db;
-    if (sqlite3_open(db_path, &db) != SQLITE_OK) {
-        fprintf(stderr, "Cannot open database for TOTP setup.\n");
-        return 0;
-    }
-    /* Ensure KV table exists. */
-    sqlite3_exec(db, TB_CREATE_KV_STORE, 0, 0, NULL);
-
     /* Check for existing secret. */
-    sds existing = kvGet(db, "totp_secret");
+    sds key = user_key(uid, "totp_secret");
+    sds existing = kvGet(db, key);
     if (existing) {
         sdsfree(existing);
-        /* Load stored timeout if present. */
-        sds timeout_str = kvGet(db, "otp_timeout");
-        if (timeout_str) {
-            int t = atoi(timeout_str);
-            if (t >= 30 && t <= 28800) OtpTimeout = t;
-            sdsfree(timeout_str);
-        }
-        sqlite3_close(db);
+        sdsfree(key);
         return 1; /* Secret already exists. */
     }
 
@@ -197,16 +298,31 @@ static int totp_setup(const char *db_path) {
     fclose(f);
 
     /* Store as hex in KV. */
-    kvSet(db, "totp_secret", bytes_to_hex(secret, 20), 0);
-    sqlite3_close(db);
+    kvSet(db, key, bytes_to_hex(secret, 20), 0);
+    sdsfree(key);
 
-    /* Build otpauth URI and display QR code. */
+    /* Build otpauth URI and display QR code. The account name tells
+     * apart the codes of the different bots and users in the
+     * authenticator. */
+    BotInstance *bot = botCurrent();
     const char *b32 = base32_encode(secret, 20);
+    char account[128];
+    if (bot->id == 0)
+        snprintf(account, sizeof(account), "tgterm");
+    else if (bot->username)
+        snprintf(account, sizeof(account), "%s", bot->username);
+    else
+        snprintf(account, sizeof(account), "tgterm-%d", bot->id);
+    if (TeamSize) {
+        size_t len = strlen(account);
+        snprintf(account + len, sizeof(account) - len, "-%lld",
+                 (long long)uid);
+    }
     char uri[256];
     snprintf(uri, sizeof(uri),
-             "otpauth://totp/tgterm?secret=%s&issuer=tgterm", b32);
+             "otpauth://totp/%s?secret=%s&issuer=tgterm", account, b32);
 
-    printf("\n=== TOTP Setup ===\n");
+    printf("\n=== TOTP Setup (%s) ===\n", account);
     printf("Scan this QR code with Google Authenticator:\n\n");
     print_qr_ascii(uri);
     printf("\nOr enter this secret manually: %s\n", b32);
@@ -216,86 +332,197 @@ static int totp_setup(const char *db_path) {
     return 1;
 }
 
-/* Check if the given code matches the current TOTP (with +/-1 window). */
-static int totp_verify(sqlite3 *db, const char *code_str) {
-    sds hex = kvGet(db, "totp_secret");
-    if (!hex) return 0;
+/* ============================================================================
+ * Connection Management
+ * ========================================================================= */
 
-    unsigned char secret[20];
-    int slen = hex_to_bytes(hex, secret, 20);
-    sdsfree(hex);
-    if (slen != 20) return 0;
+static int session_number(Session *s) {
+    return (int)(s - user_state()->sessions) + 1;
+}
 
-    uint64_t now = (uint64_t)time(NULL) / 30;
-    uint32_t input_code = (uint32_t)atoi(code_str);
+/* Return attached session number n, or NULL. */
+static Session *session_get(int n) {
+    UserState *u = user_state();
+    if (n < 1 || n > MAX_SESSIONS || !u->sessions[n - 1].attached)
+        return NULL;
+    return &u->sessions[n - 1];
+}
 
-    for (int i = -1; i <= 1; i++) {
-        if (totp_code(secret, 20, now + i) == input_code)
-            return 1;
+/* Return the session attached to the terminal, or NULL. */
+static Session *session_find(const TermInfo *t) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *s = &user_state()->sessions[i];
+        if (s->attached && strcmp(s->term.id, t->id) == 0 &&
+            strcmp(s->term.host, t->host) == 0) return s;
     }
-    return 0;
+    return NULL;
 }
 
-/* ============================================================================
- * UTF-8 Emoji Parsing
- * ========================================================================= */
-
-/* Match red heart (E2 9D A4, optionally followed by EF B8 8F). */
-int match_red_heart(const unsigned char *p, size_t remaining) {
-    if (remaining >= 3 && p[0] == 0xE2 && p[1] == 0x9D && p[2] == 0xA4) {
-        if (remaining >= 6 && p[3] == 0xEF && p[4] == 0xB8 && p[5] == 0x8F)
-            return 6;
-        return 3;
+/* Attach to the terminal in the first free slot. Returns NULL if all the
+ * slots are taken. */
+static Session *session_attach(const TermInfo *t) {
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *s = &user_state()->sessions[i];
+        if (s->attached) continue;
+        memset(s, 0, sizeof(*s));
+        s->attached = 1;
+        s->term = *t;
+        return s;
     }
-    return 0;
+    return NULL;
 }
 
-/* Match colored hearts: blue (F0 9F 92 99), green (9A), yellow (9B). */
-int match_colored_heart(const unsigned char *p, size_t remaining, char *heart) {
-    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0x92) {
-        if (p[3] == 0x99) { *heart = 'B'; return 4; }  /* Blue = Alt */
-        if (p[3] == 0x9A) { *heart = 'G'; return 4; }  /* Green = Cmd */
-        if (p[3] == 0x9B) { *heart = 'Y'; return 4; }  /* Yellow = ESC */
+static void watch_stop(Session *s);
+static void settle_stop(Session *s);
+
+/* Publish the sessions, the active one and the authentication of the
+ * user, for the interrupt fast lane. Called with the user lock held,
+ * whenever they may have changed: at the end of every request, and when a
+ * session is detached by the threads of the jobs and of .watch-screen. */
+static void user_publish(UserState *u) {
+    pthread_mutex_lock(&InterruptLock);
+    u->fast_slot = u->active ? (int)(u->active - u->sessions) : -1;
+    u->fast_attached = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        if (!u->sessions[i].attached) continue;
+        u->fast_attached |= 1u << i;
+        u->fast_terms[i] = u->sessions[i].term;
     }
-    return 0;
+    u->fast_until = u->authenticated ? u->last_activity + u->otp_timeout : 0;
+    pthread_mutex_unlock(&InterruptLock);
 }
 
-/* Match orange heart (F0 9F A7 A1) - sends Enter. */
-int match_orange_heart(const unsigned char *p, size_t remaining) {
-    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0xA7 && p[3] == 0xA1)
-        return 4;
-    return 0;
+/* Detach the session. Its last screen is left in the chat. */
+static void session_detach(Session *s) {
+    watch_stop(s);
+    settle_stop(s);
+    sdsfree(s->screen);
+    memset(s, 0, sizeof(*s));
+    UserState *u = user_state();
+    if (u->active == s) u->active = NULL;
+    user_publish(u);
 }
 
-/* Match purple heart (F0 9F 92 9C) - used to suppress newline. */
-int match_purple_heart(const unsigned char *p, size_t remaining) {
-    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0x92 && p[3] == 0x9C)
-        return 4;
-    return 0;
+/* Return "name - title" of the session's terminal. */
+static sds session_label(Session *s) {
+    sds label = sdsnew(s->term.name);
+    if (s->term.title[0]) label = sdscatprintf(label, " - %s", s->term.title);
+    return label;
 }
 
-/* Check if string ends with purple heart. */
-int ends_with_purple_heart(const char *text) {
-    size_t len = strlen(text);
-    if (len >= 4) {
-        const unsigned char *p = (const unsigned char *)text + len - 4;
-        if (match_purple_heart(p, 4)) return 1;
+/* ============================================================================
+ * State kept across restarts
+ *
+ * A graceful shutdown (SIGTERM, or .restart, see botShutdown()) saves the
+ * sessions and the authentication of every user, and they are restored the
+ * first time the user is seen by the next process, so that an upgrade goes
+ * unnoticed.
+ * ========================================================================= */
+
+#define SAVED_STATE_TTL 3600    /* Seconds the saved sessions are valid. */
+
+/* Save the user's sessions, one per line: slot, whether it's the active
+ * one, the terminal, and the messages showing its screen, that the next
+ * screen replaces as usual. The authentication is saved as the time of
+ * the last activity, expiring with the OTP timeout. */
+static void user_save(sqlite3 *db, UserState *u) {
+    sds state = sdsempty();
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *s = &u->sessions[i];
+        if (!s->attached) continue;
+        state = sdscatprintf(state, "%d %d %d ", i, s == u->active,
+                             (int)s->term.pid);
+        state = sdscatrepr(state, s->term.id, strlen(s->term.id));
+        state = sdscat(state, " ");
+        state = sdscatrepr(state, s->term.host, strlen(s->term.host));
+        state = sdscat(state, " ");
+        state = sdscatrepr(state, s->term.name, strlen(s->term.name));
+        state = sdscat(state, " ");
+        state = sdscatrepr(state, s->term.title, strlen(s->term.title));
+        for (int j = 0; j < s->tracked_count; j++)
+            state = sdscatprintf(state, " %lld", (long long)s->tracked[j]);
+        state = sdscat(state, "\n");
+    }
+    sds key = user_key(u->id, "saved_sessions");
+    if (sdslen(state)) kvSet(db, key, state, SAVED_STATE_TTL);
+    sdsfree(key);
+    sdsfree(state);
+
+    time_t left = u->last_activity + u->otp_timeout - time(NULL);
+    if (u->authenticated && left > 0) {
+        key = user_key(u->id, "saved_auth");
+        sds value = sdsfromlonglong(u->last_activity);
+        kvSet(db, key, value, left);
+        sdsfree(value);
+        sdsfree(key);
     }
-    return 0;
 }
 
-/* ============================================================================
- * Connection Management
- * ========================================================================= */
+/* Restore the state saved by user_save(), if any. The saved state is used
+ * once. Sessions whose terminal is gone are detached at their next use,
+ * like the ones whose terminal is closed while attached. */
+static void user_restore(sqlite3 *db, UserState *u) {
+    sds key = user_key(u->id, "saved_sessions");
+    sds state = kvGet(db, key);
+    if (state) kvDel(db, key);
+    sdsfree(key);
+    if (state) {
+        int numlines;
+        sds *lines = sdssplitlen(state, sdslen(state), "\n", 1, &numlines);
+        for (int i = 0; i < numlines; i++) {
+            int argc;
+            sds *argv = sdssplitargs(lines[i], &argc);
+            int slot = argc >= 7 ? atoi(argv[0]) : -1;
+            if (slot >= 0 && slot < MAX_SESSIONS) {
+                Session *s = &u->sessions[slot];
+                memset(s, 0, sizeof(*s));
+                s->attached = 1;
+                if (atoi(argv[1])) u->active = s;
+                s->term.pid = atoi(argv[2]);
+                snprintf(s->term.id, sizeof(s->term.id), "%s", argv[3]);
+                snprintf(s->term.host, sizeof(s->term.host), "%s", argv[4]);
+                snprintf(s->term.name, sizeof(s->term.name), "%s", argv[5]);
+                snprintf(s->term.title, sizeof(s->term.title), "%s", argv[6]);
+                for (int j = 7; j < argc && j-7 < MAX_TRACKED_MSGS; j++)
+                    s->tracked[s->tracked_count++] = strtoll(argv[j], NULL, 10);
+            }
+            if (argv) sdsfreesplitres(argv, argc);
+        }
+        sdsfreesplitres(lines, numlines);
+        sdsfree(state);
+    }
+
+    key = user_key(u->id, "saved_auth");
+    sds auth = kvGet(db, key);
+    if (auth) {
+        kvDel(db, key);
+        u->authenticated = 1;
+        u->last_activity = strtoll(auth, NULL, 10);
+        sdsfree(auth);
+    }
+    sdsfree(key);
+}
 
-/* Disconnect from current terminal session. */
-void disconnect(void) {
-    Connected = 0;
-    ConnectedId[0] = '\0';
-    ConnectedPid = 0;
-    ConnectedName[0] = '\0';
-    ConnectedTitle[0] = '\0';
-    TrackedMsgCount = 0;
+/* Shutdown callback: save the state of the users of the bot. The requests
+ * in flight completed already, so a user lock still held belongs to a
+ * request that did not complete in time, whose state is not consistent:
+ * such users start from scratch. */
+void shutdown_callback(sqlite3 *db, BotInstance *bot) {
+    BotState *bs = bot->privdata;
+    int saved = 0;
+    pthread_mutex_lock(&bs->lock);
+    for (UserState *u = bs->users; u; u = u->next) {
+        if (pthread_mutex_trylock(&u->lock) != 0) {
+            printf("State of user %lld not saved: request in progress.\n",
+                   (long long)u->id);
+            continue;
+        }
+        user_save(db, u);
+        pthread_mutex_unlock(&u->lock);
+        saved++;
+    }
+    pthread_mutex_unlock(&bs->lock);
+    if (saved) printf("Saved the state of %d users.\n", saved);
 }
 
 /* ============================================================================
@@ -304,11 +531,13 @@ void disconnect(void) {
 
 /* Build the .list response. */
 sds build_list_message(void) {
-    backend_list();
+    pthread_mutex_lock(&TermListLock);
+    hub_list();
 
     sds msg = sdsempty();
     if (TermCount == 0) {
         msg = sdscat(msg, "No terminal sessions found.");
+        pthread_mutex_unlock(&TermListLock);
         return msg;
     }
 
@@ -325,6 +554,29 @@ sds build_list_message(void) {
         }
         msg = sdscat(msg, line);
     }
+    pthread_mutex_unlock(&TermListLock);
+    return msg;
+}
+
+/* Build the .sessions response. */
+static sds build_sessions_message(void) {
+    UserState *u = user_state();
+    sds msg = sdsnew("Attached sessions:\n");
+    int count = 0;
+    for (int i = 0; i < MAX_SESSIONS; i++) {
+        Session *s = &u->sessions[i];
+        if (!s->attached) continue;
+        sds label = session_label(s);
+        msg = sdscatprintf(msg, "@%d %s%s%s\n", i + 1, label,
+                           s == u->active ? " (active)" : "",
+                           s->watch.active ? " (watching)" : "");
+        sdsfree(label);
+        count++;
+    }
+    if (count == 0) {
+        sdsfree(msg);
+        msg = sdsnew("No attached sessions.");
+    }
     return msg;
 }
 
@@ -333,6 +585,19 @@ sds build_help_message(void) {
         "Commands:\n"
         ".list - Show terminal windows\n"
         ".1 .2 ... - Connect to window\n"
+        ".sessions - Attached windows\n"
+        ".detach - Detach the active window\n"
+        "@N - Switch to attached window N\n"
+        "@N text - Send text to attached window N\n"
+        ".bcast <glob> <text> - Send text to all matching windows\n"
+        ".at HH:MM <text> - Send text to the active window at a time\n"
+        ".every <interval> <text> - Send text periodically (10m, 2h, ...)\n"
+        ".jobs - Scheduled jobs, .unjob N removes job N\n"
+        ".watch-screen [secs|off] - Keep the screen up to date\n"
+        ".keypad [on|off] - Arrows, Tab, PgUp/PgDn, Ctrl-C... buttons\n"
+        ".reload - Reload the settings file\n"
+        ".restart - Restart the bot, keeping the sessions\n"
+        ".stats - Request latency statistics\n"
         ".help - This help\n\n"
         "Once connected, text is sent as keystrokes.\n"
         "Newline is auto-added; end with `\xf0\x9f\x92\x9c` to suppress it.\n\n"
@@ -340,7 +605,8 @@ sds build_help_message(void) {
         "`\xe2\x9d\xa4\xef\xb8\x8f` Ctrl  `\xf0\x9f\x92\x99` Alt  "
         "`\xf0\x9f\x92\x9a` Cmd  `\xf0\x9f\x92\x9b` ESC  "
         "`\xf0\x9f\xa7\xa1` Enter\n\n"
-        "Escape sequences: \\n=Enter \\t=Tab\n\n"
+        "Escape sequences: \\n=Enter \\t=Tab \\{up} \\{down} \\{left} "
+        "\\{right} \\{pgup} \\{pgdn} \\{home} \\{end}\n\n"
         "`.otptimeout <seconds>` - Set OTP timeout (30-28800)"
     );
 }
@@ -349,27 +615,40 @@ sds build_help_message(void) {
  * Telegram Bot Callbacks
  * ========================================================================= */
 
-#define MAX_MSG_LEN 4085  /* 4096 - strlen("<pre></pre>") */
 #define OWNER_KEY "owner_id"
 #define REFRESH_BTN "\xf0\x9f\x94\x84 Refresh"
-#define REFRESH_DATA "refresh"
-
-/* Get visible lines from TELETERM_VISIBLE_LINES env var, defaulting to 40. */
+#define REFRESH_DATA "refresh"     /* Followed by ":N", the session, and
+                                      in team mode ":UID", the user. */
+#define KEY_DATA "key"             /* Followed by ":K", the index of the
+                                      key in Keypad[], then as Refresh. */
+
+/* The inline keypad, see .keypad: the label of every button and the keys
+ * it types. The keys of a batch of presses are sent together, followed by
+ * the purple heart, so they are never followed by Enter. */
+#define KEYPAD_ROWS 3
+#define KEYPAD_COLS 4
+static const struct {
+    const char *label;
+    const char *keys;
+} Keypad[KEYPAD_ROWS][KEYPAD_COLS] = {
+    {{"Esc", "\xf0\x9f\x92\x9b"}, {"\xe2\x86\x91", "\\{up}"},
+     {"Tab", "\\t"}, {"PgUp", "\\{pgup}"}},
+    {{"\xe2\x86\x90", "\\{left}"}, {"\xe2\x86\x93", "\\{down}"},
+     {"\xe2\x86\x92", "\\{right}"}, {"PgDn", "\\{pgdn}"}},
+    {{"^C", "\xe2\x9d\xa4\xef\xb8\x8f" "c"},
+     {"^D", "\xe2\x9d\xa4\xef\xb8\x8f" "d"},
+     {"^Z", "\xe2\x9d\xa4\xef\xb8\x8f" "z"},
+     {"Enter", "\xf0\x9f\xa7\xa1"}},
+};
+
+/* Terminal lines shown per screen, see config.c. */
 static int get_visible_lines(void) {
-    const char *env = getenv("TELETERM_VISIBLE_LINES");
-    if (env) {
-        int v = atoi(env);
-        if (v > 0) return v;
-    }
-    return 40;
+    return configGet()->visible_lines;
 }
 
 /* Check if multi-message splitting is enabled (default: off = truncate). */
 static int get_split_messages(void) {
-    const char *env = getenv("TELETERM_SPLIT_MESSAGES");
-    if (env && (strcmp(env, "1") == 0 || strcasecmp(env, "true") == 0))
-        return 1;
-    return 0;
+    return configGet()->split_messages;
 }
 
 /* Send a plain HTML message (no inline keyboard). Returns message_id or 0. */
@@ -397,165 +676,1241 @@ static int64_t send_html_message(int64_t target, sds text) {
     return mid;
 }
 
-/* Delete all tracked terminal messages, then reset tracking. */
-static void delete_terminal_messages(int64_t chat_id) {
-    for (int i = TrackedMsgCount - 1; i >= 0; i--) {
-        char *options[4];
-        options[0] = "chat_id";
-        options[1] = sdsfromlonglong(chat_id);
-        options[2] = "message_id";
-        options[3] = sdsfromlonglong(TrackedMsgIds[i]);
-        int res;
-        sds body = makeGETBotRequest("deleteMessage", &res, options, 2);
-        sdsfree(body);
-        sdsfree(options[1]);
-        sdsfree(options[3]);
-    }
-    TrackedMsgCount = 0;
-}
-
-/* Escape text for Telegram HTML parse mode. */
-static sds html_escape(const char *text) {
-    sds out = sdsempty();
-    for (const char *p = text; *p; p++) {
-        switch (*p) {
-            case '<': out = sdscat(out, "&lt;"); break;
-            case '>': out = sdscat(out, "&gt;"); break;
-            case '&': out = sdscat(out, "&amp;"); break;
-            default:  out = sdscatlen(out, p, 1); break;
+/* Protects the pending deletions of all the users, see UserState. */
+static pthread_mutex_t PendingDeleteLock = PTHREAD_MUTEX_INITIALIZER;
+
+typedef struct DeleteJob {
+    BotInstance *bot;
+    UserState *user;
+    int64_t chat_id;
+    int count;
+    int64_t ids[MAX_TRACKED_MSGS * 2];
+} DeleteJob;
+
+/* Thread deleting the messages of an old screen. */
+static void *delete_messages_thread(void *arg) {
+    DeleteJob *job = arg;
+    botSetCurrent(job->bot);
+    int64_t failed[MAX_TRACKED_MSGS * 2];
+    int count = botDeleteMessages(job->chat_id, job->ids, job->count, failed);
+    if (count) {
+        UserState *u = job->user;
+        pthread_mutex_lock(&PendingDeleteLock);
+        if (u->pending_delete_chat != job->chat_id)
+            u->pending_delete_count = 0;
+        u->pending_delete_chat = job->chat_id;
+        for (int i = 0; i < count; i++) {
+            if (u->pending_delete_count == MAX_TRACKED_MSGS) break;
+            u->pending_delete_ids[u->pending_delete_count++] = failed[i];
         }
+        pthread_mutex_unlock(&PendingDeleteLock);
     }
-    return out;
+    xfree(job);
+    return NULL;
 }
 
-/* Get the last N lines from text. Returns pointer into the string. */
-static const char *last_n_lines(const char *text, int n) {
-    const char *end = text + strlen(text);
-    const char *p = end;
-    int count = 0;
-    while (p > text) {
-        p--;
-        if (*p == '\n') {
-            count++;
-            if (count >= n) { p++; break; }
+/* Delete the given messages (plus the ones a previous deletion failed to
+ * remove) in a background thread, so that the caller is not delayed. */
+static void delete_messages_async(int64_t chat_id, const int64_t *ids, int count) {
+    UserState *u = user_state();
+    DeleteJob *job = xmalloc(sizeof(*job));
+    job->bot = botCurrent();
+    job->user = u;
+    job->chat_id = chat_id;
+    job->count = 0;
+    for (int i = 0; i < count; i++) job->ids[job->count++] = ids[i];
+
+    pthread_mutex_lock(&PendingDeleteLock);
+    for (int i = 0; i < u->pending_delete_count &&
+                    u->pending_delete_chat == chat_id; i++)
+        job->ids[job->count++] = u->pending_delete_ids[i];
+    u->pending_delete_count = 0;
+    pthread_mutex_unlock(&PendingDeleteLock);
+
+    if (job->count == 0) {
+        xfree(job);
+        return;
+    }
+
+    /* Tracked by botThreadStart(): a restart waits for the deletion. */
+    if (!botThreadStart(delete_messages_thread, job))
+        delete_messages_thread(job);
+}
+
+/* Set 'buf' to the callback data of a button of the session: 'action',
+ * the session number, and in team mode the user the button is bound to:
+ * anybody in the group can press it, but only the user's sessions are
+ * theirs to refresh, or to type into. */
+static void button_data(Session *s, const char *action, char *buf,
+                        size_t size)
+{
+    if (TeamSize)
+        snprintf(buf, size, "%s:%d:%lld", action, session_number(s),
+                 (long long)user_state()->id);
+    else
+        snprintf(buf, size, "%s:%d", action, session_number(s));
+}
+
+/* Return the slot of the session of the callback data "N" or "N:UID" at
+ * 'p', or -1 if it is not valid, or the button belongs to another user.
+ * Doesn't look at the sessions, so it needs no lock. */
+static int button_slot(UserState *u, const char *p) {
+    const char *uid = strchr(p, ':');
+    if (uid && strtoll(uid + 1, NULL, 10) != u->id) return -1;
+    int n = atoi(p);
+    return n >= 1 && n <= MAX_SESSIONS ? n - 1 : -1;
+}
+
+/* Same, returning the session, or NULL if it is not attached. */
+static Session *button_session(const char *p) {
+    UserState *u = user_state();
+    int slot = button_slot(u, p);
+    return slot != -1 && u->sessions[slot].attached ? &u->sessions[slot] :
+                                                     NULL;
+}
+
+/* Parse the callback data of a keypad button, "key:K" followed by the
+ * session as for button_slot(). Returns the index K in Keypad[], setting
+ * 'session' to the rest, or -1 if it is not a keypad button. */
+static int keypad_key(const char *data, const char **session) {
+    if (strncmp(data, KEY_DATA ":", sizeof(KEY_DATA)) != 0) return -1;
+    const char *p = data + sizeof(KEY_DATA);
+    int key = atoi(p);
+    p = strchr(p, ':');
+    if (p == NULL || key < 0 || key >= KEYPAD_ROWS * KEYPAD_COLS) return -1;
+    *session = p + 1;
+    return key;
+}
+
+/* Return the JSON of the inline keyboard under the screen of the session:
+ * the Refresh button, below the keypad if enabled. */
+static sds session_markup(Session *s) {
+    char data[64];
+    sds markup = sdsnew("{\"inline_keyboard\":[");
+    for (int r = 0; s->keypad && r < KEYPAD_ROWS; r++) {
+        markup = sdscat(markup, "[");
+        for (int c = 0; c < KEYPAD_COLS; c++) {
+            char action[16];
+            snprintf(action, sizeof(action), KEY_DATA ":%d",
+                     r * KEYPAD_COLS + c);
+            button_data(s, action, data, sizeof(data));
+            markup = sdscatprintf(markup,
+                "%s{\"text\":\"%s\",\"callback_data\":\"%s\"}",
+                c ? "," : "", Keypad[r][c].label, data);
         }
+        markup = sdscat(markup, "],");
     }
-    return p;
-}
-
-/* Format terminal text into one or more HTML <pre> messages.
- * When TELETERM_SPLIT_MESSAGES is enabled, splits on line boundaries when
- * content exceeds Telegram's 4096 char limit. Otherwise truncates to fit
- * a single message (keeping the tail end of the output).
- * Caller must sdsfree each element and xfree the array. */
-static sds *format_terminal_messages(sds raw, int *count) {
-    int visible_lines = get_visible_lines();
-    const char *tail = last_n_lines(raw, visible_lines);
-    sds escaped = html_escape(tail);
-
-    sds *msgs = NULL;
-    int n = 0;
-    int split = get_split_messages();
-
-    if (!split) {
-        /* Truncate mode: keep the tail that fits in one message. */
-        if (sdslen(escaped) > MAX_MSG_LEN) {
-            /* Find a newline near the cut point to avoid breaking a line. */
-            const char *start = escaped + sdslen(escaped) - MAX_MSG_LEN;
-            const char *nl = strchr(start, '\n');
-            if (nl && (size_t)(nl - escaped) < sdslen(escaped))
-                start = nl + 1;
-            sds trimmed = sdsnew(start);
-            sdsfree(escaped);
-            escaped = trimmed;
+    button_data(s, REFRESH_DATA, data, sizeof(data));
+    return sdscatprintf(markup,
+        "[{\"text\":\"%s\",\"callback_data\":\"%s\"}]]}",
+        REFRESH_BTN, data);
+}
+
+/* Send the session's screen with refresh button (splits into multiple
+ * messages if needed). The new screen is sent first, then the messages of
+ * its previous screen are deleted in the background, creating a "live
+ * terminal view". The terminal is captured again only if 'capture' is
+ * true or the cached screen predates the last keys sent, otherwise the
+ * cached screen is shown again.
+ *
+ * If the last message can't be sent, it is not sent again: the request may
+ * have reached Telegram before failing, and the screen would show twice.
+ * The messages already sent are deleted and the previous screen is kept.
+ * If both are a single message, the previous one is edited in place to
+ * show the new screen, since unlike sending, editing is safe to repeat.
+ * Otherwise the update is dropped, and the next refresh captures the
+ * terminal again. */
+static void send_session_screen(int64_t chat_id, Session *s, int capture) {
+    if (capture || s->screen == NULL || s->captured_at < s->keys_at) {
+        uint64_t start = metricsUstime();
+        sds raw = hub_capture_text(&s->term);
+        metricObserve(metricGet(CaptureTime, NULL, NULL),
+                      metricsUstime() - start);
+        if (!raw) {
+            flightRecord(FLIGHT_ERROR, "capture failed", 0, 0);
+            botSendMessage(chat_id, "Could not read terminal text.", 0);
+            return;
         }
-        msgs = xrealloc(msgs, sizeof(sds) * 1);
-        msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", escaped);
+        metricObserve(metricGet(CaptureBytes, NULL, NULL), sdslen(raw));
+        traceMark(TRACE_CAPTURED);
+        sdsfree(s->screen);
+        s->screen = raw;
+        s->captured_at = metricsUstime();
+    }
+
+    int count;
+    sds *msgs = format_terminal_messages(s->screen, get_visible_lines(),
+                                         get_split_messages(), &count);
+    traceMark(TRACE_FORMATTED);
+
+    int64_t old_ids[MAX_TRACKED_MSGS];
+    int old_count = s->tracked_count;
+    memcpy(old_ids, s->tracked, sizeof(int64_t) * old_count);
+    s->tracked_count = 0;
+
+    for (int i = 0; i < count - 1; i++) {
+        int64_t mid = send_html_message(chat_id, msgs[i]);
+        if (mid && s->tracked_count < MAX_TRACKED_MSGS)
+            s->tracked[s->tracked_count++] = mid;
+        sdsfree(msgs[i]);
+    }
+
+    sds markup = session_markup(s);
+    int64_t last_mid = 0;
+    botSendMessageWithMarkup(chat_id, msgs[count - 1], "HTML", markup,
+                             &last_mid);
+    if (last_mid) {
+        if (s->tracked_count < MAX_TRACKED_MSGS)
+            s->tracked[s->tracked_count++] = last_mid;
+        delete_messages_async(chat_id, old_ids, old_count);
     } else {
-        /* Split mode: break into multiple messages. */
-        while (sdslen(escaped) > 0) {
-            if (sdslen(escaped) <= MAX_MSG_LEN) {
-                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
-                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", escaped);
-                break;
-            }
+        delete_messages_async(chat_id, s->tracked, s->tracked_count);
+        memcpy(s->tracked, old_ids, sizeof(int64_t) * old_count);
+        s->tracked_count = old_count;
+        int shown = old_count == 1 && count == 1 &&
+            botEditMessageTextWithMarkup(chat_id, old_ids[0], msgs[0],
+                                         "HTML", markup);
+        /* Not shown: don't keep it as the screen of the session. */
+        if (!shown) {
+            sdsfree(s->screen);
+            s->screen = NULL;
+        }
+    }
+    sdsfree(markup);
 
-            /* Find last newline within MAX_MSG_LEN to split on a line boundary. */
-            char *cut = NULL;
-            for (size_t i = MAX_MSG_LEN; i > 0; i--) {
-                if (escaped[i - 1] == '\n') {
-                    cut = escaped + i - 1;
-                    break;
-                }
-            }
+    sdsfree(msgs[count - 1]);
+    xfree(msgs);
+}
+
+/* Show the screen just captured into s->screen editing the message of the
+ * previous one, so that the chat doesn't scroll. If the screen spans more
+ * messages (split mode), or the edit fails because the message is gone,
+ * the screen is sent again. */
+static void edit_session_screen(int64_t chat_id, Session *s) {
+    int edited = 0;
+    if (s->tracked_count == 1) {
+        int count;
+        sds *msgs = format_terminal_messages(s->screen, get_visible_lines(),
+                                             0, &count);
+        traceMark(TRACE_FORMATTED);
+        sds markup = session_markup(s);
+        edited = botEditMessageTextWithMarkup(chat_id, s->tracked[0],
+                                              msgs[0], "HTML", markup);
+        sdsfree(markup);
+        for (int i = 0; i < count; i++) sdsfree(msgs[i]);
+        xfree(msgs);
+    }
+    if (!edited) send_session_screen(chat_id, s, 0);
+}
+
+/* Check the session's terminal still exists. If not, detach it and reply
+ * with the list of windows. Returns 1 if alive. */
+static int session_check(int64_t chat_id, Session *s) {
+    if (hub_connected(&s->term)) return 1;
+    session_detach(s);
+    sds msg = sdsnew("Window closed.\n\n");
+    sds list = build_list_message();
+    msg = sdscatsds(msg, list);
+    sdsfree(list);
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
+    return 0;
+}
+
+#define SETTLE_TIME 2000        /* ms the terminal gets to react to keys. */
+#define KEYPAD_DEBOUNCE 300     /* ms keypad presses are batched for. */
+#define KEYPAD_SETTLE 500       /* ms the terminal gets to react to them. */
+
+/* Wait 'ms' milliseconds for the terminal of the session to react to the
+ * keys just sent. Returns 0 if the wait was cut short by an interrupt sent
+ * to the session meanwhile, see session_interrupt(). */
+static int session_settle(Session *s, int ms) {
+    UserState *u = user_state();
+    int slot = (int)(s - u->sessions);
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += ms / 1000;
+    deadline.tv_nsec += (long)(ms % 1000) * 1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&InterruptLock);
+    uint64_t interrupts = u->interrupts[slot];
+    while (u->interrupts[slot] == interrupts &&
+           pthread_cond_timedwait(&SettleCond, &InterruptLock, &deadline)
+           != ETIMEDOUT);
+    int settled = u->interrupts[slot] == interrupts;
+    pthread_mutex_unlock(&InterruptLock);
+    return settled;
+}
+
+/* ============================================================================
+ * Type-ahead
+ *
+ * Keys are not followed by a blocking wait for the terminal to settle: the
+ * request arms the settle timer of the session and returns, so the keys of
+ * the next messages of the user are typed at once. Every new keys request
+ * moves the timer forward, superseding the screen of the previous one, and
+ * the screen is captured once, SETTLE_TIME after the last keys: N messages
+ * sent in a row cost one settle and one capture, not N.
+ * ========================================================================= */
+
+static _Atomic uint64_t SettleGen = 0;
+
+/* Tell the interrupt fast lane whether the session has keypad keys not
+ * typed yet: interrupts must not overtake them, see session_interrupt().
+ * The flag is cleared only once the keys were sent. */
+static void settle_batched(Session *s, int batched) {
+    UserState *u = user_state();
+    unsigned bit = 1u << (int)(s - u->sessions);
+    pthread_mutex_lock(&InterruptLock);
+    if (batched) u->fast_batched |= bit;
+    else u->fast_batched &= ~bit;
+    pthread_mutex_unlock(&InterruptLock);
+}
+
+/* Cancel the pending screen update of the session, if any. Called holding
+ * the user lock. The timer is initialized the first time keys are sent. */
+static void settle_stop(Session *s) {
+    Settle *st = &s->settle;
+    if (st->timer.proc) timerCancel(&st->timer);
+    if (st->traced) tracePublish(&st->trace);
+    st->traced = 0;
+    sdsfree(st->keys);
+    st->keys = NULL;
+    settle_batched(s, 0);
+}
 
-            if (!cut) {
-                /* No newline found; hard-cut at MAX_MSG_LEN. */
-                sds chunk = sdsnewlen(escaped, MAX_MSG_LEN);
-                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
-                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", chunk);
-                sdsfree(chunk);
-                sdsrange(escaped, MAX_MSG_LEN, -1);
+/* Type the keypad keys batched so far, if any. */
+static void settle_send_keys(Session *s) {
+    Settle *st = &s->settle;
+    if (st->keys == NULL) return;
+    st->keys = sdscat(st->keys, "\xf0\x9f\x92\x9c");
+    hub_send_keys(&s->term, st->keys);
+    settle_batched(s, 0);
+    sdsfree(st->keys);
+    st->keys = NULL;
+    s->keys_at = metricsUstime();
+    traceMark(TRACE_KEYS_SENT);
+}
+
+typedef struct SettleRun {
+    BotInstance *bot;
+    struct UserState *user;
+    Session *session;
+    uint64_t gen;
+} SettleRun;
+
+/* Thread showing the screen once the keys settled, holding the user lock
+ * like the requests. New keys may have been sent while waiting for the
+ * lock, re-arming the timer, or the session detached: the generation
+ * tells, and the screen is left to the next timer. The trace of the last
+ * request is completed and published here.
+ *
+ * Keypad presses are served in two steps: first the keys batched during
+ * KEYPAD_DEBOUNCE are typed, and the timer armed again, then the screen
+ * is captured and its message edited in place, if it changed. */
+static void *settle_thread(void *arg) {
+    SettleRun *run = arg;
+    botSetCurrent(run->bot);
+    UserState *u = run->user;
+    pthread_mutex_lock(&u->lock);
+    CurrentUser = u;
+    Session *s = run->session;
+    Settle *st = &s->settle;
+    if (s->attached && st->gen == run->gen && !timerPending(&st->timer)) {
+        if (st->traced) traceSetCurrent(&st->trace);
+        if (st->keys) {
+            settle_send_keys(s);
+            timerAdd(&st->timer, KEYPAD_SETTLE, 0);
+        } else {
+            traceMark(TRACE_SETTLED);
+            /* Keystrokes may switch panes/tabs, changing the active ID. */
+            hub_connected(&s->term);
+            sds raw = st->edit ? hub_capture_text(&s->term) : NULL;
+            if (raw) {
+                traceMark(TRACE_CAPTURED);
+                int changed = s->screen == NULL || sdscmp(raw, s->screen);
+                sdsfree(s->screen);
+                s->screen = raw;
+                s->captured_at = metricsUstime();
+                if (changed) edit_session_screen(st->chat_id, s);
             } else {
-                size_t chunk_len = cut - escaped;
-                sds chunk = sdsnewlen(escaped, chunk_len);
-                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
-                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", chunk);
-                sdsfree(chunk);
-                sdsrange(escaped, chunk_len + 1, -1); /* skip past newline */
+                send_session_screen(st->chat_id, s, 1);
+            }
+            traceMark(TRACE_DONE);
+            if (st->traced) tracePublish(&st->trace);
+            st->traced = 0;
+        }
+        traceSetCurrent(NULL);
+    }
+    CurrentUser = NULL;
+    pthread_mutex_unlock(&u->lock);
+    xfree(run);
+    return NULL;
+}
+
+/* Timer procedure: capturing may be slow, so it runs in its own thread.
+ * It doesn't hold the user lock: the generation is read atomically, and
+ * settle_thread() checks it again once locked. */
+static void settle_fire(void *privdata) {
+    Session *s = privdata;
+    SettleRun *run = xmalloc(sizeof(*run));
+    run->bot = s->settle.bot;
+    run->user = s->settle.user;
+    run->session = s;
+    run->gen = s->settle.gen;
+    if (!botThreadStart(settle_thread, run)) xfree(run);
+}
+
+/* Arm the settle timer of the session to fire in 'delay' milliseconds,
+ * superseding the screen of the previous keys if still pending. The trace
+ * of the request is handed over to settle_thread(), and the one of a
+ * superseded request is published as it is, without a screen. */
+static void settle_arm(int64_t chat_id, Session *s, int delay) {
+    Settle *st = &s->settle;
+    if (st->traced) tracePublish(&st->trace);
+    st->traced = 0;
+    Trace *tr = traceGetCurrent();
+    if (tr) {
+        st->trace = *tr;
+        st->traced = 1;
+        traceInit(tr);
+    }
+    st->gen = ++SettleGen;
+    st->chat_id = chat_id;
+    if (st->timer.proc == NULL) {
+        st->bot = botCurrent();
+        st->user = user_state();
+        timerInit(&st->timer, settle_fire, s);
+    }
+    timerAdd(&st->timer, delay, 0);
+}
+
+/* Show the screen of the session once it settled after the keys just sent.
+ * Returns at once: the screen is sent by settle_thread(), unless more keys
+ * come first. */
+static void session_show_keys(int64_t chat_id, Session *s) {
+    s->keys_at = metricsUstime();
+    traceMark(TRACE_KEYS_SENT);
+    s->settle.edit = 0;
+    settle_arm(chat_id, s, SETTLE_TIME);
+}
+
+/* Edit the screen of the session in place once it settled after keypad
+ * keys just sent. */
+static void session_show_keypad(int64_t chat_id, Session *s) {
+    s->keys_at = metricsUstime();
+    traceMark(TRACE_KEYS_SENT);
+    s->settle.edit = 1;
+    settle_arm(chat_id, s, KEYPAD_SETTLE);
+}
+
+/* A key of the inline keypad was pressed: batch it with the ones pressed
+ * in the next KEYPAD_DEBOUNCE milliseconds, see settle_thread().
+ * Interrupting keys are not batched: they are typed at once, after the
+ * keys batched so far. They usually don't get here, see handle_request(). */
+static void session_keypad(int64_t chat_id, Session *s, int key) {
+    Settle *st = &s->settle;
+    const char *keys = Keypad[key / KEYPAD_COLS][key % KEYPAD_COLS].keys;
+    if (is_interrupt_key(keys)) {
+        settle_send_keys(s);
+        hub_send_keys(&s->term, keys);
+        session_show_keypad(chat_id, s);
+        return;
+    }
+    if (st->keys == NULL) st->keys = sdsempty();
+    st->keys = sdscat(st->keys, keys);
+    settle_batched(s, 1);
+    st->edit = 1;
+    settle_arm(chat_id, s, KEYPAD_DEBOUNCE);
+}
+
+/* Send keystrokes to the session and show its screen once it settled. */
+static void session_send_keys(int64_t chat_id, Session *s, const char *keys) {
+    if (!session_check(chat_id, s)) return;
+    settle_send_keys(s);    /* Keypad keys pressed before, first. */
+    hub_send_keys(&s->term, keys);
+    session_show_keys(chat_id, s);
+}
+
+/* The interrupt fast lane. The requests of a user are served one at a
+ * time, and one may hold the user lock for seconds, capturing a slow
+ * terminal or running a job: a Ctrl-C for a runaway process would wait
+ * behind it, and behind the messages queued meanwhile. So a single
+ * interrupting key (see is_interrupt_key()) is sent at once to the session
+ * in 'slot', or to the active one if -1, as published by user_publish(),
+ * without the user lock, and the settle wait of a job on the session, if
+ * any, is cancelled. Keypad keys already batched for the session must be
+ * typed first: then the request is served as usual, and sends them.
+ * Returns the slot of the session the keys were sent to, or -1 if the
+ * request must be served as usual. */
+static int session_interrupt(UserState *u, int slot, const char *keys) {
+    TermInfo term;
+    pthread_mutex_lock(&InterruptLock);
+    if (slot == -1) slot = u->fast_slot;
+    if (slot != -1 && (!(u->fast_attached & (1u << slot)) ||
+                       (u->fast_batched & (1u << slot))))
+        slot = -1;
+    if (!WeakSecurity && time(NULL) > u->fast_until) slot = -1;
+    if (slot != -1) term = u->fast_terms[slot];
+    pthread_mutex_unlock(&InterruptLock);
+    if (slot == -1) return -1;
+
+    hub_send_keys(&term, keys);
+    flightRecord(FLIGHT_REQUEST, "interrupt sent", 0, 0);
+    pthread_mutex_lock(&InterruptLock);
+    u->interrupts[slot]++;
+    pthread_cond_broadcast(&SettleCond);
+    pthread_mutex_unlock(&InterruptLock);
+    return slot;
+}
+
+/* Make the session the active one and show its screen. */
+static void session_switch(int64_t chat_id, Session *s, int capture) {
+    user_state()->active = s;
+    sds label = session_label(s);
+    sds msg = sdscatprintf(sdsempty(), "Connected to @%d %s",
+                           session_number(s), label);
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
+    sdsfree(label);
+    send_session_screen(chat_id, s, capture);
+}
+
+/* ============================================================================
+ * Broadcast
+ * ========================================================================= */
+
+#define MAX_BCAST 32            /* Windows a single .bcast can reach. */
+#define BCAST_LINES 3           /* Screen lines shown per window. */
+
+typedef struct BcastJob {
+    TermInfo term;
+    const char *keys;
+    int sent;                   /* backend_send_keys() succeeded. */
+    sds screen;                 /* Screen after the keys, or NULL. */
+} BcastJob;
+
+/* Thread sending the keys to one window and capturing it once settled. */
+static void *bcast_thread(void *arg) {
+    BcastJob *job = arg;
+    job->sent = hub_send_keys(&job->term, job->keys) == 0;
+    usleep(SETTLE_TIME * 1000);
+    job->screen = hub_capture_text(&job->term);
+    return NULL;
+}
+
+/* .bcast <glob> <keys>: send the keys to every window whose name matches
+ * the glob. Every window is served by its own thread, so the keys are
+ * sent and the windows settle at the same time, and the whole broadcast
+ * takes about as long as typing into a single window. The reply shows
+ * the last lines of every screen. */
+static void handle_bcast(int64_t chat_id, const char *args) {
+    while (*args == ' ') args++;
+    const char *sp = strchr(args, ' ');
+    if (*args == '\0' || sp == NULL || sp[1] == '\0') {
+        botSendMessage(chat_id, "Usage: .bcast <glob> <keys>", 0);
+        return;
+    }
+    int patlen = (int)(sp - args);
+    const char *keys = sp + 1;
+
+    /* Compiled, so that a pattern with many stars can't make matching
+     * the names exponential, see globset.c. */
+    globSet *glob = globSetCompileLen(args, patlen, 0);
+    pthread_mutex_lock(&TermListLock);
+    hub_list();
+    BcastJob *jobs = xmalloc(sizeof(BcastJob) * MAX_BCAST);
+    int count = 0, skipped = 0;
+    for (int i = 0; i < TermCount; i++) {
+        TermInfo *t = &TermList[i];
+        if (!globSetMatch(glob, t->name, strlen(t->name))) continue;
+        if (count == MAX_BCAST) {
+            skipped++;
+            continue;
+        }
+        BcastJob *job = &jobs[count++];
+        job->term = *t;
+        job->keys = keys;
+        job->sent = 0;
+        job->screen = NULL;
+
+        /* Attached sessions must not show their cached screen again. */
+        Session *s = session_find(t);
+        if (s) s->keys_at = metricsUstime();
+    }
+    pthread_mutex_unlock(&TermListLock);
+    globSetFree(glob);
+    if (count == 0) {
+        xfree(jobs);
+        sds msg = sdscatprintf(sdsempty(), "No window matches %.*s.",
+                               patlen, args);
+        botSendMessage(chat_id, msg, 0);
+        sdsfree(msg);
+        return;
+    }
+
+    pthread_t tids[MAX_BCAST];
+    int started[MAX_BCAST];
+    for (int i = 0; i < count; i++) {
+        started[i] = pthread_create(&tids[i], NULL, bcast_thread,
+                                    &jobs[i]) == 0;
+        if (!started[i]) bcast_thread(&jobs[i]);
+    }
+    for (int i = 0; i < count; i++)
+        if (started[i]) pthread_join(tids[i], NULL);
+    traceMark(TRACE_CAPTURED);
+
+    int failed = 0;
+    sds body = sdsempty();
+    for (int i = 0; i < count; i++) {
+        BcastJob *job = &jobs[i];
+        if (!job->sent) failed++;
+        sds name = html_escape(job->term.name);
+        body = sdscatprintf(body, "<b>%s</b>", name);
+        sdsfree(name);
+        if (!job->sent) {
+            body = sdscat(body, " (send failed)\n");
+        } else if (job->screen == NULL) {
+            body = sdscat(body, " (no screen)\n");
+        } else {
+            sds tail = html_escape(last_n_lines(job->screen, BCAST_LINES));
+            body = sdscatprintf(body, "\n<pre>%s</pre>\n", tail);
+            sdsfree(tail);
+        }
+        sdsfree(job->screen);
+    }
+    xfree(jobs);
+
+    sds msg = sdscatprintf(sdsempty(), "Sent to %d window%s", count - failed,
+                           count - failed == 1 ? "" : "s");
+    if (failed) msg = sdscatprintf(msg, ", %d failed", failed);
+    if (skipped) msg = sdscatprintf(msg, ", %d skipped (max %d)",
+                                    skipped, MAX_BCAST);
+    msg = sdscat(msg, ".\n\n");
+    /* Drop the windows that don't fit in one message: cut at a window
+     * boundary so that no <pre> is left open. */
+    if (sdslen(msg) + sdslen(body) > MAX_MSG_LEN) {
+        size_t max = MAX_MSG_LEN - sdslen(msg) - 4;
+        size_t cut = 0;
+        for (char *p = strstr(body, "<b>"); p && (size_t)(p - body) <= max;
+             p = strstr(p + 1, "<b>"))
+        {
+            cut = p - body;
+        }
+        sdsrange(body, 0, (ssize_t)cut - 1);
+        if (cut == 0) sdsclear(body);
+        body = sdscat(body, "...");
+    }
+    msg = sdscatsds(msg, body);
+    sdsfree(body);
+    traceMark(TRACE_FORMATTED);
+    send_html_message(chat_id, msg);
+    sdsfree(msg);
+}
+
+/* ============================================================================
+ * Scheduled jobs
+ *
+ * ".at HH:MM <keys>" and ".every <interval> <keys>" type the keys into the
+ * active window at the given time, or periodically, and post the screen
+ * once settled. Jobs are stored in the Jobs table so that they survive
+ * restarts, and every job arms a timer (see timer.c) for its next run:
+ * nothing polls the table. The times are wall clock (Unix time), so that
+ * ".at 02:00" means 02:00 also after a restart. Jobs missed while the bot
+ * was down run as soon as it starts.
+ * ========================================================================= */
+
+#define CREATE_JOBS_TABLE \
+    "CREATE TABLE IF NOT EXISTS Jobs(id INTEGER PRIMARY KEY, bot TEXT, " \
+    "user INT, chat INT, term_id TEXT, term_host TEXT, term_name TEXT, " \
+    "keys TEXT, next_run INT, period INT);"
+
+#define MAX_USER_JOBS 16
+#define MIN_JOB_PERIOD 60       /* Seconds. */
+
+typedef struct Job {
+    int64_t id;                 /* Row ID in the Jobs table. */
+    BotInstance *bot;
+    int64_t uid;                /* User that created the job. */
+    int64_t chat_id;            /* Where the screens are posted. */
+    TermInfo term;
+    sds keys;
+    int64_t next_run;           /* Unix time. */
+    int64_t period;             /* Seconds, 0 for one shot .at jobs. */
+    int running;                /* Its thread is running. */
+    int removed;                /* Removed with .unjob while running. */
+    timerEvent timer;
+    struct Job *next;
+} Job;
+
+static pthread_mutex_t JobsLock = PTHREAD_MUTEX_INITIALIZER;
+static Job *Jobs = NULL;        /* All the jobs of all the bots. */
+
+static void job_fire(void *privdata);
+
+static void job_free(Job *job) {
+    sdsfree(job->keys);
+    xfree(job);
+}
+
+/* Arm the timer of the job for its next run. */
+static void job_arm(Job *job) {
+    int64_t delay = job->next_run - (int64_t)time(NULL);
+    timerAdd(&job->timer, delay > 0 ? (uint64_t)delay * 1000 : 0, 0);
+}
+
+/* Parse "30s", "10m", "2h", "1d" into seconds. Returns 0 on error. */
+static int64_t parse_interval(const char *s) {
+    char *end;
+    long long n = strtoll(s, &end, 10);
+    if (n <= 0 || end == s || end[0] == '\0' || end[1] != '\0') return 0;
+    switch (tolower((unsigned char)end[0])) {
+    case 's': return n;
+    case 'm': return n * 60;
+    case 'h': return n * 3600;
+    case 'd': return n * 86400;
+    }
+    return 0;
+}
+
+/* Format seconds the way parse_interval() reads them. */
+static sds format_interval(int64_t secs) {
+    if (secs % 86400 == 0) return sdscatprintf(sdsempty(), "%lldd", (long long)secs / 86400);
+    if (secs % 3600 == 0) return sdscatprintf(sdsempty(), "%lldh", (long long)secs / 3600);
+    if (secs % 60 == 0) return sdscatprintf(sdsempty(), "%lldm", (long long)secs / 60);
+    return sdscatprintf(sdsempty(), "%llds", (long long)secs);
+}
+
+/* Return the next Unix time at the local time "HH:MM", or 0 on error. */
+static int64_t parse_clock(const char *s) {
+    int h, m;
+    char extra;
+    if (sscanf(s, "%d:%d%c", &h, &m, &extra) != 2 ||
+        h < 0 || h > 23 || m < 0 || m > 59) return 0;
+    time_t now = time(NULL);
+    struct tm tm;
+    localtime_r(&now, &tm);
+    tm.tm_hour = h;
+    tm.tm_min = m;
+    tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    time_t t = mktime(&tm);
+    if (t <= now) {
+        tm.tm_mday++;
+        tm.tm_isdst = -1;
+        t = mktime(&tm);
+    }
+    return t;
+}
+
+/* Describe the job for .jobs and for the posted screens. */
+static sds job_describe(Job *job) {
+    sds desc = sdscatprintf(sdsempty(), "#%lld ", (long long)job->id);
+    if (job->period) {
+        sds every = format_interval(job->period);
+        desc = sdscatprintf(desc, "every %s", every);
+        sdsfree(every);
+    } else {
+        char buf[32];
+        time_t t = job->next_run;
+        struct tm tm;
+        localtime_r(&t, &tm);
+        strftime(buf, sizeof(buf), "%H:%M", &tm);
+        desc = sdscatprintf(desc, "at %s", buf);
+    }
+    return sdscatprintf(desc, " on %s: %s", job->term.name, job->keys);
+}
+
+/* Type the keys and post the screen. Called holding the user lock. */
+static void job_run(Job *job) {
+    /* The pane ID may have changed if tmux was restarted: look for the
+     * window by name before giving up. */
+    if (!hub_connected(&job->term)) {
+        int found = 0;
+        pthread_mutex_lock(&TermListLock);
+        hub_list();
+        for (int i = 0; i < TermCount && !found; i++) {
+            if (strcmp(TermList[i].name, job->term.name) == 0 &&
+                strcmp(TermList[i].host, job->term.host) == 0)
+            {
+                job->term = TermList[i];
+                found = 1;
             }
         }
+        pthread_mutex_unlock(&TermListLock);
+        if (!found) {
+            sds desc = job_describe(job);
+            sds msg = sdscatprintf(sdsempty(), "Job %s\nWindow not found.",
+                                   desc);
+            botSendMessage(job->chat_id, msg, 0);
+            sdsfree(msg);
+            sdsfree(desc);
+            return;
+        }
     }
 
+    int sent = hub_send_keys(&job->term, job->keys) == 0;
+    Session *s = session_find(&job->term);
+    if (s) s->keys_at = metricsUstime();
+    /* An interrupt only cuts the wait short: the job still reports. */
+    if (s) session_settle(s, SETTLE_TIME);
+    else usleep(SETTLE_TIME * 1000);
+    sds screen = sent ? hub_capture_text(&job->term) : NULL;
+
+    sds desc = job_describe(job);
+    sds escaped = html_escape(desc);
+    sds msg = sdscatprintf(sdsempty(), "<b>Job %s</b>\n", escaped);
     sdsfree(escaped);
+    sdsfree(desc);
+    if (!sent) {
+        msg = sdscat(msg, "Sending the keys failed.");
+    } else if (screen == NULL) {
+        msg = sdscat(msg, "Could not read terminal text.");
+    } else {
+        /* Keep the last lines that fit, cutting at a line boundary. */
+        sds tail = html_escape(last_n_lines(screen, get_visible_lines()));
+        size_t room = MAX_MSG_LEN > sdslen(msg) ? MAX_MSG_LEN - sdslen(msg) : 0;
+        if (sdslen(tail) > room) {
+            char *nl = strchr(tail + sdslen(tail) - room, '\n');
+            if (nl) sdsrange(tail, nl - tail + 1, -1);
+            else sdsclear(tail);
+        }
+        msg = sdscatprintf(msg, "<pre>%s</pre>", tail);
+        sdsfree(tail);
+    }
+    sdsfree(screen);
+    send_html_message(job->chat_id, msg);
+    sdsfree(msg);
+}
 
-    if (n == 0) {
-        msgs = xrealloc(msgs, sizeof(sds));
-        msgs[0] = sdsnew("<pre></pre>");
-        n = 1;
+/* Thread running a job as if its user typed it: the job waits for the
+ * requests of the user in progress, and the other way around. */
+static void *job_thread(void *arg) {
+    Job *job = arg;
+    botSetCurrent(job->bot);
+    sqlite3 *db = dbInit(NULL);
+    UserState *u = user_get(db, job->uid);
+    pthread_mutex_lock(&u->lock);
+    CurrentUser = u;
+    job_run(job);
+    CurrentUser = NULL;
+    pthread_mutex_unlock(&u->lock);
+
+    /* Schedule the next run, or forget the job. Missed runs are
+     * skipped. */
+    pthread_mutex_lock(&JobsLock);
+    job->running = 0;
+    int forget = job->removed || job->period == 0;
+    if (!job->removed && job->period) {
+        int64_t now = time(NULL);
+        if (job->next_run <= now)
+            job->next_run += ((now - job->next_run) / job->period + 1) *
+                             job->period;
+        sqlQuery(db, "UPDATE Jobs SET next_run = ?i, term_id = ?s "
+                     "WHERE id = ?i", job->next_run, job->term.id, job->id);
+        job_arm(job);
+    } else if (!job->removed) {
+        sqlQuery(db, "DELETE FROM Jobs WHERE id = ?i", job->id);
+        Job **p = &Jobs;
+        while (*p != job) p = &(*p)->next;
+        *p = job->next;
     }
+    pthread_mutex_unlock(&JobsLock);
+    if (forget) job_free(job);
+    if (db) sqlite3_close(db);
+    return NULL;
+}
+
+/* Timer procedure: it runs in the main loop, so the job, that waits for
+ * the terminal to settle, runs in its own thread. */
+static void job_fire(void *privdata) {
+    Job *job = privdata;
+    pthread_mutex_lock(&JobsLock);
+    int removed = job->removed;
+    if (!removed) job->running = 1;
+    pthread_mutex_unlock(&JobsLock);
+    if (removed) return;
+
+    if (!botThreadStart(job_thread, job)) job_thread(job);
+}
+
+/* Create a job and link it, without arming it. */
+static Job *job_new(int64_t id, BotInstance *bot, int64_t uid, int64_t chat_id,
+                    const TermInfo *term, const char *keys, int64_t next_run,
+                    int64_t period)
+{
+    Job *job = xmalloc(sizeof(*job));
+    memset(job, 0, sizeof(*job));
+    job->id = id;
+    job->bot = bot;
+    job->uid = uid;
+    job->chat_id = chat_id;
+    job->term = *term;
+    job->keys = sdsnew(keys);
+    job->next_run = next_run;
+    job->period = period;
+    timerInit(&job->timer, job_fire, job);
+    /* Appended, so that .jobs lists them by ID. */
+    pthread_mutex_lock(&JobsLock);
+    Job **p = &Jobs;
+    while (*p) p = &(*p)->next;
+    *p = job;
+    pthread_mutex_unlock(&JobsLock);
+    return job;
+}
 
-    *count = n;
-    return msgs;
+/* Load and arm the jobs of the bot, at startup. */
+static void jobs_load(sqlite3 *db, BotInstance *bot) {
+    sqlRow row;
+    sqlSelect(db, &row, "SELECT id, user, chat, term_id, term_host, "
+                        "term_name, keys, next_run, period FROM Jobs "
+                        "WHERE bot = ?s", bot->kvprefix);
+    int count = 0;
+    while (sqlNextRow(&row)) {
+        if (row.cols != 9 || row.col[3].s == NULL || row.col[4].s == NULL ||
+            row.col[5].s == NULL || row.col[6].s == NULL) continue;
+        TermInfo term;
+        memset(&term, 0, sizeof(term));
+        snprintf(term.id, sizeof(term.id), "%s", row.col[3].s);
+        snprintf(term.host, sizeof(term.host), "%s", row.col[4].s);
+        snprintf(term.name, sizeof(term.name), "%s", row.col[5].s);
+        Job *job = job_new(row.col[0].i, bot, row.col[1].i, row.col[2].i,
+                           &term, row.col[6].s, row.col[7].i, row.col[8].i);
+        job_arm(job);
+        count++;
+    }
+    if (count) printf("Loaded %d scheduled job%s\n", count,
+                      count == 1 ? "" : "s");
 }
 
-/* Send terminal text with refresh button (splits into multiple messages if needed).
- * Deletes previously tracked messages first to create a "live terminal view". */
-void send_terminal_text(int64_t chat_id) {
-    sds raw = backend_capture_text();
-    if (!raw) {
-        botSendMessage(chat_id, "Could not read terminal text.", 0);
+/* .at HH:MM <keys> and .every <interval> <keys>. */
+static void handle_job_add(sqlite3 *db, int64_t chat_id, const char *args,
+                           int every)
+{
+    const char *usage = every ? "Usage: .every <interval> <keys>, "
+                                "interval like 30s, 10m, 2h, 1d" :
+                                "Usage: .at HH:MM <keys>";
+    while (*args == ' ') args++;
+    const char *sp = strchr(args, ' ');
+    if (sp == NULL || sp[1] == '\0') {
+        botSendMessage(chat_id, (char *)usage, 0);
+        return;
+    }
+    sds when = sdsnewlen(args, sp - args);
+    const char *keys = sp + 1;
+    int64_t period = every ? parse_interval(when) : 0;
+    int64_t next_run = every ? time(NULL) + period : parse_clock(when);
+    sdsfree(when);
+    if (next_run == 0 || (every && period == 0)) {
+        botSendMessage(chat_id, (char *)usage, 0);
+        return;
+    }
+    if (every && period < MIN_JOB_PERIOD) {
+        botSendMessage(chat_id, "The minimum interval is 1m.", 0);
         return;
     }
 
-    delete_terminal_messages(chat_id);
+    UserState *u = user_state();
+    if (u->active == NULL) {
+        botSendMessage(chat_id, "Connect to a window first.", 0);
+        return;
+    }
 
-    int count;
-    sds *msgs = format_terminal_messages(raw, &count);
-    sdsfree(raw);
+    BotInstance *bot = botCurrent();
+    int count = 0;
+    pthread_mutex_lock(&JobsLock);
+    for (Job *j = Jobs; j; j = j->next)
+        if (j->bot == bot && j->uid == u->id) count++;
+    pthread_mutex_unlock(&JobsLock);
+    if (count >= MAX_USER_JOBS) {
+        botSendMessage(chat_id, "Too many jobs, remove some with .unjob.", 0);
+        return;
+    }
 
-    for (int i = 0; i < count - 1; i++) {
-        int64_t mid = send_html_message(chat_id, msgs[i]);
-        if (mid && TrackedMsgCount < MAX_TRACKED_MSGS)
-            TrackedMsgIds[TrackedMsgCount++] = mid;
-        sdsfree(msgs[i]);
+    TermInfo *t = &u->active->term;
+    int64_t id = sqlInsert(db, "INSERT INTO Jobs VALUES(NULL, ?s, ?i, ?i, "
+                               "?s, ?s, ?s, ?s, ?i, ?i)",
+                           bot->kvprefix, u->id, chat_id, t->id, t->host,
+                           t->name, keys, next_run, period);
+    if (id == 0) {
+        botSendMessage(chat_id, "Could not save the job.", 0);
+        return;
     }
+    Job *job = job_new(id, bot, u->id, chat_id, t, keys, next_run, period);
+    job_arm(job);
+
+    sds desc = job_describe(job);
+    sds msg = sdscatprintf(sdsempty(), "Scheduled job %s", desc);
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
+    sdsfree(desc);
+}
 
-    int64_t last_mid = 0;
-    botSendMessageWithKeyboard(chat_id, msgs[count - 1], "HTML",
-                               REFRESH_BTN, REFRESH_DATA, &last_mid);
-    if (last_mid && TrackedMsgCount < MAX_TRACKED_MSGS)
-        TrackedMsgIds[TrackedMsgCount++] = last_mid;
+/* .jobs: list the jobs of the user. */
+static void handle_jobs(int64_t chat_id) {
+    BotInstance *bot = botCurrent();
+    UserState *u = user_state();
+    sds msg = sdsnew("Scheduled jobs:\n");
+    int count = 0;
+    pthread_mutex_lock(&JobsLock);
+    for (Job *j = Jobs; j; j = j->next) {
+        if (j->bot != bot || j->uid != u->id) continue;
+        sds desc = job_describe(j);
+        msg = sdscatprintf(msg, "%s\n", desc);
+        sdsfree(desc);
+        count++;
+    }
+    pthread_mutex_unlock(&JobsLock);
+    if (count == 0) {
+        sdsfree(msg);
+        msg = sdsnew("No scheduled jobs.");
+    }
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
+}
 
-    sdsfree(msgs[count - 1]);
-    xfree(msgs);
+/* .unjob <id>: remove a job of the user. */
+static void handle_unjob(sqlite3 *db, int64_t chat_id, const char *args) {
+    int64_t id = strtoll(args, NULL, 10);
+    BotInstance *bot = botCurrent();
+    UserState *u = user_state();
+
+    pthread_mutex_lock(&JobsLock);
+    Job **p = &Jobs;
+    while (*p && ((*p)->id != id || (*p)->bot != bot || (*p)->uid != u->id))
+        p = &(*p)->next;
+    Job *job = *p;
+    int running = 0;
+    if (job) {
+        *p = job->next;
+        job->removed = 1;
+        running = job->running;
+    }
+    pthread_mutex_unlock(&JobsLock);
+    if (job == NULL) {
+        botSendMessage(chat_id, "No such job.", 0);
+        return;
+    }
+
+    /* Not under JobsLock: job_fire() takes it. If the job is running its
+     * thread frees it once done. */
+    timerCancel(&job->timer);
+    sqlQuery(db, "DELETE FROM Jobs WHERE id = ?i", id);
+    if (!running) job_free(job);
+    sds msg = sdscatprintf(sdsempty(), "Removed job #%lld.", (long long)id);
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
 }
 
-void handle_request(sqlite3 *db, BotRequest *br) {
-    pthread_mutex_lock(&RequestLock);
+/* ============================================================================
+ * Watch mode
+ *
+ * ".watch-screen [interval]" refreshes the screen of the active session
+ * in place, editing its last message, until the screen stays the same for
+ * the watch-idle setting (see config.c). Unchanged frames cost no Bot
+ * API call, and the interval adapts to the pane: it is the requested one
+ * while the screen changes, and doubles at every unchanged frame, up to
+ * WATCH_MAX_BACKOFF times, so a quiet pane is captured less and less
+ * often. Every refresh arms a one shot timer for the next one.
+ * ========================================================================= */
+
+#define WATCH_DEFAULT_INTERVAL 2000     /* ms. */
+#define WATCH_MIN_INTERVAL 1000
+#define WATCH_MAX_INTERVAL 60000
+#define WATCH_MAX_BACKOFF 16
+
+static _Atomic uint64_t WatchGen = 0;
+
+/* Seconds without changes after which a watch stops. */
+static int get_watch_idle(void) {
+    return configGet()->watch_idle;
+}
+
+/* Stop watching the session. Called holding the user lock. The timer is
+ * initialized the first time the session is watched. */
+static void watch_stop(Session *s) {
+    s->watch.active = 0;
+    if (s->watch.timer.proc) timerCancel(&s->watch.timer);
+}
+
+typedef struct WatchRun {
+    BotInstance *bot;
+    struct UserState *user;
+    Session *session;
+    uint64_t gen;
+} WatchRun;
+
+/* Capture the screen and update the message showing it if it changed,
+ * then arm the timer for the next refresh. */
+static void watch_refresh(Session *s) {
+    Watch *w = &s->watch;
+    if (!hub_connected(&s->term)) {
+        w->active = 0;
+        sds msg = sdscatprintf(sdsempty(), "Stopped watching @%d: window "
+                               "closed.", session_number(s));
+        botSendMessage(w->chat_id, msg, 0);
+        sdsfree(msg);
+        return;
+    }
+
+    sds raw = hub_capture_text(&s->term);
+    time_t now = time(NULL);
+    if (raw == NULL || (s->screen && sdscmp(raw, s->screen) == 0)) {
+        sdsfree(raw);
+        if (now - w->changed_at >= get_watch_idle()) {
+            w->active = 0;
+            sds msg = sdscatprintf(sdsempty(), "Stopped watching @%d: no "
+                                   "changes for %ds.", session_number(s),
+                                   (int)(now - w->changed_at));
+            botSendMessage(w->chat_id, msg, 0);
+            sdsfree(msg);
+            return;
+        }
+        w->interval *= 2;
+        if (w->interval > w->base * WATCH_MAX_BACKOFF)
+            w->interval = w->base * WATCH_MAX_BACKOFF;
+        if (w->interval > WATCH_MAX_INTERVAL)
+            w->interval = WATCH_MAX_INTERVAL;
+        /* Don't sleep past the idle timeout. */
+        int left = (int)(w->changed_at + get_watch_idle() - now) * 1000;
+        if (w->interval > left) w->interval = left;
+    } else {
+        sdsfree(s->screen);
+        s->screen = raw;
+        s->captured_at = metricsUstime();
+        w->changed_at = now;
+        w->interval = w->base;
+
+        edit_session_screen(w->chat_id, s);
+    }
+    timerAdd(&w->timer, w->interval, 0);
+}
+
+/* Thread refreshing a watched session. It runs holding the user lock, so
+ * it interleaves with the requests of the user. The watch may have been
+ * stopped, or stopped and started again, while waiting for the lock: the
+ * generation tells. */
+static void *watch_thread(void *arg) {
+    WatchRun *run = arg;
+    botSetCurrent(run->bot);
+    UserState *u = run->user;
+    pthread_mutex_lock(&u->lock);
+    CurrentUser = u;
+    Session *s = run->session;
+    if (s->attached && s->watch.active && s->watch.gen == run->gen)
+        watch_refresh(s);
+    CurrentUser = NULL;
+    pthread_mutex_unlock(&u->lock);
+    xfree(run);
+    return NULL;
+}
+
+/* Timer procedure: capturing may be slow, so the refresh runs in its own
+ * thread. The next timer is armed by the thread, so there is at most one
+ * refresh in flight per session. */
+static void watch_fire(void *privdata) {
+    Session *s = privdata;
+    WatchRun *run = xmalloc(sizeof(*run));
+    run->bot = s->watch.bot;
+    run->user = s->watch.user;
+    run->session = s;
+    run->gen = s->watch.gen;
+    if (!botThreadStart(watch_thread, run)) xfree(run);
+}
+
+/* .watch-screen [interval|off]: watch the active session. */
+static void handle_watch(int64_t chat_id, const char *args) {
+    UserState *u = user_state();
+    Session *s = u->active;
+    while (*args == ' ') args++;
+    if (s == NULL) {
+        botSendMessage(chat_id, "Connect to a window first.", 0);
+        return;
+    }
+    if (strcasecmp(args, "off") == 0) {
+        int was_active = s->watch.active;
+        watch_stop(s);
+        sds msg = sdscatprintf(sdsempty(), was_active ?
+                               "Stopped watching @%d." : "Not watching @%d.",
+                               session_number(s));
+        botSendMessage(chat_id, msg, 0);
+        sdsfree(msg);
+        return;
+    }
+
+    int base = WATCH_DEFAULT_INTERVAL;
+    if (*args) {
+        int64_t secs = isdigit((unsigned char)args[strlen(args) - 1]) ?
+                       atoi(args) : parse_interval(args);
+        base = (int)(secs * 1000);
+        if (secs <= 0 || base < WATCH_MIN_INTERVAL ||
+            base > WATCH_MAX_INTERVAL)
+        {
+            botSendMessage(chat_id, "Usage: .watch-screen [interval|off], "
+                                    "interval from 1s to 60s", 0);
+            return;
+        }
+    }
+
+    watch_stop(s);
+    Watch *w = &s->watch;
+    w->active = 1;
+    w->gen = ++WatchGen;
+    w->bot = botCurrent();
+    w->user = u;
+    w->chat_id = chat_id;
+    w->base = w->interval = base;
+    w->changed_at = time(NULL);
+    timerInit(&w->timer, watch_fire, s);
+
+    sds msg = sdscatprintf(sdsempty(), "Watching @%d every %ds, until no "
+                           "changes for %ds. Stop with .watch-screen off.",
+                           session_number(s), base / 1000, get_watch_idle());
+    botSendMessage(chat_id, msg, 0);
+    sdsfree(msg);
+    send_session_screen(chat_id, s, 1);
+    timerAdd(&w->timer, w->interval, 0);
+}
 
-    /* Check owner. First user to message becomes owner. */
-    sds owner_str = kvGet(db, OWNER_KEY);
+/* .keypad [on|off]: show or hide the inline keypad under the screen of the
+ * active session. Without argument it is toggled. */
+static void handle_keypad(int64_t chat_id, const char *args) {
+    Session *s = user_state()->active;
+    while (*args == ' ') args++;
+    if (s == NULL) {
+        botSendMessage(chat_id, "Connect to a window first.", 0);
+        return;
+    }
+    if (strcasecmp(args, "on") == 0) {
+        s->keypad = 1;
+    } else if (strcasecmp(args, "off") == 0) {
+        s->keypad = 0;
+    } else if (*args == '\0') {
+        s->keypad = !s->keypad;
+    } else {
+        botSendMessage(chat_id, "Usage: .keypad [on|off]", 0);
+        return;
+    }
+    send_session_screen(chat_id, s, 0);
+}
+
+/* Return true if the sender of the request may use the bot: in team mode
+ * the members of the team, otherwise the owner, the first user to message
+ * the bot. */
+static int user_allowed(sqlite3 *db, BotRequest *br) {
+    if (TeamSize) {
+        if (team_member(br->from)) return 1;
+        printf("Ignoring message from non-member %lld\n", (long long)br->from);
+        return 0;
+    }
+
+    BotState *bs = bot_state();
+    pthread_mutex_lock(&bs->lock);
+    sds owner_key = bot_key(OWNER_KEY);
+    sds owner_str = kvGet(db, owner_key);
     int64_t owner_id = 0;
 
     if (owner_str) {
@@ -567,20 +1922,55 @@ void handle_request(sqlite3 *db, BotRequest *br) {
         /* Register first user as owner. */
         char buf[32];
         snprintf(buf, sizeof(buf), "%lld", (long long)br->from);
-        kvSet(db, OWNER_KEY, buf, 0);
+        kvSet(db, owner_key, buf, 0);
         owner_id = br->from;
         printf("Registered owner: %lld (%s)\n", (long long)owner_id, br->from_username);
     }
+    sdsfree(owner_key);
+    pthread_mutex_unlock(&bs->lock);
 
     if (br->from != owner_id) {
         printf("Ignoring message from non-owner %lld\n", (long long)br->from);
-        goto done;
+        return 0;
     }
+    return 1;
+}
+
+void handle_request(sqlite3 *db, BotRequest *br) {
+    if (!user_allowed(db, br)) return;
+
+    /* Requests of the same user are served in order, the ones of other
+     * users meanwhile. */
+    UserState *u = user_get(db, br->from);
+
+    /* Interrupting keys skip the queue, see session_interrupt(), typed or
+     * from the keypad. */
+    int interrupted = -1;
+    const char *p;
+    if (!br->is_callback && is_interrupt_key(br->request)) {
+        interrupted = session_interrupt(u, -1, br->request);
+    } else if (br->is_callback) {
+        int key = keypad_key(br->callback_data, &p);
+        const char *keys = key != -1 ?
+            Keypad[key / KEYPAD_COLS][key % KEYPAD_COLS].keys : NULL;
+        int slot = keys && is_interrupt_key(keys) ? button_slot(u, p) : -1;
+        if (slot != -1) interrupted = session_interrupt(u, slot, keys);
+    }
+
+    uint64_t start = metricsUstime();
+    pthread_mutex_lock(&u->lock);
+    uint64_t waited = metricsUstime() - start;
+    metricObserve(metricGet(LockWaitTime, NULL, NULL), waited);
+    flightRecord(FLIGHT_LOCK, "user lock", 0, waited);
+    traceMark(TRACE_LOCKED);
+    CurrentUser = u;
 
     /* TOTP authentication check (applies to both messages and callbacks). */
     if (!WeakSecurity) {
-        if (!Authenticated || time(NULL) - LastActivity > OtpTimeout) {
-            Authenticated = 0;
+        if (!u->authenticated ||
+            time(NULL) - u->last_activity > u->otp_timeout)
+        {
+            u->authenticated = 0;
             if (br->is_callback) {
                 botAnswerCallbackQuery(br->callback_id);
                 goto done;
@@ -591,32 +1981,62 @@ void handle_request(sqlite3 *db, BotRequest *br) {
             for (int i = 0; is_otp && i < 6; i++) {
                 if (!isdigit((unsigned char)req[i])) is_otp = 0;
             }
-            if (is_otp && totp_verify(db, req)) {
-                Authenticated = 1;
-                LastActivity = time(NULL);
+            sds key = user_key(u->id, "totp_secret");
+            if (is_otp && totp_verify(db, key, req)) {
+                u->authenticated = 1;
+                u->last_activity = time(NULL);
                 botSendMessage(br->target, "Authenticated.", 0);
             } else {
                 botSendMessage(br->target, "Enter OTP code.", 0);
             }
+            sdsfree(key);
             goto done;
         }
-        LastActivity = time(NULL);
+        u->last_activity = time(NULL);
+    }
+
+    /* The keys were sent by the fast lane: just show the screen, edited
+     * in place for the keypad. */
+    if (interrupted != -1) {
+        Session *s = &u->sessions[interrupted];
+        if (br->is_callback) {
+            botAnswerCallbackQuery(br->callback_id);
+            if (s->attached) session_show_keypad(br->target, s);
+        } else if (s->attached) {
+            session_show_keys(br->target, s);
+        }
+        goto done;
     }
 
     /* Handle callback query (button press). */
     if (br->is_callback) {
         botAnswerCallbackQuery(br->callback_id);
-        if (strcmp(br->callback_data, REFRESH_DATA) == 0 && Connected) {
-            send_terminal_text(br->target);
+        /* "refresh:N" refreshes session N, plain "refresh" (buttons sent
+         * before sessions existed) the active one, "key:K:N" types key K
+         * of the keypad. Buttons of other users are ignored. */
+        char *data = br->callback_data;
+        Session *s = NULL;
+        int key;
+        if (strcmp(data, REFRESH_DATA) == 0) {
+            s = u->active;
+        } else if (strncmp(data, REFRESH_DATA ":",
+                           sizeof(REFRESH_DATA)) == 0) {
+            s = button_session(data + sizeof(REFRESH_DATA));
+        } else if ((key = keypad_key(data, &p)) != -1) {
+            Session *ks = button_session(p);
+            if (ks) session_keypad(br->target, ks, key);
+            goto done;
         }
+        if (s) send_session_screen(br->target, s, 1);
         goto done;
     }
 
     char *req = br->request;
 
-    /* Handle .list command. */
+    /* Handle .list command. Sessions stay attached, but there is no
+     * active one until the next .N or @N. */
     if (strcasecmp(req, ".list") == 0) {
-        disconnect();
+        u->active = NULL;
         sds msg = build_list_message();
         botSendMessage(br->target, msg, 0);
         sdsfree(msg);
@@ -631,6 +2051,127 @@ void handle_request(sqlite3 *db, BotRequest *br) {
         goto done;
     }
 
+    /* Handle .sessions command. */
+    if (strcasecmp(req, ".sessions") == 0) {
+        sds msg = build_sessions_message();
+        botSendMessage(br->target, msg, 0);
+        sdsfree(msg);
+        goto done;
+    }
+
+    /* Handle .detach [N] command. */
+    if (strncasecmp(req, ".detach", 7) == 0 &&
+        (req[7] == '\0' || req[7] == ' '))
+    {
+        Session *s = req[7] ? session_get(atoi(req + 8)) : u->active;
+        if (s == NULL) {
+            botSendMessage(br->target, "No such session.", 0);
+            goto done;
+        }
+        sds label = session_label(s);
+        sds msg = sdscatprintf(sdsempty(), "Detached from @%d %s",
+                               session_number(s), label);
+        session_detach(s);
+        botSendMessage(br->target, msg, 0);
+        sdsfree(msg);
+        sdsfree(label);
+        goto done;
+    }
+
+    /* Handle @N (switch to session N) and @N <keys> (send keys to it). */
+    if (req[0] == '@' && isdigit(req[1])) {
+        char *p = req + 1;
+        while (isdigit(*p)) p++;
+        if (*p == '\0' || *p == ' ') {
+            Session *s = session_get(atoi(req + 1));
+            if (s == NULL) {
+                botSendMessage(br->target, "No such session.", 0);
+            } else if (*p == '\0') {
+                session_switch(br->target, s, 0);
+            } else {
+                session_send_keys(br->target, s, p + 1);
+            }
+            goto done;
+        }
+    }
+
+    /* Handle .bcast <glob> <keys> command. */
+    if (strncasecmp(req, ".bcast", 6) == 0 &&
+        (req[6] == '\0' || req[6] == ' '))
+    {
+        handle_bcast(br->target, req + 6);
+        goto done;
+    }
+
+    /* Handle .at, .every, .jobs and .unjob commands. */
+    if (strncasecmp(req, ".at ", 4) == 0) {
+        handle_job_add(db, br->target, req + 4, 0);
+        goto done;
+    }
+    if (strncasecmp(req, ".every ", 7) == 0) {
+        handle_job_add(db, br->target, req + 7, 1);
+        goto done;
+    }
+    if (strcasecmp(req, ".jobs") == 0) {
+        handle_jobs(br->target);
+        goto done;
+    }
+    if (strncasecmp(req, ".unjob ", 7) == 0) {
+        handle_unjob(db, br->target, req + 7);
+        goto done;
+    }
+
+    /* Handle .watch-screen [interval|off] command. */
+    if (strncasecmp(req, ".watch-screen", 13) == 0 &&
+        (req[13] == '\0' || req[13] == ' '))
+    {
+        handle_watch(br->target, req + 13);
+        goto done;
+    }
+
+    /* Handle .keypad [on|off] command. */
+    if (strncasecmp(req, ".keypad", 7) == 0 &&
+        (req[7] == '\0' || req[7] == ' '))
+    {
+        handle_keypad(br->target, req + 7);
+        goto done;
+    }
+
+    /* Handle .reload command: load the settings file again. */
+    if (strcasecmp(req, ".reload") == 0) {
+        sds err = NULL;
+        if (configReload(&err)) {
+            botSendMessage(br->target, "Settings reloaded.", 0);
+        } else {
+            sds msg = sdscatprintf(sdsempty(), "Settings not reloaded: %s",
+                                   err);
+            botSendMessage(br->target, msg, 0);
+            sdsfree(msg);
+            sdsfree(err);
+        }
+        goto done;
+    }
+
+    /* Handle .restart command: restart the bot, possibly with a new
+     * binary, once the requests in flight completed. */
+    if (strcasecmp(req, ".restart") == 0) {
+        botSendMessage(br->target, "Restarting...", 0);
+        botShutdown(1);
+        goto done;
+    }
+
+    /* Handle .stats command. */
+    if (strcasecmp(req, ".stats") == 0) {
+        sds stats = traceSummary();
+        sds escaped = html_escape(stats);
+        sds msg = sdscatprintf(sdsempty(), "<pre>%s</pre>", escaped);
+        send_html_message(br->target, msg);
+        sdsfree(msg);
+        sdsfree(escaped);
+        sdsfree(stats);
+        goto done;
+    }
+
     /* Handle .otptimeout command. */
     if (strncasecmp(req, ".otptimeout", 11) == 0) {
         char *arg = req + 11;
@@ -638,10 +2179,12 @@ void handle_request(sqlite3 *db, BotRequest *br) {
         int secs = atoi(arg);
         if (secs < 30) secs = 30;
         if (secs > 28800) secs = 28800;
-        OtpTimeout = secs;
+        u->otp_timeout = secs;
         char buf[64];
         snprintf(buf, sizeof(buf), "%d", secs);
-        kvSet(db, "otp_timeout", buf, 0);
+        sds key = user_key(u->id, "otp_timeout");
+        kvSet(db, key, buf, 0);
+        sdsfree(key);
         sds msg = sdscatprintf(sdsempty(), "OTP timeout set to %d seconds.", secs);
         botSendMessage(br->target, msg, 0);
         sdsfree(msg);
@@ -651,82 +2194,96 @@ void handle_request(sqlite3 *db, BotRequest *br) {
     /* Handle .N to connect to terminal session N. */
     if (req[0] == '.' && isdigit(req[1])) {
         int n = atoi(req + 1);
-        backend_list();
-
-        if (n < 1 || n > TermCount) {
+        TermInfo term;
+        pthread_mutex_lock(&TermListLock);
+        hub_list();
+        int valid = n >= 1 && n <= TermCount;
+        if (valid) term = TermList[n - 1];
+        pthread_mutex_unlock(&TermListLock);
+
+        if (!valid) {
             botSendMessage(br->target, "Invalid window number.", 0);
             goto done;
         }
 
-        /* Store connection info directly. */
-        TermInfo *t = &TermList[n - 1];
-        Connected = 1;
-        strncpy(ConnectedId, t->id, sizeof(ConnectedId) - 1);
-        ConnectedId[sizeof(ConnectedId) - 1] = '\0';
-        ConnectedPid = t->pid;
-        strncpy(ConnectedName, t->name, sizeof(ConnectedName) - 1);
-        ConnectedName[sizeof(ConnectedName) - 1] = '\0';
-        strncpy(ConnectedTitle, t->title, sizeof(ConnectedTitle) - 1);
-        ConnectedTitle[sizeof(ConnectedTitle) - 1] = '\0';
-
-        sds msg = sdsnew("Connected to ");
-        msg = sdscat(msg, ConnectedName);
-        if (ConnectedTitle[0]) {
-            msg = sdscat(msg, " - ");
-            msg = sdscat(msg, ConnectedTitle);
+        /* Already attached: just switch to it. The title may have
+         * changed in the meantime. */
+        Session *s = session_find(&term);
+        if (s) {
+            memcpy(s->term.title, term.title, sizeof(term.title));
+            session_switch(br->target, s, 0);
+            goto done;
         }
-        botSendMessage(br->target, msg, 0);
-        sdsfree(msg);
 
-        /* Send terminal text. */
-        send_terminal_text(br->target);
+        s = session_attach(&term);
+        if (s == NULL) {
+            botSendMessage(br->target, "Too many attached sessions, "
+                                       "use .detach first.", 0);
+            goto done;
+        }
+        session_switch(br->target, s, 1);
         goto done;
     }
 
     /* Not a command - send as keystrokes if connected. */
-    if (!Connected) {
+    if (u->active == NULL) {
         sds msg = build_list_message();
         botSendMessage(br->target, msg, 0);
         sdsfree(msg);
         goto done;
     }
-
-    /* Check terminal session still exists. */
-    if (!backend_connected()) {
-        disconnect();
-        sds msg = sdsnew("Window closed.\n\n");
-        sds list = build_list_message();
-        msg = sdscatsds(msg, list);
-        sdsfree(list);
-        botSendMessage(br->target, msg, 0);
-        sdsfree(msg);
-        goto done;
-    }
-
-    /* Send keystrokes. */
-    backend_send_keys(req);
-
-    /* Wait a bit for the terminal to react, then re-check the session
-     * (keystrokes may switch panes/tabs, changing the active ID). */
-    sleep(2);
-    backend_connected();
-    send_terminal_text(br->target);
+    session_send_keys(br->target, u->active, req);
 
 done:
-    pthread_mutex_unlock(&RequestLock);
+    user_publish(u);
+    CurrentUser = NULL;
+    pthread_mutex_unlock(&u->lock);
 }
 
-void cron_callback(sqlite3 *db) {
-    UNUSED(db);
+/* Set up the state of every bot, before requests are served, the TOTP
+ * secret of the owner, or of every member of the team, and the scheduled
+ * jobs. */
+void init_callback(sqlite3 *db, BotInstance *bot) {
+    BotState *bs = xmalloc(sizeof(*bs));
+    memset(bs, 0, sizeof(*bs));
+    pthread_mutex_init(&bs->lock, NULL);
+    bot->privdata = bs;
+    if (TeamSize == 0) totp_setup(db, 0);
+    for (int i = 0; i < TeamSize; i++) totp_setup(db, TeamUsers[i]);
+    jobs_load(db, bot);
 }
 
 /* ============================================================================
  * Main
  * ========================================================================= */
 
+/* Parse the --team list of user IDs. Returns 0 on error. */
+static int team_init(const char *list) {
+    int count;
+    sds *ids = sdssplitlen(list, strlen(list), ",", 1, &count);
+    TeamUsers = xrealloc(TeamUsers, sizeof(int64_t) * (TeamSize + count));
+    int ok = 1;
+    for (int i = 0; i < count; i++) {
+        char *end;
+        long long id = strtoll(ids[i], &end, 10);
+        if (id <= 0 || *end != '\0') {
+            fprintf(stderr, "Invalid team member '%s': use the numeric "
+                            "Telegram user IDs.\n", ids[i]);
+            ok = 0;
+            break;
+        }
+        TeamUsers[TeamSize++] = id;
+    }
+    sdsfreesplitres(ids, count);
+    if (ok) printf("Team mode: %d users allowed.\n", TeamSize);
+    return ok;
+}
+
 int main(int argc, char **argv) {
     /* Parse our custom flags. */
-    const char *dbfile = "./mybot.sqlite";
+    int agent = 0;
+    const char *listen = NULL, *agents = NULL;
+    const char *secret = getenv("TELETERM_AGENT_SECRET");
     for (int i = 1; i < argc; i++) {
         if (strcmp(argv[i], "--dangerously-attach-to-any-window") == 0) {
             DangerMode = 1;
@@ -734,18 +2291,53 @@ int main(int argc, char **argv) {
         } else if (strcmp(argv[i], "--use-weak-security") == 0) {
             WeakSecurity = 1;
             printf("WARNING: OTP authentication disabled.\n");
-        } else if (strcmp(argv[i], "--dbfile") == 0 && i+1 < argc) {
-            dbfile = argv[i+1];
+        } else if (strcmp(argv[i], "--agent") == 0) {
+            agent = 1;
+        } else if (strcmp(argv[i], "--listen") == 0 && i+1 < argc) {
+            listen = argv[++i];
+        } else if (strcmp(argv[i], "--agents") == 0 && i+1 < argc) {
+            agents = argv[++i];
+        } else if (strcmp(argv[i], "--agent-secret") == 0 && i+1 < argc) {
+            secret = argv[++i];
+        } else if (strcmp(argv[i], "--team") == 0 && i+1 < argc) {
+            if (!team_init(argv[++i])) exit(1);
         }
     }
 
-    /* TOTP setup: check/generate secret before starting the bot. */
-    totp_setup(dbfile);
+    if ((agent || agents) && (secret == NULL || strlen(secret) < 16)) {
+        fprintf(stderr, "Agents need a shared secret of at least 16 "
+                        "characters: use --agent-secret or "
+                        "TELETERM_AGENT_SECRET.\n");
+        exit(1);
+    }
+
+    /* Agent mode: serve the local terminals to a hub, no Telegram. */
+    if (agent) {
+        char flightpath[64];
+        snprintf(flightpath, sizeof(flightpath), "teleterm-flight-%d.txt",
+                 (int)getpid());
+        flightInit(flightpath);
+        agentServe(listen ? listen : ":7070", secret);
+        exit(1);
+    }
+    if (agents && !hub_init(agents, secret)) exit(1);
+
+    CaptureBytes = metricsNew(METRIC_HISTOGRAM, "teleterm_capture_bytes",
+        "Size of the terminal text captured.", NULL, 1);
+    CaptureTime = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_capture_duration_seconds",
+        "Time taken to capture the terminal text.", NULL, 1e-6);
+    LockWaitTime = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_user_lock_wait_seconds",
+        "Time requests waited for the lock of their user.", NULL, 1e-6);
 
     /* Triggers: respond to all private messages. */
     static char *triggers[] = { "*", NULL };
 
-    startBot(TB_CREATE_KV_STORE, argc, argv, TB_FLAGS_IGNORE_BAD_ARG,
-             handle_request, cron_callback, triggers);
+    /* TOTP setup is done for every bot by init_callback(), before
+     * starting to serve requests. */
+    botSetShutdownCallback(shutdown_callback);
+    startBot(TB_CREATE_KV_STORE CREATE_JOBS_TABLE, argc, argv, TB_FLAGS_IGNORE_BAD_ARG,
+             init_callback, handle_request, NULL, triggers);
     return 0;
 }
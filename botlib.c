@@ -43,6 +43,9 @@
 #include <unistd.h>
 #include <math.h>
 #include <time.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
 
 #include <curl/curl.h>
 #include <sqlite3.h>
@@ -50,9 +53,17 @@
 #include "sds.h"
 #include "cJSON.h"
 #include "botlib.h"
+#include "httpd.h"
+#include "globset.h"
+#include "timer.h"
+#include "config.h"
+#include "metrics.h"
+#include "flight.h"
 
 /* Thread local and atomic state. */
 _Thread_local sqlite3 *DbHandle = NULL; /* Per-thread sqlite handle. */
+/* Bot the calling thread works for, see botCurrent(). */
+static _Thread_local BotInstance *CurrentBot = NULL;
 
 /* The bot global state. */
 struct {
@@ -62,21 +73,48 @@ struct {
                           enabled with a few --debug calls. */
     int verbose;                        // If true enables verbose info.
     char *dbfile;                       // Change with --dbfile.
-    char **triggers;                    // Strings triggering processing.
-    sds apikey;                         // Telegram API key for the bot.
-    sds username;                       // Bot username from getMe call.
+    globSet *triggers;                  // Strings triggering processing.
+    BotInstance *bots[TB_MAX_BOTS];     // Bots served, one per API key.
+    int numbots;
+    char *apiurl;                       // Bot API base URL, --api-url.
+    char *webhook_url;                  // Public URL for setWebhook.
+    char *webhook_listen;               // Address of the webhook listener.
+    char *webhook_secret;               // --webhook-secret, if given.
+    char *metrics_listen;               // Address of the metrics endpoint.
+    TBInitCallback init_callback;       // Callback setting up every bot.
     TBRequestCallback req_callback;     // Callback handling requests.
     TBCronCallback cron_callback;
+    char *config_file;                  // Settings file, --config.
+    TBShutdownCallback shutdown_callback;
+    char **argv;                        // Command line, to restart.
 } Bot;
 
-/* Global stats. Sometimes we access such stats from threads without caring
- * about race conditions, since they in practice are very unlikely to happen
- * in most archs with this data types, and even so we don't care.
- * This stuff is reported by the bot when the $$ info command is used. */
-struct {
-    time_t start_time;      /* Unix time the bot was started. */
-    uint64_t queries;       /* Number of queries received. */
-} botStats;
+/* Set by the SIGUSR1 handler: the main loop will log the latency stats. */
+static volatile sig_atomic_t StatsRequested = 0;
+/* Set by the SIGHUP handler: the main loop will reload the settings. */
+static volatile sig_atomic_t ReloadRequested = 0;
+/* Set by botShutdown() and by SIGTERM / SIGINT: the main loop stops. */
+#define TB_SHUTDOWN_STOP 1
+#define TB_SHUTDOWN_RESTART 2
+static volatile sig_atomic_t ShutdownRequested = 0;
+
+/* Metrics exported via --metrics-listen, see metrics.h. They are created
+ * by botMetricsInit() at startup, before any thread is started. */
+static struct {
+    metricFamily *start_time;       /* Unix time the bot was started. */
+    metricFamily *updates;          /* Updates dispatched, by type. */
+    metricFamily *inflight;         /* Requests being served. */
+    metricFamily *request_time;     /* Duration of the request callback. */
+    metricFamily *api_calls;        /* Bot API calls, by method and status. */
+    metricFamily *api_time;         /* Bot API call latency, by method. */
+    metricFamily *api_retries;      /* Retries of transient failures. */
+    metricFamily *api_floods;       /* 429 replies. */
+    metricFamily *rl_waiters;       /* Calls queued by the rate limiter. */
+    metricFamily *rl_wait_time;     /* Time spent queued. */
+    metricFamily *rl_merged;        /* Queued edits superseded. */
+    metricFamily *rl_chat_cache;    /* Per chat bucket lookups, hit/miss. */
+    metricFamily *webhook_dups;     /* Webhook deliveries already seen. */
+} botMetrics;
 
 /* ============================================================================
  * Utils
@@ -252,26 +290,104 @@ size_t makeHTTPGETCallWriterFILE(char *ptr, size_t size, size_t nmemb, void *use
 }
 
 
+/* Connect timeout of a single HTTP request, in milliseconds. The total
+ * timeout is the http-timeout setting, see config.c. */
+#define HTTP_CONNECT_TIMEOUT 15000
+
+/* Every request thread of every bot talks to the same API server, so the
+ * curl handles are not created per call: finished handles are parked in
+ * a pool and taken again by the next call, from whatever thread, keeping
+ * their connection open and the TLS session warm. DNS and TLS session
+ * caches are also shared among all the handles, so a new handle, needed
+ * only when more calls than pooled handles are in flight, skips them. */
+#define HTTP_POOL_SIZE 16
+
+static struct {
+    pthread_mutex_t lock;
+    CURL *idle[HTTP_POOL_SIZE];
+    int count;
+    CURLSH *share;
+    pthread_mutex_t share_locks[CURL_LOCK_DATA_LAST];
+} HttpPool = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void httpShareLock(CURL *curl, curl_lock_data data,
+                          curl_lock_access access, void *privdata)
+{
+    UNUSED(curl); UNUSED(access); UNUSED(privdata);
+    pthread_mutex_lock(&HttpPool.share_locks[data]);
+}
+
+static void httpShareUnlock(CURL *curl, curl_lock_data data, void *privdata) {
+    UNUSED(curl); UNUSED(privdata);
+    pthread_mutex_unlock(&HttpPool.share_locks[data]);
+}
+
+/* Called at startup, after curl_global_init(). */
+static void httpPoolInit(void) {
+    for (int j = 0; j < CURL_LOCK_DATA_LAST; j++)
+        pthread_mutex_init(&HttpPool.share_locks[j],NULL);
+    HttpPool.share = curl_share_init();
+    curl_share_setopt(HttpPool.share,CURLSHOPT_LOCKFUNC,httpShareLock);
+    curl_share_setopt(HttpPool.share,CURLSHOPT_UNLOCKFUNC,httpShareUnlock);
+    curl_share_setopt(HttpPool.share,CURLSHOPT_SHARE,CURL_LOCK_DATA_DNS);
+    curl_share_setopt(HttpPool.share,CURLSHOPT_SHARE,CURL_LOCK_DATA_SSL_SESSION);
+}
+
+/* Return a handle from the pool, or a new one. */
+static CURL *httpGetHandle(void) {
+    CURL *curl = NULL;
+    pthread_mutex_lock(&HttpPool.lock);
+    if (HttpPool.count) curl = HttpPool.idle[--HttpPool.count];
+    pthread_mutex_unlock(&HttpPool.lock);
+    if (curl == NULL) curl = curl_easy_init();
+    if (curl && HttpPool.share)
+        curl_easy_setopt(curl,CURLOPT_SHARE,HttpPool.share);
+    return curl;
+}
+
+/* Give the handle back to the pool. Its options are reset, but not its
+ * open connections. */
+static void httpReleaseHandle(CURL *curl) {
+    curl_easy_reset(curl);
+    pthread_mutex_lock(&HttpPool.lock);
+    if (HttpPool.count < HTTP_POOL_SIZE) {
+        HttpPool.idle[HttpPool.count++] = curl;
+        curl = NULL;
+    }
+    pthread_mutex_unlock(&HttpPool.lock);
+    if (curl) curl_easy_cleanup(curl);
+}
+
 /* Request the specified URL in a blocking way, returns the content (or
  * error string) as an SDS string. If 'resptr' is not NULL, the integer
  * will be set, by reference, to 1 or 0 to indicate success or error.
+ * If 'codeptr' is not NULL, the HTTP status code is returned by reference
+ * (0 if the request failed at the transport level).
+ * If 'sentptr' is not NULL, it is set to 0 when the request certainly
+ * never reached the server (DNS or connection errors), so that it is
+ * always safe to perform it again, otherwise to 1.
+ * 'timeout' is the max duration of the request in milliseconds.
  * The returned SDS string must be freed by the caller both in case of
  * error and success. */
-sds makeHTTPGETCall(const char *url, int *resptr) {
+static sds makeHTTPGETCallCode(const char *url, int *resptr, long *codeptr, long timeout, int *sentptr) {
     if (Bot.debug) printf("HTTP GET %s\n", url);
     CURL* curl;
     CURLcode res;
     sds body = sdsempty();
 
-    curl = curl_easy_init();
+    if (resptr) *resptr = 0;
+    if (codeptr) *codeptr = 0;
+    if (sentptr) *sentptr = 0;
+    curl = httpGetHandle();
     if (curl) {
         curl_easy_setopt(curl, CURLOPT_URL, url);
         curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, makeHTTPGETCallWriterSDS);
         curl_easy_setopt(curl, CURLOPT_WRITEDATA, &body);
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
         curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 1L);
-        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15);
-        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, timeout);
+        curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS,
+            timeout < HTTP_CONNECT_TIMEOUT ? timeout : HTTP_CONNECT_TIMEOUT);
 
         /* Perform the request, res will get the return code */
         res = curl_easy_perform(curl);
@@ -281,24 +397,39 @@ sds makeHTTPGETCall(const char *url, int *resptr) {
         if (res != CURLE_OK) {
             const char *errstr = curl_easy_strerror(res);
             body = sdscat(body,errstr);
+            if (sentptr) {
+                long reqsize = 0;
+                curl_easy_getinfo(curl, CURLINFO_REQUEST_SIZE, &reqsize);
+                *sentptr = !(res == CURLE_COULDNT_RESOLVE_HOST ||
+                             res == CURLE_COULDNT_RESOLVE_PROXY ||
+                             res == CURLE_COULDNT_CONNECT ||
+                             res == CURLE_SSL_CONNECT_ERROR ||
+                             reqsize == 0);
+            }
         } else {
-            /* Return 0 if the request worked but returned a 500 code. */
+            /* Return 0 if the request worked but returned an error code,
+             * this includes the 429 code Telegram uses for flood control. */
             long code;
             curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
-            if ((code == 500 || code == 400) && resptr) *resptr = 0;
+            if (codeptr) *codeptr = code;
+            if (sentptr) *sentptr = 1;
+            if (code >= 400 && resptr) *resptr = 0;
         }
 
-        /* always cleanup */
-        curl_easy_cleanup(curl);
+        /* always give the handle back */
+        httpReleaseHandle(curl);
     }
     return body;
 }
 
-/* Like makeHTTPGETCall(), but the list of options will be concatenated to
- * the URL as a query string, and URL encoded as needed.
- * The option list array should contain optnum*2 strings, alternating
- * option names and values. */
-sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum) {
+/* Like makeHTTPGETCallCode() but without returning the HTTP status. */
+sds makeHTTPGETCall(const char *url, int *resptr) {
+    return makeHTTPGETCallCode(url,resptr,NULL,configGet()->http_timeout,NULL);
+}
+
+/* Concatenate the list of options to the URL as a query string, URL
+ * encoding them as needed. Returns a new SDS string. */
+static sds buildQueryURL(const char *url, char **optlist, int optnum) {
     sds fullurl = sdsnew(url);
     if (optnum) fullurl = sdscatlen(fullurl,"?",1);
     CURL *curl = curl_easy_init();
@@ -312,23 +443,474 @@ sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum)
         curl_free(escaped);
     }
     curl_easy_cleanup(curl);
+    return fullurl;
+}
+
+/* Like makeHTTPGETCall(), but the list of options will be concatenated to
+ * the URL as a query string, and URL encoded as needed.
+ * The option list array should contain optnum*2 strings, alternating
+ * option names and values. */
+sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum) {
+    sds fullurl = buildQueryURL(url,optlist,optnum);
     sds body = makeHTTPGETCall(fullurl,resptr);
     sdsfree(fullurl);
     return body;
 }
 
+/* ============================================================================
+ * Bot instances
+ *
+ * The process serves one bot per --apikey. The bot API calls don't take
+ * the bot as argument: they are performed on behalf of the bot the calling
+ * thread is working for, which is the bot that received the request for
+ * the request threads. Threads started while serving a request should
+ * call botSetCurrent() to keep working for the same bot.
+ * ==========================================================================*/
+
+/* Return the bot the calling thread is working for: the first bot, unless
+ * the thread serves a request or botSetCurrent() was called. */
+BotInstance *botCurrent(void) {
+    return CurrentBot ? CurrentBot : Bot.bots[0];
+}
+
+void botSetCurrent(BotInstance *bot) {
+    CurrentBot = bot;
+}
+
+/* Add a bot with the given API key. The first bot keeps its keys in the
+ * KV store as they are, for compatibility with the databases of single
+ * bot setups, the keys of the others are prefixed with the numeric ID
+ * that starts the API key, which is public and stays the same if the
+ * order of the keys changes. */
+static void botAddInstance(const char *apikey) {
+    if (Bot.numbots == TB_MAX_BOTS) {
+        printf("Too many API keys: at most %d bots are supported.\n",
+               TB_MAX_BOTS);
+        exit(1);
+    }
+    BotInstance *bot = xmalloc(sizeof(*bot));
+    memset(bot,0,sizeof(*bot));
+    bot->id = Bot.numbots;
+    bot->apikey = sdstrim(sdsnew(apikey)," \t\r\n");
+    bot->kvprefix = sdsempty();
+    if (bot->id > 0) {
+        const char *colon = strchr(bot->apikey,':');
+        if (colon)
+            bot->kvprefix = sdscatprintf(bot->kvprefix,"bot%.*s:",
+                (int)(colon-bot->apikey),bot->apikey);
+        else
+            bot->kvprefix = sdscatprintf(bot->kvprefix,"bot%d:",bot->id);
+    }
+    Bot.bots[Bot.numbots++] = bot;
+}
+
+/* Add a bot for every API key in the comma separated list. */
+static void botAddInstances(const char *apikeys) {
+    int count;
+    sds *keys = sdssplitlen(apikeys,strlen(apikeys),",",1,&count);
+    for (int j = 0; j < count; j++)
+        if (sdslen(keys[j])) botAddInstance(keys[j]);
+    sdsfreesplitres(keys,count);
+}
+
+/* ============================================================================
+ * Outbound rate limiting
+ *
+ * Telegram applies flood control to bots: roughly 30 messages per second
+ * globally, about one message per second per chat (bursts are tolerated)
+ * and 20 messages per minute in groups. Exceeding the limits results in
+ * a 429 reply with a 'retry_after' parameter, and the call is lost.
+ *
+ * Every outbound bot API call bound to a chat goes through a global and
+ * a per-chat token bucket. Callers wait for their turn in priority order
+ * (callback answers first, deletions last), and when Telegram replies
+ * with 429 the bucket is blocked for 'retry_after' seconds and the call
+ * is performed again. Edits of the same message waiting in the queue are
+ * merged: only the newest one is sent, the superseded ones return success.
+ *
+ * Telegram applies the limits to every bot on its own, so when serving
+ * several bots each one has its global bucket, and chat buckets are per
+ * bot and chat.
+ * ==========================================================================*/
+
+#define RL_PRIO_HIGH 0          /* Callback answers: the user is waiting. */
+#define RL_PRIO_NORMAL 1        /* Sends and edits. */
+#define RL_PRIO_LOW 2           /* Deletions of old messages. */
+
+#define RL_GLOBAL_RATE 30.0     /* Tokens per second, all chats. */
+#define RL_GLOBAL_BURST 30.0
+#define RL_CHAT_RATE 1.0        /* Tokens per second, private chats. */
+#define RL_GROUP_RATE (20.0/60) /* Tokens per second, groups/channels. */
+#define RL_CHAT_BURST 20.0
+#define RL_MAX_CHATS 64         /* Chats with a tracked bucket (LRU). */
+#define RL_MAX_429_RETRY 5      /* Max resends after a 429 reply. */
+
+typedef struct rlBucket {
+    double tokens;              /* Available tokens. */
+    double rate;                /* Refill rate, tokens per second. */
+    double burst;               /* Max tokens. */
+    uint64_t last;              /* Last refill time, monotonic ms. */
+    uint64_t blocked_until;     /* Set from 'retry_after', monotonic ms. */
+} rlBucket;
+
+typedef struct rlChat {
+    int bot;                    /* BotInstance id. */
+    int64_t chat_id;            /* Zero if the slot is free. */
+    uint64_t last_use;          /* For LRU eviction. */
+    rlBucket bucket;
+} rlChat;
+
+typedef struct rlWaiter {
+    int prio;                   /* RL_PRIO_* */
+    uint64_t seq;               /* Arrival order among same priority. */
+    int bot;                    /* BotInstance id. */
+    int64_t chat_id;            /* Zero if not bound to a chat. */
+    int64_t edit_msg_id;        /* Message ID for mergeable edits, or 0. */
+    int superseded;             /* Set when a newer edit replaced us. */
+    struct rlWaiter *next;
+} rlWaiter;
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;        /* Broadcast every time the queue changes. */
+    rlBucket global[TB_MAX_BOTS];   /* Indexed by BotInstance id. */
+    rlChat chats[RL_MAX_CHATS];
+    rlWaiter *waiters;
+    uint64_t seq;
+} RateLimit = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* Called at startup, before any call is performed. */
+static void rlInit(void) {
+    for (int j = 0; j < TB_MAX_BOTS; j++) {
+        rlBucket *b = &RateLimit.global[j];
+        b->tokens = b->burst = RL_GLOBAL_BURST;
+        b->rate = RL_GLOBAL_RATE;
+    }
+}
+
+/* Return the monotonic time in milliseconds. */
+static uint64_t mstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+/* Add the tokens accumulated since the last refill. */
+static void rlRefill(rlBucket *b, uint64_t now) {
+    if (now > b->last) {
+        b->tokens += (now - b->last) * b->rate / 1000.0;
+        if (b->tokens > b->burst) b->tokens = b->burst;
+    }
+    b->last = now;
+}
+
+/* Return the number of milliseconds after which the bucket will be able
+ * to provide a token, or 0 if a token is available right now. */
+static uint64_t rlBucketWait(rlBucket *b, uint64_t now) {
+    if (b->blocked_until > now) return b->blocked_until - now;
+    if (b->tokens >= 1) return 0;
+    return (uint64_t)((1 - b->tokens) * 1000.0 / b->rate) + 1;
+}
+
+/* Return the bucket of the specified chat of the bot, creating it if
+ * needed and evicting the least recently used one if the table is full.
+ * Must be called with the lock held. */
+static rlBucket *rlChatBucket(int bot, int64_t chat_id, uint64_t now) {
+    rlChat *lru = &RateLimit.chats[0];
+    for (int j = 0; j < RL_MAX_CHATS; j++) {
+        rlChat *c = &RateLimit.chats[j];
+        if (c->chat_id == chat_id && c->bot == bot) {
+            c->last_use = now;
+            metricAdd(metricGet(botMetrics.rl_chat_cache,"hit",NULL),1);
+            return &c->bucket;
+        }
+        if (c->last_use < lru->last_use) lru = c;
+    }
+    metricAdd(metricGet(botMetrics.rl_chat_cache,"miss",NULL),1);
+    lru->bot = bot;
+    lru->chat_id = chat_id;
+    lru->last_use = now;
+    lru->bucket.rate = chat_id < 0 ? RL_GROUP_RATE : RL_CHAT_RATE;
+    lru->bucket.burst = RL_CHAT_BURST;
+    lru->bucket.tokens = RL_CHAT_BURST;
+    lru->bucket.last = now;
+    lru->bucket.blocked_until = 0;
+    return &lru->bucket;
+}
+
+/* Return the milliseconds the waiter has to wait before both its
+ * buckets can provide a token, or zero if it could go right now. */
+static uint64_t rlWaiterWait(rlWaiter *w, uint64_t now) {
+    rlRefill(&RateLimit.global[w->bot],now);
+    uint64_t wait = rlBucketWait(&RateLimit.global[w->bot],now);
+    if (w->chat_id) {
+        rlBucket *b = rlChatBucket(w->bot,w->chat_id,now);
+        rlRefill(b,now);
+        uint64_t chatwait = rlBucketWait(b,now);
+        if (chatwait > wait) wait = chatwait;
+    }
+    return wait;
+}
+
+/* Remove the waiter from the queue. Must be called with the lock held. */
+static void rlUnlink(rlWaiter *w) {
+    rlWaiter **p = &RateLimit.waiters;
+    while (*p && *p != w) p = &(*p)->next;
+    if (*p) *p = w->next;
+}
+
+/* Wait for our turn to perform an API call. Returns 1 when the call can
+ * be performed, or 0 if the call was superseded by a newer edit of the
+ * same message and should not be performed at all. */
+static int rlAcquire(int bot, int prio, int64_t chat_id, int64_t edit_msg_id) {
+    rlWaiter w = {prio, 0, bot, chat_id, edit_msg_id, 0, NULL};
+    metric *waiters = metricGet(botMetrics.rl_waiters,NULL,NULL);
+    uint64_t start = metricsUstime();
+
+    pthread_mutex_lock(&RateLimit.lock);
+    w.seq = RateLimit.seq++;
+
+    /* Merge with an older edit of the same message still in the queue. */
+    if (edit_msg_id) {
+        for (rlWaiter *o = RateLimit.waiters; o; o = o->next) {
+            if (o->bot == bot && o->chat_id == chat_id &&
+                o->edit_msg_id == edit_msg_id && !o->superseded)
+            {
+                o->superseded = 1;
+                metricAdd(metricGet(botMetrics.rl_merged,NULL,NULL),1);
+                if (Bot.verbose) printf("Merging queued edit of message %lld\n",
+                    (long long)edit_msg_id);
+            }
+        }
+        pthread_cond_broadcast(&RateLimit.cond);
+    }
+    w.next = RateLimit.waiters;
+    RateLimit.waiters = &w;
+    metricAdd(waiters,1);
+
+    int retval;
+    while(1) {
+        if (w.superseded) {
+            retval = 0;
+            break;
+        }
+
+        uint64_t now = mstime();
+        uint64_t wait = rlWaiterWait(&w,now);
+
+        /* We can go only if no other ready waiter comes before us. */
+        if (wait == 0) {
+            rlWaiter *o;
+            for (o = RateLimit.waiters; o; o = o->next) {
+                if (o == &w || o->superseded) continue;
+                if (o->prio > w.prio ||
+                    (o->prio == w.prio && o->seq > w.seq)) continue;
+                if (rlWaiterWait(o,now) == 0) break;
+            }
+            if (o == NULL) {
+                RateLimit.global[bot].tokens -= 1;
+                if (chat_id) rlChatBucket(bot,chat_id,now)->tokens -= 1;
+                retval = 1;
+                break;
+            }
+            wait = 10; /* Someone else goes first, re-check soon. */
+        }
+
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME,&ts);
+        ts.tv_sec += wait / 1000;
+        ts.tv_nsec += (wait % 1000) * 1000000;
+        if (ts.tv_nsec >= 1000000000) {
+            ts.tv_sec++;
+            ts.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&RateLimit.cond,&RateLimit.lock,&ts);
+    }
+    rlUnlink(&w);
+    pthread_cond_broadcast(&RateLimit.cond);
+    pthread_mutex_unlock(&RateLimit.lock);
+    metricAdd(waiters,-1);
+    uint64_t waited = metricsUstime()-start;
+    metricObserve(metricGet(botMetrics.rl_wait_time,NULL,NULL),waited);
+    flightRecord(FLIGHT_LOCK,"ratelimit",retval,waited);
+    return retval;
+}
+
+/* Telegram replied with 429: block the chat (or every call of the bot, if
+ * the call was not bound to a chat) for the number of seconds requested. */
+static void rlBlock(int bot, int64_t chat_id, int retry_after) {
+    pthread_mutex_lock(&RateLimit.lock);
+    uint64_t now = mstime();
+    rlBucket *b = chat_id ? rlChatBucket(bot,chat_id,now) :
+                            &RateLimit.global[bot];
+    uint64_t until = now + (uint64_t)retry_after*1000;
+    if (until > b->blocked_until) b->blocked_until = until;
+    b->tokens = 0;
+    pthread_cond_broadcast(&RateLimit.cond);
+    pthread_mutex_unlock(&RateLimit.lock);
+}
+
+/* Return the value of the option 'name' in the option list, or NULL. */
+static const char *botGetOption(char **optlist, int numopt, const char *name) {
+    for (int j = 0; j < numopt; j++)
+        if (!strcmp(optlist[j*2],name)) return optlist[j*2+1];
+    return NULL;
+}
+
+/* ============================================================================
+ * Retries of failed calls
+ *
+ * Transient failures (network errors, timeouts, 5xx replies) are retried
+ * with capped exponential backoff and full jitter, until the per-call
+ * deadline is reached. Every attempt is given only the time left before
+ * the deadline, so a call never blocks the caller for longer than that.
+ *
+ * Calls that are not idempotent (sendMessage & co.) are resent only when
+ * the failed attempt certainly never reached Telegram: if a send timed
+ * out after the request was written, Telegram may have posted it anyway,
+ * and resending would duplicate the message in the chat.
+ * ==========================================================================*/
+
+#define RETRY_DEADLINE 30000    /* Max total duration of a call, in ms. */
+#define RETRY_BASE_DELAY 250    /* First backoff delay, in ms. */
+#define RETRY_MAX_DELAY 4000    /* Backoff cap, in ms. */
+
+/* Return true if performing the action twice has the same effect of
+ * performing it once. */
+static int botActionIsIdempotent(const char *action) {
+    return strncmp(action,"send",4) != 0 &&
+           strcmp(action,"forwardMessage") != 0 &&
+           strcmp(action,"copyMessage") != 0;
+}
+
+/* Seed of the retry jitter of the thread. rand() is not thread safe, and
+ * with a single sequence the threads retrying at once would not get
+ * independent delays. Zero means not seeded yet. */
+static _Thread_local unsigned int RetrySeed = 0;
+
+/* Return the delay before the retry number 'attempt' (starting from 0):
+ * a random value between zero and the exponential backoff, capped. */
+static uint64_t botRetryDelay(int attempt) {
+    uint64_t max = RETRY_BASE_DELAY;
+    while (attempt-- > 0 && max < RETRY_MAX_DELAY) max *= 2;
+    if (max > RETRY_MAX_DELAY) max = RETRY_MAX_DELAY;
+    if (RetrySeed == 0) {
+        RetrySeed = (unsigned int)(metricsUstime() ^
+                                   (uintptr_t)pthread_self()) | 1;
+    }
+    return 1 + rand_r(&RetrySeed) % max;
+}
+
 /* Make an HTTP request to the Telegram bot API, where 'req' is the specified
  * action name. This is a low level API that is used by other bot APIs
  * in order to do higher level work. 'resptr' works the same as in
- * makeHTTPGETCall(). */
+ * makeHTTPGETCall().
+ *
+ * Calls targeting a chat are subject to rate limiting, and failed calls
+ * are retried when it is safe to do so (see above), so this function may
+ * block for a while before returning. */
 sds makeGETBotRequest(const char *action, int *resptr, char **optlist, int numopt)
 {
-    sds url = sdsnew("https://api.telegram.org/bot");
-    url = sdscat(url,Bot.apikey);
+    BotInstance *bot = botCurrent();
+    sds url = sdscatprintf(sdsempty(),"%s/bot",Bot.apiurl);
+    url = sdscat(url,bot->apikey);
     url = sdscatlen(url,"/",1);
     url = sdscat(url,action);
-    sds body = makeHTTPGETCallOpt(url,resptr,optlist,numopt);
+    sds fullurl = buildQueryURL(url,optlist,numopt);
     sdsfree(url);
+
+    /* Classify the call for the rate limiter. */
+    const char *chat = botGetOption(optlist,numopt,"chat_id");
+    int64_t chat_id = chat ? strtoll(chat,NULL,10) : 0;
+    int64_t edit_msg_id = 0;
+    int prio = RL_PRIO_NORMAL;
+    int limited = chat_id != 0;
+    if (!strcmp(action,"answerCallbackQuery")) {
+        prio = RL_PRIO_HIGH;
+        limited = 1;
+    } else if (!strncmp(action,"deleteMessage",13)) {
+        prio = RL_PRIO_LOW;
+    } else if (!strcmp(action,"editMessageText")) {
+        const char *mid = botGetOption(optlist,numopt,"message_id");
+        edit_msg_id = mid ? strtoll(mid,NULL,10) : 0;
+    }
+
+    /* getUpdates is already retried by the main loop, and it has its own
+     * long polling timeout: no deadline and no retries for it. */
+    int retry = strcmp(action,"getUpdates") != 0;
+    int idempotent = botActionIsIdempotent(action);
+    uint64_t deadline = mstime() + RETRY_DEADLINE;
+
+    sds body = NULL;
+    int ratelimited = 0, failures = 0;
+    while(1) {
+        if (limited && !rlAcquire(bot->id,prio,chat_id,edit_msg_id)) {
+            /* A newer edit of the same message will be sent instead. */
+            if (resptr) *resptr = 1;
+            body = sdsnew("{\"ok\":true,\"result\":true}");
+            break;
+        }
+
+        uint64_t now = mstime();
+        long timeout = configGet()->http_timeout;
+        if (retry && now + timeout > deadline)
+            timeout = now < deadline ? (long)(deadline - now) : 1;
+
+        long code;
+        int sent;
+        int tc = traceCallStart(action);
+        uint64_t start = metricsUstime();
+        body = makeHTTPGETCallCode(fullurl,resptr,&code,timeout,&sent);
+        traceCallEnd(tc);
+        uint64_t elapsed = metricsUstime()-start;
+        metricObserve(metricGet(botMetrics.api_time,action,NULL),elapsed);
+        flightRecord(FLIGHT_HTTP,action,code,elapsed);
+        if (code == 0) flightRecord(FLIGHT_ERROR,body,0,0);
+        char codestr[16];
+        if (code) snprintf(codestr,sizeof(codestr),"%ld",code);
+        else memcpy(codestr,"error",6);
+        metricAdd(metricGet(botMetrics.api_calls,action,codestr),1);
+
+        /* Flood control: wait as long as Telegram asks, then resend,
+         * unless that would take us past the deadline of the call. */
+        if (code == 429 && ratelimited < RL_MAX_429_RETRY) {
+            cJSON *json = cJSON_Parse(body);
+            cJSON *ra = cJSON_Select(json,".parameters.retry_after:n");
+            int retry_after = ra ? (int)ra->valuedouble : 1;
+            cJSON_Delete(json);
+            metricAdd(metricGet(botMetrics.api_floods,action,NULL),1);
+            rlBlock(bot->id,chat_id,retry_after);
+            uint64_t wait = (uint64_t)retry_after*1000;
+            now = mstime();
+            if (retry && now + wait > deadline) {
+                if (Bot.verbose) printf("%s: flood control, retry after %d "
+                    "sec is past the deadline\n", action, retry_after);
+                break;
+            }
+            if (Bot.verbose) printf("%s: flood control, retrying after %d sec\n",
+                action, retry_after);
+            if (!limited) usleep(wait*1000);
+            ratelimited++;
+            sdsfree(body);
+            continue;
+        }
+
+        /* Transient errors. */
+        int transient = code == 0 || code >= 500;
+        if (!retry || !transient) break;
+        if (!idempotent && sent) break;
+        uint64_t delay = botRetryDelay(failures++);
+        if (mstime() + delay >= deadline) break;
+        if (Bot.verbose) printf("%s: transient error (%s), retry in %llu ms\n",
+            action, code ? "HTTP error" : body, (unsigned long long)delay);
+        metricAdd(metricGet(botMetrics.api_retries,action,NULL),1);
+        sdsfree(body);
+        usleep(delay*1000);
+    }
+    sdsfree(fullurl);
     return body;
 }
 
@@ -348,20 +930,24 @@ int botAnswerCallbackQuery(const char *callback_id) {
  * Higher level Telegram bot API.
  * ===========================================================================*/
 
-/* Return the bot username. */
+/* Return the username of the current bot. */
 char *botGetUsername(void) {
+    BotInstance *bot = botCurrent();
     int res;
 
-    if (Bot.username) return Bot.username;
+    if (bot->username) return bot->username;
     sds body = makeGETBotRequest("getMe",&res,NULL,0);
-    if (res == 0) return NULL;
+    if (res == 0) {
+        sdsfree(body);
+        return NULL;
+    }
 
     cJSON *json = cJSON_Parse(body), *username;
     username = cJSON_Select(json,".result.username:s");
-    if (username) Bot.username = sdsnew(username->valuestring);
+    if (username) bot->username = sdsnew(username->valuestring);
     sdsfree(body);
     cJSON_Delete(json);
-    return Bot.username;
+    return bot->username;
 }
 
 /* Send a message to the specified channel, optionally as a reply to a
@@ -412,13 +998,10 @@ int botSendMessage(int64_t target, sds text, int64_t reply_to) {
     return botSendMessageAndGetInfo(target,text,reply_to,NULL,NULL);
 }
 
-/* Send a text message with an inline keyboard button. Returns message_id
- * via msg_id if not NULL. Return 1 on success, 0 on error. */
-int botSendMessageWithKeyboard(int64_t target, sds text, const char *parse_mode, const char *btn_text, const char *btn_data, int64_t *msg_id) {
-    sds keyboard = sdscatprintf(sdsempty(),
-        "{\"inline_keyboard\":[[{\"text\":\"%s\",\"callback_data\":\"%s\"}]]}",
-        btn_text, btn_data);
-
+/* Send a text message with the given reply markup, the JSON of an inline
+ * keyboard. Returns message_id via msg_id if not NULL.
+ * Return 1 on success, 0 on error. */
+int botSendMessageWithMarkup(int64_t target, sds text, const char *parse_mode, const char *markup, int64_t *msg_id) {
     char *options[10];
     int optlen = 4;
     options[0] = "chat_id";
@@ -428,7 +1011,7 @@ int botSendMessageWithKeyboard(int64_t target, sds text, const char *parse_mode,
     options[4] = "parse_mode";
     options[5] = (char*)parse_mode;
     options[6] = "reply_markup";
-    options[7] = keyboard;
+    options[7] = (char*)markup;
 
     int res;
     sds body = makeGETBotRequest("sendMessage",&res,options,optlen);
@@ -442,17 +1025,12 @@ int botSendMessageWithKeyboard(int64_t target, sds text, const char *parse_mode,
 
     sdsfree(body);
     sdsfree(options[1]);
-    sdsfree(keyboard);
     return res;
 }
 
-/* Edit an existing text message, preserving the inline keyboard button.
- * Return 1 on success, 0 on error. */
-int botEditMessageTextWithKeyboard(int64_t chat_id, int64_t message_id, sds text, const char *parse_mode, const char *btn_text, const char *btn_data) {
-    sds keyboard = sdscatprintf(sdsempty(),
-        "{\"inline_keyboard\":[[{\"text\":\"%s\",\"callback_data\":\"%s\"}]]}",
-        btn_text, btn_data);
-
+/* Edit an existing text message, replacing its inline keyboard with the
+ * given reply markup. Return 1 on success, 0 on error. */
+int botEditMessageTextWithMarkup(int64_t chat_id, int64_t message_id, sds text, const char *parse_mode, const char *markup) {
     char *options[12];
     int optlen = 5;
     options[0] = "chat_id";
@@ -464,13 +1042,35 @@ int botEditMessageTextWithKeyboard(int64_t chat_id, int64_t message_id, sds text
     options[6] = "parse_mode";
     options[7] = (char*)parse_mode;
     options[8] = "reply_markup";
-    options[9] = keyboard;
+    options[9] = (char*)markup;
 
     int res;
     sds body = makeGETBotRequest("editMessageText",&res,options,optlen);
     sdsfree(body);
     sdsfree(options[1]);
     sdsfree(options[3]);
+    return res;
+}
+
+/* Send a text message with an inline keyboard button. Returns message_id
+ * via msg_id if not NULL. Return 1 on success, 0 on error. */
+int botSendMessageWithKeyboard(int64_t target, sds text, const char *parse_mode, const char *btn_text, const char *btn_data, int64_t *msg_id) {
+    sds keyboard = sdscatprintf(sdsempty(),
+        "{\"inline_keyboard\":[[{\"text\":\"%s\",\"callback_data\":\"%s\"}]]}",
+        btn_text, btn_data);
+    int res = botSendMessageWithMarkup(target,text,parse_mode,keyboard,msg_id);
+    sdsfree(keyboard);
+    return res;
+}
+
+/* Edit an existing text message, preserving the inline keyboard button.
+ * Return 1 on success, 0 on error. */
+int botEditMessageTextWithKeyboard(int64_t chat_id, int64_t message_id, sds text, const char *parse_mode, const char *btn_text, const char *btn_data) {
+    sds keyboard = sdscatprintf(sdsempty(),
+        "{\"inline_keyboard\":[[{\"text\":\"%s\",\"callback_data\":\"%s\"}]]}",
+        btn_text, btn_data);
+    int res = botEditMessageTextWithMarkup(chat_id,message_id,text,parse_mode,
+                                           keyboard);
     sdsfree(keyboard);
     return res;
 }
@@ -500,6 +1100,124 @@ int botEditMessageText(int64_t chat_id, int message_id, sds text) {
     return res;
 }
 
+/* Return true if 'body' is Telegram refusing the call for good: a 4xx
+ * error, such as "message can't be deleted" for messages older than 48
+ * hours. Trying again won't help, unlike with flood control (429), 5xx
+ * errors, or an error string produced because Telegram could not be
+ * reached at all. */
+static int botIsPermanentError(sds body) {
+    cJSON *json = cJSON_Parse(body);
+    cJSON *code = cJSON_Select(json,".error_code:n");
+    int retval = code && code->valuedouble >= 400 &&
+                 code->valuedouble < 500 && code->valuedouble != 429;
+    cJSON_Delete(json);
+    return retval;
+}
+
+/* Delete a message. Return 1 if the message is gone or Telegram refused to
+ * delete it (too old, already deleted, ...), and 0 if Telegram could not
+ * be reached or failed temporarily, so that the caller may want to try
+ * again later. */
+int botDeleteMessage(int64_t chat_id, int64_t message_id) {
+    char *options[4];
+    options[0] = "chat_id";
+    options[1] = sdsfromlonglong(chat_id);
+    options[2] = "message_id";
+    options[3] = sdsfromlonglong(message_id);
+
+    int res;
+    sds body = makeGETBotRequest("deleteMessage",&res,options,2);
+    if (!res) res = botIsPermanentError(body);
+    sdsfree(body);
+    sdsfree(options[1]);
+    sdsfree(options[3]);
+    return res;
+}
+
+typedef struct botDeleteJob {
+    BotInstance *bot;
+    int64_t chat_id;
+    int64_t message_id;
+    int res;
+} botDeleteJob;
+
+static void *botDeleteMessageThread(void *arg) {
+    botDeleteJob *job = arg;
+    botSetCurrent(job->bot);
+    job->res = botDeleteMessage(job->chat_id,job->message_id);
+    return NULL;
+}
+
+#define TB_DELETE_BATCH 100 /* Max messages per deleteMessages call. */
+
+/* Delete 'count' messages from the specified chat. The batch deleteMessages
+ * call is used, up to 100 messages per call. If Telegram refuses it, the
+ * messages are deleted one by one, performing the calls concurrently.
+ * Return the number of messages that could not be deleted for now (same
+ * semantics as botDeleteMessage()), storing their IDs in 'failed' if not
+ * NULL: it must have room for 'count' IDs. */
+int botDeleteMessages(int64_t chat_id, const int64_t *ids, int count,
+                      int64_t *failed)
+{
+    int numfailed = 0;
+
+    for (int start = 0; start < count; start += TB_DELETE_BATCH) {
+        int n = count - start;
+        if (n > TB_DELETE_BATCH) n = TB_DELETE_BATCH;
+
+        sds list = sdsnewlen("[",1);
+        for (int j = 0; j < n; j++) {
+            if (j) list = sdscatlen(list,",",1);
+            list = sdscatprintf(list,"%lld",(long long)ids[start+j]);
+        }
+        list = sdscatlen(list,"]",1);
+
+        char *options[4];
+        options[0] = "chat_id";
+        options[1] = sdsfromlonglong(chat_id);
+        options[2] = "message_ids";
+        options[3] = list;
+
+        int res;
+        sds body = makeGETBotRequest("deleteMessages",&res,options,2);
+        int refused = !res && botIsPermanentError(body);
+        sdsfree(body);
+        sdsfree(options[1]);
+        sdsfree(list);
+
+        if (res) continue;
+        if (!refused) {
+            for (int j = 0; j < n; j++) {
+                if (failed) failed[numfailed] = ids[start+j];
+                numfailed++;
+            }
+            continue;
+        }
+
+        /* The batch call was refused: fall back to single deletions. */
+        if (Bot.verbose) printf("deleteMessages failed, deleting one by one\n");
+        botDeleteJob jobs[TB_DELETE_BATCH];
+        pthread_t tids[TB_DELETE_BATCH];
+        int started[TB_DELETE_BATCH];
+        for (int j = 0; j < n; j++) {
+            jobs[j].bot = botCurrent();
+            jobs[j].chat_id = chat_id;
+            jobs[j].message_id = ids[start+j];
+            jobs[j].res = 0;
+            started[j] = pthread_create(&tids[j],NULL,
+                                        botDeleteMessageThread,&jobs[j]) == 0;
+            if (!started[j]) botDeleteMessageThread(&jobs[j]);
+        }
+        for (int j = 0; j < n; j++) {
+            if (started[j]) pthread_join(tids[j],NULL);
+            if (jobs[j].res) continue;
+            if (failed) failed[numfailed] = jobs[j].message_id;
+            numfailed++;
+        }
+    }
+    return numfailed;
+}
+
 /* This function should be called from the bot implementation callback.
  * If the bot request has a file (the user can see that by inspecting
  * the br->file_type field), then this function will attempt to download
@@ -551,15 +1269,15 @@ int botGetFile(BotRequest *br, const char *target_filename) {
 
     char url[1024];
     snprintf(url, sizeof(url),
-        "https://api.telegram.org/file/bot%s/%s", Bot.apikey, file_path);
+        "%s/file/bot%s/%s", Bot.apiurl, botCurrent()->apikey, file_path);
     cJSON_Delete(json);
     curl_easy_setopt(curl, CURLOPT_URL, url);
     curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, makeHTTPGETCallWriterFILE);
     curl_easy_setopt(curl, CURLOPT_WRITEDATA, &fp);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYPEER, 1L);
     curl_easy_setopt(curl, CURLOPT_SSL_VERIFYHOST, 1L);
-    curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15);
-    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT, 15);
+    curl_easy_setopt(curl, CURLOPT_TIMEOUT_MS, (long)configGet()->http_timeout);
+    curl_easy_setopt(curl, CURLOPT_CONNECTTIMEOUT_MS, (long)HTTP_CONNECT_TIMEOUT);
 
     /* Perform the request and cleanup. */
     int retval = curl_easy_perform(curl) == CURLE_OK ? 1 : 0;
@@ -587,6 +1305,18 @@ void freeBotRequest(BotRequest *br) {
     free(br);
 }
 
+/* Return the request split into arguments, setting *argc, like
+ * sdssplitargs() does. The request is split the first time, and the result
+ * kept in br->argv: requests that are not commands, like the text pasted
+ * to a terminal, that may be many kilobytes, are never split. Returns NULL
+ * if the request has unbalanced quotes. */
+sds *botRequestArgv(BotRequest *br, int *argc) {
+    if (br->argv == NULL)
+        br->argv = sdssplitargs(br->request,&br->argc);
+    if (argc) *argc = br->argv ? br->argc : 0;
+    return br->argv;
+}
+
 /* Create a bot request object and return it to the caller. */
 BotRequest *createBotRequest(void) {
     BotRequest *br = malloc(sizeof(*br));
@@ -609,6 +1339,8 @@ BotRequest *createBotRequest(void) {
     br->is_callback = 0;
     br->callback_id = NULL;
     br->callback_data = NULL;
+    br->bot = NULL;
+    traceInit(&br->trace);
     return br;
 }
 
@@ -651,295 +1383,934 @@ void dbClose(void) {
  * Bot requests handling
  * ========================================================================== */
 
+/* The threads serving the requests, and the ones the application starts
+ * for work that must not be lost on restart, are started with
+ * botThreadStart(), that counts them: a graceful shutdown waits for the
+ * count to drop to zero, see botShutdownDrain(). */
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* Signaled when the count drops to zero. */
+    int count;
+} Workers = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+typedef struct botWorker {
+    void *(*fn)(void *);
+    void *arg;
+} botWorker;
+
+static void botWorkersAdd(int delta) {
+    pthread_mutex_lock(&Workers.lock);
+    Workers.count += delta;
+    if (Workers.count == 0) pthread_cond_broadcast(&Workers.done);
+    pthread_mutex_unlock(&Workers.lock);
+}
+
+static void *botWorkerMain(void *arg) {
+    botWorker w = *(botWorker*)arg;
+    xfree(arg);
+    void *retval = w.fn(w.arg);
+    botWorkersAdd(-1);
+    return retval;
+}
+
+/* Run fn(arg) in a new detached thread, that a graceful shutdown will wait
+ * for. Returns 1 on success, 0 if the thread can't be created: then it's
+ * up to the caller to run fn() or to release arg. */
+int botThreadStart(void *(*fn)(void *), void *arg) {
+    botWorker *w = xmalloc(sizeof(*w));
+    w->fn = fn;
+    w->arg = arg;
+    botWorkersAdd(1);
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,botWorkerMain,w) != 0) {
+        xfree(w);
+        botWorkersAdd(-1);
+        return 0;
+    }
+    pthread_detach(tid);
+    return 1;
+}
+
+/* Wait up to 'timeout' milliseconds for the worker threads to exit.
+ * Returns the number of threads still running. */
+static int botWorkersWait(int timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME,&deadline);
+    deadline.tv_sec += timeout/1000;
+    deadline.tv_nsec += (long)(timeout%1000)*1000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
+    }
+    pthread_mutex_lock(&Workers.lock);
+    while (Workers.count &&
+           pthread_cond_timedwait(&Workers.done,&Workers.lock,&deadline)
+           != ETIMEDOUT);
+    int left = Workers.count;
+    pthread_mutex_unlock(&Workers.lock);
+    return left;
+}
+
 /* Request handling thread entry point. */
 void *botHandleRequest(void *arg) {
     DbHandle = dbInit(NULL);
     BotRequest *br = arg;
+    botSetCurrent(br->bot);
 
-    /* Parse the request as a command composed of arguments. */
-    br->argv = sdssplitargs(br->request,&br->argc);
+    traceSetCurrent(&br->trace);
+    traceMark(TRACE_DISPATCHED);
+    metric *inflight = metricGet(botMetrics.inflight,NULL,NULL);
+    metricAdd(inflight,1);
+    uint64_t start = metricsUstime();
+    flightRecord(FLIGHT_REQUEST,br->request,0,0);
+
+    /* The request is split into arguments only if the callback asks for
+     * them, see botRequestArgv(). */
     Bot.req_callback(DbHandle,br);
+
+    uint64_t elapsed = metricsUstime()-start;
+    metricObserve(metricGet(botMetrics.request_time,NULL,NULL),elapsed);
+    flightRecord(FLIGHT_DONE,NULL,0,elapsed);
+    metricAdd(inflight,-1);
+    /* A request finishing later, in another thread, hands its trace over
+     * to it and clears it here: nothing to publish then. */
+    traceMark(TRACE_DONE);
+    if (br->trace.t[TRACE_RECEIVED]) tracePublish(&br->trace);
+    traceSetCurrent(NULL);
     freeBotRequest(br);
     dbClose();
     return NULL;
 }
 
-/* Get the updates from the Telegram API, process them, and return the
- * ID of the highest processed update.
+/* Process a single update received from Telegram by the specified bot,
+ * either via getUpdates or via webhook: if it is a message or a callback
+ * query that the bot should handle, start a thread running the request
+ * callback. 'received' is the traceNow() time the update was received. */
+void botDispatchUpdate(BotInstance *bot, cJSON *update, uint64_t received) {
+    /* Check for callback query (button press) first. */
+    cJSON *callback = cJSON_Select(update,".callback_query");
+    if (callback) {
+        cJSON *cb_id = cJSON_Select(callback,".id:s");
+        cJSON *cb_data = cJSON_Select(callback,".data:s");
+        cJSON *cb_from = cJSON_Select(callback,".from.id:n");
+        cJSON *cb_msg = cJSON_Select(callback,".message");
+        if (cb_id && cb_data && cb_from && cb_msg) {
+            cJSON *chatid = cJSON_Select(cb_msg,".chat.id:n");
+            cJSON *msgid = cJSON_Select(cb_msg,".message_id:n");
+            if (chatid && msgid) {
+                BotRequest *br = createBotRequest();
+                br->is_callback = 1;
+                br->callback_id = sdsnew(cb_id->valuestring);
+                br->callback_data = sdsnew(cb_data->valuestring);
+                br->from = (int64_t)cb_from->valuedouble;
+                br->target = (int64_t)chatid->valuedouble;
+                br->msg_id = (int64_t)msgid->valuedouble;
+                br->request = sdsnew(cb_data->valuestring);
+                br->type = TB_TYPE_PRIVATE;
+                br->bot = bot;
+                br->trace.t[TRACE_RECEIVED] = received;
+                br->trace.t[TRACE_PARSED] = traceNow();
+
+                metricAdd(metricGet(botMetrics.updates,"callback",NULL),1);
+                if (!botThreadStart(botHandleRequest,br))
+                    freeBotRequest(br);
+            }
+        }
+        return;
+    }
+
+    /* The actual message may be stored in .message or .channel_post
+     * depending on the fact this is a private or group message,
+     * or, instead, a channel post. */
+    cJSON *msg = cJSON_Select(update,".message");
+    if (!msg) msg = cJSON_Select(update,".channel_post");
+    if (!msg) return;
+
+    cJSON *chatid = cJSON_Select(msg,".chat.id:n");
+    if (chatid == NULL) return;
+    int64_t target = (int64_t) chatid->valuedouble;
+
+    cJSON *fromid = cJSON_Select(msg,".from.id:n");
+    int64_t from = fromid ? (int64_t) fromid->valuedouble : 0;
+
+    cJSON *fromuser = cJSON_Select(msg,".from.username:s");
+    char *from_username = fromuser ? fromuser->valuestring : "unknown";
+
+    cJSON *msgid = cJSON_Select(msg,".message_id:n");
+    int64_t message_id = msgid ? (int64_t) msgid->valuedouble : 0;
+
+    cJSON *chattype = cJSON_Select(msg,".chat.type:s");
+    char *ct = chattype->valuestring;
+    int type = TB_TYPE_UNKNOWN;
+    if (ct != NULL) {
+        if (!strcmp(ct,"private")) type = TB_TYPE_PRIVATE;
+        else if (!strcmp(ct,"group")) type = TB_TYPE_GROUP;
+        else if (!strcmp(ct,"supergroup")) type = TB_TYPE_SUPERGROUP;
+        else if (!strcmp(ct,"channel")) type = TB_TYPE_CHANNEL;
+    }
+
+    cJSON *date = cJSON_Select(msg,".date:n");
+    if (date == NULL) return;
+    time_t timestamp = date->valuedouble;
+    cJSON *text = cJSON_Select(msg,".text:s");
+    /* Text may be NULL even if the message is valid but
+     * is a voice message, image, ... .*/
+
+    if (Bot.verbose) printf(".text (from: %lld, target: %lld): %s\n",
+        (long long) from,
+        (long long) target,
+        text ? text->valuestring : "<no text field>");
+
+    /* Sanity check the request before starting the thread:
+     * validate that is a request that is really targeting our bot
+     * list of "triggers". */
+    if (text && type != TB_TYPE_PRIVATE && Bot.triggers) {
+        char *s = text->valuestring;
+        if (!globSetMatch(Bot.triggers,s,strlen(s))) return; // No match.
+    }
+    if (time(NULL)-timestamp > 60*5) return; // Ignore stale messages
+
+    /* At this point we are sure we are going to pass the request
+     * to our callback. Prepare the request object. */
+    sds request = sdsnew(text ? text->valuestring : "");
+    BotRequest *br = createBotRequest();
+    br->request = request;
+    br->from_username = sdsnew(from_username);
+
+    /* Check for files: voice, audio, or document. */
+    cJSON *voice = cJSON_Select(msg,".voice.file_id:s");
+    if (voice) {
+        br->file_type = TB_FILE_TYPE_VOICE_OGG;
+        br->file_id = sdsnew(voice->valuestring);
+        cJSON *size = cJSON_Select(msg,".voice.file_size:n");
+        br->file_size = size ? size->valuedouble : 0;
+    }
+
+    cJSON *audio = cJSON_Select(msg,".audio.file_id:s");
+    if (audio && br->file_type == TB_FILE_TYPE_NONE) {
+        br->file_type = TB_FILE_TYPE_AUDIO;
+        br->file_id = sdsnew(audio->valuestring);
+        cJSON *size = cJSON_Select(msg,".audio.file_size:n");
+        cJSON *mime = cJSON_Select(msg,".audio.mime_type:s");
+        cJSON *name = cJSON_Select(msg,".audio.file_name:s");
+        br->file_size = size ? size->valuedouble : 0;
+        br->file_mime = mime ? sdsnew(mime->valuestring) : NULL;
+        br->file_name = name ? sdsnew(name->valuestring) : NULL;
+    }
+
+    cJSON *doc = cJSON_Select(msg,".document.file_id:s");
+    if (doc && br->file_type == TB_FILE_TYPE_NONE) {
+        br->file_type = TB_FILE_TYPE_DOCUMENT;
+        br->file_id = sdsnew(doc->valuestring);
+        cJSON *size = cJSON_Select(msg,".document.file_size:n");
+        cJSON *mime = cJSON_Select(msg,".document.mime_type:s");
+        cJSON *name = cJSON_Select(msg,".document.file_name:s");
+        br->file_size = size ? size->valuedouble : 0;
+        br->file_mime = mime ? sdsnew(mime->valuestring) : NULL;
+        br->file_name = name ? sdsnew(name->valuestring) : NULL;
+    }
+
+    /* Parse entities, filling the mentions array. */
+    cJSON *entities = cJSON_Select(msg,".entities[0]");
+    while(entities) {
+        cJSON *et = cJSON_Select(entities,".type:s");
+        cJSON *offset = cJSON_Select(entities,".offset:n");
+        cJSON *length = cJSON_Select(entities,".length:n");
+        if (et && offset && length && !strcmp(et->valuestring,"mention")) {
+            unsigned long off = offset->valuedouble;
+            unsigned long len = length->valuedouble;
+            /* Don't trust Telegram offsets inside our stirng. */
+            if (off+len <= sdslen(br->request)) {
+                sds mention = sdsnewlen(br->request+off,len);
+                br->num_mentions++;
+                br->mentions = xrealloc(br->mentions,br->num_mentions);
+                br->mentions[br->num_mentions-1] = mention;
+                /* Is the user addressing the bot? Set the flag. */
+                if (bot->username && !strcmp(bot->username,mention+1))
+                    br->bot_mentioned = 1;
+            }
+        }
+        entities = entities->next;
+    }
+
+    br->type = type;
+    br->from = from;
+    br->target = target;
+    br->msg_id = message_id;
+    br->bot = bot;
+    br->trace.t[TRACE_RECEIVED] = received;
+    br->trace.t[TRACE_PARSED] = traceNow();
+
+    /* Spawn a thread that will handle the request. */
+    metricAdd(metricGet(botMetrics.updates,"message",NULL),1);
+    if (!botThreadStart(botHandleRequest,br)) {
+        freeBotRequest(br);
+        return;
+    }
+    if (Bot.verbose)
+        printf("Starting thread to serve: \"%s\"\n",br->request);
+
+    /* It's up to the callback to free the bot request with
+     * freeBotRequest(). */
+}
+
+/* =============================================================================
+ * Long polling
  *
- * The offset is the last ID already processed, the timeout is the number
- * of seconds to wait in long polling in case no request is immediately
- * available. */
-int64_t botProcessUpdates(int64_t offset, int timeout) {
-    char *options[6];
-    int res;
+ * Every bot has its getUpdates call always in flight. The calls of all the
+ * bots are performed together by the main thread with the curl multi
+ * interface, on connections kept open across polls: adding bots adds no
+ * threads, and the main loop only wakes up when some bot receives updates,
+ * when a long poll expires (every TB_POLL_TIMEOUT seconds per bot), or when
+ * a timer expires.
+ * ===========================================================================*/
 
+#define TB_POLL_TIMEOUT 25      /* getUpdates long polling, in seconds. */
+#define TB_POLL_RETRY 1000      /* Delay after a failed poll, in ms. */
+
+typedef struct botPoll {
+    BotInstance *bot;
+    CURL *curl;
+    sds body;                   /* Reply accumulated so far. */
+    int active;                 /* The call is in flight. */
+    uint64_t start;             /* metricsUstime() of the call start. */
+    uint64_t retry_at;          /* mstime() of the next call, if failed. */
+} botPoll;
+
+/* Start the getUpdates call of the bot, returning the updates after the
+ * bot offset, the last ID already processed. */
+static void botPollStart(CURLM *multi, botPoll *p) {
+    char *options[6];
     options[0] = "offset";
-    options[1] = sdsfromlonglong(offset+1);
+    options[1] = sdsfromlonglong(p->bot->offset+1);
     options[2] = "timeout";
-    options[3] = sdsfromlonglong(timeout);
+    options[3] = sdsfromlonglong(TB_POLL_TIMEOUT);
     options[4] = "allowed_updates";
     options[5] = "[\"message\",\"callback_query\"]";
-    sds body = makeGETBotRequest("getUpdates",&res,options,3);
+    sds url = sdscatprintf(sdsempty(),"%s/bot%s/getUpdates",
+                           Bot.apiurl,p->bot->apikey);
+    sds fullurl = buildQueryURL(url,options,3);
+    sdsfree(url);
     sdsfree(options[1]);
     sdsfree(options[3]);
+    if (Bot.debug) printf("HTTP GET %s\n", fullurl);
+
+    if (p->curl == NULL) p->curl = curl_easy_init();
+    sdsfree(p->body);
+    p->body = sdsempty();
+    curl_easy_setopt(p->curl, CURLOPT_URL, fullurl);
+    curl_easy_setopt(p->curl, CURLOPT_PRIVATE, p);
+    curl_easy_setopt(p->curl, CURLOPT_SHARE, HttpPool.share);
+    curl_easy_setopt(p->curl, CURLOPT_WRITEFUNCTION, makeHTTPGETCallWriterSDS);
+    curl_easy_setopt(p->curl, CURLOPT_WRITEDATA, &p->body);
+    curl_easy_setopt(p->curl, CURLOPT_SSL_VERIFYPEER, 1L);
+    curl_easy_setopt(p->curl, CURLOPT_SSL_VERIFYHOST, 1L);
+    curl_easy_setopt(p->curl, CURLOPT_TIMEOUT_MS,
+                     (long)TB_POLL_TIMEOUT*1000 + configGet()->http_timeout);
+    curl_easy_setopt(p->curl, CURLOPT_CONNECTTIMEOUT_MS,
+                     (long)HTTP_CONNECT_TIMEOUT);
+    sdsfree(fullurl);
+
+    p->start = metricsUstime();
+    p->active = curl_multi_add_handle(multi,p->curl) == CURLM_OK;
+    if (!p->active) p->retry_at = mstime() + TB_POLL_RETRY;
+}
+
+/* The getUpdates call of the bot completed with the specified result:
+ * dispatch the updates received, and advance the bot offset. */
+static void botPollDone(CURLM *multi, botPoll *p, CURLcode res) {
+    BotInstance *bot = p->bot;
+    long code = 0;
+    curl_multi_remove_handle(multi,p->curl);
+    p->active = 0;
+    uint64_t received = traceNow();
+    uint64_t elapsed = metricsUstime()-p->start;
+    if (res == CURLE_OK) {
+        curl_easy_getinfo(p->curl,CURLINFO_RESPONSE_CODE,&code);
+    } else {
+        p->body = sdscat(p->body,curl_easy_strerror(res));
+    }
+    metricObserve(metricGet(botMetrics.api_time,"getUpdates",NULL),elapsed);
+    flightRecord(FLIGHT_HTTP,"getUpdates",code,elapsed);
+    if (code == 0) flightRecord(FLIGHT_ERROR,p->body,0,0);
+    char codestr[16];
+    if (code) snprintf(codestr,sizeof(codestr),"%ld",code);
+    else memcpy(codestr,"error",6);
+    metricAdd(metricGet(botMetrics.api_calls,"getUpdates",codestr),1);
 
     /* If two --debug options are provided, log the whole Telegram
      * reply here. */
     if (Bot.debug >= 2)
-        printf("RECEIVED FROM TELEGRAM API:\n%s\n",body);
+        printf("RECEIVED FROM TELEGRAM API:\n%s\n",p->body);
 
     /* Parse the JSON in order to extract the message info. */
-    cJSON *json = cJSON_Parse(body);
+    cJSON *json = cJSON_Parse(p->body);
     cJSON *result = cJSON_Select(json,".result:a");
-    if (result == NULL) goto fmterr;
+    if (result == NULL) {
+        /* A webhook left over by a previous run in webhook mode makes
+         * getUpdates fail: remove it. */
+        cJSON *errcode = cJSON_Select(json,".error_code:n");
+        if (errcode && errcode->valuedouble == 409) {
+            printf("Removing the webhook to receive updates via getUpdates\n");
+            botSetCurrent(bot);
+            sds reply = makeGETBotRequest("deleteWebhook",NULL,NULL,0);
+            sdsfree(reply);
+            botSetCurrent(NULL);
+        }
+        /* Don't saturate the CPU polling again and again a server that
+         * fails immediately. */
+        p->retry_at = mstime() + TB_POLL_RETRY;
+        cJSON_Delete(json);
+        return;
+    }
+
     /* Process the array of updates. */
     cJSON *update;
     cJSON_ArrayForEach(update,result) {
         cJSON *update_id = cJSON_Select(update,".update_id:n");
         if (update_id == NULL) continue;
         int64_t thisoff = (int64_t) update_id->valuedouble;
-        if (thisoff > offset) offset = thisoff;
-
-        /* Check for callback query (button press) first. */
-        cJSON *callback = cJSON_Select(update,".callback_query");
-        if (callback) {
-            cJSON *cb_id = cJSON_Select(callback,".id:s");
-            cJSON *cb_data = cJSON_Select(callback,".data:s");
-            cJSON *cb_from = cJSON_Select(callback,".from.id:n");
-            cJSON *cb_msg = cJSON_Select(callback,".message");
-            if (cb_id && cb_data && cb_from && cb_msg) {
-                cJSON *chatid = cJSON_Select(cb_msg,".chat.id:n");
-                cJSON *msgid = cJSON_Select(cb_msg,".message_id:n");
-                if (chatid && msgid) {
-                    BotRequest *br = createBotRequest();
-                    br->is_callback = 1;
-                    br->callback_id = sdsnew(cb_id->valuestring);
-                    br->callback_data = sdsnew(cb_data->valuestring);
-                    br->from = (int64_t)cb_from->valuedouble;
-                    br->target = (int64_t)chatid->valuedouble;
-                    br->msg_id = (int64_t)msgid->valuedouble;
-                    br->request = sdsnew(cb_data->valuestring);
-                    br->type = TB_TYPE_PRIVATE;
-
-                    botStats.queries++;
-                    pthread_t tid;
-                    if (pthread_create(&tid,NULL,botHandleRequest,br) == 0) {
-                        pthread_detach(tid);
-                    } else {
-                        freeBotRequest(br);
-                    }
-                }
-            }
-            continue;
-        }
+        if (thisoff > bot->offset) bot->offset = thisoff;
+        botDispatchUpdate(bot,update,received);
+    }
+    p->retry_at = 0;
+    cJSON_Delete(json);
+}
 
-        /* The actual message may be stored in .message or .channel_post
-         * depending on the fact this is a private or group message,
-         * or, instead, a channel post. */
-        cJSON *msg = cJSON_Select(update,".message");
-        if (!msg) msg = cJSON_Select(update,".channel_post");
-        if (!msg) continue;
-
-        cJSON *chatid = cJSON_Select(msg,".chat.id:n");
-        if (chatid == NULL) continue;
-        int64_t target = (int64_t) chatid->valuedouble;
-
-        cJSON *fromid = cJSON_Select(msg,".from.id:n");
-        int64_t from = fromid ? (int64_t) fromid->valuedouble : 0;
-
-        cJSON *fromuser = cJSON_Select(msg,".from.username:s");
-        char *from_username = fromuser ? fromuser->valuestring : "unknown";
-
-        cJSON *msgid = cJSON_Select(msg,".message_id:n");
-        int64_t message_id = msgid ? (int64_t) msgid->valuedouble : 0;
-
-        cJSON *chattype = cJSON_Select(msg,".chat.type:s");
-        char *ct = chattype->valuestring;
-        int type = TB_TYPE_UNKNOWN;
-        if (ct != NULL) {
-            if (!strcmp(ct,"private")) type = TB_TYPE_PRIVATE;
-            else if (!strcmp(ct,"group")) type = TB_TYPE_GROUP;
-            else if (!strcmp(ct,"supergroup")) type = TB_TYPE_SUPERGROUP;
-            else if (!strcmp(ct,"channel")) type = TB_TYPE_CHANNEL;
-        }
+/* =============================================================================
+ * Signals
+ * ===========================================================================*/
 
-        cJSON *date = cJSON_Select(msg,".date:n");
-        if (date == NULL) continue;
-        time_t timestamp = date->valuedouble;
-        cJSON *text = cJSON_Select(msg,".text:s");
-        /* Text may be NULL even if the message is valid but
-         * is a voice message, image, ... .*/
-
-        if (Bot.verbose) printf(".text (from: %lld, target: %lld): %s\n",
-            (long long) from,
-            (long long) target,
-            text ? text->valuestring : "<no text field>");
-
-        /* Sanity check the request before starting the thread:
-         * validate that is a request that is really targeting our bot
-         * list of "triggers". */
-        if (text && type != TB_TYPE_PRIVATE && Bot.triggers) {
-            char *s = text->valuestring;
-            int j;
-            for (j = 0; Bot.triggers[j]; j++) {
-                if (strmatch(Bot.triggers[j], strlen(Bot.triggers[j]),
-                    s, strlen(s), 1))
-                {
-                    break;
-                }
-            }
-            if (Bot.triggers[j] == NULL) continue; // No match.
-        }
-        if (time(NULL)-timestamp > 60*5) continue; // Ignore stale messages
-
-        /* At this point we are sure we are going to pass the request
-         * to our callback. Prepare the request object. */
-        sds request = sdsnew(text ? text->valuestring : "");
-        BotRequest *br = createBotRequest();
-        br->request = request;
-        br->from_username = sdsnew(from_username);
-
-        /* Check for files: voice, audio, or document. */
-        cJSON *voice = cJSON_Select(msg,".voice.file_id:s");
-        if (voice) {
-            br->file_type = TB_FILE_TYPE_VOICE_OGG;
-            br->file_id = sdsnew(voice->valuestring);
-            cJSON *size = cJSON_Select(msg,".voice.file_size:n");
-            br->file_size = size ? size->valuedouble : 0;
-        }
+static httpServer *WebhookServer;   /* Set in webhook mode. */
+static int WakeupPipe[2] = {-1,-1}; /* Interrupts the getUpdates loop. */
+
+/* Interrupt the main loop sleep, so that it acts on the flags set by the
+ * signal handlers. Only calls write(2), so it's async signal safe. */
+static void botWakeupMain(void) {
+    int saved_errno = errno;
+    if (WebhookServer) {
+        httpServerWakeup(WebhookServer);
+    } else if (WakeupPipe[1] != -1) {
+        ssize_t nwritten = write(WakeupPipe[1],"",1);
+        UNUSED(nwritten); /* A full pipe is a pending wakeup already. */
+    }
+    errno = saved_errno;
+}
 
-        cJSON *audio = cJSON_Select(msg,".audio.file_id:s");
-        if (audio && br->file_type == TB_FILE_TYPE_NONE) {
-            br->file_type = TB_FILE_TYPE_AUDIO;
-            br->file_id = sdsnew(audio->valuestring);
-            cJSON *size = cJSON_Select(msg,".audio.file_size:n");
-            cJSON *mime = cJSON_Select(msg,".audio.mime_type:s");
-            cJSON *name = cJSON_Select(msg,".audio.file_name:s");
-            br->file_size = size ? size->valuedouble : 0;
-            br->file_mime = mime ? sdsnew(mime->valuestring) : NULL;
-            br->file_name = name ? sdsnew(name->valuestring) : NULL;
-        }
+static void botSigusr1Handler(int sig) {
+    UNUSED(sig);
+    StatsRequested = 1;
+    botWakeupMain();
+}
 
-        cJSON *doc = cJSON_Select(msg,".document.file_id:s");
-        if (doc && br->file_type == TB_FILE_TYPE_NONE) {
-            br->file_type = TB_FILE_TYPE_DOCUMENT;
-            br->file_id = sdsnew(doc->valuestring);
-            cJSON *size = cJSON_Select(msg,".document.file_size:n");
-            cJSON *mime = cJSON_Select(msg,".document.mime_type:s");
-            cJSON *name = cJSON_Select(msg,".document.file_name:s");
-            br->file_size = size ? size->valuedouble : 0;
-            br->file_mime = mime ? sdsnew(mime->valuestring) : NULL;
-            br->file_name = name ? sdsnew(name->valuestring) : NULL;
-        }
+static void botSighupHandler(int sig) {
+    UNUSED(sig);
+    ReloadRequested = 1;
+    botWakeupMain();
+}
 
-        /* Parse entities, filling the mentions array. */
-        cJSON *entities = cJSON_Select(msg,".entities[0]");
-        while(entities) {
-            cJSON *et = cJSON_Select(entities,".type:s");
-            cJSON *offset = cJSON_Select(entities,".offset:n");
-            cJSON *length = cJSON_Select(entities,".length:n");
-            if (et && offset && length && !strcmp(et->valuestring,"mention")) {
-                unsigned long off = offset->valuedouble;
-                unsigned long len = length->valuedouble;
-                /* Don't trust Telegram offsets inside our stirng. */
-                if (off+len <= sdslen(br->request)) {
-                    sds mention = sdsnewlen(br->request+off,len);
-                    br->num_mentions++;
-                    br->mentions = xrealloc(br->mentions,br->num_mentions);
-                    br->mentions[br->num_mentions-1] = mention;
-                    /* Is the user addressing the bot? Set the flag. */
-                    if (Bot.username && !strcmp(Bot.username,mention+1))
-                        br->bot_mentioned = 1;
-                }
-            }
-            entities = entities->next;
+/* SIGTERM and SIGINT start a graceful shutdown. A second one, while the
+ * requests are drained, exits at once. */
+static void botSigtermHandler(int sig) {
+    UNUSED(sig);
+    if (ShutdownRequested == TB_SHUTDOWN_STOP) _exit(1);
+    ShutdownRequested = TB_SHUTDOWN_STOP;
+    botWakeupMain();
+}
+
+/* Called by the main loops: log what the signal handlers requested. Printing
+ * is not async signal safe, so it can't be done by the handlers. */
+static void botHandleSignals(void) {
+    if (ReloadRequested) {
+        ReloadRequested = 0;
+        sds err = NULL;
+        if (configReload(&err)) {
+            printf("Settings reloaded\n");
+        } else {
+            printf("Settings not reloaded: %s\n", err);
+            sdsfree(err);
         }
+        fflush(stdout);
+    }
+    if (StatsRequested) {
+        StatsRequested = 0;
+        sds stats = traceSummary();
+        printf("%s",stats);
+        fflush(stdout);
+        sdsfree(stats);
+    }
+}
+
+/* =============================================================================
+ * Graceful shutdown and restart
+ *
+ * Killing the bot while it serves a request may leave behind the messages
+ * of an old screen, half deleted, and the updates received but not served
+ * yet, since Telegram considers them delivered at the next getUpdates, are
+ * lost. A graceful shutdown instead stops receiving updates, waits up to
+ * TB_DRAIN_TIMEOUT for the worker threads (see botThreadStart()) to
+ * complete, and saves the getUpdates offset and, via the shutdown callback,
+ * the application state. Then the process exits, or, to restart, executes
+ * again the program with the same arguments: replacing the binary and
+ * restarting this way upgrades the bot without losing updates or sessions.
+ * ===========================================================================*/
 
-        br->type = type;
-        br->from = from;
-        br->target = target;
-        br->msg_id = message_id;
+#define TB_DRAIN_TIMEOUT 10000  /* Milliseconds. */
+#define TB_OFFSET_KEY "update_offset"
 
-        /* Spawn a thread that will handle the request. */
-        botStats.queries++;
-        pthread_t tid;
-        if (pthread_create(&tid,NULL,botHandleRequest,br) != 0) {
-            freeBotRequest(br);
-            continue;
-        }
-        pthread_detach(tid);
-        if (Bot.verbose)
-            printf("Starting thread to serve: \"%s\"\n",br->request);
+/* Start a graceful shutdown: the main loop stops receiving updates, and
+ * the process exits, or if 'restart' is true, restarts, once the requests
+ * in flight completed. Can be called from any thread. */
+void botShutdown(int restart) {
+    if (!ShutdownRequested)
+        ShutdownRequested = restart ? TB_SHUTDOWN_RESTART : TB_SHUTDOWN_STOP;
+    botWakeupMain();
+}
 
-        /* It's up to the callback to free the bot request with
-         * freeBotRequest(). */
+void botSetShutdownCallback(TBShutdownCallback cb) {
+    Bot.shutdown_callback = cb;
+}
+
+/* Return the getUpdates offset saved by the last graceful shutdown, or
+ * -100, to get the last 100 updates, if there is none. The saved offset
+ * is used once: after a crash we are back to the last 100 updates. */
+static int64_t botLoadOffset(BotInstance *bot) {
+    int64_t offset = -100;
+    sds key = sdscat(sdsdup(bot->kvprefix),TB_OFFSET_KEY);
+    sds value = kvGet(DbHandle,key);
+    if (value) {
+        offset = strtoll(value,NULL,10);
+        kvDel(DbHandle,key);
+        sdsfree(value);
     }
+    sdsfree(key);
+    return offset;
+}
 
-fmterr:
-    cJSON_Delete(json);
+static void botSaveOffset(BotInstance *bot) {
+    if (bot->offset <= 0) return; /* Webhook mode, or no update yet. */
+    sds key = sdscat(sdsdup(bot->kvprefix),TB_OFFSET_KEY);
+    sds value = sdsfromlonglong(bot->offset);
+    kvSet(DbHandle,key,value,0);
+    sdsfree(key);
+    sdsfree(value);
+}
+
+/* Execute again the program, with the same arguments. The file descriptors
+ * are not inherited: the new process opens again the database and the
+ * listening sockets. */
+static void botRestart(void) {
+    long maxfd = sysconf(_SC_OPEN_MAX);
+    if (maxfd < 0 || maxfd > 65536) maxfd = 65536;
+    for (int fd = 3; fd < maxfd; fd++) fcntl(fd,F_SETFD,FD_CLOEXEC);
+    printf("Restarting %s\n", Bot.argv[0]);
+    fflush(stdout);
+    execvp(Bot.argv[0],Bot.argv);
+    printf("Can't restart %s: %s\n", Bot.argv[0], strerror(errno));
+    exit(1);
+}
+
+/* Called by the main loops once they stopped receiving updates: wait for
+ * the requests in flight, save the state, and exit or restart. */
+static void botShutdownDrain(void) {
+    pthread_mutex_lock(&Workers.lock);
+    int busy = Workers.count;
+    pthread_mutex_unlock(&Workers.lock);
+    if (busy) {
+        printf("Shutting down: waiting for %d requests to complete\n", busy);
+        fflush(stdout);
+    }
+    int left = botWorkersWait(TB_DRAIN_TIMEOUT);
+    if (left)
+        printf("%d requests still running after %d seconds, "
+               "shutting down anyway\n", left, TB_DRAIN_TIMEOUT/1000);
+
+    for (int j = 0; j < Bot.numbots; j++) {
+        BotInstance *bot = Bot.bots[j];
+        botSetCurrent(bot);
+        botSaveOffset(bot);
+        if (Bot.shutdown_callback) Bot.shutdown_callback(DbHandle,bot);
+    }
+    botSetCurrent(NULL);
+    dbClose();
+
+    /* Read the flag only now: a SIGTERM while draining turns a restart
+     * into a shutdown. */
+    if (ShutdownRequested == TB_SHUTDOWN_RESTART) botRestart();
+    printf("Shutdown completed\n");
+    exit(0);
+}
+
+/* =============================================================================
+ * Webhook receive mode
+ *
+ * Instead of polling getUpdates, Telegram can POST every update to our
+ * URL as soon as it is available. The embedded HTTP server listens on
+ * --webhook-listen (usually behind a TLS terminating reverse proxy, since
+ * Telegram only delivers to HTTPS URLs), checks that the request carries
+ * the secret token we registered with setWebhook, and feeds the update
+ * to the same dispatch path used in polling mode.
+ *
+ * All the bots are registered with the same URL, each with its own secret
+ * token: the token tells which bot the update is for.
+ * ===========================================================================*/
+
+#define TB_WEBHOOK_SEEN 128 /* Recent update IDs remembered for dedup. */
+
+/* Compare two strings in constant time (for a given length of 'b'). */
+static int botSecureCompare(const char *a, const char *b) {
+    size_t alen = strlen(a), blen = strlen(b);
+    unsigned char diff = alen != blen;
+    for (size_t j = 0; j < blen; j++)
+        diff |= (unsigned char)(j < alen ? a[j] : 0) ^ (unsigned char)b[j];
+    return diff == 0;
+}
+
+/* Telegram delivers again updates that were not acknowledged in time:
+ * return 1 if the update was already seen by the bot, otherwise remember
+ * it. Update IDs are per bot. */
+static int botWebhookSeen(BotInstance *bot, int64_t update_id) {
+    static struct {
+        int bot;
+        int64_t update_id;
+    } seen[TB_WEBHOOK_SEEN];
+    static int next = 0;
+    for (int j = 0; j < TB_WEBHOOK_SEEN; j++)
+        if (seen[j].update_id == update_id && seen[j].bot == bot->id)
+            return 1;
+    seen[next].bot = bot->id;
+    seen[next].update_id = update_id;
+    next = (next+1) % TB_WEBHOOK_SEEN;
+    return 0;
+}
+
+/* Return the bot registered with the specified secret token, or NULL. */
+static BotInstance *botWebhookBot(const char *token) {
+    BotInstance *found = NULL;
+    /* No early exit: the time taken must not depend on the token. */
+    for (int j = 0; j < Bot.numbots; j++)
+        if (botSecureCompare(token,Bot.bots[j]->webhook_secret))
+            found = Bot.bots[j];
+    return found;
+}
+
+static void botWebhookHandler(httpRequest *req, httpResponse *res, void *privdata) {
+    UNUSED(privdata);
+    uint64_t received = traceNow();
+    if (strcmp(req->method,"POST") != 0) {
+        res->status = 405;
+        return;
+    }
+    const char *token = httpGetHeader(req,"X-Telegram-Bot-Api-Secret-Token");
+    BotInstance *bot = token ? botWebhookBot(token) : NULL;
+    if (bot == NULL) {
+        if (Bot.verbose) printf("Webhook: rejecting request with bad secret\n");
+        res->status = 401;
+        return;
+    }
+    if (Bot.debug >= 2)
+        printf("RECEIVED FROM TELEGRAM WEBHOOK:\n%s\n",req->body);
+
+    cJSON *update = cJSON_Parse(req->body);
+    cJSON *update_id = cJSON_Select(update,".update_id:n");
+    if (update_id == NULL) {
+        res->status = 400;
+    } else if (!botWebhookSeen(bot,(int64_t)update_id->valuedouble)) {
+        botDispatchUpdate(bot,update,received);
+    } else {
+        metricAdd(metricGet(botMetrics.webhook_dups,NULL,NULL),1);
+    }
+    cJSON_Delete(update);
+}
+
+/* Register our URL and the secret of the current bot with Telegram.
+ * Return 1 on success. */
+static int botSetWebhook(void) {
+    char *options[6];
+    options[0] = "url";
+    options[1] = Bot.webhook_url;
+    options[2] = "secret_token";
+    options[3] = botCurrent()->webhook_secret;
+    options[4] = "allowed_updates";
+    options[5] = "[\"message\",\"callback_query\"]";
+    int res;
+    sds body = makeGETBotRequest("setWebhook",&res,options,3);
+    if (!res) printf("setWebhook failed: %s\n", body);
     sdsfree(body);
-    return offset;
+    return res;
+}
+
+/* Set the secret token of the bot webhook: the one given with
+ * --webhook-secret for the first bot, and the same followed by "-<id>" for
+ * the others, or a random one if none was given. */
+static void botWebhookInitSecret(BotInstance *bot) {
+    if (Bot.webhook_secret) {
+        bot->webhook_secret = sdsnew(Bot.webhook_secret);
+        if (bot->id)
+            bot->webhook_secret = sdscatprintf(bot->webhook_secret,"-%d",
+                                               bot->id);
+        return;
+    }
+    unsigned char buf[16];
+    FILE *fp = fopen("/dev/urandom","r");
+    if (fp == NULL || fread(buf,sizeof(buf),1,fp) != 1) {
+        printf("Can't read /dev/urandom to generate the webhook secret\n");
+        exit(1);
+    }
+    fclose(fp);
+    bot->webhook_secret = sdsempty();
+    for (size_t j = 0; j < sizeof(buf); j++)
+        bot->webhook_secret = sdscatprintf(bot->webhook_secret,"%02x",buf[j]);
+    if (!Bot.webhook_url)
+        printf("Webhook secret token of bot %d: %s\n", bot->id,
+               bot->webhook_secret);
+}
+
+static void botWebhookWakeup(void) {
+    httpServerWakeup(WebhookServer);
+}
+
+/* Main loop of the webhook mode. Requests are served as they arrive, and
+ * the timers are run when they expire (see timer.c). */
+void botMainWebhook(void) {
+    for (int j = 0; j < Bot.numbots; j++)
+        botWebhookInitSecret(Bot.bots[j]);
+    httpServer *srv = httpServerCreate(Bot.webhook_listen,
+                                       botWebhookHandler,NULL);
+    if (srv == NULL) exit(1);
+    for (int j = 0; j < Bot.numbots; j++) {
+        botSetCurrent(Bot.bots[j]);
+        if (Bot.webhook_url && !botSetWebhook()) exit(1);
+    }
+    botSetCurrent(NULL);
+    printf("Receiving updates via webhook on %s\n", Bot.webhook_listen);
+
+    WebhookServer = srv;
+    timerSetWakeup(botWebhookWakeup);
+    while(!ShutdownRequested) {
+        timerProcess();
+        botHandleSignals();
+        int timeout = timerTimeout();
+        if (timeout == -1 || timeout > TB_POLL_TIMEOUT*1000)
+            timeout = TB_POLL_TIMEOUT*1000;
+        httpServerPoll(srv,timeout);
+    }
+
+    /* Updates not acknowledged yet are delivered again by Telegram. */
+    botShutdownDrain();
+}
+
+/* =============================================================================
+ * Metrics
+ * ===========================================================================*/
+
+static void botMetricsInit(void) {
+    botMetrics.start_time = metricsNew(METRIC_GAUGE,
+        "teleterm_start_time_seconds",
+        "Unix time the bot was started.",NULL,1);
+    botMetrics.updates = metricsNew(METRIC_COUNTER,
+        "teleterm_updates_total",
+        "Updates dispatched to the request callback.","type",1);
+    botMetrics.inflight = metricsNew(METRIC_GAUGE,
+        "teleterm_requests_in_flight",
+        "Requests currently being served.",NULL,1);
+    botMetrics.request_time = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_request_duration_seconds",
+        "Time spent serving a request.",NULL,1e-6);
+    botMetrics.api_calls = metricsNew(METRIC_COUNTER,
+        "teleterm_api_calls_total",
+        "Bot API HTTP calls, by method and HTTP status.","method,code",1);
+    botMetrics.api_time = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_api_call_duration_seconds",
+        "Bot API HTTP call latency.","method",1e-6);
+    botMetrics.api_retries = metricsNew(METRIC_COUNTER,
+        "teleterm_api_retries_total",
+        "Bot API calls retried after a transient failure.","method",1);
+    botMetrics.api_floods = metricsNew(METRIC_COUNTER,
+        "teleterm_api_flood_waits_total",
+        "Bot API calls refused with 429 Too Many Requests.","method",1);
+    botMetrics.rl_waiters = metricsNew(METRIC_GAUGE,
+        "teleterm_ratelimit_queue_depth",
+        "Bot API calls waiting for the rate limiter.",NULL,1);
+    botMetrics.rl_wait_time = metricsNew(METRIC_HISTOGRAM,
+        "teleterm_ratelimit_wait_seconds",
+        "Time Bot API calls spent waiting for the rate limiter.",NULL,1e-6);
+    botMetrics.rl_merged = metricsNew(METRIC_COUNTER,
+        "teleterm_ratelimit_edits_merged_total",
+        "Queued message edits superseded by a newer edit.",NULL,1);
+    botMetrics.rl_chat_cache = metricsNew(METRIC_COUNTER,
+        "teleterm_ratelimit_chat_lookups_total",
+        "Lookups of the per chat rate limiter table.","result",1);
+    botMetrics.webhook_dups = metricsNew(METRIC_COUNTER,
+        "teleterm_webhook_duplicates_total",
+        "Webhook deliveries of updates already processed.",NULL,1);
+}
+
+static void botMetricsHandler(httpRequest *req, httpResponse *res, void *privdata) {
+    UNUSED(privdata);
+    if (strcmp(req->path,"/metrics") != 0) {
+        res->status = 404;
+        return;
+    }
+    if (strcmp(req->method,"GET") != 0) {
+        res->status = 405;
+        return;
+    }
+    res->content_type = "text/plain; version=0.0.4";
+    sdsfree(res->body);
+    res->body = metricsRender();
+}
+
+/* The metrics endpoint runs in its own thread, so that scrapes are
+ * served even while the main loop is blocked in long polling. */
+static void *botMetricsThread(void *arg) {
+    httpServer *srv = arg;
+    while(1) httpServerPoll(srv,-1);
+    return NULL;
+}
+
+/* Start serving the metrics on the address specified with
+ * --metrics-listen. Exits on error, like the other startup failures. */
+static void botMetricsStart(const char *addr) {
+    httpServer *srv = httpServerCreate(addr,botMetricsHandler,NULL);
+    if (srv == NULL) exit(1);
+    pthread_t tid;
+    if (pthread_create(&tid,NULL,botMetricsThread,srv) != 0) {
+        printf("Can't start the metrics thread\n");
+        exit(1);
+    }
+    pthread_detach(tid);
+    printf("Serving metrics on %s\n", addr);
 }
 
 /* =============================================================================
  * Bot main loop
  * ===========================================================================*/
 
-/* This is the bot main loop: we get messages using getUpdates in blocking
- * mode, but with a timeout. Then we serve requests as needed, and every
- * time we unblock, we check for completed requests (by the thread that
- * handles Yahoo Finance API calls). */
+static CURLM *MainMulti;
+
+/* Timer procedure calling the cron callback once per second. */
+static void botCron(void *privdata) {
+    UNUSED(privdata);
+    Bot.cron_callback(DbHandle);
+}
+
+/* Called by timerAdd() from the request threads. */
+static void botMainWakeup(void) {
+    curl_multi_wakeup(MainMulti);
+}
+
+/* This is the bot main loop: the getUpdates long polls of all the bots
+ * are performed at the same time (see botPollStart()), serving the updates
+ * as they arrive, and the timers are run when they expire (see timer.c). */
 void botMain(void) {
-    int64_t nextid = -100; /* Start getting the last 100 messages. */
-    int previd;
+    CURLM *multi = curl_multi_init();
+    botPoll *polls = xmalloc(sizeof(botPoll)*Bot.numbots);
+    memset(polls,0,sizeof(botPoll)*Bot.numbots);
+    for (int j = 0; j < Bot.numbots; j++) {
+        polls[j].bot = Bot.bots[j];
+        polls[j].bot->offset = botLoadOffset(polls[j].bot);
+    }
+    if (pipe(WakeupPipe) == -1) {
+        perror("pipe");
+        exit(1);
+    }
+    for (int j = 0; j < 2; j++) {
+        fcntl(WakeupPipe[j],F_SETFL,O_NONBLOCK);
+        fcntl(WakeupPipe[j],F_SETFD,FD_CLOEXEC);
+    }
 
-    botGetUsername(); // Will cache Bot.username as side effect.
-    while(1) {
-        previd = nextid;
-        nextid = botProcessUpdates(nextid,1);
-        /* We don't want to saturate all the CPU in a busy loop in case
-         * the above call fails and returns immediately (for networking
-         * errors for instance), so wait a bit at every cycle, but only
-         * if we didn't made any progresses with the ID. */
-        if (nextid == previd) usleep(100000);
-        if (Bot.cron_callback) Bot.cron_callback(DbHandle);
+    MainMulti = multi;
+    timerSetWakeup(botMainWakeup);
+    while(!ShutdownRequested) {
+        uint64_t now = mstime();
+        for (int j = 0; j < Bot.numbots; j++)
+            if (!polls[j].active && polls[j].retry_at <= now)
+                botPollStart(multi,&polls[j]);
+
+        int running;
+        curl_multi_perform(multi,&running);
+        CURLMsg *msg;
+        int left;
+        while ((msg = curl_multi_info_read(multi,&left)) != NULL) {
+            if (msg->msg != CURLMSG_DONE) continue;
+            botPoll *p;
+            curl_easy_getinfo(msg->easy_handle,CURLINFO_PRIVATE,(char**)&p);
+            botPollDone(multi,p,msg->data.result);
+        }
+
+        botHandleSignals();
+        timerProcess();
+
+        /* Sleep until there is some traffic, the next timer, or the next
+         * retry of a failed poll. */
+        now = mstime();
+        int timeout = timerTimeout();
+        if (timeout == -1 || timeout > TB_POLL_TIMEOUT*1000)
+            timeout = TB_POLL_TIMEOUT*1000;
+        uint64_t wakeup = now + timeout;
+        for (int j = 0; j < Bot.numbots; j++)
+            if (!polls[j].active && polls[j].retry_at < wakeup)
+                wakeup = polls[j].retry_at;
+        timeout = wakeup > now ? (int)(wakeup-now) : 0;
+        struct curl_waitfd wfd = {.fd = WakeupPipe[0],
+                                  .events = CURL_WAIT_POLLIN};
+        curl_multi_poll(multi,&wfd,1,timeout,NULL);
+        if (wfd.revents) {
+            char buf[64];
+            while (read(WakeupPipe[0],buf,sizeof(buf)) > 0);
+        }
     }
+
+    /* Stop polling. The updates of the interrupted polls were not
+     * dispatched, and are not acknowledged since the offset was not
+     * advanced: we'll get them again at the next start. */
+    for (int j = 0; j < Bot.numbots; j++)
+        if (polls[j].active) curl_multi_remove_handle(multi,polls[j].curl);
+    botShutdownDrain();
 }
 
 /* Check if a file named 'apikey.txt' exists, if so load the Telegram bot
- * API key from there. If the function is able to read the API key from
- * the file, as a side effect the global SDS string Bot.apikey is populated. */
+ * API keys from there, one per line, adding a bot for each of them. */
 void readApiKeyFromFile(void) {
     FILE *fp = fopen("apikey.txt","r");
     if (fp == NULL) return;
     char buf[1024];
-    if (fgets(buf,sizeof(buf),fp) == NULL) {
-        fclose(fp);
-        return;
+    while (fgets(buf,sizeof(buf),fp) != NULL) {
+        sds key = sdstrim(sdsnew(buf)," \t\r\n");
+        if (sdslen(key)) botAddInstances(key);
+        sdsfree(key);
     }
-    buf[sizeof(buf)-1] = '\0';
     fclose(fp);
-    sdsfree(Bot.apikey);
-    Bot.apikey = sdsnew(buf);
-    Bot.apikey = sdstrim(Bot.apikey," \t\r\n");
 }
 
 void resetBotStats(void) {
-    botStats.start_time = time(NULL);
-    botStats.queries = 0;
+    metricSet(metricGet(botMetrics.start_time,NULL,NULL),time(NULL));
 }
 
-int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers) {
+int startBot(char *createdb_query, int argc, char **argv, int flags, TBInitCallback init_callback, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers) {
     srand(time(NULL));
 
     Bot.debug = 0;
     Bot.verbose = 0;
     Bot.dbfile = "./mybot.sqlite";
-    Bot.triggers = triggers;
-    Bot.apikey = NULL;
+    /* Compiled once: every group message is matched against them. */
+    Bot.triggers = triggers ? globSetCompile(triggers,1) : NULL;
+    Bot.numbots = 0;
+    Bot.apiurl = getenv("TELETERM_API_URL");
+    if (Bot.apiurl == NULL) Bot.apiurl = "https://api.telegram.org";
+    Bot.webhook_url = NULL;
+    Bot.webhook_listen = NULL;
+    Bot.webhook_secret = NULL;
+    Bot.metrics_listen = NULL;
+    Bot.init_callback = init_callback;
     Bot.req_callback = req_callback;
     Bot.cron_callback = cron_callback;
+    Bot.config_file = NULL;
+    Bot.argv = argv;
 
     /* Parse options. */
     for (int j = 1; j < argc; j++) {
@@ -950,34 +2321,94 @@ int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCa
         } else if (!strcmp(argv[j],"--verbose")) {
             Bot.verbose = 1;
         } else if (!strcmp(argv[j],"--apikey") && morearg) {
-            Bot.apikey = sdsnew(argv[++j]);
+            botAddInstances(argv[++j]);
+        } else if (!strcmp(argv[j],"--api-url") && morearg) {
+            Bot.apiurl = argv[++j];
+        } else if (!strcmp(argv[j],"--webhook") && morearg) {
+            Bot.webhook_url = argv[++j];
+        } else if (!strcmp(argv[j],"--webhook-listen") && morearg) {
+            Bot.webhook_listen = argv[++j];
+        } else if (!strcmp(argv[j],"--webhook-secret") && morearg) {
+            Bot.webhook_secret = argv[++j];
+        } else if (!strcmp(argv[j],"--metrics-listen") && morearg) {
+            Bot.metrics_listen = argv[++j];
         } else if (!strcmp(argv[j],"--dbfile") && morearg) {
             Bot.dbfile = argv[++j];
+        } else if (!strcmp(argv[j],"--config") && morearg) {
+            Bot.config_file = argv[++j];
         } else if (!(flags & TB_FLAGS_IGNORE_BAD_ARG)) {
             printf(
             "Usage: %s [--apikey <apikey>] [--debug] [--verbose] "
-            "[--dbfile <filename>]"
+            "[--dbfile <filename>] [--api-url <url>] [--webhook <url>] "
+            "[--webhook-listen <addr>] [--webhook-secret <token>] "
+            "[--metrics-listen <addr>] [--config <file>]"
             "\n",argv[0]);
             exit(1);
         }
     }
 
+    /* Calls go to "<apiurl>/bot<token>/...": with a trailing slash the
+     * local Bot API server would get "//bot<token>" and reject it. */
+    sds apiurl = sdsnew(Bot.apiurl);
+    while (sdslen(apiurl) && apiurl[sdslen(apiurl)-1] == '/')
+        sdsrange(apiurl,0,-2);
+    Bot.apiurl = apiurl;
+
+    sds err = NULL;
+    if (!configLoad(Bot.config_file,&err)) {
+        printf("%s\n", err);
+        exit(1);
+    }
+
     /* Initializations. Note that we don't redefine the SQLite allocator,
      * since SQLite errors are always handled by Stonky anyway. */
     curl_global_init(CURL_GLOBAL_DEFAULT);
-    if (Bot.apikey == NULL) readApiKeyFromFile();
-    if (Bot.apikey == NULL) {
+    httpPoolInit();
+    rlInit();
+    if (Bot.numbots == 0) readApiKeyFromFile();
+    if (Bot.numbots == 0) {
         printf("Provide a bot API key via --apikey or storing a file named "
                "apikey.txt in the bot working directory.\n");
         exit(1);
     }
+    botMetricsInit();
     resetBotStats();
     DbHandle = dbInit(createdb_query);
     if (DbHandle == NULL) exit(1);
     cJSON_Hooks jh = {.malloc_fn = xmalloc, .free_fn = xfree};
     cJSON_InitHooks(&jh);
+    signal(SIGUSR1,botSigusr1Handler);
+    signal(SIGHUP,botSighupHandler);
+    signal(SIGTERM,botSigtermHandler);
+    signal(SIGINT,botSigtermHandler);
+    char flightpath[64];
+    snprintf(flightpath,sizeof(flightpath),"teleterm-flight-%d.txt",
+             (int)getpid());
+    flightInit(flightpath);
+    if (Bot.metrics_listen) botMetricsStart(Bot.metrics_listen);
+
+    /* Setup the bots, caching their username as side effect. */
+    for (int j = 0; j < Bot.numbots; j++) {
+        botSetCurrent(Bot.bots[j]);
+        botGetUsername();
+        if (Bot.init_callback) Bot.init_callback(DbHandle,Bot.bots[j]);
+    }
+    botSetCurrent(NULL);
+    if (Bot.numbots > 1) printf("Serving %d bots\n", Bot.numbots);
+
+    /* The cron callback is just a periodic timer. */
+    static timerEvent cron;
+    if (Bot.cron_callback) {
+        timerInit(&cron,botCron,NULL);
+        timerAdd(&cron,1000,1000);
+    }
 
     /* Enter the infinite loop handling the bot. */
-    botMain();
+    if (Bot.webhook_url || Bot.webhook_listen) {
+        if (Bot.webhook_listen == NULL) Bot.webhook_listen = ":8443";
+        botMainWebhook();
+    } else {
+        botMain();
+    }
     return 0;
 }
@@ -10,10 +10,28 @@
 #include "sds.h"
 #include "sqlite_wrap.h"
 #include "cJSON.h"
+#include "trace.h"
 
 #define TB_FLAGS_NONE 0
 #define TB_FLAGS_IGNORE_BAD_ARG (1<<0)
 
+#define TB_MAX_BOTS 64
+
+/* One of the bots served by the process: --apikey can be given more than
+ * once to serve several bots with the same HTTP connections, threads and
+ * database. Requests are always served on behalf of a bot, see
+ * botCurrent(). */
+typedef struct BotInstance {
+    int id;             /* Position in the --apikey list, from 0. */
+    sds apikey;         /* Telegram API key of the bot. */
+    sds username;       /* Bot username from getMe call. */
+    sds kvprefix;       /* Prefix of the bot keys in the KV store, empty
+                           for the first bot. */
+    sds webhook_secret; /* Secret token of its webhook requests. */
+    int64_t offset;     /* Last update processed via getUpdates. */
+    void *privdata;     /* State of the bot, owned by the application. */
+} BotInstance;
+
 /* This structure is passed to the thread processing a given user request,
  * it's up to the thread to free it once it is done. */
 typedef struct BotRequest {
@@ -23,7 +41,8 @@ typedef struct BotRequest {
     sds from_username;  /* Username of the user sending the message. */
     int64_t target;     /* Target channel/user where to reply. */
     int64_t msg_id;     /* Message ID. */
-    sds *argv;          /* Request split to single words. */
+    sds *argv;          /* Request split to single words, NULL until
+                           botRequestArgv() is called. */
     int argc;           /* Number of words. */
     int file_type;      /* TB_FILE_TYPE_* */
     sds file_id;        /* File ID if a file is present in the message.
@@ -38,14 +57,28 @@ typedef struct BotRequest {
     int is_callback;    /* True if this is a callback query (button press). */
     sds callback_id;    /* Callback query ID for answering. */
     sds callback_data;  /* Callback data from button. */
+    Trace trace;        /* Per-stage timestamps, see trace.h. */
+    BotInstance *bot;   /* The bot that received the request. */
 } BotRequest;
 
 /* Bot callback type. This must be registed when the bot is initialized.
  * Each time the bot receives a command / message matching the list of
  * trigger strings, it starts a thread and calls this callback. */
 typedef void (*TBRequestCallback)(sqlite3 *dbhandle, BotRequest *br);
+
+/* Called once per second by the main loop thread, if not NULL. Other
+ * schedules can use the timers of timer.h directly. */
 typedef void (*TBCronCallback)(sqlite3 *dbhandle);
 
+/* Called once per bot at startup, before any request is served, so that
+ * the application can set up the bot state in bot->privdata. */
+typedef void (*TBInitCallback)(sqlite3 *dbhandle, BotInstance *bot);
+
+/* Called once per bot by a graceful shutdown (see botShutdown()), after the
+ * requests in flight completed, so that the application can save the state
+ * it wants back after a restart. */
+typedef void (*TBShutdownCallback)(sqlite3 *dbhandle, BotInstance *bot);
+
 /* Type of request used as arugment of the request callback. */
 #define TB_TYPE_UNKNOWN 0
 #define TB_TYPE_PRIVATE 1
@@ -72,25 +105,40 @@ void *xmalloc(size_t size);
 void *xrealloc(void *ptr, size_t size);
 void xfree(void *ptr);
 
+/* Utils. */
+int strmatch(const char *pattern, int patternLen,
+             const char *string, int stringLen, int nocase);
+
 /* HTTP */
 sds makeHTTPGETCallOpt(const char *url, int *resptr, char **optlist, int optnum);
 sds makeHTTPGETCall(const char *url, int *resptr);
 
 /* Telegram bot API. */
 
-int startBot(char *createdb_query, int argc, char **argv, int flags, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers);
+int startBot(char *createdb_query, int argc, char **argv, int flags, TBInitCallback init_callback, TBRequestCallback req_callback, TBCronCallback cron_callback, char **triggers);
+BotInstance *botCurrent(void);
+void botSetCurrent(BotInstance *bot);
 sds makeGETBotRequest(const char *action, int *resptr, char **optlist, int numopt);
 int botSendMessageAndGetInfo(int64_t target, sds text, int64_t reply_to, int64_t *chat_id, int64_t *message_id);
 int botSendMessage(int64_t target, sds text, int64_t reply_to);
 int botEditMessageText(int64_t chat_id, int message_id, sds text);
 int botSendMessageWithKeyboard(int64_t target, sds text, const char *parse_mode, const char *btn_text, const char *btn_data, int64_t *msg_id);
 int botEditMessageTextWithKeyboard(int64_t chat_id, int64_t message_id, sds text, const char *parse_mode, const char *btn_text, const char *btn_data);
+int botSendMessageWithMarkup(int64_t target, sds text, const char *parse_mode, const char *markup, int64_t *msg_id);
+int botEditMessageTextWithMarkup(int64_t chat_id, int64_t message_id, sds text, const char *parse_mode, const char *markup);
+int botDeleteMessage(int64_t chat_id, int64_t message_id);
+int botDeleteMessages(int64_t chat_id, const int64_t *ids, int count, int64_t *failed);
 int botAnswerCallbackQuery(const char *callback_id);
 int botGetFile(BotRequest *br, const char *target_filename);
 char *botGetUsername(void);
 void freeBotRequest(BotRequest *br);
+sds *botRequestArgv(BotRequest *br, int *argc);
+int botThreadStart(void *(*fn)(void *), void *arg);
+void botShutdown(int restart);
+void botSetShutdownCallback(TBShutdownCallback cb);
 
 /* Database. */
+sqlite3 *dbInit(char *createdb_query);
 int kvSetLen(sqlite3 *dbhandle, const char *key, const char *value, size_t vlen, int64_t expire);
 int kvSet(sqlite3 *dbhandle, const char *key, const char *value, int64_t expire);
 sds kvGet(sqlite3 *dbhandle, const char *key);
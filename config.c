@@ -0,0 +1,159 @@
+/*
+ * config.c - Runtime settings, reloadable without restarting
+ *
+ * The settings are parsed once into an immutable Config snapshot, and
+ * published with an atomic pointer store: the readers, that are on the
+ * hot path of every screen refresh, only do an atomic pointer load, and
+ * never see a half updated configuration. A reload (SIGHUP, or the .reload
+ * command) parses the file into a new snapshot and swaps it in. If the
+ * file has errors nothing changes.
+ *
+ * Old snapshots may still be in use by other threads when a reload swaps
+ * them out, and reloads are rare and small, so they are never freed.
+ *
+ * The file has one "name value" setting per line, '#' starts a comment:
+ *
+ *   visible-lines 40
+ *   split-messages no
+ *   watch-idle 600
+ *   http-timeout 15
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "config.h"
+#include "xmalloc.h"
+
+static const Config Defaults = {
+    .visible_lines = 40,
+    .split_messages = 0,
+    .watch_idle = 600,
+    .http_timeout = 15000,
+};
+
+static _Atomic(const Config *) Current = &Defaults;
+static pthread_mutex_t ReloadLock = PTHREAD_MUTEX_INITIALIZER;
+static sds ConfigPath = NULL;
+
+const Config *configGet(void) {
+    return atomic_load_explicit(&Current, memory_order_acquire);
+}
+
+/* Parse a positive integer in the range min-max. Returns 0 on error. */
+static int configParseInt(const char *s, int min, int max, int *value) {
+    char *end;
+    long v = strtol(s, &end, 10);
+    if (end == s || *end != '\0' || v < min || v > max) return 0;
+    *value = (int)v;
+    return 1;
+}
+
+static int configParseBool(const char *s, int *value) {
+    if (!strcmp(s, "1") || !strcasecmp(s, "yes") || !strcasecmp(s, "true")) {
+        *value = 1;
+    } else if (!strcmp(s, "0") || !strcasecmp(s, "no") ||
+               !strcasecmp(s, "false"))
+    {
+        *value = 0;
+    } else {
+        return 0;
+    }
+    return 1;
+}
+
+/* Apply a setting to 'c'. Returns 0 if the name or the value is not
+ * valid. Environment variables use the same parser, with lenient
+ * handling of invalid values for compatibility: see configFromEnv(). */
+static int configSet(Config *c, const char *name, const char *value) {
+    int secs;
+    if (!strcasecmp(name, "visible-lines"))
+        return configParseInt(value, 1, 1000, &c->visible_lines);
+    if (!strcasecmp(name, "split-messages"))
+        return configParseBool(value, &c->split_messages);
+    if (!strcasecmp(name, "watch-idle"))
+        return configParseInt(value, 1, 86400, &c->watch_idle);
+    if (!strcasecmp(name, "http-timeout")) {
+        if (!configParseInt(value, 1, 300, &secs)) return 0;
+        c->http_timeout = secs * 1000;
+        return 1;
+    }
+    return 0;
+}
+
+/* The settings also available as environment variables. */
+static void configFromEnv(Config *c) {
+    static const char *vars[][2] = {
+        {"TELETERM_VISIBLE_LINES", "visible-lines"},
+        {"TELETERM_SPLIT_MESSAGES", "split-messages"},
+        {"TELETERM_WATCH_IDLE", "watch-idle"},
+        {"TELETERM_HTTP_TIMEOUT", "http-timeout"},
+    };
+    for (size_t j = 0; j < sizeof(vars)/sizeof(vars[0]); j++) {
+        const char *v = getenv(vars[j][0]);
+        if (v == NULL) continue;
+        /* Invalid values were always ignored: keep doing so. */
+        Config tmp = *c;
+        if (configSet(&tmp, vars[j][1], v)) *c = tmp;
+    }
+}
+
+/* Parse the file into 'c'. Returns 0 on error, setting *err. */
+static int configFromFile(Config *c, const char *path, sds *err) {
+    FILE *fp = fopen(path, "r");
+    if (fp == NULL) {
+        *err = sdscatprintf(sdsempty(), "Can't open %s", path);
+        return 0;
+    }
+    char buf[1024];
+    int linenum = 0, ok = 1;
+    while (ok && fgets(buf, sizeof(buf), fp) != NULL) {
+        linenum++;
+        sds line = sdstrim(sdsnew(buf), " \t\r\n");
+        if (sdslen(line) && line[0] != '#') {
+            int argc;
+            sds *argv = sdssplitargs(line, &argc);
+            if (argv == NULL || argc != 2 || !configSet(c, argv[0], argv[1])) {
+                *err = sdscatprintf(sdsempty(), "%s:%d: invalid setting '%s'",
+                                    path, linenum, line);
+                ok = 0;
+            }
+            if (argv) sdsfreesplitres(argv, argc);
+        }
+        sdsfree(line);
+    }
+    fclose(fp);
+    return ok;
+}
+
+int configLoad(const char *path, sds *err) {
+    pthread_mutex_lock(&ReloadLock);
+    Config c = Defaults;
+    configFromEnv(&c);
+    int ok = path == NULL || configFromFile(&c, path, err);
+    if (ok) {
+        Config *snapshot = xmalloc(sizeof(*snapshot));
+        *snapshot = c;
+        atomic_store_explicit(&Current, snapshot, memory_order_release);
+        if (path != ConfigPath) {
+            sds newpath = path ? sdsnew(path) : NULL;
+            sdsfree(ConfigPath);
+            ConfigPath = newpath;
+        }
+    }
+    pthread_mutex_unlock(&ReloadLock);
+    return ok;
+}
+
+int configReload(sds *err) {
+    pthread_mutex_lock(&ReloadLock);
+    sds path = ConfigPath ? sdsdup(ConfigPath) : NULL;
+    pthread_mutex_unlock(&ReloadLock);
+    int ok = configLoad(path, err);
+    sdsfree(path);
+    return ok;
+}
@@ -0,0 +1,31 @@
+#ifndef CONFIG_H
+#define CONFIG_H
+
+#include "sds.h"
+
+/* The runtime settings. A snapshot is never modified once published:
+ * a reload publishes a new one. */
+typedef struct Config {
+    int visible_lines;      /* Terminal lines shown per screen. */
+    int split_messages;     /* Split long screens instead of truncating. */
+    int watch_idle;         /* Seconds after which .watch-screen stops. */
+    int http_timeout;       /* Bot API call timeout, milliseconds. */
+} Config;
+
+/* Return the current snapshot. Just an atomic pointer load, so it can be
+ * called on every use: callers needing several settings consistent with
+ * each other should read them from the same snapshot. Snapshots are
+ * never freed, so the pointer stays valid after a reload. */
+const Config *configGet(void);
+
+/* Load the settings from the defaults, the TELETERM_* environment
+ * variables and the file 'path' (may be NULL), in this order, and publish
+ * them. The path is remembered for configReload(). Returns 1 on success,
+ * otherwise 0 with the reason in *err (to free), and the current settings
+ * are left untouched. */
+int configLoad(const char *path, sds *err);
+
+/* Load again the file given to configLoad(). Same return values. */
+int configReload(sds *err);
+
+#endif
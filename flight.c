@@ -0,0 +1,289 @@
+/*
+ * flight.c - Flight recorder of recent events
+ *
+ * Every thread records what it is doing (Bot API calls, tmux commands,
+ * lock waits, errors) in its own fixed size ring of events, so recording
+ * needs no locks. The rings are taken from a static pool: a thread gets
+ * one the first time it records something, and gives it back when it
+ * exits, so the short lived request threads don't need allocations and
+ * their last events are still there after they exit, until the ring is
+ * reused by a new thread.
+ *
+ * The rings are dumped to a file on SIGUSR2, or when the process crashes.
+ * The dump is done from the signal handler, so it only uses async signal
+ * safe calls: open(), write() and a hand written number formatter. It
+ * reads the rings while they are written, so the last event of a busy
+ * thread may be garbled, which is fine for a debugging aid.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+
+#include "flight.h"
+
+#define FLIGHT_EVENTS 256       /* Events per thread. Power of two. */
+#define FLIGHT_RINGS 64         /* Threads recording at the same time. */
+
+typedef struct flightEvent {
+    uint64_t time;              /* Monotonic time, nanoseconds. */
+    int64_t value;
+    uint32_t duration;          /* Microseconds. */
+    uint16_t type;
+    char what[42];
+} flightEvent;
+
+typedef struct flightRing {
+    _Atomic int in_use;         /* Owned by a running thread. */
+    long tid;                   /* Thread ID of the last owner. */
+    uint64_t released;          /* When the last owner exited. */
+    _Atomic uint64_t head;      /* Total number of events recorded. */
+    flightEvent events[FLIGHT_EVENTS];
+} flightRing;
+
+static flightRing Rings[FLIGHT_RINGS];
+static _Thread_local flightRing *MyRing = NULL;
+static pthread_once_t KeyOnce = PTHREAD_ONCE_INIT;
+static pthread_key_t RingKey;
+static _Atomic uint64_t Dropped = 0;    /* Events with no ring available. */
+static char DumpPath[256];
+
+static const char *TypeNames[FLIGHT_TYPES] = {
+    "request", "done", "http", "tmux", "lock", "error"
+};
+
+static uint64_t flightNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000000 + ts.tv_nsec;
+}
+
+static long flightTid(void) {
+#ifdef __linux__
+    return syscall(SYS_gettid);
+#elif defined(__APPLE__)
+    uint64_t id;
+    pthread_threadid_np(NULL,&id);
+    return (long)id;
+#else
+    return (long)getpid();
+#endif
+}
+
+/* Thread exit: give the ring back to the pool. */
+static void flightRelease(void *arg) {
+    flightRing *r = arg;
+    r->released = flightNow();
+    atomic_store_explicit(&r->in_use,0,memory_order_release);
+}
+
+static void flightCreateKey(void) {
+    pthread_key_create(&RingKey,flightRelease);
+}
+
+/* Take the free ring that was released first, so that the events of the
+ * threads that exited most recently are preserved as long as possible.
+ * The events of the previous owner are discarded. */
+static flightRing *flightClaim(void) {
+    pthread_once(&KeyOnce,flightCreateKey);
+    while(1) {
+        flightRing *best = NULL;
+        for (int j = 0; j < FLIGHT_RINGS; j++) {
+            flightRing *r = &Rings[j];
+            if (atomic_load_explicit(&r->in_use,memory_order_relaxed))
+                continue;
+            if (best == NULL || r->released < best->released) best = r;
+        }
+        if (best == NULL) return NULL;
+        int expected = 0;
+        if (atomic_compare_exchange_strong(&best->in_use,&expected,1)) {
+            best->tid = flightTid();
+            atomic_store_explicit(&best->head,0,memory_order_release);
+            pthread_setspecific(RingKey,best);
+            return best;
+        }
+    }
+}
+
+void flightRecord(int type, const char *what, int64_t value, uint64_t duration) {
+    flightRing *r = MyRing;
+    if (r == NULL) {
+        r = MyRing = flightClaim();
+        if (r == NULL) {
+            atomic_fetch_add_explicit(&Dropped,1,memory_order_relaxed);
+            return;
+        }
+    }
+
+    uint64_t head = atomic_load_explicit(&r->head,memory_order_relaxed);
+    flightEvent *e = &r->events[head & (FLIGHT_EVENTS-1)];
+    e->time = flightNow();
+    e->value = value;
+    e->duration = duration > UINT32_MAX ? UINT32_MAX : duration;
+    e->type = type;
+    size_t j = 0;
+    if (what) {
+        for (; j < sizeof(e->what)-1 && what[j]; j++) e->what[j] = what[j];
+    }
+    e->what[j] = '\0';
+    atomic_store_explicit(&r->head,head+1,memory_order_release);
+}
+
+/* ============================================================================
+ * Dump, async signal safe
+ * ========================================================================= */
+
+typedef struct flightBuf {
+    char buf[256];
+    size_t len;
+} flightBuf;
+
+static void fbCat(flightBuf *b, const char *s) {
+    while (*s && b->len < sizeof(b->buf)) b->buf[b->len++] = *s++;
+}
+
+/* Append 'v' in decimal, left padded with zeros to 'width' digits. */
+static void fbNum(flightBuf *b, uint64_t v, int width) {
+    char tmp[24];
+    int n = 0;
+    do {
+        tmp[n++] = '0' + v % 10;
+        v /= 10;
+    } while (v && n < (int)sizeof(tmp));
+    while (n < width && n < (int)sizeof(tmp)) tmp[n++] = '0';
+    while (n && b->len < sizeof(b->buf)) b->buf[b->len++] = tmp[--n];
+}
+
+static void fbSigned(flightBuf *b, int64_t v) {
+    if (v < 0) {
+        fbCat(b,"-");
+        fbNum(b,-(uint64_t)v,0);
+    } else {
+        fbNum(b,v,0);
+    }
+}
+
+/* Append 's' truncated or padded with spaces to 'width' chars. */
+static void fbPad(flightBuf *b, const char *s, size_t width) {
+    size_t start = b->len;
+    fbCat(b,s);
+    if (b->len > start + width) b->len = start + width;
+    while (b->len < start + width && b->len < sizeof(b->buf))
+        b->buf[b->len++] = ' ';
+}
+
+static void fbFlush(flightBuf *b, int fd) {
+    ssize_t nwritten = write(fd,b->buf,b->len);
+    (void)nwritten;
+    b->len = 0;
+}
+
+void flightDump(int fd) {
+    uint64_t now = flightNow();
+    flightBuf b = {.len = 0};
+
+    fbCat(&b,"Flight recorder of process ");
+    fbNum(&b,getpid(),0);
+    fbCat(&b,", times in seconds before the dump. Dropped events: ");
+    fbNum(&b,atomic_load(&Dropped),0);
+    fbCat(&b,"\n");
+    fbFlush(&b,fd);
+
+    for (int j = 0; j < FLIGHT_RINGS; j++) {
+        flightRing *r = &Rings[j];
+        uint64_t head = atomic_load_explicit(&r->head,memory_order_acquire);
+        if (head == 0) continue;
+
+        fbCat(&b,"\nThread ");
+        fbNum(&b,r->tid,0);
+        fbCat(&b,atomic_load(&r->in_use) ? " (running)\n" : " (exited)\n");
+        fbFlush(&b,fd);
+
+        uint64_t first = head > FLIGHT_EVENTS ? head - FLIGHT_EVENTS : 0;
+        for (uint64_t i = first; i < head; i++) {
+            flightEvent *e = &r->events[i & (FLIGHT_EVENTS-1)];
+            uint64_t ago = now > e->time ? (now - e->time) / 1000 : 0;
+            fbCat(&b,"  -");
+            fbNum(&b,ago/1000000,0);
+            fbCat(&b,".");
+            fbNum(&b,ago%1000000,6);
+            fbCat(&b," ");
+            fbPad(&b,e->type < FLIGHT_TYPES ? TypeNames[e->type] : "?",8);
+            fbPad(&b,e->what,24);
+            if (e->type == FLIGHT_HTTP || e->type == FLIGHT_TMUX ||
+                e->type == FLIGHT_LOCK)
+            {
+                fbCat(&b," value=");
+                fbSigned(&b,e->value);
+            }
+            if (e->duration) {
+                fbCat(&b," duration=");
+                fbNum(&b,e->duration,0);
+                fbCat(&b,"us");
+            }
+            fbCat(&b,"\n");
+            fbFlush(&b,fd);
+        }
+    }
+}
+
+/* Dump the recorder into DumpPath. */
+static void flightDumpToFile(void) {
+    int fd = open(DumpPath,O_WRONLY|O_CREAT|O_TRUNC,0600);
+    if (fd == -1) return;
+    flightDump(fd);
+    close(fd);
+
+    flightBuf b = {.len = 0};
+    fbCat(&b,"Flight recorder dumped to ");
+    fbCat(&b,DumpPath);
+    fbCat(&b,"\n");
+    fbFlush(&b,STDERR_FILENO);
+}
+
+static void flightSigusr2Handler(int sig) {
+    (void)sig;
+    int saved_errno = errno;
+    flightDumpToFile();
+    errno = saved_errno;
+}
+
+/* The crash handler is installed with SA_RESETHAND, so raising the signal
+ * again terminates the process as it would have without the handler. */
+static void flightCrashHandler(int sig) {
+    flightDumpToFile();
+    raise(sig);
+}
+
+void flightInit(const char *path) {
+    snprintf(DumpPath,sizeof(DumpPath),"%s",path);
+
+    /* Stack overflows can only be handled on an alternate stack. Only
+     * the main thread gets one: request threads are short lived. */
+    static char altstack[65536];
+    stack_t ss = {.ss_sp = altstack, .ss_size = sizeof(altstack)};
+    sigaltstack(&ss,NULL);
+
+    struct sigaction act;
+    memset(&act,0,sizeof(act));
+    sigemptyset(&act.sa_mask);
+    act.sa_handler = flightSigusr2Handler;
+    act.sa_flags = SA_RESTART;
+    sigaction(SIGUSR2,&act,NULL);
+
+    int crashsigs[] = {SIGSEGV, SIGBUS, SIGILL, SIGFPE, SIGABRT};
+    act.sa_handler = flightCrashHandler;
+    act.sa_flags = SA_RESETHAND|SA_ONSTACK;
+    for (size_t j = 0; j < sizeof(crashsigs)/sizeof(crashsigs[0]); j++)
+        sigaction(crashsigs[j],&act,NULL);
+}
@@ -0,0 +1,28 @@
+#ifndef FLIGHT_H
+#define FLIGHT_H
+
+#include <stdint.h>
+
+/* Event types. */
+#define FLIGHT_REQUEST 0    /* Request started: what = request text. */
+#define FLIGHT_DONE 1       /* Request done: duration = time to serve it. */
+#define FLIGHT_HTTP 2       /* Bot API call: value = HTTP code or 0. */
+#define FLIGHT_TMUX 3       /* tmux command: value = exit status. */
+#define FLIGHT_LOCK 4       /* Lock acquired: duration = time waited. */
+#define FLIGHT_ERROR 5      /* Something failed: what = description. */
+#define FLIGHT_TYPES 6
+
+/* Record an event in the ring of the calling thread. 'what' is truncated
+ * if too long, 'duration' is in microseconds. This is cheap enough to be
+ * called on every operation: no locks, no allocations, no syscalls except
+ * the first time a thread records an event. */
+void flightRecord(int type, const char *what, int64_t value, uint64_t duration);
+
+/* Install the handlers dumping the recorder to 'path' on SIGUSR2 and
+ * when the process crashes. */
+void flightInit(const char *path);
+
+/* Write the recorded events of all threads to 'fd'. Async signal safe. */
+void flightDump(int fd);
+
+#endif
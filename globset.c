@@ -0,0 +1,261 @@
+/*
+ * globset.c - Glob patterns compiled to match in linear time
+ *
+ * strmatch() backtracks: every '*' retries the rest of the pattern at all
+ * the following positions, so a pattern with k stars can take O(n^k) steps
+ * on a string of n characters. Patterns matched again and again, like the
+ * triggers checked against every group message, are instead compiled once
+ * into a single NFA for all of them, simulated with bit parallelism.
+ *
+ * Every pattern is a sequence of character classes ('?' is the class of
+ * all the bytes, a literal the class of a single one), and the state of a
+ * pattern is how many classes were matched so far: N classes, N+1 states,
+ * one bit each, and the states of all the patterns side by side in one
+ * bitmap. A '*' doesn't need a class: it makes the state it precedes loop
+ * on any byte. For every byte c of the string the new bitmap is:
+ *
+ *   D = ((D << 1) & Class[c]) | (D & Star)
+ *
+ * Class[c] has the bit of state i+1 set if c belongs to the class i of the
+ * pattern, so the first state of a pattern can't be entered from the last
+ * one of the previous pattern, and Star has the bits of the looping states.
+ * The string matches if the last state of some pattern is set at the end.
+ * That is one pass over the string for the whole set, whatever the
+ * patterns, with two ways out early: no state left, or the last state of
+ * a pattern ending with '*' reached.
+ *
+ * The syntax is the one of strmatch(): '*', '?', '[abc]', '[a-z]', '[^a]'
+ * and '\' to escape the next character, and the results are the same,
+ * but for the empty string, that is matched by "*" here, and for the case
+ * insensitive ranges with bytes over 127, where strmatch() depends on how
+ * the C library lowers negative chars.
+ */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "globset.h"
+#include "xmalloc.h"
+
+#define GLOB_STACK_WORDS 8      /* States matched without allocating. */
+
+struct globSet {
+    int words;              /* Size of the bitmaps, in 64 bit words. */
+    uint64_t *class;        /* 256 bitmaps, the states entered by a byte. */
+    uint64_t *star;         /* States looping on any byte. */
+    uint64_t *initial;      /* The first state of every pattern. */
+    uint64_t *final;        /* The last state of every pattern. */
+    uint64_t *sure;         /* Final states that loop: a match for sure. */
+};
+
+/* A byte class, one bit per byte value. */
+typedef struct globClass {
+    uint64_t bits[4];
+} globClass;
+
+static void classAdd(globClass *c, int byte) {
+    c->bits[(byte >> 6) & 3] |= 1ULL << (byte & 63);
+}
+
+/* strmatch() compares chars, that may be signed, and lowers the case with
+ * tolower(), that in the C locale only changes ASCII letters: so do we. */
+static int lower(int c) {
+    return c >= 'A' && c <= 'Z' ? c + ('a'-'A') : c;
+}
+
+/* Add the byte, or, with 'nocase', the byte in both cases. */
+static void classAddChar(globClass *c, int byte, int nocase) {
+    classAdd(c, (unsigned char)byte);
+    if (nocase && lower(byte) != byte) classAdd(c, lower(byte));
+    if (nocase && byte >= 'a' && byte <= 'z') classAdd(c, byte - ('a'-'A'));
+}
+
+/* Parse a pattern. Returns the number of classes. If 'classes' is not
+ * NULL they are stored there, and the looping states flagged in 'star',
+ * that has room for one more element than the classes. */
+static int globParse(const char *p, size_t len, int nocase,
+                     globClass *classes, unsigned char *star)
+{
+    int n = 0;
+    while (len) {
+        if (*p == '*') {
+            if (star) star[n] = 1;
+            p++;
+            len--;
+            continue;
+        }
+        globClass c;
+        memset(&c, 0, sizeof(c));
+        if (*p == '?') {
+            memset(&c, 0xff, sizeof(c));
+        } else if (*p == '[') {
+            p++;
+            len--;
+            int not = len && *p == '^';
+            if (not) {
+                p++;
+                len--;
+            }
+            while (len && *p != ']') {
+                if (*p == '\\' && len >= 2) {
+                    /* Escaped bytes always match exactly. */
+                    p++;
+                    len--;
+                    classAdd(&c, (unsigned char)*p);
+                } else if (len >= 3 && p[1] == '-') {
+                    int start = (signed char)p[0], end = (signed char)p[2];
+                    if (start > end) {
+                        int t = start;
+                        start = end;
+                        end = t;
+                    }
+                    if (nocase) {
+                        start = lower(start);
+                        end = lower(end);
+                    }
+                    for (int b = -128; b < 128; b++) {
+                        int v = nocase ? lower(b) : b;
+                        if (v >= start && v <= end) classAdd(&c, b & 0xff);
+                    }
+                    p += 2;
+                    len -= 2;
+                } else {
+                    classAddChar(&c, *p, nocase);
+                }
+                p++;
+                len--;
+            }
+            if (not)
+                for (int j = 0; j < 4; j++) c.bits[j] = ~c.bits[j];
+            /* Unterminated classes end with the pattern. */
+            if (len == 0) {
+                if (classes) classes[n] = c;
+                n++;
+                break;
+            }
+        } else {
+            if (*p == '\\' && len >= 2) {
+                p++;
+                len--;
+            }
+            classAddChar(&c, *p, nocase);
+        }
+        if (classes) classes[n] = c;
+        n++;
+        p++;
+        len--;
+    }
+    return n;
+}
+
+static void bitSet(uint64_t *bitmap, int bit) {
+    bitmap[bit >> 6] |= 1ULL << (bit & 63);
+}
+
+globSet *globSetCompile(char **patterns, int nocase) {
+    /* Count the states first, to size the bitmaps. */
+    int states = 0;
+    for (int j = 0; patterns[j]; j++)
+        states += globParse(patterns[j], strlen(patterns[j]), nocase,
+                            NULL, NULL) + 1;
+
+    globSet *gs = xmalloc(sizeof(*gs));
+    gs->words = states ? (states+63)/64 : 1;
+    size_t size = sizeof(uint64_t) * gs->words;
+    gs->class = xmalloc(size*256);
+    gs->star = xmalloc(size);
+    gs->initial = xmalloc(size);
+    gs->final = xmalloc(size);
+    gs->sure = xmalloc(size);
+    memset(gs->class, 0, size*256);
+    memset(gs->star, 0, size);
+    memset(gs->initial, 0, size);
+    memset(gs->final, 0, size);
+    memset(gs->sure, 0, size);
+
+    int base = 0;
+    for (int j = 0; patterns[j]; j++) {
+        size_t len = strlen(patterns[j]);
+        int n = globParse(patterns[j], len, nocase, NULL, NULL);
+        globClass *classes = xmalloc(sizeof(globClass) * (n+1));
+        unsigned char *star = xmalloc(n+1);
+        memset(star, 0, n+1);
+        globParse(patterns[j], len, nocase, classes, star);
+
+        bitSet(gs->initial, base);
+        bitSet(gs->final, base+n);
+        if (star[n]) bitSet(gs->sure, base+n);
+        for (int i = 0; i <= n; i++)
+            if (star[i]) bitSet(gs->star, base+i);
+        for (int i = 0; i < n; i++) {
+            for (int b = 0; b < 256; b++) {
+                if (classes[i].bits[b >> 6] & (1ULL << (b & 63)))
+                    bitSet(gs->class + (size_t)b*gs->words, base+i+1);
+            }
+        }
+        xfree(classes);
+        xfree(star);
+        base += n+1;
+    }
+    return gs;
+}
+
+globSet *globSetCompileLen(const char *pattern, size_t len, int nocase) {
+    char *copy = xmalloc(len+1);
+    memcpy(copy, pattern, len);
+    copy[len] = '\0';
+    char *patterns[2] = {copy, NULL};
+    globSet *gs = globSetCompile(patterns, nocase);
+    xfree(copy);
+    return gs;
+}
+
+int globSetMatch(const globSet *gs, const char *s, size_t len) {
+    int words = gs->words;
+    uint64_t stackbuf[GLOB_STACK_WORDS];
+    uint64_t *d = words <= GLOB_STACK_WORDS ? stackbuf :
+                  xmalloc(sizeof(uint64_t) * words);
+    memcpy(d, gs->initial, sizeof(uint64_t) * words);
+
+    int match = 0;
+    for (size_t j = 0; j <= len; j++) {
+        /* Check the states reached so far. */
+        uint64_t any = 0, sure = 0;
+        for (int w = 0; w < words; w++) {
+            any |= d[w];
+            sure |= d[w] & gs->sure[w];
+        }
+        if (sure) {
+            match = 1;
+            break;
+        }
+        if (!any) break;
+        if (j == len) {
+            for (int w = 0; w < words; w++)
+                if (d[w] & gs->final[w]) match = 1;
+            break;
+        }
+
+        /* Advance by one byte. Go from the last word so that the carry
+         * is read before the word it comes from is updated. */
+        const uint64_t *class = gs->class + (size_t)(unsigned char)s[j]*words;
+        for (int w = words-1; w >= 0; w--) {
+            uint64_t shifted = d[w] << 1;
+            if (w) shifted |= d[w-1] >> 63;
+            d[w] = (shifted & class[w]) | (d[w] & gs->star[w]);
+        }
+    }
+    if (d != stackbuf) xfree(d);
+    return match;
+}
+
+void globSetFree(globSet *gs) {
+    if (gs == NULL) return;
+    xfree(gs->class);
+    xfree(gs->star);
+    xfree(gs->initial);
+    xfree(gs->final);
+    xfree(gs->sure);
+    xfree(gs);
+}
@@ -0,0 +1,23 @@
+#ifndef GLOBSET_H
+#define GLOBSET_H
+
+#include <stddef.h>
+
+/* A set of glob patterns compiled to be matched together, in linear time,
+ * see globset.c. The pattern syntax is the one of strmatch(). */
+typedef struct globSet globSet;
+
+/* Compile the NULL terminated array of patterns. If 'nocase' is true the
+ * letters match regardless of their case. */
+globSet *globSetCompile(char **patterns, int nocase);
+
+/* Same, for a single pattern of the given length. */
+globSet *globSetCompileLen(const char *pattern, size_t len, int nocase);
+
+/* Return 1 if the string matches at least one of the patterns, otherwise
+ * 0. The set is never modified: threads can share it. */
+int globSetMatch(const globSet *gs, const char *s, size_t len);
+
+void globSetFree(globSet *gs);
+
+#endif
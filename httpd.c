@@ -0,0 +1,494 @@
+/*
+ * httpd.c - Small embedded HTTP/1.1 server
+ *
+ * Single threaded and event driven: the owner calls httpServerPoll() in
+ * its loop. Connections are kept alive and pipelined requests are served
+ * in order. It is meant for a few local or trusted clients (Telegram
+ * webhook deliveries, metrics scrapers), not as a general web server:
+ * requests must fit in memory and chunked bodies are not supported.
+ *
+ * epoll(7) is used on Linux, poll(2) elsewhere.
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <netdb.h>
+#include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+
+#include "httpd.h"
+#include "botlib.h"
+
+#define HTTPD_MAX_REQUEST (1024*1024*4) /* Max header + body size. */
+#define HTTPD_MAX_CONN 256
+#define HTTPD_IDLE_TIMEOUT 120          /* Seconds. */
+
+typedef struct httpConn {
+    int fd;
+    sds rbuf;               /* Data read and not yet consumed. */
+    sds wbuf;               /* Data to write. */
+    int close_after_write;  /* Close once wbuf is flushed. */
+    time_t last_activity;
+} httpConn;
+
+struct httpServer {
+    int fd;                 /* Listening socket. */
+    int unixsock;           /* True if listening on a unix socket. */
+    sds unixpath;
+    httpHandler handler;
+    void *privdata;
+    httpConn *conns[HTTPD_MAX_CONN];
+    int wakefd[2];          /* Pipe written by httpServerWakeup(). */
+#ifdef __linux__
+    int epfd;
+#endif
+};
+
+/* ============================================================================
+ * Sockets
+ * ========================================================================= */
+
+static int httpSetNonBlock(int fd) {
+    int flags = fcntl(fd, F_GETFL);
+    if (flags == -1) return -1;
+    return fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int httpListen(const char *addr, int *unixsock) {
+    int fd;
+    *unixsock = 0;
+
+    if (!strncmp(addr, "unix:", 5)) {
+        struct sockaddr_un sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sun_family = AF_UNIX;
+        if (strlen(addr + 5) >= sizeof(sa.sun_path)) return -1;
+        strcpy(sa.sun_path, addr + 5);
+        unlink(sa.sun_path);
+        if ((fd = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) return -1;
+        if (bind(fd, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+            listen(fd, 128) == -1)
+        {
+            close(fd);
+            return -1;
+        }
+        *unixsock = 1;
+        return fd;
+    }
+
+    const char *colon = strrchr(addr, ':');
+    if (!colon) return -1;
+    sds host = sdsnewlen(addr, colon - addr);
+    if (sdslen(host) == 0) host = sdscat(host, "0.0.0.0");
+    /* Allow "[::1]:8080". */
+    if (host[0] == '[') {
+        sdsrange(host, 1, -1);
+        if (sdslen(host) && host[sdslen(host)-1] == ']')
+            sdsrange(host, 0, -2);
+    }
+
+    struct addrinfo hints, *ai;
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    int err = getaddrinfo(host, colon + 1, &hints, &ai);
+    sdsfree(host);
+    if (err) return -1;
+
+    fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd != -1) {
+        int yes = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == -1 ||
+            listen(fd, 128) == -1)
+        {
+            close(fd);
+            fd = -1;
+        }
+    }
+    freeaddrinfo(ai);
+    return fd;
+}
+
+/* ============================================================================
+ * Event loop registration
+ * ========================================================================= */
+
+#ifdef __linux__
+static void httpWatch(httpServer *srv, int fd, int writable, int add) {
+    struct epoll_event ee;
+    memset(&ee, 0, sizeof(ee));
+    ee.events = EPOLLIN | (writable ? EPOLLOUT : 0);
+    ee.data.fd = fd;
+    epoll_ctl(srv->epfd, add ? EPOLL_CTL_ADD : EPOLL_CTL_MOD, fd, &ee);
+}
+#else
+static void httpWatch(httpServer *srv, int fd, int writable, int add) {
+    /* With poll() the set of fds is rebuilt at every call. */
+    UNUSED(srv); UNUSED(fd); UNUSED(writable); UNUSED(add);
+}
+#endif
+
+httpServer *httpServerCreate(const char *addr, httpHandler handler, void *privdata) {
+    int unixsock;
+    int fd = httpListen(addr, &unixsock);
+    if (fd == -1) {
+        fprintf(stderr, "HTTP server: can't listen on %s: %s\n",
+                addr, strerror(errno));
+        return NULL;
+    }
+    httpSetNonBlock(fd);
+
+    httpServer *srv = xmalloc(sizeof(*srv));
+    memset(srv, 0, sizeof(*srv));
+    srv->fd = fd;
+    srv->unixsock = unixsock;
+    srv->unixpath = unixsock ? sdsnew(addr + 5) : NULL;
+    srv->handler = handler;
+    srv->privdata = privdata;
+#ifdef __linux__
+    srv->epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv->epfd == -1) {
+        close(fd);
+        sdsfree(srv->unixpath);
+        xfree(srv);
+        return NULL;
+    }
+#endif
+    httpWatch(srv, fd, 0, 1);
+    if (pipe(srv->wakefd) == 0) {
+        httpSetNonBlock(srv->wakefd[0]);
+        httpSetNonBlock(srv->wakefd[1]);
+        httpWatch(srv, srv->wakefd[0], 0, 1);
+    } else {
+        srv->wakefd[0] = srv->wakefd[1] = -1;
+    }
+    return srv;
+}
+
+static void httpCloseConn(httpServer *srv, httpConn *c) {
+#ifdef __linux__
+    epoll_ctl(srv->epfd, EPOLL_CTL_DEL, c->fd, NULL);
+#endif
+    for (int j = 0; j < HTTPD_MAX_CONN; j++)
+        if (srv->conns[j] == c) srv->conns[j] = NULL;
+    close(c->fd);
+    sdsfree(c->rbuf);
+    sdsfree(c->wbuf);
+    xfree(c);
+}
+
+void httpServerFree(httpServer *srv) {
+    if (!srv) return;
+    for (int j = 0; j < HTTPD_MAX_CONN; j++)
+        if (srv->conns[j]) httpCloseConn(srv, srv->conns[j]);
+    close(srv->fd);
+    if (srv->wakefd[0] != -1) {
+        close(srv->wakefd[0]);
+        close(srv->wakefd[1]);
+    }
+#ifdef __linux__
+    close(srv->epfd);
+#endif
+    if (srv->unixpath) unlink(srv->unixpath);
+    sdsfree(srv->unixpath);
+    xfree(srv);
+}
+
+static void httpAccept(httpServer *srv) {
+    while (1) {
+        int fd = accept(srv->fd, NULL, NULL);
+        if (fd == -1) return;
+
+        int slot;
+        for (slot = 0; slot < HTTPD_MAX_CONN; slot++)
+            if (srv->conns[slot] == NULL) break;
+        if (slot == HTTPD_MAX_CONN) {
+            close(fd);
+            continue;
+        }
+
+        httpSetNonBlock(fd);
+        if (!srv->unixsock) {
+            int yes = 1;
+            setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        }
+        httpConn *c = xmalloc(sizeof(*c));
+        c->fd = fd;
+        c->rbuf = sdsempty();
+        c->wbuf = sdsempty();
+        c->close_after_write = 0;
+        c->last_activity = time(NULL);
+        srv->conns[slot] = c;
+        httpWatch(srv, fd, 0, 1);
+    }
+}
+
+/* ============================================================================
+ * Requests parsing and replies
+ * ========================================================================= */
+
+const char *httpGetHeader(httpRequest *req, const char *name) {
+    for (int j = 0; j < req->numheaders; j++)
+        if (!strcasecmp(req->headers[j*2], name)) return req->headers[j*2+1];
+    return NULL;
+}
+
+static const char *httpStatusText(int status) {
+    switch (status) {
+    case 200: return "OK";
+    case 204: return "No Content";
+    case 400: return "Bad Request";
+    case 401: return "Unauthorized";
+    case 403: return "Forbidden";
+    case 404: return "Not Found";
+    case 405: return "Method Not Allowed";
+    case 413: return "Payload Too Large";
+    case 503: return "Service Unavailable";
+    default: return "Internal Server Error";
+    }
+}
+
+static void httpQueueReply(httpConn *c, int status, const char *ctype,
+                           const char *body, size_t len, int keepalive)
+{
+    c->wbuf = sdscatprintf(c->wbuf,
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n",
+        status, httpStatusText(status), ctype, len,
+        keepalive ? "keep-alive" : "close");
+    c->wbuf = sdscatlen(c->wbuf, body, len);
+    if (!keepalive) c->close_after_write = 1;
+}
+
+/* Parse and serve the complete requests in the connection buffer.
+ * Returns the number of requests served, or -1 if the connection must
+ * be closed because of a protocol error. */
+static int httpProcessInput(httpServer *srv, httpConn *c) {
+    int served = 0;
+
+    while (!c->close_after_write) {
+        char *hdr_end = strstr(c->rbuf, "\r\n\r\n");
+        if (!hdr_end) {
+            if (sdslen(c->rbuf) > HTTPD_MAX_REQUEST) return -1;
+            break;
+        }
+        size_t hdr_len = hdr_end - c->rbuf + 4;
+
+        int nlines;
+        sds *lines = sdssplitlen(c->rbuf, hdr_len - 4, "\r\n", 2, &nlines);
+        if (!lines || nlines < 1) {
+            sdsfreesplitres(lines, nlines);
+            return -1;
+        }
+
+        httpRequest req;
+        memset(&req, 0, sizeof(req));
+        int nparts;
+        sds *parts = sdssplitlen(lines[0], sdslen(lines[0]), " ", 1, &nparts);
+        if (nparts != 3 || strncmp(parts[2], "HTTP/1.", 7)) {
+            sdsfreesplitres(parts, nparts);
+            sdsfreesplitres(lines, nlines);
+            return -1;
+        }
+        int keepalive = !strcmp(parts[2], "HTTP/1.1");
+
+        req.headers = xmalloc(sizeof(sds) * 2 * nlines);
+        size_t content_length = 0;
+        for (int j = 1; j < nlines; j++) {
+            char *colon = strchr(lines[j], ':');
+            if (!colon) continue;
+            sds name = sdsnewlen(lines[j], colon - lines[j]);
+            sds value = sdsnew(colon + 1);
+            sdstrim(value, " \t");
+            if (!strcasecmp(name, "Content-Length"))
+                content_length = strtoul(value, NULL, 10);
+            else if (!strcasecmp(name, "Connection"))
+                keepalive = strcasecmp(value, "close") != 0;
+            req.headers[req.numheaders*2] = name;
+            req.headers[req.numheaders*2+1] = value;
+            req.numheaders++;
+        }
+        sdsfreesplitres(lines, nlines);
+
+        int complete = content_length <= HTTPD_MAX_REQUEST &&
+                       sdslen(c->rbuf) >= hdr_len + content_length;
+        if (complete) {
+            req.method = sdsdup(parts[0]);
+            char *q = strchr(parts[1], '?');
+            req.path = q ? sdsnewlen(parts[1], q - parts[1]) : sdsdup(parts[1]);
+            req.query = sdsnew(q ? q + 1 : "");
+            req.body = sdsnewlen(c->rbuf + hdr_len, content_length);
+            sdsrange(c->rbuf, hdr_len + content_length, -1);
+
+            httpResponse res = {200, "text/plain", sdsempty()};
+            srv->handler(&req, &res, srv->privdata);
+            httpQueueReply(c, res.status, res.content_type,
+                           res.body, sdslen(res.body), keepalive);
+            sdsfree(res.body);
+            sdsfree(req.method);
+            sdsfree(req.path);
+            sdsfree(req.query);
+            sdsfree(req.body);
+            served++;
+        }
+        sdsfreesplitres(parts, nparts);
+        for (int j = 0; j < req.numheaders*2; j++) sdsfree(req.headers[j]);
+        xfree(req.headers);
+
+        if (content_length > HTTPD_MAX_REQUEST) {
+            httpQueueReply(c, 413, "text/plain", "", 0, 0);
+            break;
+        }
+        if (!complete) break;
+    }
+    return served;
+}
+
+/* Write as much as possible of the output buffer. Returns -1 if the
+ * connection must be closed. */
+static int httpFlush(httpServer *srv, httpConn *c) {
+    while (sdslen(c->wbuf)) {
+        ssize_t n = write(c->fd, c->wbuf, sdslen(c->wbuf));
+        if (n == -1 && errno == EINTR) continue;
+        if (n == -1 && errno == EAGAIN) break;
+        if (n <= 0) return -1;
+        sdsrange(c->wbuf, n, -1);
+    }
+    if (sdslen(c->wbuf) == 0 && c->close_after_write) return -1;
+    httpWatch(srv, c->fd, sdslen(c->wbuf) != 0, 0);
+    return 0;
+}
+
+/* Serve a readable/writable event on a client connection. */
+static int httpHandleConn(httpServer *srv, httpConn *c, int readable) {
+    int served = 0;
+    if (readable) {
+        char buf[16384];
+        while (1) {
+            ssize_t n = read(c->fd, buf, sizeof(buf));
+            if (n == -1 && errno == EINTR) continue;
+            if (n == -1 && errno == EAGAIN) break;
+            if (n <= 0) {
+                httpCloseConn(srv, c);
+                return 0;
+            }
+            c->rbuf = sdscatlen(c->rbuf, buf, n);
+            if ((size_t)n < sizeof(buf)) break;
+        }
+        c->last_activity = time(NULL);
+        served = httpProcessInput(srv, c);
+        if (served == -1) {
+            httpCloseConn(srv, c);
+            return 0;
+        }
+    }
+    if (httpFlush(srv, c) == -1) httpCloseConn(srv, c);
+    return served;
+}
+
+static httpConn *httpFindConn(httpServer *srv, int fd) {
+    for (int j = 0; j < HTTPD_MAX_CONN; j++)
+        if (srv->conns[j] && srv->conns[j]->fd == fd) return srv->conns[j];
+    return NULL;
+}
+
+/* Close connections idle for too long. */
+static void httpCloseIdle(httpServer *srv) {
+    time_t now = time(NULL);
+    for (int j = 0; j < HTTPD_MAX_CONN; j++) {
+        httpConn *c = srv->conns[j];
+        if (c && now - c->last_activity > HTTPD_IDLE_TIMEOUT)
+            httpCloseConn(srv, c);
+    }
+}
+
+/* Consume the bytes written by httpServerWakeup(). */
+static void httpDrainWakeup(httpServer *srv) {
+    char buf[64];
+    while (read(srv->wakefd[0], buf, sizeof(buf)) > 0);
+}
+
+void httpServerWakeup(httpServer *srv) {
+    if (srv->wakefd[1] == -1) return;
+    ssize_t nwritten = write(srv->wakefd[1], "", 1);
+    (void)nwritten; /* A full pipe is a pending wakeup already. */
+}
+
+int httpServerPoll(httpServer *srv, int timeout) {
+    int served = 0;
+
+#ifdef __linux__
+    struct epoll_event events[64];
+    int n = epoll_wait(srv->epfd, events, 64, timeout);
+    if (n == -1) return errno == EINTR ? 0 : -1;
+    for (int j = 0; j < n; j++) {
+        int fd = events[j].data.fd;
+        if (fd == srv->fd) {
+            httpAccept(srv);
+            continue;
+        }
+        if (fd == srv->wakefd[0]) {
+            httpDrainWakeup(srv);
+            continue;
+        }
+        httpConn *c = httpFindConn(srv, fd);
+        if (!c) continue;
+        served += httpHandleConn(srv, c,
+            events[j].events & (EPOLLIN|EPOLLERR|EPOLLHUP));
+    }
+#else
+    struct pollfd pfd[HTTPD_MAX_CONN+2];
+    int nfds = 0;
+    pfd[nfds].fd = srv->fd;
+    pfd[nfds].events = POLLIN;
+    nfds++;
+    if (srv->wakefd[0] != -1) {
+        pfd[nfds].fd = srv->wakefd[0];
+        pfd[nfds].events = POLLIN;
+        nfds++;
+    }
+    for (int j = 0; j < HTTPD_MAX_CONN; j++) {
+        httpConn *c = srv->conns[j];
+        if (!c) continue;
+        pfd[nfds].fd = c->fd;
+        pfd[nfds].events = POLLIN | (sdslen(c->wbuf) ? POLLOUT : 0);
+        nfds++;
+    }
+    int n = poll(pfd, nfds, timeout);
+    if (n == -1) return errno == EINTR ? 0 : -1;
+    for (int j = 0; j < nfds; j++) {
+        if (!pfd[j].revents) continue;
+        if (pfd[j].fd == srv->fd) {
+            httpAccept(srv);
+            continue;
+        }
+        if (pfd[j].fd == srv->wakefd[0]) {
+            httpDrainWakeup(srv);
+            continue;
+        }
+        httpConn *c = httpFindConn(srv, pfd[j].fd);
+        if (!c) continue;
+        served += httpHandleConn(srv, c,
+            pfd[j].revents & (POLLIN|POLLERR|POLLHUP));
+    }
+#endif
+    httpCloseIdle(srv);
+    return served;
+}
@@ -0,0 +1,53 @@
+#ifndef HTTPD_H
+#define HTTPD_H
+
+#include "sds.h"
+
+/* A parsed HTTP request, valid only during the handler call. */
+typedef struct httpRequest {
+    sds method;         /* "GET", "POST", ... */
+    sds path;           /* Path without the query string. */
+    sds query;          /* Query string (without '?'), may be empty. */
+    sds body;           /* Request body, may be empty. */
+    sds *headers;       /* Alternating names and values. */
+    int numheaders;     /* Number of headers (half the array length). */
+} httpRequest;
+
+/* The reply the handler fills. The server sends 200 with an empty body
+ * unless the handler sets something else. */
+typedef struct httpResponse {
+    int status;
+    const char *content_type;
+    sds body;
+} httpResponse;
+
+typedef void (*httpHandler)(httpRequest *req, httpResponse *res, void *privdata);
+
+typedef struct httpServer httpServer;
+
+/* Listen on 'addr', that is "host:port", ":port", or "unix:/path/to/socket".
+ * Returns NULL on error, after logging the reason. */
+httpServer *httpServerCreate(const char *addr, httpHandler handler, void *privdata);
+
+/* Create a blocking listening socket for "host:port", ":port" or
+ * "unix:/path", and set *unixsock if it is a unix socket. Returns the
+ * file descriptor, or -1 on error. Used by httpServerCreate() and by
+ * the agent (agent.c). */
+int httpListen(const char *addr, int *unixsock);
+
+/* Wait up to 'timeout' milliseconds for events, and serve them.
+ * A timeout of -1 waits forever. Returns the number of requests served,
+ * or -1 on error. */
+int httpServerPoll(httpServer *srv, int timeout);
+
+/* Make a httpServerPoll() in progress, or the next one, return at once.
+ * Can be called from any thread. */
+void httpServerWakeup(httpServer *srv);
+
+/* Close all the connections and the listening socket. */
+void httpServerFree(httpServer *srv);
+
+/* Return the value of the header 'name' (case insensitive), or NULL. */
+const char *httpGetHeader(httpRequest *req, const char *name);
+
+#endif
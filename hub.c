@@ -0,0 +1,114 @@
+/*
+ * hub.c - Route the backend operations to local or remote terminals
+ *
+ * With --agents, the bot is a hub: besides its own terminals it lists and
+ * controls the terminals of teleterm agents running on other machines
+ * (see agent.c). Every TermInfo carries the name of the agent it belongs
+ * to in 'host', empty for local terminals, so the command handlers don't
+ * need to care where a terminal is: they call hub_*() instead of the
+ * backend functions, and the call is routed accordingly.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hub.h"
+#include "agent.h"
+#include "flight.h"
+#include "xmalloc.h"
+
+#define HUB_MAX_AGENTS 64
+#define HUB_LIST_TIMEOUT 5000
+
+static agentClient *Agents[HUB_MAX_AGENTS];
+static int AgentCount = 0;
+
+int hub_init(const char *agents, const char *secret) {
+    int count;
+    sds *items = sdssplitlen(agents, strlen(agents), ",", 1, &count);
+    int ok = 1;
+    for (int i = 0; i < count && ok; i++) {
+        char *eq = strchr(items[i], '=');
+        size_t namelen = eq ? (size_t)(eq - items[i]) : 0;
+        if (namelen == 0 || eq[1] == '\0' ||
+            namelen >= sizeof(((TermInfo *)0)->host) ||
+            AgentCount == HUB_MAX_AGENTS)
+        {
+            fprintf(stderr, "Invalid agent '%s': use name=host:port or "
+                            "name=unix:/path.\n", items[i]);
+            ok = 0;
+            break;
+        }
+        sds name = sdsnewlen(items[i], namelen);
+        Agents[AgentCount++] = agentClientNew(name, eq + 1, secret);
+        sdsfree(name);
+    }
+    sdsfreesplitres(items, count);
+    return ok;
+}
+
+static agentClient *hub_agent(const char *host) {
+    for (int i = 0; i < AgentCount; i++)
+        if (strcmp(agentClientName(Agents[i]), host) == 0) return Agents[i];
+    return NULL;
+}
+
+/* List the local terminals, then append the ones of every agent. The
+ * requests to the agents are all sent before waiting for the replies, so
+ * listing takes as long as the slowest agent, not the sum of all. */
+int hub_list(void) {
+    backend_list();
+    for (int i = 0; i < TermCount; i++) TermList[i].host[0] = '\0';
+    if (AgentCount == 0) return TermCount;
+
+    agentCall calls[HUB_MAX_AGENTS];
+    int sent[HUB_MAX_AGENTS];
+    for (int i = 0; i < AgentCount; i++)
+        sent[i] = agentStart(Agents[i], &calls[i], AGENT_LIST, "", 0);
+
+    for (int i = 0; i < AgentCount; i++) {
+        if (!sent[i] || !agentWait(Agents[i], &calls[i], HUB_LIST_TIMEOUT)) {
+            flightRecord(FLIGHT_ERROR, "agent list failed", 0, 0);
+            continue;
+        }
+        TermInfo *remote;
+        int n = agentParseList(Agents[i], calls[i].reply, &remote);
+        sdsfree(calls[i].reply);
+
+        TermInfo *list = realloc(TermList, (TermCount + n) * sizeof(TermInfo));
+        if (list == NULL) {
+            xfree(remote);
+            continue;
+        }
+        TermList = list;
+        for (int j = 0; j < n; j++) {
+            TermInfo *t = &TermList[TermCount++];
+            *t = remote[j];
+            sds name = sdscatprintf(sdsempty(), "%s/%s",
+                                    agentClientName(Agents[i]), remote[j].name);
+            snprintf(t->name, sizeof(t->name), "%s", name);
+            sdsfree(name);
+        }
+        xfree(remote);
+    }
+    return TermCount;
+}
+
+int hub_connected(TermInfo *t) {
+    if (t->host[0] == '\0') return backend_connected(t);
+    agentClient *c = hub_agent(t->host);
+    return c ? agentConnected(c, t) : 0;
+}
+
+sds hub_capture_text(const TermInfo *t) {
+    if (t->host[0] == '\0') return backend_capture_text(t);
+    agentClient *c = hub_agent(t->host);
+    return c ? agentCaptureText(c, t) : NULL;
+}
+
+int hub_send_keys(const TermInfo *t, const char *text) {
+    if (t->host[0] == '\0') return backend_send_keys(t, text);
+    agentClient *c = hub_agent(t->host);
+    return c ? agentSendKeys(c, t, text) : -1;
+}
@@ -0,0 +1,18 @@
+#ifndef HUB_H
+#define HUB_H
+
+#include "backend.h"
+
+/* Register the agents of "name=addr,name=addr,...". Returns 1 on
+ * success, 0 if the list is malformed. */
+int hub_init(const char *agents, const char *secret);
+
+/* The backend interface of backend.h, routed by TermInfo.host: local
+ * terminals go to the local backend, the others to their agent. The list
+ * includes the terminals of every reachable agent, named "host/name". */
+int hub_list(void);
+int hub_connected(TermInfo *t);
+sds hub_capture_text(const TermInfo *t);
+int hub_send_keys(const TermInfo *t, const char *text);
+
+#endif
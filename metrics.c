@@ -0,0 +1,247 @@
+/*
+ * metrics.c - Counters, gauges and latency histograms
+ *
+ * A tiny registry of metrics exported in the Prometheus text format.
+ * Updating a metric is a single relaxed atomic operation, so metrics can
+ * be updated from any thread on the hot path. Only the creation of a
+ * family takes a lock, and that happens at startup. Series (the values
+ * of a family for given label values) are created on first use and are
+ * published with compare and swap, so even that does not block.
+ *
+ * Histograms use log-linear buckets, like HDR histograms: every power of
+ * two is split in HIST_SUB linear sub-buckets, so the relative error is
+ * at most 1/HIST_SUB whatever the magnitude of the value, and recording
+ * a value is just a few bit operations.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <stdatomic.h>
+
+#include "metrics.h"
+#include "xmalloc.h"
+
+#define HIST_SUB_BITS 2
+#define HIST_SUB (1<<HIST_SUB_BITS)
+#define HIST_MAX_EXP 36         /* Values up to 2^36 are bucketed. */
+#define HIST_BUCKETS ((HIST_MAX_EXP-HIST_SUB_BITS+1)*HIST_SUB)
+
+struct metric {
+    struct metric *next;
+    char *values[METRICS_MAX_LABELS];
+    _Atomic int64_t value;      /* Counters and gauges. */
+    _Atomic uint64_t sum;       /* Histograms: sum of the values, and */
+    _Atomic uint64_t *buckets;  /* HIST_BUCKETS+1 buckets, the last one
+                                   for values out of range. */
+};
+
+struct metricFamily {
+    int type;
+    char *name;
+    char *help;
+    char *labels[METRICS_MAX_LABELS];
+    int numlabels;
+    double scale;
+    _Atomic(metric *) series;
+    struct metricFamily *next;
+};
+
+static pthread_mutex_t FamiliesLock = PTHREAD_MUTEX_INITIALIZER;
+static metricFamily *Families = NULL;
+static metricFamily **FamiliesTail = &Families;
+
+static char *metricsStrdup(const char *s) {
+    size_t len = strlen(s)+1;
+    char *copy = xmalloc(len);
+    memcpy(copy,s,len);
+    return copy;
+}
+
+metricFamily *metricsNew(int type, const char *name, const char *help,
+                         const char *labels, double scale)
+{
+    metricFamily *f = xmalloc(sizeof(*f));
+    memset(f,0,sizeof(*f));
+    f->type = type;
+    f->name = metricsStrdup(name);
+    f->help = metricsStrdup(help);
+    f->scale = scale;
+    atomic_init(&f->series,NULL);
+    if (labels) {
+        int count;
+        sds *l = sdssplitlen(labels,strlen(labels),",",1,&count);
+        for (int j = 0; j < count && j < METRICS_MAX_LABELS; j++)
+            f->labels[f->numlabels++] = metricsStrdup(l[j]);
+        sdsfreesplitres(l,count);
+    }
+
+    pthread_mutex_lock(&FamiliesLock);
+    *FamiliesTail = f;
+    FamiliesTail = &f->next;
+    pthread_mutex_unlock(&FamiliesLock);
+    return f;
+}
+
+static int metricMatch(metric *m, const char **values, int numlabels) {
+    for (int j = 0; j < numlabels; j++) {
+        const char *v = values[j] ? values[j] : "";
+        if (strcmp(m->values[j],v)) return 0;
+    }
+    return 1;
+}
+
+metric *metricGet(metricFamily *f, const char *v1, const char *v2) {
+    const char *values[METRICS_MAX_LABELS] = {v1, v2};
+    metric *head = atomic_load_explicit(&f->series,memory_order_acquire);
+    for (metric *m = head; m; m = m->next)
+        if (metricMatch(m,values,f->numlabels)) return m;
+
+    metric *m = xmalloc(sizeof(*m));
+    memset(m,0,sizeof(*m));
+    for (int j = 0; j < f->numlabels; j++)
+        m->values[j] = metricsStrdup(values[j] ? values[j] : "");
+    if (f->type == METRIC_HISTOGRAM) {
+        size_t size = sizeof(_Atomic uint64_t)*(HIST_BUCKETS+1);
+        m->buckets = xmalloc(size);
+        memset((void*)m->buckets,0,size);
+    }
+
+    /* Publish the new series. If another thread published a series in
+     * the meantime, it may be the one we are creating: check again. */
+    m->next = head;
+    while (!atomic_compare_exchange_weak_explicit(&f->series,&head,m,
+            memory_order_release,memory_order_acquire))
+    {
+        for (metric *o = head; o; o = o->next) {
+            if (metricMatch(o,values,f->numlabels)) {
+                for (int j = 0; j < f->numlabels; j++) xfree(m->values[j]);
+                xfree((void*)m->buckets);
+                xfree(m);
+                return o;
+            }
+        }
+        m->next = head;
+    }
+    return m;
+}
+
+void metricAdd(metric *m, int64_t delta) {
+    atomic_fetch_add_explicit(&m->value,delta,memory_order_relaxed);
+}
+
+void metricSet(metric *m, int64_t value) {
+    atomic_store_explicit(&m->value,value,memory_order_relaxed);
+}
+
+/* Return the bucket of the histogram where 'v' belongs. */
+static int histBucket(uint64_t v) {
+    if (v <= HIST_SUB) return v ? v-1 : 0;
+    uint64_t w = v-1;
+    int e = 63 - __builtin_clzll(w);
+    if (e >= HIST_MAX_EXP) return HIST_BUCKETS;
+    int shift = e - HIST_SUB_BITS;
+    return (shift+1)*HIST_SUB + ((w >> shift) & (HIST_SUB-1));
+}
+
+/* Return the largest value stored in the specified bucket. */
+static uint64_t histUpperBound(int idx) {
+    if (idx < HIST_SUB) return idx+1;
+    int shift = idx/HIST_SUB - 1;
+    return (uint64_t)(HIST_SUB + idx%HIST_SUB + 1) << shift;
+}
+
+void metricObserve(metric *m, uint64_t value) {
+    atomic_fetch_add_explicit(&m->buckets[histBucket(value)],1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&m->sum,value,memory_order_relaxed);
+}
+
+uint64_t metricsUstime(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000000 + ts.tv_nsec/1000;
+}
+
+/* ============================================================================
+ * Prometheus text format
+ * ========================================================================= */
+
+/* Append the label set of the series, plus the 'le' label if not NULL. */
+static sds metricsCatLabels(sds s, metricFamily *f, metric *m, const char *le) {
+    if (f->numlabels == 0 && le == NULL) return s;
+    s = sdscatlen(s,"{",1);
+    for (int j = 0; j < f->numlabels; j++) {
+        if (j) s = sdscatlen(s,",",1);
+        s = sdscatprintf(s,"%s=\"",f->labels[j]);
+        for (const char *p = m->values[j]; *p; p++) {
+            if (*p == '\\' || *p == '"') s = sdscatprintf(s,"\\%c",*p);
+            else if (*p == '\n') s = sdscatlen(s,"\\n",2);
+            else s = sdscatlen(s,p,1);
+        }
+        s = sdscatlen(s,"\"",1);
+    }
+    if (le) s = sdscatprintf(s,"%sle=\"%s\"",f->numlabels ? "," : "",le);
+    return sdscatlen(s,"}",1);
+}
+
+/* Only the non empty buckets are emitted: the cumulative count of an
+ * empty bucket is the same of the previous boundary, so no information
+ * is lost, while emitting all the HIST_BUCKETS boundaries of every series
+ * would produce mostly redundant lines. */
+static sds metricsCatHistogram(sds s, metricFamily *f, metric *m) {
+    uint64_t cumulative = 0;
+    char le[64];
+    for (int j = 0; j < HIST_BUCKETS; j++) {
+        uint64_t count = atomic_load_explicit(&m->buckets[j],
+                                              memory_order_relaxed);
+        if (count == 0) continue;
+        cumulative += count;
+        snprintf(le,sizeof(le),"%.9g",histUpperBound(j)*f->scale);
+        s = sdscatprintf(s,"%s_bucket",f->name);
+        s = metricsCatLabels(s,f,m,le);
+        s = sdscatprintf(s," %llu\n",(unsigned long long)cumulative);
+    }
+    cumulative += atomic_load_explicit(&m->buckets[HIST_BUCKETS],
+                                       memory_order_relaxed);
+
+    s = sdscatprintf(s,"%s_bucket",f->name);
+    s = metricsCatLabels(s,f,m,"+Inf");
+    s = sdscatprintf(s," %llu\n",(unsigned long long)cumulative);
+    s = sdscatprintf(s,"%s_sum",f->name);
+    s = metricsCatLabels(s,f,m,NULL);
+    s = sdscatprintf(s," %.9g\n",
+        atomic_load_explicit(&m->sum,memory_order_relaxed)*f->scale);
+    s = sdscatprintf(s,"%s_count",f->name);
+    s = metricsCatLabels(s,f,m,NULL);
+    /* The count is reported as the sum of the buckets, so that it is
+     * consistent with them even if observations happen while we read. */
+    s = sdscatprintf(s," %llu\n",(unsigned long long)cumulative);
+    return s;
+}
+
+sds metricsRender(void) {
+    static const char *types[] = {"counter","gauge","histogram"};
+    sds s = sdsempty();
+
+    pthread_mutex_lock(&FamiliesLock);
+    for (metricFamily *f = Families; f; f = f->next) {
+        s = sdscatprintf(s,"# HELP %s %s\n# TYPE %s %s\n",
+            f->name, f->help, f->name, types[f->type]);
+        metric *m = atomic_load_explicit(&f->series,memory_order_acquire);
+        for (; m; m = m->next) {
+            if (f->type == METRIC_HISTOGRAM) {
+                s = metricsCatHistogram(s,f,m);
+            } else {
+                s = sdscat(s,f->name);
+                s = metricsCatLabels(s,f,m,NULL);
+                s = sdscatprintf(s," %lld\n",(long long)
+                    atomic_load_explicit(&m->value,memory_order_relaxed));
+            }
+        }
+    }
+    pthread_mutex_unlock(&FamiliesLock);
+    return s;
+}
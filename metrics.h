@@ -0,0 +1,42 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+#include "sds.h"
+
+#define METRIC_COUNTER 0
+#define METRIC_GAUGE 1
+#define METRIC_HISTOGRAM 2
+
+#define METRICS_MAX_LABELS 2
+
+typedef struct metricFamily metricFamily;
+typedef struct metric metric;
+
+/* Create a metric family and add it to the registry. 'labels' is a comma
+ * separated list of up to METRICS_MAX_LABELS label names, or NULL.
+ * Histogram values are integers (microseconds, bytes, ...) and are
+ * multiplied by 'scale' when exported, so that durations can be recorded
+ * in microseconds and exported in seconds as Prometheus expects. Families
+ * are never freed. */
+metricFamily *metricsNew(int type, const char *name, const char *help,
+                         const char *labels, double scale);
+
+/* Return the series of the family with the given label values (NULL for
+ * unused labels), creating it the first time. The returned pointer is
+ * valid forever, so callers updating the same series often can cache it.
+ * Never blocks: series are published with compare and swap. */
+metric *metricGet(metricFamily *f, const char *v1, const char *v2);
+
+/* Update a series. All these are lock free. */
+void metricAdd(metric *m, int64_t delta);       /* Counters and gauges. */
+void metricSet(metric *m, int64_t value);       /* Gauges. */
+void metricObserve(metric *m, uint64_t value);  /* Histograms. */
+
+/* Return the monotonic time in microseconds, for durations. */
+uint64_t metricsUstime(void);
+
+/* Return all the metrics in the Prometheus text exposition format. */
+sds metricsRender(void);
+
+#endif
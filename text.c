@@ -0,0 +1,204 @@
+/*
+ * text.c - Terminal text formatting and emoji parsing for teleterm
+ *
+ * Pure functions with no state, shared by bot_common.c and the backends:
+ * the emoji modifiers of the keystroke syntax, and the conversion of the
+ * captured terminal text into Telegram HTML messages.
+ */
+
+#include <string.h>
+
+#include "text.h"
+#include "xmalloc.h"
+
+/* ============================================================================
+ * UTF-8 Emoji Parsing
+ * ========================================================================= */
+
+/* Match red heart (E2 9D A4, optionally followed by EF B8 8F). */
+int match_red_heart(const unsigned char *p, size_t remaining) {
+    if (remaining >= 3 && p[0] == 0xE2 && p[1] == 0x9D && p[2] == 0xA4) {
+        if (remaining >= 6 && p[3] == 0xEF && p[4] == 0xB8 && p[5] == 0x8F)
+            return 6;
+        return 3;
+    }
+    return 0;
+}
+
+/* Match colored hearts: blue (F0 9F 92 99), green (9A), yellow (9B). */
+int match_colored_heart(const unsigned char *p, size_t remaining, char *heart) {
+    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0x92) {
+        if (p[3] == 0x99) { *heart = 'B'; return 4; }  /* Blue = Alt */
+        if (p[3] == 0x9A) { *heart = 'G'; return 4; }  /* Green = Cmd */
+        if (p[3] == 0x9B) { *heart = 'Y'; return 4; }  /* Yellow = ESC */
+    }
+    return 0;
+}
+
+/* Match orange heart (F0 9F A7 A1) - sends Enter. */
+int match_orange_heart(const unsigned char *p, size_t remaining) {
+    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0xA7 && p[3] == 0xA1)
+        return 4;
+    return 0;
+}
+
+/* Match purple heart (F0 9F 92 9C) - used to suppress newline. */
+int match_purple_heart(const unsigned char *p, size_t remaining) {
+    if (remaining >= 4 && p[0] == 0xF0 && p[1] == 0x9F && p[2] == 0x92 && p[3] == 0x9C)
+        return 4;
+    return 0;
+}
+
+/* Check if string ends with purple heart. */
+int ends_with_purple_heart(const char *text) {
+    size_t len = strlen(text);
+    if (len >= 4) {
+        const unsigned char *p = (const unsigned char *)text + len - 4;
+        if (match_purple_heart(p, 4)) return 1;
+    }
+    return 0;
+}
+
+/* Check if the text is a single key interrupting what runs in the
+ * terminal: Ctrl-C or Ctrl-Z (red heart followed by c or z), ESC (yellow
+ * heart), or q, that quits pagers, optionally followed by the purple
+ * heart. */
+int is_interrupt_key(const char *text) {
+    const unsigned char *p = (const unsigned char *)text;
+    size_t len = strlen(text);
+    if (ends_with_purple_heart(text)) len -= 4;
+    size_t m;
+    char heart;
+    if ((m = match_red_heart(p, len)) && len == m + 1)
+        return p[m] == 'c' || p[m] == 'z';
+    if ((m = match_colored_heart(p, len, &heart)) && len == m)
+        return heart == 'Y';
+    return len == 1 && p[0] == 'q';
+}
+
+/* Match a special key escape, "\{up}", "\{pgdn}" and so forth, setting
+ * *key to its KEY_* code. These keys have no character of their own: the
+ * escape lets messages, and the inline keypad, type them. */
+int match_special_key(const unsigned char *p, size_t remaining, int *key) {
+    static const char *names[SPECIAL_KEYS] = {
+        "up", "down", "left", "right", "pgup", "pgdn", "home", "end"
+    };
+    if (remaining < 4 || p[0] != '\\' || p[1] != '{') return 0;
+    for (int j = 0; j < SPECIAL_KEYS; j++) {
+        size_t len = strlen(names[j]);
+        if (remaining >= len + 3 && p[len + 2] == '}' &&
+            memcmp(p + 2, names[j], len) == 0)
+        {
+            *key = j;
+            return (int)len + 3;
+        }
+    }
+    return 0;
+}
+
+/* ============================================================================
+ * Terminal Text Formatting
+ * ========================================================================= */
+
+/* Escape text for Telegram HTML parse mode. */
+sds html_escape(const char *text) {
+    sds out = sdsempty();
+    for (const char *p = text; *p; p++) {
+        switch (*p) {
+            case '<': out = sdscat(out, "&lt;"); break;
+            case '>': out = sdscat(out, "&gt;"); break;
+            case '&': out = sdscat(out, "&amp;"); break;
+            default:  out = sdscatlen(out, p, 1); break;
+        }
+    }
+    return out;
+}
+
+/* Get the last N lines from text. Returns pointer into the string. */
+const char *last_n_lines(const char *text, int n) {
+    const char *end = text + strlen(text);
+    const char *p = end;
+    int count = 0;
+    while (p > text) {
+        p--;
+        if (*p == '\n') {
+            count++;
+            if (count >= n) { p++; break; }
+        }
+    }
+    return p;
+}
+
+/* Format the last 'visible_lines' of terminal text into one or more HTML
+ * <pre> messages. When 'split' is true, splits on line boundaries when
+ * content exceeds Telegram's 4096 char limit. Otherwise truncates to fit
+ * a single message (keeping the tail end of the output).
+ * Caller must sdsfree each element and xfree the array. */
+sds *format_terminal_messages(sds raw, int visible_lines, int split, int *count) {
+    const char *tail = last_n_lines(raw, visible_lines);
+    sds escaped = html_escape(tail);
+
+    sds *msgs = NULL;
+    int n = 0;
+
+    if (!split) {
+        /* Truncate mode: keep the tail that fits in one message. */
+        if (sdslen(escaped) > MAX_MSG_LEN) {
+            /* Find a newline near the cut point to avoid breaking a line. */
+            const char *start = escaped + sdslen(escaped) - MAX_MSG_LEN;
+            const char *nl = strchr(start, '\n');
+            if (nl && (size_t)(nl - escaped) < sdslen(escaped))
+                start = nl + 1;
+            sds trimmed = sdsnew(start);
+            sdsfree(escaped);
+            escaped = trimmed;
+        }
+        msgs = xrealloc(msgs, sizeof(sds) * 1);
+        msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", escaped);
+    } else {
+        /* Split mode: break into multiple messages. */
+        while (sdslen(escaped) > 0) {
+            if (sdslen(escaped) <= MAX_MSG_LEN) {
+                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
+                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", escaped);
+                break;
+            }
+
+            /* Find last newline within MAX_MSG_LEN to split on a line boundary. */
+            char *cut = NULL;
+            for (size_t i = MAX_MSG_LEN; i > 0; i--) {
+                if (escaped[i - 1] == '\n') {
+                    cut = escaped + i - 1;
+                    break;
+                }
+            }
+
+            if (!cut) {
+                /* No newline found; hard-cut at MAX_MSG_LEN. */
+                sds chunk = sdsnewlen(escaped, MAX_MSG_LEN);
+                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
+                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", chunk);
+                sdsfree(chunk);
+                sdsrange(escaped, MAX_MSG_LEN, -1);
+            } else {
+                size_t chunk_len = cut - escaped;
+                sds chunk = sdsnewlen(escaped, chunk_len);
+                msgs = xrealloc(msgs, sizeof(sds) * (n + 1));
+                msgs[n++] = sdscatprintf(sdsempty(), "<pre>%s</pre>", chunk);
+                sdsfree(chunk);
+                sdsrange(escaped, chunk_len + 1, -1); /* skip past newline */
+            }
+        }
+    }
+
+    sdsfree(escaped);
+
+    if (n == 0) {
+        msgs = xrealloc(msgs, sizeof(sds));
+        msgs[0] = sdsnew("<pre></pre>");
+        n = 1;
+    }
+
+    *count = n;
+    return msgs;
+}
@@ -0,0 +1,35 @@
+#ifndef TEXT_H
+#define TEXT_H
+
+#include <stddef.h>
+#include "sds.h"
+
+#define MAX_MSG_LEN 4085  /* 4096 - strlen("<pre></pre>") */
+
+/* Emoji modifiers. Each matcher returns the number of bytes matched at
+ * 'p', or 0 if there is no match. */
+int match_red_heart(const unsigned char *p, size_t remaining);
+int match_colored_heart(const unsigned char *p, size_t remaining, char *heart);
+int match_orange_heart(const unsigned char *p, size_t remaining);
+int match_purple_heart(const unsigned char *p, size_t remaining);
+int ends_with_purple_heart(const char *text);
+int is_interrupt_key(const char *text);
+
+/* Special keys of the "\{name}" escape, see match_special_key(). */
+#define KEY_UP 0
+#define KEY_DOWN 1
+#define KEY_LEFT 2
+#define KEY_RIGHT 3
+#define KEY_PGUP 4
+#define KEY_PGDN 5
+#define KEY_HOME 6
+#define KEY_END 7
+#define SPECIAL_KEYS 8
+int match_special_key(const unsigned char *p, size_t remaining, int *key);
+
+/* Terminal text formatting. */
+sds html_escape(const char *text);
+const char *last_n_lines(const char *text, int n);
+sds *format_terminal_messages(sds raw, int visible_lines, int split, int *count);
+
+#endif
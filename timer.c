@@ -0,0 +1,264 @@
+/*
+ * timer.c - Hierarchical timer wheel
+ *
+ * Deferred and periodic tasks (delayed refreshes, settle checks, expiry
+ * sweeps, scheduled keystrokes) are timers run by the bot main loop, that
+ * also uses the wheel to know how long it can sleep: so timers fire on
+ * time, and an idle bot does not wake up at all.
+ *
+ * The wheel has TIMER_LEVELS levels of TIMER_SLOTS slots. The resolution
+ * is one millisecond: level 0 holds the timers expiring in the next 64
+ * ms, one slot per millisecond, level 1 the ones expiring in the next
+ * 64*64 ms, one slot every 64 ms, and so forth. When the time reaches a
+ * slot of an upper level, its timers are cascaded to the lower levels,
+ * and finally run from level 0. Every slot is a doubly linked list, and a
+ * timer knows its slot, so arming and cancelling are O(1). A bitmap of
+ * the non empty slots of every level lets the loop find the next slot to
+ * process with a few bit operations, and jump there directly instead of
+ * stepping one millisecond at a time.
+ *
+ * The wheel is protected by a mutex, so timers can be armed and cancelled
+ * from the request threads. The procedures run in the main loop thread,
+ * without the lock held: they must be quick, and start a thread for
+ * anything that may block.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <limits.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "timer.h"
+
+#define TIMER_BITS 6
+#define TIMER_SLOTS (1<<TIMER_BITS)
+#define TIMER_MASK (TIMER_SLOTS-1)
+#define TIMER_LEVELS 6      /* 2^36 ms, that is about two years. */
+#define TIMER_EXPIRED TIMER_LEVELS /* Pseudo level of the timers to run. */
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t done;        /* Signaled when a procedure returns. */
+    uint64_t now;               /* Next tick to process. */
+    timerEvent *slots[TIMER_LEVELS+1][TIMER_SLOTS];
+    uint64_t used[TIMER_LEVELS+1]; /* Bitmaps of the non empty slots. */
+    int count;                  /* Pending timers. */
+    timerEvent *running;        /* Timer whose procedure is running. */
+    int cancelled;              /* The running timer was cancelled. */
+    int has_runner;
+    pthread_t runner;           /* Thread calling timerProcess(). */
+    void (*wakeup)(void);
+} Wheel = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .done = PTHREAD_COND_INITIALIZER
+};
+
+uint64_t timerNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (uint64_t)ts.tv_sec*1000 + ts.tv_nsec/1000000;
+}
+
+void timerInit(timerEvent *t, timerProc proc, void *privdata) {
+    memset(t,0,sizeof(*t));
+    t->proc = proc;
+    t->privdata = privdata;
+    t->level = -1;
+}
+
+int timerPending(timerEvent *t) {
+    pthread_mutex_lock(&Wheel.lock);
+    int pending = t->level != -1;
+    pthread_mutex_unlock(&Wheel.lock);
+    return pending;
+}
+
+void timerSetWakeup(void (*wakeup)(void)) {
+    pthread_mutex_lock(&Wheel.lock);
+    Wheel.wakeup = wakeup;
+    pthread_mutex_unlock(&Wheel.lock);
+}
+
+/* =============================================================================
+ * The wheel. All these are called with the lock held.
+ * ===========================================================================*/
+
+/* Put the timer in the slot of its expire time. */
+static void wheelLink(timerEvent *t, int level, int slot) {
+    t->level = level;
+    t->slot = slot;
+    t->prev = NULL;
+    t->next = Wheel.slots[level][slot];
+    if (t->next) t->next->prev = t;
+    Wheel.slots[level][slot] = t;
+    Wheel.used[level] |= 1ULL<<slot;
+    Wheel.count++;
+}
+
+static void wheelInsert(timerEvent *t) {
+    if (Wheel.now == 0) Wheel.now = timerNow();
+    uint64_t expires = t->when < Wheel.now ? Wheel.now : t->when;
+    uint64_t delta = expires - Wheel.now;
+    int level = 0;
+    while (level < TIMER_LEVELS-1 && delta >> (TIMER_BITS*(level+1)))
+        level++;
+    /* Farther than the wheel can see: park it in the last slot, it will
+     * be inserted again when that slot is cascaded. */
+    if (delta >> (TIMER_BITS*TIMER_LEVELS))
+        expires = Wheel.now + (1ULL << (TIMER_BITS*TIMER_LEVELS)) - 1;
+    wheelLink(t,level,(expires >> (TIMER_BITS*level)) & TIMER_MASK);
+}
+
+static void wheelUnlink(timerEvent *t) {
+    if (t->prev) t->prev->next = t->next;
+    else Wheel.slots[t->level][t->slot] = t->next;
+    if (t->next) t->next->prev = t->prev;
+    if (Wheel.slots[t->level][t->slot] == NULL)
+        Wheel.used[t->level] &= ~(1ULL<<t->slot);
+    t->level = -1;
+    Wheel.count--;
+}
+
+/* Return the first tick, not before Wheel.now, at which a non empty slot
+ * must be processed: run if it is in level 0, cascaded otherwise. Slots of
+ * level N are processed at the ticks multiple of 64^N, so the answer for
+ * every level is the first such tick, plus the distance in slots to the
+ * next non empty one. */
+static uint64_t wheelNextTick(void) {
+    uint64_t next = UINT64_MAX;
+    for (int level = 0; level < TIMER_LEVELS; level++) {
+        uint64_t used = Wheel.used[level];
+        if (used == 0) continue;
+        int shift = TIMER_BITS*level;
+        uint64_t first = (Wheel.now + ((1ULL<<shift)-1)) >> shift;
+        int idx = first & TIMER_MASK;
+        uint64_t rotated = (used >> idx) | (used << ((TIMER_SLOTS-idx) & TIMER_MASK));
+        uint64_t tick = (first + __builtin_ctzll(rotated)) << shift;
+        if (tick < next) next = tick;
+    }
+    return next;
+}
+
+/* Move the timers of an upper level slot to the lower levels. */
+static void wheelCascade(int level, int slot) {
+    timerEvent *t = Wheel.slots[level][slot];
+    Wheel.slots[level][slot] = NULL;
+    Wheel.used[level] &= ~(1ULL<<slot);
+    while (t) {
+        timerEvent *next = t->next;
+        Wheel.count--;
+        wheelInsert(t);
+        t = next;
+    }
+}
+
+/* =============================================================================
+ * API
+ * ===========================================================================*/
+
+void timerAdd(timerEvent *t, uint64_t delay, uint64_t period) {
+    uint64_t now = timerNow();
+    pthread_mutex_lock(&Wheel.lock);
+    if (t->level != -1) wheelUnlink(t);
+    uint64_t before = wheelNextTick();
+    t->when = now + delay;
+    t->period = period;
+    wheelInsert(t);
+    /* The main loop computes its timeout after processing the timers, so
+     * it only needs to be woken up if the timer is armed by another
+     * thread, and fires before anything else. */
+    void (*wakeup)(void) = NULL;
+    if (wheelNextTick() < before &&
+        !(Wheel.has_runner && pthread_equal(Wheel.runner,pthread_self())))
+    {
+        wakeup = Wheel.wakeup;
+    }
+    pthread_mutex_unlock(&Wheel.lock);
+    if (wakeup) wakeup();
+}
+
+int timerCancel(timerEvent *t) {
+    pthread_mutex_lock(&Wheel.lock);
+    int pending = t->level != -1;
+    if (pending) wheelUnlink(t);
+    if (Wheel.running == t) {
+        Wheel.cancelled = 1;
+        if (!pthread_equal(Wheel.runner,pthread_self())) {
+            while (Wheel.running == t)
+                pthread_cond_wait(&Wheel.done,&Wheel.lock);
+        }
+    }
+    pthread_mutex_unlock(&Wheel.lock);
+    return pending;
+}
+
+int timerProcess(void) {
+    int fired = 0;
+    uint64_t now = timerNow();
+
+    pthread_mutex_lock(&Wheel.lock);
+    Wheel.runner = pthread_self();
+    Wheel.has_runner = 1;
+    while (Wheel.count) {
+        uint64_t tick = wheelNextTick();
+        if (tick > now) break;
+        Wheel.now = tick;
+        for (int level = 1; level < TIMER_LEVELS; level++) {
+            int shift = TIMER_BITS*level;
+            if (tick & ((1ULL<<shift)-1)) break;
+            wheelCascade(level,(tick >> shift) & TIMER_MASK);
+        }
+        Wheel.now = tick+1;
+
+        /* Move the expired timers to their own list: the procedures may
+         * arm timers landing in the same level 0 slot, 64 ms later. */
+        int slot = tick & TIMER_MASK;
+        timerEvent *t = Wheel.slots[0][slot];
+        Wheel.slots[0][slot] = NULL;
+        Wheel.used[0] &= ~(1ULL<<slot);
+        while (t) {
+            timerEvent *next = t->next;
+            Wheel.count--;
+            wheelLink(t,TIMER_EXPIRED,0);
+            t = next;
+        }
+
+        while ((t = Wheel.slots[TIMER_EXPIRED][0]) != NULL) {
+            wheelUnlink(t);
+            uint64_t period = t->period;
+            Wheel.running = t;
+            Wheel.cancelled = 0;
+            pthread_mutex_unlock(&Wheel.lock);
+            t->proc(t->privdata);
+            pthread_mutex_lock(&Wheel.lock);
+            /* Re-arm periodic timers, unless the procedure cancelled or
+             * re-armed the timer: in the first case it may even have
+             * released it. Missed periods are skipped. */
+            if (period && !Wheel.cancelled && t->level == -1) {
+                t->when += period;
+                if (t->when < now) t->when = now + period;
+                wheelInsert(t);
+            }
+            Wheel.running = NULL;
+            pthread_cond_broadcast(&Wheel.done);
+            fired++;
+        }
+    }
+    /* Nothing to do up to 'now': skip there, so that new timers are
+     * placed relative to the current time. */
+    if (Wheel.now <= now) Wheel.now = now+1;
+    pthread_mutex_unlock(&Wheel.lock);
+    return fired;
+}
+
+int timerTimeout(void) {
+    pthread_mutex_lock(&Wheel.lock);
+    uint64_t tick = Wheel.count ? wheelNextTick() : UINT64_MAX;
+    pthread_mutex_unlock(&Wheel.lock);
+    if (tick == UINT64_MAX) return -1;
+    uint64_t now = timerNow();
+    if (tick <= now) return 0;
+    return tick-now > INT_MAX ? INT_MAX : (int)(tick-now);
+}
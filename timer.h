@@ -0,0 +1,49 @@
+#ifndef TIMER_H
+#define TIMER_H
+
+#include <stdint.h>
+
+typedef void (*timerProc)(void *privdata);
+
+/* A timer. The memory is owned by the caller, usually embedded in the
+ * structure the timer works for, so that arming and cancelling never
+ * allocate. Initialize it with timerInit() before anything else. */
+typedef struct timerEvent {
+    uint64_t when;              /* Expire time, see timerNow(). */
+    uint64_t period;            /* If not zero, re-armed after firing. */
+    timerProc proc;
+    void *privdata;
+    int level, slot;            /* Position in the wheel, level -1 if not
+                                   pending. */
+    struct timerEvent *prev, *next;
+} timerEvent;
+
+void timerInit(timerEvent *t, timerProc proc, void *privdata);
+
+/* Arm the timer to fire after 'delay' milliseconds, and then every
+ * 'period' milliseconds if 'period' is not zero. If the timer is already
+ * pending it is moved. Can be called from any thread, including from the
+ * timer procedure itself. */
+void timerAdd(timerEvent *t, uint64_t delay, uint64_t period);
+
+/* Stop the timer. When this returns the timer procedure is not running,
+ * unless called by the procedure itself, and won't run again, so the
+ * timer memory can be released. Returns 1 if the timer was pending. */
+int timerCancel(timerEvent *t);
+
+int timerPending(timerEvent *t);
+
+/* The clock of the timers: monotonic time in milliseconds. */
+uint64_t timerNow(void);
+
+/* The event loop side. timerProcess() runs the procedures of the expired
+ * timers, in the calling thread, and returns how many ran. timerTimeout()
+ * returns how many milliseconds the loop can sleep before the next call,
+ * or -1 if no timer is pending. timerSetWakeup() registers a function
+ * that interrupts the loop sleep, called when a timer is armed from
+ * another thread and must fire before the loop would wake up. */
+int timerProcess(void);
+int timerTimeout(void);
+void timerSetWakeup(void (*wakeup)(void));
+
+#endif
@@ -0,0 +1,919 @@
+/*
+ * mock_telegram.c - Local stand-in for the Telegram Bot API
+ *
+ * Serves the subset of the Bot API used by teleterm, so that the whole
+ * bot can be tested and benchmarked on one machine, without network
+ * access and without flood limits:
+ *
+ *   getMe, getUpdates (long polling), sendMessage, editMessageText,
+ *   deleteMessage, deleteMessages, answerCallbackQuery, getFile
+ *   (plus the /file/bot<token>/<path> download).
+ *
+ * Every call is recorded. Latency and errors can be injected to see
+ * how the bot behaves when Telegram is slow or failing.
+ *
+ * Incoming traffic (what a user would type) is injected through the
+ * control endpoints:
+ *
+ *   /mock/message?text=...[&chat_id=N][&from=N]  Queue a text message.
+ *   /mock/callback?data=...&message_id=N          Queue a button press.
+ *   /mock/chat[?chat_id=N]                        Messages the bot left
+ *                                                 in the chat.
+ *   /mock/calls[?clear=1]                         Recorded calls.
+ *   /mock/stats                                   Calls count per method.
+ *
+ * When teleterm serves several bots (several --apikey), the message and
+ * callback endpoints take 'bot=<apikey>' to address one of them, and the
+ * chat endpoint the same to show only what that bot sent. Updates without
+ * 'bot' go to whatever bot polls first.
+ *
+ * When the bot registers a webhook with setWebhook, queued updates are
+ * POSTed to the webhook URL (with the secret token header) instead of
+ * being returned by getUpdates, like Telegram does. This way the mock is
+ * also a local sender for testing the webhook receive mode.
+ *
+ * Usage: point teleterm to the mock with --api-url:
+ *
+ *   ./tools/mock_telegram --port 8081 --latency 50 &
+ *   ./teleterm --apikey test --api-url http://127.0.0.1:8081
+ *   curl 'http://127.0.0.1:8081/mock/message?text=.list'
+ */
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <errno.h>
+#include <time.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+#include <curl/curl.h>
+
+#include "../sds.h"
+#include "../cJSON.h"
+
+/* ============================================================================
+ * Configuration and state
+ * ========================================================================= */
+
+static struct {
+    int port;
+    int latency;            /* Milliseconds added to every API reply. */
+    int jitter;             /* Random extra milliseconds, 0..jitter. */
+    double error_rate;      /* Probability of replying with a 500. */
+    double flood_rate;      /* Probability of replying with a 429. */
+    int retry_after;        /* retry_after of injected 429 replies. */
+    int64_t chat_id;        /* Default chat of injected messages. */
+    int64_t user_id;        /* Default sender of injected messages. */
+    FILE *log;              /* If not NULL, calls are logged here (JSONL). */
+    int verbose;
+} Cfg = {8081, 0, 0, 0, 0, 1, 1000, 1000, NULL, 0};
+
+/* A message the bot sent and did not delete yet. */
+typedef struct MockMsg {
+    sds bot;                /* API key of the bot that sent it. */
+    int64_t chat_id;
+    int64_t message_id;
+    sds text;
+    sds reply_markup;
+    struct MockMsg *next;
+} MockMsg;
+
+/* A recorded API call. */
+typedef struct MockCall {
+    double time;            /* Unix time with microseconds. */
+    sds method;
+    cJSON *params;
+    int status;             /* HTTP status we replied with. */
+    double duration;        /* Time spent serving the call, ms. */
+} MockCall;
+
+#define MAX_CALLS 100000
+#define MAX_UPDATES 4096
+
+static pthread_mutex_t Lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t UpdatesCond = PTHREAD_COND_INITIALIZER;
+static cJSON *Updates[MAX_UPDATES]; /* Pending updates, FIFO. */
+static sds UpdatesBot[MAX_UPDATES]; /* Their recipient, NULL for any bot. */
+static int UpdatesCount = 0;
+static int64_t NextUpdateId = 1;
+static int64_t NextMessageId = 1;
+static MockMsg *Messages = NULL;
+static MockCall *Calls = NULL;
+static int CallsCount = 0;
+static cJSON *Webhook = NULL;       /* Last setWebhook parameters. */
+
+/* sds.c uses the xmalloc() family, normally provided by botlib.c. */
+void *xmalloc(size_t size) {
+    void *p = malloc(size);
+    if (!p) { fprintf(stderr, "Out of memory\n"); exit(1); }
+    return p;
+}
+
+void *xrealloc(void *ptr, size_t size) {
+    void *p = realloc(ptr, size);
+    if (!p) { fprintf(stderr, "Out of memory\n"); exit(1); }
+    return p;
+}
+
+void xfree(void *ptr) {
+    free(ptr);
+}
+
+static double now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* ============================================================================
+ * Minimal HTTP/1.1 handling
+ * ========================================================================= */
+
+typedef struct HttpReq {
+    sds method;
+    sds path;               /* Without the query string. */
+    cJSON *params;          /* Query string and form/JSON body, as strings. */
+    int keepalive;
+} HttpReq;
+
+static int hexval(int c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+/* URL-decode len bytes of s into a new sds string. */
+static sds url_decode(const char *s, size_t len) {
+    sds out = sdsempty();
+    for (size_t i = 0; i < len; i++) {
+        if (s[i] == '%' && i + 2 < len &&
+            hexval(s[i+1]) >= 0 && hexval(s[i+2]) >= 0)
+        {
+            char c = (char)(hexval(s[i+1]) * 16 + hexval(s[i+2]));
+            out = sdscatlen(out, &c, 1);
+            i += 2;
+        } else if (s[i] == '+') {
+            out = sdscatlen(out, " ", 1);
+        } else {
+            out = sdscatlen(out, s + i, 1);
+        }
+    }
+    return out;
+}
+
+/* Parse "a=1&b=2" adding the fields to the 'params' object. */
+static void parse_form(cJSON *params, const char *s, size_t len) {
+    const char *end = s + len;
+    while (s < end) {
+        const char *amp = memchr(s, '&', end - s);
+        if (!amp) amp = end;
+        const char *eq = memchr(s, '=', amp - s);
+        if (eq) {
+            sds k = url_decode(s, eq - s);
+            sds v = url_decode(eq + 1, amp - eq - 1);
+            cJSON_DeleteItemFromObject(params, k);
+            cJSON_AddStringToObject(params, k, v);
+            sdsfree(k);
+            sdsfree(v);
+        }
+        s = amp + 1;
+    }
+}
+
+/* Read a request from the socket. 'buf' holds bytes already read and not
+ * yet consumed (pipelined requests). Return NULL on EOF or error. */
+static HttpReq *read_request(int fd, sds *buf) {
+    char chunk[16384];
+    char *hdr_end;
+    while ((hdr_end = strstr(*buf, "\r\n\r\n")) == NULL) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) return NULL;
+        *buf = sdscatlen(*buf, chunk, n);
+        if (sdslen(*buf) > 1024*1024) return NULL;
+    }
+
+    size_t hdr_len = hdr_end - *buf + 4;
+    sds hdr = sdsnewlen(*buf, hdr_len);
+    size_t content_length = 0;
+    int keepalive = 1;
+    int is_json = 0;
+
+    int nlines;
+    sds *lines = sdssplitlen(hdr, hdr_len, "\r\n", 2, &nlines);
+    sdsfree(hdr);
+    if (nlines < 1) {
+        sdsfreesplitres(lines, nlines);
+        return NULL;
+    }
+    for (int i = 1; i < nlines; i++) {
+        if (!strncasecmp(lines[i], "Content-Length:", 15))
+            content_length = strtoul(lines[i] + 15, NULL, 10);
+        else if (!strncasecmp(lines[i], "Connection:", 11) &&
+                 strcasestr(lines[i], "close"))
+            keepalive = 0;
+        else if (!strncasecmp(lines[i], "Content-Type:", 13) &&
+                 strcasestr(lines[i], "json"))
+            is_json = 1;
+    }
+
+    /* Read the body. */
+    while (sdslen(*buf) < hdr_len + content_length) {
+        ssize_t n = read(fd, chunk, sizeof(chunk));
+        if (n <= 0) {
+            sdsfreesplitres(lines, nlines);
+            return NULL;
+        }
+        *buf = sdscatlen(*buf, chunk, n);
+    }
+
+    int nparts;
+    sds *parts = sdssplitlen(lines[0], sdslen(lines[0]), " ", 1, &nparts);
+    sdsfreesplitres(lines, nlines);
+    if (nparts < 2) {
+        sdsfreesplitres(parts, nparts);
+        return NULL;
+    }
+
+    HttpReq *req = xmalloc(sizeof(*req));
+    req->method = sdsdup(parts[0]);
+    req->params = cJSON_CreateObject();
+    req->keepalive = keepalive;
+    char *q = strchr(parts[1], '?');
+    if (q) {
+        req->path = sdsnewlen(parts[1], q - parts[1]);
+        parse_form(req->params, q + 1, strlen(q + 1));
+    } else {
+        req->path = sdsdup(parts[1]);
+    }
+    sdsfreesplitres(parts, nparts);
+
+    /* Body parameters: JSON objects or URL encoded forms. */
+    const char *body = *buf + hdr_len;
+    if (content_length && is_json) {
+        cJSON *json = cJSON_ParseWithLength(body, content_length);
+        cJSON *item;
+        cJSON_ArrayForEach(item, json) {
+            if (cJSON_IsString(item)) {
+                cJSON_AddStringToObject(req->params, item->string,
+                                        item->valuestring);
+            } else {
+                char *s = cJSON_PrintUnformatted(item);
+                cJSON_AddStringToObject(req->params, item->string, s);
+                free(s);
+            }
+        }
+        cJSON_Delete(json);
+    } else if (content_length) {
+        parse_form(req->params, body, content_length);
+    }
+    sdsrange(*buf, hdr_len + content_length, -1);
+    return req;
+}
+
+static void free_request(HttpReq *req) {
+    sdsfree(req->method);
+    sdsfree(req->path);
+    cJSON_Delete(req->params);
+    xfree(req);
+}
+
+static int write_all(int fd, const char *p, size_t len) {
+    while (len) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) return -1;
+        p += n;
+        len -= n;
+    }
+    return 0;
+}
+
+static int send_reply(int fd, int status, const char *ctype,
+                      const char *body, size_t len, int keepalive)
+{
+    const char *reason = status == 200 ? "OK" :
+                         status == 400 ? "Bad Request" :
+                         status == 404 ? "Not Found" :
+                         status == 429 ? "Too Many Requests" :
+                         "Internal Server Error";
+    sds hdr = sdscatprintf(sdsempty(),
+        "HTTP/1.1 %d %s\r\n"
+        "Content-Type: %s\r\n"
+        "Content-Length: %zu\r\n"
+        "Connection: %s\r\n\r\n",
+        status, reason, ctype, len, keepalive ? "keep-alive" : "close");
+    int retval = write_all(fd, hdr, sdslen(hdr));
+    if (retval == 0) retval = write_all(fd, body, len);
+    sdsfree(hdr);
+    return retval;
+}
+
+/* ============================================================================
+ * Bot API implementation
+ * ========================================================================= */
+
+static const char *param(HttpReq *req, const char *name) {
+    cJSON *v = cJSON_GetObjectItemCaseSensitive(req->params, name);
+    return cJSON_IsString(v) ? v->valuestring : NULL;
+}
+
+static int64_t param_int(HttpReq *req, const char *name, int64_t def) {
+    const char *v = param(req, name);
+    return v ? strtoll(v, NULL, 10) : def;
+}
+
+/* Build a Telegram style error reply. */
+static cJSON *api_error(int code, const char *desc) {
+    cJSON *r = cJSON_CreateObject();
+    cJSON_AddBoolToObject(r, "ok", 0);
+    cJSON_AddNumberToObject(r, "error_code", code);
+    cJSON_AddStringToObject(r, "description", desc);
+    return r;
+}
+
+static cJSON *api_ok(cJSON *result) {
+    cJSON *r = cJSON_CreateObject();
+    cJSON_AddBoolToObject(r, "ok", 1);
+    cJSON_AddItemToObject(r, "result", result);
+    return r;
+}
+
+/* Message object as returned by sendMessage/editMessageText. */
+static cJSON *message_json(MockMsg *m) {
+    cJSON *msg = cJSON_CreateObject();
+    cJSON_AddNumberToObject(msg, "message_id", m->message_id);
+    cJSON_AddNumberToObject(msg, "date", (double)time(NULL));
+    cJSON *chat = cJSON_AddObjectToObject(msg, "chat");
+    cJSON_AddNumberToObject(chat, "id", m->chat_id);
+    cJSON_AddStringToObject(chat, "type", m->chat_id < 0 ? "group" : "private");
+    cJSON *from = cJSON_AddObjectToObject(msg, "from");
+    cJSON_AddNumberToObject(from, "id", 1);
+    cJSON_AddBoolToObject(from, "is_bot", 1);
+    cJSON_AddStringToObject(from, "username", "mock_bot");
+    cJSON_AddStringToObject(msg, "text", m->text);
+    return msg;
+}
+
+static MockMsg *find_message(int64_t chat_id, int64_t message_id) {
+    for (MockMsg *m = Messages; m; m = m->next)
+        if (m->chat_id == chat_id && m->message_id == message_id) return m;
+    return NULL;
+}
+
+/* Remove a message. Returns 1 if the message existed. */
+static int delete_message(int64_t chat_id, int64_t message_id) {
+    for (MockMsg **p = &Messages; *p; p = &(*p)->next) {
+        MockMsg *m = *p;
+        if (m->chat_id == chat_id && m->message_id == message_id) {
+            *p = m->next;
+            sdsfree(m->bot);
+            sdsfree(m->text);
+            sdsfree(m->reply_markup);
+            xfree(m);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Queue an update for the bot with the specified API key (any bot if
+ * NULL) and wake up long polling getUpdates calls.
+ * Must be called with the lock held. */
+static void push_update(cJSON *update, const char *bot) {
+    if (UpdatesCount == MAX_UPDATES) {
+        cJSON_Delete(update);
+        return;
+    }
+    cJSON_AddNumberToObject(update, "update_id", (double)NextUpdateId++);
+    UpdatesBot[UpdatesCount] = bot ? sdsnew(bot) : NULL;
+    Updates[UpdatesCount++] = update;
+    pthread_cond_broadcast(&UpdatesCond);
+}
+
+/* Return true if the pending update 'i' is for the bot. */
+static int update_is_for(int i, const char *bot) {
+    return UpdatesBot[i] == NULL || !strcmp(UpdatesBot[i], bot);
+}
+
+/* Wait for updates of the bot with id >= offset, up to 'timeout' seconds.
+ * Updates of the bot with a smaller id are confirmed, so they are
+ * discarded. Must be called with the lock held. */
+static cJSON *get_updates(const char *bot, int64_t offset, int timeout) {
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout;
+
+    int found;
+    while (1) {
+        int kept = 0;
+        found = 0;
+        for (int i = 0; i < UpdatesCount; i++) {
+            cJSON *id = cJSON_GetObjectItem(Updates[i], "update_id");
+            if (update_is_for(i, bot) && (int64_t)id->valuedouble < offset) {
+                cJSON_Delete(Updates[i]);
+                sdsfree(UpdatesBot[i]);
+                continue;
+            }
+            if (update_is_for(i, bot)) found++;
+            Updates[kept] = Updates[i];
+            UpdatesBot[kept] = UpdatesBot[i];
+            kept++;
+        }
+        UpdatesCount = kept;
+        if (found || timeout <= 0) break;
+        if (pthread_cond_timedwait(&UpdatesCond, &Lock, &deadline) != 0) break;
+    }
+
+    cJSON *result = cJSON_CreateArray();
+    for (int i = 0; i < UpdatesCount && cJSON_GetArraySize(result) < 100; i++)
+        if (update_is_for(i, bot))
+            cJSON_AddItemToArray(result, cJSON_Duplicate(Updates[i], 1));
+    return result;
+}
+
+/* Serve a bot API method. Must be called with the lock held. The status
+ * code is returned by reference. */
+static cJSON *api_call(const char *bot, const char *method, HttpReq *req,
+                       int *status) {
+    *status = 200;
+    int64_t chat_id = param_int(req, "chat_id", 0);
+    int64_t message_id = param_int(req, "message_id", 0);
+
+    if (!strcmp(method, "getMe")) {
+        cJSON *me = cJSON_CreateObject();
+        cJSON_AddNumberToObject(me, "id", 1);
+        cJSON_AddBoolToObject(me, "is_bot", 1);
+        cJSON_AddStringToObject(me, "first_name", "Mock");
+        cJSON_AddStringToObject(me, "username", "mock_bot");
+        return api_ok(me);
+    } else if (!strcmp(method, "getUpdates")) {
+        if (Webhook) {
+            *status = 409;
+            return api_error(409, "Conflict: can't use getUpdates method "
+                                  "while webhook is active");
+        }
+        return api_ok(get_updates(bot, param_int(req, "offset", 0),
+                                  (int)param_int(req, "timeout", 0)));
+    } else if (!strcmp(method, "sendMessage")) {
+        const char *text = param(req, "text");
+        if (!chat_id || !text || !text[0]) {
+            *status = 400;
+            return api_error(400, "Bad Request: message text is empty");
+        }
+        if (strlen(text) > 4096 + 64) {
+            *status = 400;
+            return api_error(400, "Bad Request: message is too long");
+        }
+        MockMsg *m = xmalloc(sizeof(*m));
+        m->bot = sdsnew(bot);
+        m->chat_id = chat_id;
+        m->message_id = NextMessageId++;
+        m->text = sdsnew(text);
+        const char *rm = param(req, "reply_markup");
+        m->reply_markup = rm ? sdsnew(rm) : NULL;
+        m->next = Messages;
+        Messages = m;
+        return api_ok(message_json(m));
+    } else if (!strcmp(method, "editMessageText")) {
+        MockMsg *m = find_message(chat_id, message_id);
+        const char *text = param(req, "text");
+        if (!m || !text) {
+            *status = 400;
+            return api_error(400, "Bad Request: message to edit not found");
+        }
+        if (!strcmp(m->text, text)) {
+            *status = 400;
+            return api_error(400, "Bad Request: message is not modified");
+        }
+        sdsfree(m->text);
+        m->text = sdsnew(text);
+        const char *rm = param(req, "reply_markup");
+        sdsfree(m->reply_markup);
+        m->reply_markup = rm ? sdsnew(rm) : NULL;
+        return api_ok(message_json(m));
+    } else if (!strcmp(method, "deleteMessage")) {
+        if (!delete_message(chat_id, message_id)) {
+            *status = 400;
+            return api_error(400, "Bad Request: message to delete not found");
+        }
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(method, "deleteMessages")) {
+        const char *ids = param(req, "message_ids");
+        cJSON *list = ids ? cJSON_Parse(ids) : NULL;
+        if (!cJSON_IsArray(list)) {
+            cJSON_Delete(list);
+            *status = 400;
+            return api_error(400, "Bad Request: message_ids must be an array");
+        }
+        cJSON *id;
+        cJSON_ArrayForEach(id, list)
+            delete_message(chat_id, (int64_t)id->valuedouble);
+        cJSON_Delete(list);
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(method, "answerCallbackQuery")) {
+        if (!param(req, "callback_query_id")) {
+            *status = 400;
+            return api_error(400, "Bad Request: query is too old");
+        }
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(method, "getFile")) {
+        const char *file_id = param(req, "file_id");
+        if (!file_id) {
+            *status = 400;
+            return api_error(400, "Bad Request: invalid file_id");
+        }
+        cJSON *f = cJSON_CreateObject();
+        cJSON_AddStringToObject(f, "file_id", file_id);
+        cJSON_AddNumberToObject(f, "file_size", 16);
+        sds path = sdscatprintf(sdsempty(), "documents/%s", file_id);
+        cJSON_AddStringToObject(f, "file_path", path);
+        sdsfree(path);
+        return api_ok(f);
+    } else if (!strcmp(method, "setWebhook")) {
+        if (!param(req, "url")) {
+            *status = 400;
+            return api_error(400, "Bad Request: bad webhook: URL is empty");
+        }
+        cJSON_Delete(Webhook);
+        Webhook = cJSON_Duplicate(req->params, 1);
+        pthread_cond_broadcast(&UpdatesCond);
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(method, "deleteWebhook")) {
+        cJSON_Delete(Webhook);
+        Webhook = NULL;
+        return api_ok(cJSON_CreateTrue());
+    }
+    *status = 404;
+    return api_error(404, "Not Found");
+}
+
+/* Record a call. Must be called with the lock held. */
+static void record_call(const char *method, HttpReq *req, int status,
+                        double start)
+{
+    double end = now_us();
+    if (CallsCount < MAX_CALLS) {
+        MockCall *c = &Calls[CallsCount++];
+        c->time = start;
+        c->method = sdsnew(method);
+        c->params = cJSON_Duplicate(req->params, 1);
+        c->status = status;
+        c->duration = (end - start) * 1000;
+    }
+    if (Cfg.log) {
+        char *p = cJSON_PrintUnformatted(req->params);
+        fprintf(Cfg.log, "{\"time\":%.6f,\"method\":\"%s\",\"status\":%d,"
+                "\"ms\":%.3f,\"params\":%s}\n",
+                start, method, status, (end - start) * 1000, p);
+        fflush(Cfg.log);
+        free(p);
+    }
+    if (Cfg.verbose) printf("%s -> %d\n", method, status);
+}
+
+/* ============================================================================
+ * Control endpoints
+ * ========================================================================= */
+
+static cJSON *control_call(const char *what, HttpReq *req, int *status) {
+    *status = 200;
+    int64_t chat_id = param_int(req, "chat_id", Cfg.chat_id);
+    int64_t from = param_int(req, "from", Cfg.user_id);
+    const char *bot = param(req, "bot");
+
+    if (!strcmp(what, "message")) {
+        const char *text = param(req, "text");
+        if (!text) {
+            *status = 400;
+            return api_error(400, "text is required");
+        }
+        cJSON *update = cJSON_CreateObject();
+        cJSON *msg = cJSON_AddObjectToObject(update, "message");
+        cJSON_AddNumberToObject(msg, "message_id", (double)NextMessageId++);
+        cJSON_AddNumberToObject(msg, "date", (double)time(NULL));
+        cJSON_AddStringToObject(msg, "text", text);
+        cJSON *chat = cJSON_AddObjectToObject(msg, "chat");
+        cJSON_AddNumberToObject(chat, "id", (double)chat_id);
+        cJSON_AddStringToObject(chat, "type",
+            chat_id < 0 ? "supergroup" : "private");
+        cJSON *u = cJSON_AddObjectToObject(msg, "from");
+        cJSON_AddNumberToObject(u, "id", (double)from);
+        cJSON_AddStringToObject(u, "username",
+            param(req, "username") ? param(req, "username") : "mockuser");
+        push_update(update, bot);
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(what, "callback")) {
+        const char *data = param(req, "data");
+        int64_t message_id = param_int(req, "message_id", 0);
+        if (!data) {
+            *status = 400;
+            return api_error(400, "data is required");
+        }
+        /* Default to the most recent message of the chat. */
+        if (!message_id) {
+            for (MockMsg *m = Messages; m; m = m->next) {
+                if (m->chat_id == chat_id && (!bot || !strcmp(m->bot, bot))) {
+                    message_id = m->message_id;
+                    break;
+                }
+            }
+        }
+        static uint64_t cbid = 0;
+        char idbuf[32];
+        snprintf(idbuf, sizeof(idbuf), "cb%llu", (unsigned long long)++cbid);
+        cJSON *update = cJSON_CreateObject();
+        cJSON *cb = cJSON_AddObjectToObject(update, "callback_query");
+        cJSON_AddStringToObject(cb, "id", idbuf);
+        cJSON_AddStringToObject(cb, "data", data);
+        cJSON *u = cJSON_AddObjectToObject(cb, "from");
+        cJSON_AddNumberToObject(u, "id", (double)from);
+        cJSON *msg = cJSON_AddObjectToObject(cb, "message");
+        cJSON_AddNumberToObject(msg, "message_id", (double)message_id);
+        cJSON *chat = cJSON_AddObjectToObject(msg, "chat");
+        cJSON_AddNumberToObject(chat, "id", (double)chat_id);
+        push_update(update, bot);
+        return api_ok(cJSON_CreateTrue());
+    } else if (!strcmp(what, "chat")) {
+        /* Oldest first, like a chat window. */
+        cJSON *list = cJSON_CreateArray();
+        for (MockMsg *m = Messages; m; m = m->next) {
+            if (m->chat_id != chat_id) continue;
+            if (bot && strcmp(m->bot, bot)) continue;
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "message_id", (double)m->message_id);
+            cJSON_AddStringToObject(item, "text", m->text);
+            if (m->reply_markup)
+                cJSON_AddStringToObject(item, "reply_markup", m->reply_markup);
+            cJSON_InsertItemInArray(list, 0, item);
+        }
+        return api_ok(list);
+    } else if (!strcmp(what, "calls")) {
+        cJSON *list = cJSON_CreateArray();
+        for (int i = 0; i < CallsCount; i++) {
+            cJSON *item = cJSON_CreateObject();
+            cJSON_AddNumberToObject(item, "time", Calls[i].time);
+            cJSON_AddStringToObject(item, "method", Calls[i].method);
+            cJSON_AddNumberToObject(item, "status", Calls[i].status);
+            cJSON_AddNumberToObject(item, "ms", Calls[i].duration);
+            cJSON_AddItemToObject(item, "params",
+                                  cJSON_Duplicate(Calls[i].params, 1));
+            cJSON_AddItemToArray(list, item);
+        }
+        if (param_int(req, "clear", 0)) {
+            for (int i = 0; i < CallsCount; i++) {
+                sdsfree(Calls[i].method);
+                cJSON_Delete(Calls[i].params);
+            }
+            CallsCount = 0;
+        }
+        return api_ok(list);
+    } else if (!strcmp(what, "stats")) {
+        cJSON *stats = cJSON_CreateObject();
+        for (int i = 0; i < CallsCount; i++) {
+            cJSON *s = cJSON_GetObjectItem(stats, Calls[i].method);
+            if (!s) {
+                s = cJSON_AddObjectToObject(stats, Calls[i].method);
+                cJSON_AddNumberToObject(s, "calls", 0);
+                cJSON_AddNumberToObject(s, "errors", 0);
+            }
+            cJSON *n = cJSON_GetObjectItem(s, "calls");
+            cJSON_SetNumberValue(n, n->valuedouble + 1);
+            if (Calls[i].status != 200) {
+                n = cJSON_GetObjectItem(s, "errors");
+                cJSON_SetNumberValue(n, n->valuedouble + 1);
+            }
+        }
+        cJSON_AddNumberToObject(stats, "pending_updates", UpdatesCount);
+        if (Webhook)
+            cJSON_AddItemToObject(stats, "webhook", cJSON_Duplicate(Webhook, 1));
+        return api_ok(stats);
+    }
+    *status = 404;
+    return api_error(404, "Not Found");
+}
+
+/* ============================================================================
+ * Webhook delivery
+ * ========================================================================= */
+
+static size_t discard_body(char *ptr, size_t size, size_t nmemb, void *ud) {
+    (void)ptr; (void)ud;
+    return size * nmemb;
+}
+
+/* POST queued updates to the webhook, one at a time and in order, like
+ * Telegram does with max_connections=1. Failed deliveries are retried. */
+static void *webhook_thread(void *arg) {
+    (void)arg;
+    CURL *curl = curl_easy_init();
+
+    pthread_mutex_lock(&Lock);
+    while (1) {
+        while (!Webhook || UpdatesCount == 0)
+            pthread_cond_wait(&UpdatesCond, &Lock);
+
+        cJSON *update = Updates[0];
+        char *body = cJSON_PrintUnformatted(update);
+        sds url = sdsnew(cJSON_GetObjectItem(Webhook, "url")->valuestring);
+        cJSON *secret = cJSON_GetObjectItem(Webhook, "secret_token");
+        sds hdr = sdscatprintf(sdsempty(), "X-Telegram-Bot-Api-Secret-Token: %s",
+                               cJSON_IsString(secret) ? secret->valuestring : "");
+        pthread_mutex_unlock(&Lock);
+
+        struct curl_slist *headers = NULL;
+        headers = curl_slist_append(headers, "Content-Type: application/json");
+        headers = curl_slist_append(headers, hdr);
+        curl_easy_setopt(curl, CURLOPT_URL, url);
+        curl_easy_setopt(curl, CURLOPT_POSTFIELDS, body);
+        curl_easy_setopt(curl, CURLOPT_HTTPHEADER, headers);
+        curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, discard_body);
+        curl_easy_setopt(curl, CURLOPT_TIMEOUT, 10L);
+        double start = now_us();
+        CURLcode res = curl_easy_perform(curl);
+        long code = 0;
+        curl_easy_getinfo(curl, CURLINFO_RESPONSE_CODE, &code);
+        curl_slist_free_all(headers);
+        sdsfree(hdr);
+        sdsfree(url);
+        free(body);
+
+        pthread_mutex_lock(&Lock);
+        int ok = res == CURLE_OK && code >= 200 && code < 300;
+        if (Cfg.verbose) printf("webhook delivery -> %ld\n", code);
+        if (Cfg.log) {
+            fprintf(Cfg.log, "{\"time\":%.6f,\"method\":\"webhook\","
+                    "\"status\":%ld,\"ms\":%.3f}\n",
+                    start, code, (now_us() - start) * 1000);
+            fflush(Cfg.log);
+        }
+        if (ok && UpdatesCount && Updates[0] == update) {
+            cJSON_Delete(update);
+            sdsfree(UpdatesBot[0]);
+            memmove(Updates, Updates + 1, sizeof(cJSON *) * (UpdatesCount - 1));
+            memmove(UpdatesBot, UpdatesBot + 1,
+                    sizeof(sds) * (UpdatesCount - 1));
+            UpdatesCount--;
+        } else if (!ok) {
+            pthread_mutex_unlock(&Lock);
+            sleep(1);
+            pthread_mutex_lock(&Lock);
+        }
+    }
+    return NULL;
+}
+
+/* ============================================================================
+ * Connection handling
+ * ========================================================================= */
+
+/* Sleep the configured latency, plus jitter. */
+static void inject_latency(void) {
+    int ms = Cfg.latency;
+    if (Cfg.jitter) ms += rand() % (Cfg.jitter + 1);
+    if (ms) usleep(ms * 1000);
+}
+
+/* Handle a request. Return 0 to keep the connection open. */
+static int handle(int fd, HttpReq *req) {
+    int status;
+    cJSON *reply = NULL;
+
+    if (!strncmp(req->path, "/mock/", 6)) {
+        pthread_mutex_lock(&Lock);
+        reply = control_call(req->path + 6, req, &status);
+        pthread_mutex_unlock(&Lock);
+    } else if (!strncmp(req->path, "/file/bot", 9)) {
+        const char *body = "mock file content";
+        return send_reply(fd, 200, "application/octet-stream",
+                          body, strlen(body), req->keepalive);
+    } else if (!strncmp(req->path, "/bot", 4) && strchr(req->path + 4, '/')) {
+        const char *method = strchr(req->path + 4, '/') + 1;
+        sds bot = sdsnewlen(req->path + 4, method - 1 - (req->path + 4));
+        double start = now_us();
+
+        /* Long polling calls are not slowed down nor failed. */
+        int polling = !strcmp(method, "getUpdates");
+        if (!polling) inject_latency();
+        double dice = (double)rand() / RAND_MAX;
+        if (!polling && dice < Cfg.error_rate) {
+            status = 500;
+            reply = api_error(500, "Internal Server Error");
+        } else if (!polling && dice < Cfg.error_rate + Cfg.flood_rate) {
+            status = 429;
+            sds desc = sdscatprintf(sdsempty(),
+                "Too Many Requests: retry after %d", Cfg.retry_after);
+            reply = api_error(429, desc);
+            sdsfree(desc);
+            cJSON *p = cJSON_AddObjectToObject(reply, "parameters");
+            cJSON_AddNumberToObject(p, "retry_after", Cfg.retry_after);
+        }
+
+        pthread_mutex_lock(&Lock);
+        if (!reply) reply = api_call(bot, method, req, &status);
+        record_call(method, req, status, start);
+        pthread_mutex_unlock(&Lock);
+        sdsfree(bot);
+    } else {
+        status = 404;
+        reply = api_error(404, "Not Found");
+    }
+
+    char *body = cJSON_PrintUnformatted(reply);
+    int retval = send_reply(fd, status, "application/json",
+                            body, strlen(body), req->keepalive);
+    free(body);
+    cJSON_Delete(reply);
+    return retval;
+}
+
+static void *connection_thread(void *arg) {
+    int fd = (int)(intptr_t)arg;
+    sds buf = sdsempty();
+    HttpReq *req;
+    while ((req = read_request(fd, &buf)) != NULL) {
+        int err = handle(fd, req);
+        int keepalive = req->keepalive;
+        free_request(req);
+        if (err || !keepalive) break;
+    }
+    sdsfree(buf);
+    close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+        "Usage: %s [--port <port>] [--latency <ms>] [--jitter <ms>]\n"
+        "          [--error-rate <0..1>] [--flood-rate <0..1>]\n"
+        "          [--retry-after <sec>] [--chat-id <id>] [--user-id <id>]\n"
+        "          [--log <file>] [--verbose]\n", prog);
+    exit(1);
+}
+
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        int more = i + 1 < argc;
+        if (!strcmp(argv[i], "--port") && more) Cfg.port = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--latency") && more) Cfg.latency = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--jitter") && more) Cfg.jitter = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--error-rate") && more) Cfg.error_rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--flood-rate") && more) Cfg.flood_rate = atof(argv[++i]);
+        else if (!strcmp(argv[i], "--retry-after") && more) Cfg.retry_after = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--chat-id") && more) Cfg.chat_id = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--user-id") && more) Cfg.user_id = atoll(argv[++i]);
+        else if (!strcmp(argv[i], "--verbose")) Cfg.verbose = 1;
+        else if (!strcmp(argv[i], "--log") && more) {
+            Cfg.log = fopen(argv[++i], "a");
+            if (!Cfg.log) { perror("fopen"); exit(1); }
+        } else usage(argv[0]);
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    srand(time(NULL));
+    Calls = xmalloc(sizeof(MockCall) * MAX_CALLS);
+    curl_global_init(CURL_GLOBAL_DEFAULT);
+    pthread_t wh;
+    pthread_create(&wh, NULL, webhook_thread, NULL);
+
+    int s = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    struct sockaddr_in sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sin_family = AF_INET;
+    sa.sin_port = htons(Cfg.port);
+    sa.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (bind(s, (struct sockaddr *)&sa, sizeof(sa)) == -1 ||
+        listen(s, 128) == -1)
+    {
+        perror("bind/listen");
+        exit(1);
+    }
+    printf("Mock Telegram Bot API listening on http://127.0.0.1:%d\n", Cfg.port);
+    fflush(stdout);
+
+    while (1) {
+        int fd = accept(s, NULL, NULL);
+        if (fd == -1) continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        pthread_t tid;
+        if (pthread_create(&tid, NULL, connection_thread,
+                           (void *)(intptr_t)fd) == 0)
+        {
+            pthread_detach(tid);
+        } else {
+            close(fd);
+        }
+    }
+    return 0;
+}
@@ -0,0 +1,102 @@
+/*
+ * totp.c - TOTP (RFC 6238) codes for the teleterm authentication
+ *
+ * The secret is stored hex encoded in the KV store under "totp_secret",
+ * and shown to the user Base32 encoded, as authenticator apps expect.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "botlib.h"
+#include "sha1.h"
+#include "totp.h"
+
+/* Encode raw bytes to Base32 string (RFC 4648). Returns static buffer. */
+const char *base32_encode(const unsigned char *data, size_t len) {
+    static char out[128];
+    static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZ234567";
+    int i = 0, j = 0;
+    uint64_t buf = 0;
+    int bits = 0;
+
+    for (i = 0; i < (int)len; i++) {
+        buf = (buf << 8) | data[i];
+        bits += 8;
+        while (bits >= 5) {
+            bits -= 5;
+            out[j++] = alphabet[(buf >> bits) & 0x1f];
+        }
+    }
+    if (bits > 0) {
+        out[j++] = alphabet[(buf << (5 - bits)) & 0x1f];
+    }
+    out[j] = '\0';
+    return out;
+}
+
+/* Compute 6-digit TOTP code from raw secret and time step. */
+uint32_t totp_code(const unsigned char *secret, size_t secret_len,
+                          uint64_t time_step)
+{
+    unsigned char msg[8];
+    for (int i = 7; i >= 0; i--) {
+        msg[i] = (unsigned char)(time_step & 0xff);
+        time_step >>= 8;
+    }
+
+    unsigned char hash[SHA1_DIGEST_SIZE];
+    hmac_sha1(secret, secret_len, msg, 8, hash);
+
+    int offset = hash[19] & 0x0f;
+    uint32_t code = ((uint32_t)(hash[offset] & 0x7f) << 24)
+                  | ((uint32_t)hash[offset+1] << 16)
+                  | ((uint32_t)hash[offset+2] << 8)
+                  | (uint32_t)hash[offset+3];
+    return code % 1000000;
+}
+
+/* Convert hex string to raw bytes. Returns number of bytes written. */
+int hex_to_bytes(const char *hex, unsigned char *out, int max) {
+    int len = 0;
+    while (*hex && *(hex+1) && len < max) {
+        unsigned int byte;
+        if (sscanf(hex, "%2x", &byte) != 1) break;
+        out[len++] = (unsigned char)byte;
+        hex += 2;
+    }
+    return len;
+}
+
+/* Convert raw bytes to hex string. Returns static buffer. */
+const char *bytes_to_hex(const unsigned char *data, int len) {
+    static char hex[128];
+    for (int i = 0; i < len && i < 63; i++) {
+        sprintf(hex + i*2, "%02x", data[i]);
+    }
+    hex[len*2] = '\0';
+    return hex;
+}
+
+/* Check if the given code matches the current TOTP (with +/-1 window) of
+ * the secret stored in the KV store at 'key'. */
+int totp_verify(sqlite3 *db, const char *key, const char *code_str) {
+    sds hex = kvGet(db, key);
+    if (!hex) return 0;
+
+    unsigned char secret[20];
+    int slen = hex_to_bytes(hex, secret, 20);
+    sdsfree(hex);
+    if (slen != 20) return 0;
+
+    uint64_t now = (uint64_t)time(NULL) / 30;
+    uint32_t input_code = (uint32_t)atoi(code_str);
+
+    for (int i = -1; i <= 1; i++) {
+        if (totp_code(secret, 20, now + i) == input_code)
+            return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef TOTP_H
+#define TOTP_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sqlite3.h>
+
+/* Encode raw bytes to Base32. Returns a static buffer. */
+const char *base32_encode(const unsigned char *data, size_t len);
+
+/* Compute the 6 digit code of the secret for the given time step. */
+uint32_t totp_code(const unsigned char *secret, size_t secret_len,
+                   uint64_t time_step);
+
+/* Hex conversions for storing the secret in the KV store. */
+int hex_to_bytes(const char *hex, unsigned char *out, int max);
+const char *bytes_to_hex(const unsigned char *data, int len);
+
+/* Return 1 if the code matches the secret stored at 'key' now, or 30
+ * seconds before or after now. */
+int totp_verify(sqlite3 *db, const char *key, const char *code_str);
+
+#endif
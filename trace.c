@@ -0,0 +1,187 @@
+/*
+ * trace.c - Per-stage latency tracing of bot requests
+ *
+ * Every request records a monotonic timestamp at each stage of its life
+ * (see trace.h). Completed traces are stored in a fixed size ring buffer
+ * that writers fill without taking locks: each slot has a sequence number
+ * that is zero while the slot is being written, so that readers can
+ * detect and skip torn copies (seqlock style). Statistics are computed
+ * on demand from the traces currently in the ring.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <stdatomic.h>
+
+#include "trace.h"
+#include "xmalloc.h"
+
+#define TRACE_RING 1024     /* Recent requests kept. Power of two. */
+#define TRACE_MAX_METHODS 16
+
+typedef struct TraceSlot {
+    _Atomic uint64_t seq;   /* Index+1 of the trace stored, 0 if busy. */
+    Trace trace;
+} TraceSlot;
+
+static TraceSlot Ring[TRACE_RING];
+static _Atomic uint64_t RingHead = 0;
+static _Thread_local Trace *CurrentTrace = NULL;
+
+static const char *StageNames[TRACE_STAGES] = {
+    "received", "parsed", "dispatched", "locked", "keys sent",
+    "settled", "captured", "formatted", "done"
+};
+
+/* Return the monotonic time in nanoseconds. */
+uint64_t traceNow(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+void traceInit(Trace *tr) {
+    memset(tr, 0, sizeof(*tr));
+}
+
+void traceSetCurrent(Trace *tr) {
+    CurrentTrace = tr;
+}
+
+Trace *traceGetCurrent(void) {
+    return CurrentTrace;
+}
+
+/* Record the time the current request reached 'stage'. */
+void traceMark(int stage) {
+    if (CurrentTrace) CurrentTrace->t[stage] = traceNow();
+}
+
+/* Record the start of a bot API call. Returns the index to pass to
+ * traceCallEnd(), or -1 if the call is not recorded. */
+int traceCallStart(const char *method) {
+    Trace *tr = CurrentTrace;
+    if (!tr || tr->numcalls == TRACE_MAX_CALLS) return -1;
+    TraceCall *c = &tr->calls[tr->numcalls];
+    snprintf(c->method, sizeof(c->method), "%s", method);
+    c->start = traceNow();
+    c->end = 0;
+    return tr->numcalls++;
+}
+
+void traceCallEnd(int idx) {
+    if (CurrentTrace && idx >= 0) CurrentTrace->calls[idx].end = traceNow();
+}
+
+void tracePublish(Trace *tr) {
+    uint64_t idx = atomic_fetch_add_explicit(&RingHead, 1, memory_order_relaxed);
+    TraceSlot *slot = &Ring[idx & (TRACE_RING-1)];
+    atomic_store_explicit(&slot->seq, 0, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    memcpy(&slot->trace, tr, sizeof(*tr));
+    atomic_store_explicit(&slot->seq, idx+1, memory_order_release);
+}
+
+/* ============================================================================
+ * Statistics
+ * ========================================================================= */
+
+/* Copy the valid traces of the ring into a new array. Returns the number
+ * of traces copied. */
+static int traceSnapshot(Trace **out) {
+    Trace *traces = xmalloc(sizeof(Trace) * TRACE_RING);
+    int n = 0;
+    for (int j = 0; j < TRACE_RING; j++) {
+        TraceSlot *slot = &Ring[j];
+        uint64_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        if (seq == 0) continue;
+        memcpy(&traces[n], &slot->trace, sizeof(Trace));
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&slot->seq, memory_order_relaxed) != seq)
+            continue; /* Overwritten while we were copying it. */
+        n++;
+    }
+    *out = traces;
+    return n;
+}
+
+static int cmpU64(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+    return x < y ? -1 : x > y;
+}
+
+/* Append a line with count and percentiles (in ms) of 'n' durations in
+ * nanoseconds. The array is sorted in place. */
+static sds traceAppendRow(sds s, const char *name, uint64_t *v, int n) {
+    if (n == 0) return s;
+    qsort(v, n, sizeof(uint64_t), cmpU64);
+    return sdscatprintf(s, "%-20.20s %6d %8.1f %8.1f %8.1f %8.1f\n", name, n,
+        v[(n-1)*50/100] / 1e6, v[(n-1)*90/100] / 1e6,
+        v[(n-1)*99/100] / 1e6, v[n-1] / 1e6);
+}
+
+sds traceSummary(void) {
+    Trace *traces;
+    int n = traceSnapshot(&traces);
+    uint64_t *v = xmalloc(sizeof(uint64_t) * (n ? n : 1) * TRACE_MAX_CALLS);
+
+    sds s = sdscatprintf(sdsempty(),
+        "Latency of the last %d requests (ms):\n"
+        "%-20s %6s %8s %8s %8s %8s\n",
+        n, "stage", "count", "p50", "p90", "p99", "max");
+
+    /* Time spent to reach every stage from the previous one. */
+    for (int stage = 1; stage < TRACE_STAGES; stage++) {
+        int count = 0;
+        for (int j = 0; j < n; j++) {
+            uint64_t *t = traces[j].t;
+            if (!t[stage]) continue;
+            int prev = stage-1;
+            while (prev > 0 && !t[prev]) prev--;
+            if (!t[prev] || t[stage] < t[prev]) continue;
+            v[count++] = t[stage] - t[prev];
+        }
+        s = traceAppendRow(s, StageNames[stage], v, count);
+    }
+
+    /* End to end. */
+    int count = 0;
+    for (int j = 0; j < n; j++) {
+        uint64_t *t = traces[j].t;
+        if (t[TRACE_RECEIVED] && t[TRACE_DONE] >= t[TRACE_RECEIVED])
+            v[count++] = t[TRACE_DONE] - t[TRACE_RECEIVED];
+    }
+    s = traceAppendRow(s, "total", v, count);
+
+    /* Bot API calls, by method. */
+    char methods[TRACE_MAX_METHODS][24];
+    int nmethods = 0;
+    for (int j = 0; j < n; j++) {
+        for (int k = 0; k < traces[j].numcalls; k++) {
+            const char *m = traces[j].calls[k].method;
+            int i;
+            for (i = 0; i < nmethods; i++)
+                if (!strcmp(methods[i], m)) break;
+            if (i == nmethods && nmethods < TRACE_MAX_METHODS)
+                memcpy(methods[nmethods++], m, sizeof(methods[0]));
+        }
+    }
+    if (nmethods) s = sdscat(s, "\nBot API calls (ms):\n");
+    for (int i = 0; i < nmethods; i++) {
+        count = 0;
+        for (int j = 0; j < n; j++) {
+            for (int k = 0; k < traces[j].numcalls; k++) {
+                TraceCall *c = &traces[j].calls[k];
+                if (c->end && !strcmp(c->method, methods[i]))
+                    v[count++] = c->end - c->start;
+            }
+        }
+        s = traceAppendRow(s, methods[i], v, count);
+    }
+
+    xfree(v);
+    xfree(traces);
+    return s;
+}
@@ -0,0 +1,56 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "sds.h"
+
+/* Stages of a request, in the order they normally happen. Stages that a
+ * given request does not go through (a command that sends no keys, for
+ * instance) are left to zero and skipped in the statistics. */
+#define TRACE_RECEIVED 0    /* Update received from Telegram. */
+#define TRACE_PARSED 1      /* Update parsed into a BotRequest. */
+#define TRACE_DISPATCHED 2  /* Request thread started. */
+#define TRACE_LOCKED 3      /* Request lock acquired. */
+#define TRACE_KEYS_SENT 4   /* Keystrokes delivered to the terminal. */
+#define TRACE_SETTLED 5     /* Waited for the terminal to react. */
+#define TRACE_CAPTURED 6    /* Terminal text captured. */
+#define TRACE_FORMATTED 7   /* Terminal text formatted as messages. */
+#define TRACE_DONE 8        /* Request callback returned. */
+#define TRACE_STAGES 9
+
+#define TRACE_MAX_CALLS 8   /* Bot API calls recorded per request. */
+
+/* Timestamps are nanoseconds from traceNow(). */
+typedef struct TraceCall {
+    char method[24];        /* Bot API method, truncated if needed. */
+    uint64_t start;
+    uint64_t end;
+} TraceCall;
+
+typedef struct Trace {
+    uint64_t t[TRACE_STAGES];
+    int numcalls;
+    TraceCall calls[TRACE_MAX_CALLS];
+} Trace;
+
+uint64_t traceNow(void);
+void traceInit(Trace *tr);
+
+/* The thread serving a request sets its trace as current, so that code
+ * not having access to the request (bot API calls, the terminal backend)
+ * can record stages with traceMark() and traceCall*(). All these
+ * functions do nothing if the thread has no current trace. */
+void traceSetCurrent(Trace *tr);
+Trace *traceGetCurrent(void);
+void traceMark(int stage);
+int traceCallStart(const char *method);
+void traceCallEnd(int idx);
+
+/* Store a completed trace in the ring buffer of recent requests. */
+void tracePublish(Trace *tr);
+
+/* Return a human readable summary of the recent requests, with latency
+ * percentiles for every stage and bot API method. */
+sds traceSummary(void);
+
+#endif